@@ -9,11 +9,99 @@ Also see neural2d.h for more information.
 
 namespace NNet {
 
+// This method of converting bytes to integers is portable for little- or
+// big-endian environments:
+//
+static uint32_t readLE32(unsigned char const *p)
+{
+    return ((uint32_t)p[3] << 24) + ((uint32_t)p[2] << 16) + ((uint32_t)p[1] << 8) + p[0];
+}
 
-// Extract the input data from the specified file and save the data in the data container.
-// Returns the nonzero image size if successful, else returns 0,0.
+static uint16_t readLE16(unsigned char const *p)
+{
+    return (uint16_t)((p[1] << 8) + p[0]);
+}
+
+
+// Converts pixel values to one color channel. BMP pixels are arranged in memory in
+// the order (B, G, R) or (B, G, R, A), and palette entries in the order (B, G, R, unused).
+// For BW, the sum rounds down. The three terms are kept in tables so that the
+// result is exactly the same as computing 0.3 * R + 0.6 * G + 0.1 * B for each pixel.
 //
-xySize ImageReaderBMP::getData(std::string const &filename, std::vector<float> &dataContainer, ColorChannel_t colorChannel)
+struct BWTerms
+{
+    BWTerms(void)
+    {
+        for (unsigned v = 0; v < 256; ++v) {
+            red[v] = 0.3 * v;
+            green[v] = 0.6 * v;
+            blue[v] = 0.1 * v;
+        }
+    }
+
+    double red[256];
+    double green[256];
+    double blue[256];
+};
+
+struct ChannelConverter
+{
+    ChannelConverter(ColorChannel_t colorChannel)
+    {
+        switch (colorChannel) {
+        case NNet::R:  byteOffset = 2; break;
+        case NNet::G:  byteOffset = 1; break;
+        case NNet::B:  byteOffset = 0; break;
+        case NNet::BW: isBW = true; break;
+        default:
+            err << "Error: unknown pixel conversion" << endl;
+            throw exceptionImageFile();
+        }
+    }
+
+    unsigned char operator()(unsigned char const *pBGR) const
+    {
+        if (!isBW) {
+            return pBGR[byteOffset];
+        }
+        return (unsigned char)(unsigned)(bw.red[pBGR[2]] + bw.green[pBGR[1]] + bw.blue[pBGR[0]]);
+    }
+
+    // Extracts the channel from a row of pixels of bytesPerPixel bytes each:
+    template <unsigned bytesPerPixel>
+    void convertRow(unsigned char const *pRow, uint32_t width, unsigned char *pOut) const
+    {
+        if (!isBW) {
+            pRow += byteOffset;
+            for (uint32_t x = 0; x < width; ++x) {
+                pOut[x] = pRow[x * bytesPerPixel];
+            }
+        } else {
+            for (uint32_t x = 0; x < width; ++x) {
+                pOut[x] = (*this)(pRow + x * bytesPerPixel);
+            }
+        }
+    }
+
+    static const BWTerms bw;
+    bool isBW = false;
+    unsigned byteOffset = 0;
+};
+
+const BWTerms ChannelConverter::bw;
+
+
+// Extract the color channels in channelMask (bit 1 << channel for each ColorChannel_t)
+// from the specified file and save the 8-bit pixel values in the pixels container,
+// one block of width * height values per channel in ColorChannel_t order, in
+// flattenXY() order. Returns the nonzero image size if successful, else returns 0,0.
+// Supports uncompressed BMP files of 24 bits per pixel, 32 bits per pixel (BGRA,
+// the alpha channel is ignored), and 8 bits per pixel with a color palette. The
+// whole file is read in one call; each row is first reduced to one byte per pixel
+// in the selected color channel, then the bytes are transposed into the pixels
+// container a block at a time.
+//
+static xySize readBmp(std::string const &filename, std::vector<unsigned char> &pixels, uint32_t channelMask)
 {
     FILE* f = fopen(filename.c_str(), "rb");
 
@@ -21,100 +109,167 @@ xySize ImageReaderBMP::getData(std::string const &filename, std::vector<float> &
         return { 0, 0 };
     }
 
-    // Read the BMP header to get the image dimensions:
+    vector<unsigned char> file;
+    if (fseek(f, 0, SEEK_END) == 0) {
+        long fileSize = ftell(f);
+        if (fileSize > 0 && fseek(f, 0, SEEK_SET) == 0) {
+            file.resize((size_t)fileSize);
+            file.resize(fread(file.data(), 1, file.size(), f));
+        }
+    }
+    fclose(f);
 
-    unsigned char info[54];
-    if (fread(info, sizeof(unsigned char), 54, f) != 54) {
-        fclose(f);
+    if (file.size() < 54) {
         return { 0, 0 };
     }
 
+    unsigned char const *info = file.data();
+
     if (info[0] != 'B' || info[1] != 'M') {
-        fclose(f);
         return { 0, 0 };
     }
 
-    // Verify the offset to the pixel data. It should be the same size as the info[] data read above.
+    uint64_t dataOffset = readLE32(info + 10);
+    uint32_t infoHeaderSize = readLE32(info + 14);
+    uint32_t width = readLE32(info + 18);
+    int32_t signedHeight = (int32_t)readLE32(info + 22);
+    unsigned pixelDepth = readLE16(info + 28);
+    uint32_t compression = readLE32(info + 30);
+    uint32_t numPaletteColors = readLE32(info + 46);
 
-    size_t dataOffset = (info[13] << 24)
-                      + (info[12] << 16)
-                      + (info[11] << 8)
-                      +  info[10];
+    // Rows are normally stored bottom row first; a negative height means top row first:
 
-    // Verify that the file contains 24 bits (3 bytes) per pixel (red, green blue at 8 bits each):
+    bool isTopDown = signedHeight < 0;
+    uint32_t height = isTopDown ? 0u - (uint32_t)signedHeight : (uint32_t)signedHeight;
 
-    int pixelDepth = (info[29] << 8) + info[28];
-    if (pixelDepth != 24) {
-        fclose(f);
-        return { 0, 0 };
-    }
-
-    // This method of converting 4 bytes to a uint32_t is portable for little- or
-    // big-endian environments:
+    // Compression type 3 (BI_BITFIELDS) is acceptable if the masks describe plain BGRA:
 
-    uint32_t width = (info[21] << 24)
-                   + (info[20] << 16)
-                   + (info[19] << 8)
-                   +  info[18];
+    bool isPlainBitfields = compression == 3 && pixelDepth == 32 && infoHeaderSize >= 52
+            && 14ull + 52 <= file.size()
+            && readLE32(info + 54) == 0x00ff0000 && readLE32(info + 58) == 0x0000ff00
+            && readLE32(info + 62) == 0x000000ff;
 
-    uint32_t height = (info[25] << 24)
-                    + (info[24] << 16)
-                    + (info[23] << 8)
-                    +  info[22];
-
-    // Position the read pointer to the first byte of pixel data:
+    if ((compression != 0 && !isPlainBitfields)
+            || (pixelDepth != 8 && pixelDepth != 24 && pixelDepth != 32)
+            || width == 0 || height == 0 || width > 0x10000000 / height) {
+        return { 0, 0 };
+    }
 
-    if (fseek(f, dataOffset, SEEK_SET) != 0) {
-        fclose(f);
+    uint64_t rowLenPadded = ((uint64_t)width * (pixelDepth / 8) + 3) & ~3ull;
+    if (dataOffset + rowLenPadded * height > file.size()) {
         return { 0, 0 };
     }
 
-    uint32_t rowLen_padded = (width*3 + 3) & (~3);
-    std::unique_ptr<unsigned char[]> imageData {new unsigned char[rowLen_padded]};
+    uint64_t paletteOffset = 14ull + infoHeaderSize;
+    if (pixelDepth == 8) {
+        if (numPaletteColors == 0 || numPaletteColors > 256) {
+            numPaletteColors = 256;
+        }
+        if (paletteOffset + 4ull * numPaletteColors > dataOffset) {
+            return { 0, 0 };
+        }
+    }
+
+    size_t channelIndex = 0;
+    pixels.resize((size_t)width * height * bitCount(channelMask));
+    vector<unsigned char> plane((size_t)width * height);
 
-    dataContainer.clear();
-    dataContainer.assign(width * height, 0); // Pre-allocate to make random access easy
+    for (uint32_t channel = 0; channel < 32; ++channel) {
+        if ((channelMask & (1u << channel)) == 0) {
+            continue;
+        }
+        ChannelConverter converter((ColorChannel_t)channel);
 
-    // Fill the data container with 8-bit data taken from the image data:
+        // For paletted images, convert the palette once, then look up each pixel index:
 
-    for (uint32_t y = 0; y < height; ++y) {
-        if (fread(imageData.get(), sizeof(unsigned char), rowLen_padded, f) != rowLen_padded) {
-            fclose(f);
-            return { 0, 0 };
+        unsigned char paletteValues[256] = { 0 };
+        if (pixelDepth == 8) {
+            for (uint32_t i = 0; i < numPaletteColors; ++i) {
+                paletteValues[i] = converter(info + paletteOffset + 4 * i);
+            }
         }
 
-        // BMP pixels are arranged in memory in the order (B, G, R):
-
-        unsigned val = 0;
-
-        for (uint32_t x = 0; x < width; ++x) {
-            if (colorChannel == NNet::R) {
-                val = imageData[x * 3 + 2]; // Red
-            } else if (colorChannel == NNet::G) {
-                val = imageData[x * 3 + 1]; // Green
-            } else if (colorChannel == NNet::B) {
-                val = imageData[x * 3 + 0]; // Blue
-            } else if (colorChannel == NNet::BW) {
-                // Rounds down:
-                val = (unsigned)(0.3 * imageData[x*3 + 2] +   // Red
-                                 0.6 * imageData[x*3 + 1] +   // Green
-                                 0.1 * imageData[x*3 + 0]);   // Blue
+        // Reduce the pixels to one byte each, with the origin at the upper left at 0,0:
+
+        for (uint32_t y = 0; y < height; ++y) {
+            unsigned char const *pRow = info + dataOffset + rowLenPadded * (isTopDown ? y : (height - y) - 1);
+            unsigned char *pOut = &plane[(size_t)y * width];
+            if (pixelDepth == 24) {
+                converter.convertRow<3>(pRow, width, pOut);
+            } else if (pixelDepth == 32) {
+                converter.convertRow<4>(pRow, width, pOut);
             } else {
-                err << "Error: unknown pixel conversion" << endl;
-                throw exceptionImageFile();
+                for (uint32_t x = 0; x < width; ++x) {
+                    pOut[x] = paletteValues[pRow[x]];
+                }
             }
+        }
+
+        // The pixels container is in column-major order (see flattenXY()), so we'll
+        // transpose in blocks that stay in the cache:
 
-            // Convert the pixel from the range 0..256 to a smaller
-            // range that we can input into the neural net:
-            // Also we'll invert the rows so that the origin is the upper left at 0,0:
+        unsigned char *pData = pixels.data() + channelIndex++ * plane.size();
+        const uint32_t blockSize = 32;
 
-            dataContainer[flattenXY(x, (height - y) - 1, height)] = pixelToNetworkInputRange(val);
+        for (uint32_t y0 = 0; y0 < height; y0 += blockSize) {
+            uint32_t yEnd = std::min(y0 + blockSize, height);
+            for (uint32_t x0 = 0; x0 < width; x0 += blockSize) {
+                uint32_t xEnd = std::min(x0 + blockSize, width);
+                for (uint32_t x = x0; x < xEnd; ++x) {
+                    unsigned char const *pColumn = &plane[x];
+                    unsigned char *pOut = pData + (size_t)x * height;
+                    for (uint32_t y = y0; y < yEnd; ++y) {
+                        pOut[y] = pColumn[(size_t)y * width];
+                    }
+                }
+            }
         }
     }
 
-    fclose(f);
-
     return { width, height };
 }
 
+
+// Converts the pixels from the range 0..256 to a smaller range that we can input
+// into the neural net:
+//
+static xySize toNetworkInputRange(xySize size, std::vector<unsigned char> const &pixels,
+                                  std::vector<float> &dataContainer)
+{
+    float const *pTable = pixelToNetworkInputTable();
+
+    dataContainer.resize(pixels.size());
+    for (size_t i = 0; i < pixels.size(); ++i) {
+        dataContainer[i] = pTable[pixels[i]];
+    }
+
+    return size;
+}
+
+
+// Extract the input data from the specified file and save the data in the data container.
+// Returns the nonzero image size if successful, else returns 0,0.
+//
+xySize ImageReaderBMP::getData(std::string const &filename, std::vector<float> &dataContainer, ColorChannel_t colorChannel)
+{
+    std::vector<unsigned char> pixels;
+    return toNetworkInputRange(readBmp(filename, pixels, 1u << colorChannel), pixels, dataContainer);
+}
+
+
+// Extract the R, G, B, and BW channels:
+//
+xySize ImageReaderBMP::getAllChannels(std::string const &filename, std::vector<float> &dataContainer, uint32_t &channelMask)
+{
+    std::vector<unsigned char> pixels;
+    channelMask = (1u << NNet::R) | (1u << NNet::G) | (1u << NNet::B) | (1u << NNet::BW);
+    return toNetworkInputRange(readBmp(filename, pixels, channelMask), pixels, dataContainer);
+}
+
+
+xySize ImageReaderBMP::getPixels(std::string const &filename, std::vector<uint8_t> &pixels, uint32_t channelMask)
+{
+    return readBmp(filename, pixels, channelMask);
+}
+
 } // end namespace NNet
@@ -5,6 +5,7 @@ https://github.com/davidrmiller/neural2d
 Also see neural2d.h for more information.
 */
 
+#include <cstring>   // for memcpy
 #include "neural2d.h"
 
 namespace NNet {
@@ -40,11 +41,53 @@ struct datHeader
 };
 
 
-// Extract the input data from the specified file and save the data in the data container.
-// Returns the nonzero image size if successful, else returns 0,0.
+// Returns the value of type T (float or double) stored in big-endian order at p.
+// Assembling the bytes with shifts works in little- or big-endian environments,
+// and compilers turn it into a single byte-swap instruction where there is one:
 //
-xySize ImageReaderDat::getData(std::string const &filename,
-            std::vector<float> &dataContainer, ColorChannel_t colorChannel)
+template <class T, class U>
+static float loadBigEndian(unsigned char const *p)
+{
+    U bits = 0;
+    for (unsigned i = 0; i < sizeof(U); ++i) {
+        bits = (U)((bits << 8) | p[i]);
+    }
+    T n;
+    memcpy(&n, &bits, sizeof n);
+    return (float)n;
+}
+
+// Converts one channel of big-endian values stored in rows into floats in
+// flattenXY() order (column-major). The transposition is done in square blocks
+// so that the reads and the writes both stay in the cache:
+//
+template <class T, class U>
+static void convertChannel(unsigned char const *pBytes, uint32_t width, uint32_t height, float *pOut)
+{
+    const uint32_t blockSize = 32;
+
+    for (uint32_t y0 = 0; y0 < height; y0 += blockSize) {
+        uint32_t yEnd = std::min(y0 + blockSize, height);
+        for (uint32_t x0 = 0; x0 < width; x0 += blockSize) {
+            uint32_t xEnd = std::min(x0 + blockSize, width);
+            for (uint32_t x = x0; x < xEnd; ++x) {
+                float *pColumn = pOut + (size_t)x * height;
+                for (uint32_t y = y0; y < yEnd; ++y) {
+                    pColumn[y] = loadBigEndian<T, U>(pBytes + ((size_t)y * width + x) * sizeof(T));
+                }
+            }
+        }
+    }
+}
+
+
+// Reads numChannels consecutive channels, starting at channel number firstChannel,
+// into dataContainer, one block of width * height values per channel. The channel
+// data is read from the file in one call. Returns the image size, or 0,0 if the
+// file is not a .dat file:
+//
+static xySize readDatChannels(std::string const &filename, std::vector<float> &dataContainer,
+                              uint32_t firstChannel, uint32_t numChannels, uint32_t *pNumChannelsInFile)
 {
     datHeader hdr;
 
@@ -69,6 +112,57 @@ xySize ImageReaderDat::getData(std::string const &filename,
         return { 0, 0 };
     }
 
+    if (pNumChannelsInFile != nullptr) {
+        *pNumChannelsInFile = hdr.numChannels;
+        numChannels = std::min(numChannels, hdr.numChannels);
+    }
+
+    if (firstChannel + numChannels > hdr.numChannels) {
+        err << "The color channel specified for " << filename << " does not exist" << std::endl;
+        throw exceptionInputSamplesFile();
+    }
+
+    if (hdr.bytesPerElement != sizeof(float) && hdr.bytesPerElement != sizeof(double)) {
+        err << "In " << filename << ", " << hdr.bytesPerElement
+            << " bytes per element is not supported." << std::endl;
+        throw exceptionInputSamplesFile();
+    }
+
+    // Read all the requested channels at once:
+
+    size_t channelSize = (size_t)hdr.width * hdr.height;
+    size_t channelBytes = channelSize * hdr.bytesPerElement;
+    std::vector<unsigned char> bytes(channelBytes * numChannels);
+
+    f.seekg(hdr.offsetToData + firstChannel * channelBytes);
+    f.read((char *)bytes.data(), bytes.size());
+    if ((size_t)f.gcount() != bytes.size()) {
+        err << "Premature end of file in " << filename << std::endl;
+        throw exceptionInputSamplesFile();
+    }
+
+    dataContainer.resize(channelSize * numChannels);
+
+    for (uint32_t c = 0; c < numChannels; ++c) {
+        unsigned char const *pBytes = bytes.data() + c * channelBytes;
+        float *pOut = dataContainer.data() + c * channelSize;
+        if (hdr.bytesPerElement == sizeof(float)) {
+            convertChannel<float, uint32_t>(pBytes, hdr.width, hdr.height, pOut);
+        } else {
+            convertChannel<double, uint64_t>(pBytes, hdr.width, hdr.height, pOut);
+        }
+    }
+
+    return { hdr.width, hdr.height };
+}
+
+
+// Extract the input data from the specified file and save the data in the data container.
+// Returns the nonzero image size if successful, else returns 0,0.
+//
+xySize ImageReaderDat::getData(std::string const &filename,
+            std::vector<float> &dataContainer, ColorChannel_t colorChannel)
+{
     // Map the color channel enumeration to a channel index:
     uint32_t colorChannelNumber;
     switch (colorChannel) {
@@ -76,49 +170,32 @@ xySize ImageReaderDat::getData(std::string const &filename,
     case NNet::G: colorChannelNumber = 1; break;
     case NNet::B: colorChannelNumber = 2; break;
     default:
+        if (readDatChannels(filename, dataContainer, 0, 0, nullptr).x == 0) {
+            return { 0, 0 }; // Not a .dat file
+        }
         err << "Error: unsupported color channel specified for " << filename << std::endl;
-        //return { 0, 0 };
         throw exceptionInputSamplesFile();
     }
 
-    if (colorChannelNumber >= hdr.numChannels) {
-        err << "The color channel specified for " << filename << " does not exist" << std::endl;
-        //return { 0, 0 };
-        throw exceptionInputSamplesFile();
-    }
+    return readDatChannels(filename, dataContainer, colorChannelNumber, 1, nullptr);
+}
 
-    // Position the stream at the start of the image data:
-    f.seekg(hdr.offsetToData + colorChannelNumber * hdr.bytesPerElement * hdr.width * hdr.height);
 
-    // Clear dataContainer and reserve enough space:
-    dataContainer.clear();
-    dataContainer.assign(hdr.width * hdr.height, 0.0);
+// Extract the R, G, and B channels, or as many of them as the file has. Any more
+// channels in the file are ignored:
+//
+xySize ImageReaderDat::getAllChannels(std::string const &filename,
+            std::vector<float> &dataContainer, uint32_t &channelMask)
+{
+    uint32_t numChannelsInFile = 0;
+    xySize size = readDatChannels(filename, dataContainer, 0, 3, &numChannelsInFile);
 
-    if (hdr.bytesPerElement == sizeof(float)) {
-        for (uint32_t y = 0; y < hdr.height; ++y) {
-            for (uint32_t x = 0; x < hdr.width; ++x) {
-                float n;
-                f.read((char *)&n, sizeof n);
-                fixEndianness(&n);
-                dataContainer[flattenXY(x, y, hdr.height)] = n;
-            }
-        }
-    } else if (hdr.bytesPerElement == sizeof(double)) {
-        for (uint32_t y = 0; y < hdr.height; ++y) {
-            for (uint32_t x = 0; x < hdr.width; ++x) {
-                double n;
-                f.read((char *)&n, sizeof n);
-                fixEndianness(&n);
-                dataContainer[flattenXY(x, y, hdr.height)] = (float)n;
-            }
-        }
-    } else {
-        err << "In " << filename << ", " << hdr.bytesPerElement
-            << " bytes per element is not supported." << std::endl;
-        throw exceptionInputSamplesFile();
+    channelMask = 0;
+    for (uint32_t c = 0; c < std::min(numChannelsInFile, 3u); ++c) {
+        channelMask |= 1u << (NNet::R + c);
     }
 
-    return { hdr.width, hdr.height };
+    return size;
 }
 
 } // end namespace NNet
@@ -7,9 +7,16 @@ See neural2d.h for more information.
 */
 
 #include <cctype>
+#include <cfloat>
 #include <cmath>
+#include <cstring>
+#include <limits>
 #include <memory>
 
+#if !defined(NNET_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+    #include <immintrin.h>
+#endif
+
 // On *nix, we have usleep(), but in Windows, we have to simulate it:
 #if defined(WIN32)
     #include <chrono>
@@ -17,6 +24,9 @@ See neural2d.h for more information.
     #define usleep(usec) std::this_thread::sleep_for(std::chrono::microseconds(usec));
 #else
     #include <unistd.h> // For sleep() or usleep()
+    #include <fcntl.h>     // For mmap() of the binary weights file
+    #include <sys/mman.h>
+    #include <sys/stat.h>
 #endif
 
 #include "neural2d.h"
@@ -37,14 +47,6 @@ namespace NNet {
 Logger info, warn, err(std::cerr);
 
 
-// Returns a random float in the range [0.0..1.0]
-//
-float randomFloat(void)
-{
-    return (float)rand() / RAND_MAX;
-}
-
-
 // Given a (depth, x, y) coordinate, return a flattened index.
 // There's nothing magic here; we use a function to do this so that we
 // always flatten it the same way each time:
@@ -71,6 +73,18 @@ float elliptDist(float x, float y, float radiusX, float radiusY)
 }
 
 
+// Given a coordinate in a destination layer, returns the coordinate of the
+// nearest neuron in a source layer along the same axis. The destination neuron is
+// mapped to the center of its cell in normalized [0..1] coordinates, then scaled
+// to the source layer:
+//
+uint32_t nearestSourceCoord(uint32_t destCoord, uint32_t destSize, uint32_t fromSize)
+{
+    float normalized = ((float)destCoord / destSize) + (1.0f / (2 * destSize));
+    return uint32_t(normalized * fromSize); // should we round off instead of round down?
+}
+
+
 bool isFileExists(string const &filename)
 {
     std::ifstream file(filename);
@@ -96,6 +110,314 @@ void sanitizeFilename(string &s)
 }
 
 
+// ***********************************  Matrix kernels  ***********************************
+
+// These small loops do nearly all the arithmetic for regular layers, which store their
+// weights in Projections, and for convolution layers. They work on plain float arrays so
+// that the compiler can keep the operands in registers and vectorize them.
+
+// Returns the sum of a[i] * b[i]. Four independent partial sums let several
+// multiply-adds be in flight at once instead of serializing on one accumulator:
+//
+float dotProduct(float const *a, float const *b, uint32_t n)
+{
+    float sum0 = 0.0f, sum1 = 0.0f, sum2 = 0.0f, sum3 = 0.0f;
+    uint32_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        sum0 += a[i]     * b[i];
+        sum1 += a[i + 1] * b[i + 1];
+        sum2 += a[i + 2] * b[i + 2];
+        sum3 += a[i + 3] * b[i + 3];
+    }
+    for (; i < n; ++i) {
+        sum0 += a[i] * b[i];
+    }
+
+    return (sum0 + sum1) + (sum2 + sum3);
+}
+
+// y[i] += a * x[i]
+//
+void axpy(float a, float const *x, float *y, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; ++i) {
+        y[i] += a * x[i];
+    }
+}
+
+// c += a * b, where a is an m x k matrix, b is k x n, and c is m x n, all stored
+// row-major with lda, ldb, and ldc elements between the starts of consecutive rows.
+// The loops are blocked so that a panel of b, blockK rows by blockN columns, stays in
+// cache while every row of a is applied to it. Four rows of c are updated in each pass
+// over a row of the panel, so each element of b loaded into a register is used four
+// times; the innermost loops run over contiguous columns and can be vectorized:
+//
+void gemm(uint32_t m, uint32_t n, uint32_t k, float const *a, uint32_t lda,
+          float const *b, uint32_t ldb, float *c, uint32_t ldc)
+{
+    const uint32_t blockN = 256;
+    const uint32_t blockK = 128;
+
+    for (uint32_t n0 = 0; n0 < n; n0 += blockN) {
+        uint32_t nLen = min(blockN, n - n0);
+
+        for (uint32_t k0 = 0; k0 < k; k0 += blockK) {
+            uint32_t kEnd = min(k0 + blockK, k);
+            uint32_t i = 0;
+
+            for (; i + 4 <= m; i += 4) {
+                float *c0 = c + i * ldc + n0;
+                float *c1 = c0 + ldc;
+                float *c2 = c1 + ldc;
+                float *c3 = c2 + ldc;
+                for (uint32_t kk = k0; kk < kEnd; ++kk) {
+                    float a0 = a[i * lda + kk];
+                    float a1 = a[(i + 1) * lda + kk];
+                    float a2 = a[(i + 2) * lda + kk];
+                    float a3 = a[(i + 3) * lda + kk];
+                    float const *bRow = b + kk * ldb + n0;
+                    for (uint32_t j = 0; j < nLen; ++j) {
+                        float bVal = bRow[j];
+                        c0[j] += a0 * bVal;
+                        c1[j] += a1 * bVal;
+                        c2[j] += a2 * bVal;
+                        c3[j] += a3 * bVal;
+                    }
+                }
+            }
+
+            for (; i < m; ++i) {
+                for (uint32_t kk = k0; kk < kEnd; ++kk) {
+                    axpy(a[i * lda + kk], b + kk * ldb + n0, c + i * ldc + n0, nLen);
+                }
+            }
+        }
+    }
+}
+
+// The same, for matrices without padding between rows:
+//
+void gemm(uint32_t m, uint32_t n, uint32_t k, float const *a, float const *b, float *c)
+{
+    gemm(m, n, k, a, k, b, n, c, n);
+}
+
+// Returns the sum of w[k] * x[columns[k]], i.e., one row of a sparse matrix times a
+// dense vector. The sum is accumulated in order, the same order in which the weights
+// are stored in the weights file:
+//
+float sparseDotProduct(float const *w, uint32_t const *columns, float const *x, uint32_t n)
+{
+    float sum = 0.0f;
+
+    for (uint32_t k = 0; k < n; ++k) {
+        sum += w[k] * x[columns[k]];
+    }
+
+    return sum;
+}
+
+// y[columns[k]] += a * w[k], the transpose of sparseDotProduct():
+//
+void sparseAxpy(float a, float const *w, uint32_t const *columns, float *y, uint32_t n)
+{
+    for (uint32_t k = 0; k < n; ++k) {
+        y[columns[k]] += a * w[k];
+    }
+}
+
+
+// ***********************************  class Philox  ***********************************
+
+// The key is the seed and the upper half of the counter is the stream number. The
+// lower half of the counter numbers the blocks of four outputs in the stream:
+//
+Philox::Philox(uint64_t seed, uint64_t stream)
+{
+    key[0] = (uint32_t)seed;
+    key[1] = (uint32_t)(seed >> 32);
+    streamLo = (uint32_t)stream;
+    streamHi = (uint32_t)(stream >> 32);
+}
+
+void Philox::block(uint32_t ctr[4], uint32_t const key_[2])
+{
+    uint32_t k0 = key_[0];
+    uint32_t k1 = key_[1];
+
+    for (uint32_t round = 0; round < 10; ++round) {
+        uint64_t product0 = (uint64_t)0xD2511F53 * ctr[0];
+        uint64_t product1 = (uint64_t)0xCD9E8D57 * ctr[2];
+        uint32_t c1 = ctr[1];
+        uint32_t c3 = ctr[3];
+        ctr[0] = (uint32_t)(product1 >> 32) ^ c1 ^ k0;
+        ctr[1] = (uint32_t)product1;
+        ctr[2] = (uint32_t)(product0 >> 32) ^ c3 ^ k1;
+        ctr[3] = (uint32_t)product0;
+        k0 += 0x9E3779B9;
+        k1 += 0xBB67AE85;
+    }
+}
+
+// The top 24 bits of each output become a float with no rounding:
+//
+static float uniformFromBits(uint32_t bits)
+{
+    return (float)(bits >> 8) * (1.0f / 16777216.0f);
+}
+
+float Philox::uniform(uint64_t index) const
+{
+    uint32_t ctr[4] = { (uint32_t)(index >> 2), (uint32_t)(index >> 34), streamLo, streamHi };
+    block(ctr, key);
+    return uniformFromBits(ctr[index & 3]);
+}
+
+void Philox::uniform(uint64_t firstIndex, float *pDest, size_t count) const
+{
+    uint64_t index = firstIndex;
+    uint64_t endIndex = firstIndex + count;
+
+    while (index < endIndex) {
+        uint32_t ctr[4] = { (uint32_t)(index >> 2), (uint32_t)(index >> 34), streamLo, streamHi };
+        block(ctr, key);
+        for (uint32_t lane = index & 3; lane < 4 && index < endIndex; ++lane, ++index) {
+            *pDest++ = uniformFromBits(ctr[lane]);
+        }
+    }
+}
+
+
+// ***********************************  class ThreadPool  ***********************************
+
+
+ThreadPool::ThreadPool(uint32_t numThreads)
+    : pJob(nullptr), numTasksRemaining(0), jobNumber(0), stopping(false)
+{
+    for (uint32_t queueNum = 0; queueNum < std::max(numThreads, 1u); ++queueNum) {
+        queues.push_back(std::unique_ptr<TaskQueue>(new TaskQueue));
+    }
+
+    for (uint32_t queueNum = 1; queueNum < queues.size(); ++queueNum) {
+        threads.emplace_back(&ThreadPool::workerLoop, this, queueNum);
+    }
+}
+
+ThreadPool::~ThreadPool(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        stopping = true;
+    }
+    jobStarted.notify_all();
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+void ThreadPool::parallelFor(uint32_t numItems, uint32_t grainSize,
+                             std::function<void(uint32_t, uint32_t)> const &fn)
+{
+    grainSize = std::max(grainSize, 1u);
+    uint32_t numTasks = (numItems + grainSize - 1) / grainSize;
+
+    if (numTasks <= 1 || queues.size() == 1) {
+        fn(0, numItems);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        pJob = &fn;
+        numTasksRemaining = numTasks;
+    }
+
+    // Deal out the tasks in contiguous blocks, one block per queue:
+
+    for (uint32_t queueNum = 0; queueNum < queues.size(); ++queueNum) {
+        uint32_t firstTask = (uint32_t)((uint64_t)numTasks * queueNum / queues.size());
+        uint32_t lastTask = (uint32_t)((uint64_t)numTasks * (queueNum + 1) / queues.size());
+        std::lock_guard<std::mutex> lock(queues[queueNum]->mutex);
+        for (uint32_t taskNum = firstTask; taskNum < lastTask; ++taskNum) {
+            queues[queueNum]->tasks.push_back({ taskNum * grainSize, std::min((taskNum + 1) * grainSize, numItems) });
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        ++jobNumber;
+    }
+    jobStarted.notify_all();
+
+    runTasks(0);
+
+    std::unique_lock<std::mutex> lock(jobMutex);
+    jobFinished.wait(lock, [this] { return numTasksRemaining == 0; });
+    pJob = nullptr;
+}
+
+void ThreadPool::workerLoop(uint32_t queueNum)
+{
+    uint64_t lastJobNumber = 0;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(jobMutex);
+            jobStarted.wait(lock, [&] { return stopping || jobNumber != lastJobNumber; });
+            if (stopping) {
+                return;
+            }
+            lastJobNumber = jobNumber;
+        }
+
+        runTasks(queueNum);
+    }
+}
+
+void ThreadPool::runTasks(uint32_t queueNum)
+{
+    Task task;
+
+    while (takeTask(queueNum, task)) {
+        (*pJob)(task.begin, task.end);
+        if (--numTasksRemaining == 0) {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            jobFinished.notify_all();
+        }
+    }
+}
+
+// Takes the next task from our own queue, or else steals the last task of the
+// first other queue that has one. Returns false if all the queues are empty:
+//
+bool ThreadPool::takeTask(uint32_t queueNum, Task &task)
+{
+    {
+        TaskQueue &own = *queues[queueNum];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = own.tasks.front();
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+
+    for (uint32_t offset = 1; offset < queues.size(); ++offset) {
+        TaskQueue &victim = *queues[(queueNum + offset) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
 // ***********************************  Transfer Functions  ***********************************
 
 // Here is where we define at least one transfer function. We refer to them by
@@ -105,11 +427,11 @@ void sanitizeFilename(string &s)
 
 // tanh is a sigmoid curve scaled; output ranges from -1 to +1:
 float transferFunctionTanh(float x) { return tanh(x); }
-float transferFunctionDerivativeTanh(float x) { return 1.0f - tanh(x) * tanh(x); }
+float transferFunctionDerivativeTanh(float x) { float t = tanh(x); return 1.0f - t * t; }
 
 // logistic is a sigmoid curve that ranges 0.0 to 1.0:
 float transferFunctionLogistic(float x) { return 1.0f / (1.0f + exp(-x)); }
-float transferFunctionDerivativeLogistic(float x) { return exp(-x) / pow((exp(-x) + 1.0f), 2.0f); }
+float transferFunctionDerivativeLogistic(float x) { float s = transferFunctionLogistic(x); return s * (1.0f - s); }
 
 // linear is a constant slope; ranges from -inf to +inf:
 float transferFunctionLinear(float x) { return x; }
@@ -138,211 +460,2001 @@ float transferFunctionIdentity(float x) { return x; }
 float transferFunctionIdentityDerivative(float x) { return (void)x, 1.0f; }
 
 
-// ***********************************  Input samples  ***********************************
-
+// ***********************************  Batch transfer functions  ***********************************
+
+// The batch transfer functions apply a transfer function, or multiply by its
+// derivative, across a whole array of floats. They use polynomial and rational
+// approximations of tanh(), exp() and log1p() that are within a few float ulps
+// of the library functions, written once in terms of a small vector type. The
+// vector width is selected at compile time from the instruction sets the
+// compiler was told it may use (see the SIMD option in CMakeLists.txt):
+// AVX-512 (16 floats), AVX2 (8), SSE2 (4), or else plain scalar code. Defining
+// NNET_NO_SIMD forces the scalar code. The tail of an array that doesn't fill a
+// whole vector always goes through the scalar version of the same code.
+
+#if !defined(NNET_NO_SIMD) && defined(__AVX512F__)
+    #define NNET_SIMD_AVX512
+#elif !defined(NNET_NO_SIMD) && defined(__AVX2__)
+    #define NNET_SIMD_AVX2
+#elif !defined(NNET_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+    #define NNET_SIMD_SSE2
+#endif
 
-// Given an integer 8-bit pixel value in the range 0..255, convert that into
-// a floating point value that can be input directly into the input layer of
-// the neural net. If you change this, also change the inverse function
-// networkInputValToPixelRange()
+// One float at a time:
 //
-float pixelToNetworkInputRange(unsigned val)
+struct floatx1
 {
-    // Return a value in the range -1..1:
-    return val / 128.0f - 1.0f;
+    float v;
+    static const uint32_t width = 1;
 
-    // Alternatively, return a value in the range 0..1:
-    //return val / 256.0f;
+    static floatx1 load(float const *p) { return { *p }; }
+    static floatx1 set(float f) { return { f }; }
+    void store(float *p) const { *p = v; }
+};
 
-    // Alternatively, return a value in the range -0.5..0.5:
-    //return val / 256.0f - 0.5f;
-}
+inline floatx1 operator+(floatx1 a, floatx1 b) { return { a.v + b.v }; }
+inline floatx1 operator-(floatx1 a, floatx1 b) { return { a.v - b.v }; }
+inline floatx1 operator*(floatx1 a, floatx1 b) { return { a.v * b.v }; }
+inline floatx1 operator/(floatx1 a, floatx1 b) { return { a.v / b.v }; }
+inline floatx1 vmin(floatx1 a, floatx1 b) { return { a.v < b.v ? a.v : b.v }; }
+inline floatx1 vmax(floatx1 a, floatx1 b) { return { a.v > b.v ? a.v : b.v }; }
 
-// If you change this, also change the inverse function
-// pixelToNetworkInputRange().
+// Returns the nearest integer to a and 2 raised to that integer. a must be in
+// the range of a float exponent, -126..127:
 //
-unsigned networkInputValToPixelRange(float val)
+inline floatx1 vround(floatx1 a) { return { (float)(int32_t)(a.v >= 0.0f ? a.v + 0.5f : a.v - 0.5f) }; }
+inline floatx1 vpow2(floatx1 n)
 {
-    return min((unsigned)((val + 1.0f) * 128 + 0.5f), 255);
-
-    // Alternatively for a value in the range 0..1:
-    //return min((unsigned)(val * 256 + 0.5f), 255);
-
-    // Alternatively for a value in the range -0.5..0.5:
-    //return min((unsigned)((val + 0.5f) * 256 + 0.5f), 255);
+    uint32_t bits = (uint32_t)((int32_t)n.v + 127) << 23;
+    floatx1 result;
+    memcpy(&result.v, &bits, sizeof result.v);
+    return result;
 }
 
+#if defined(NNET_SIMD_AVX512)
 
-// ***********************************  class Sample  ***********************************
-
-
-// If the data is available, we'll return it. If this is the first time getData()
-// is called for inputs that come from an image, we'll open the image file and
-// cache the pixel data in memory. Returns a reference to the container of input data.
-//
-vector<float> const &Sample::getData(ColorChannel_t channel)
+struct floatxN
 {
-   if (data.size() == 0 && imageFilename != "") {
-       // Try all the image readers until we find one that succeeds:
-       for (auto imageReader : SampleSet::imageReaders) {
-           size = imageReader->getData(imageFilename, data, channel);
-           if (size.x != 0) {
-               break;
-           }
-       }
-
-       if (size.x == 0) {
-           err << "Unsupported image file format in " << imageFilename << std::endl;
-           throw exceptionInputSamplesFile();
-       }
-   }
+    __m512 v;
+    static const uint32_t width = 16;
 
-   // If we get here, we can assume there is something in the .data member
+    static floatxN load(float const *p) { return { _mm512_loadu_ps(p) }; }
+    static floatxN set(float f) { return { _mm512_set1_ps(f) }; }
+    void store(float *p) const { _mm512_storeu_ps(p, v); }
+};
 
-   return data;
+inline floatxN operator+(floatxN a, floatxN b) { return { _mm512_add_ps(a.v, b.v) }; }
+inline floatxN operator-(floatxN a, floatxN b) { return { _mm512_sub_ps(a.v, b.v) }; }
+inline floatxN operator*(floatxN a, floatxN b) { return { _mm512_mul_ps(a.v, b.v) }; }
+inline floatxN operator/(floatxN a, floatxN b) { return { _mm512_div_ps(a.v, b.v) }; }
+inline floatxN vmin(floatxN a, floatxN b) { return { _mm512_min_ps(a.v, b.v) }; }
+inline floatxN vmax(floatxN a, floatxN b) { return { _mm512_max_ps(a.v, b.v) }; }
+inline floatxN vround(floatxN a) { return { _mm512_cvtepi32_ps(_mm512_cvtps_epi32(a.v)) }; }
+inline floatxN vpow2(floatxN n)
+{
+    __m512i bits = _mm512_add_epi32(_mm512_cvtps_epi32(n.v), _mm512_set1_epi32(127));
+    return { _mm512_castsi512_ps(_mm512_slli_epi32(bits, 23)) };
 }
 
+#elif defined(NNET_SIMD_AVX2)
 
-void Sample::clearImageCache(void)
+struct floatxN
 {
-    data.clear();
-}
+    __m256 v;
+    static const uint32_t width = 8;
 
-
-vector<ImageReader *> SampleSet::imageReaders = {
-        new ImageReaderDat(),
-        new ImageReaderBMP()
+    static floatxN load(float const *p) { return { _mm256_loadu_ps(p) }; }
+    static floatxN set(float f) { return { _mm256_set1_ps(f) }; }
+    void store(float *p) const { _mm256_storeu_ps(p, v); }
 };
 
-
-// ***********************************  class SampleSet  ***********************************
-
-
-// Given the name of an input sample config file, open it and save the contents
-// in memory. For lines that specify an image filename, we'll just save the filename
-// for now and defer reading the pixel data until it's needed. For lines that
-// contain an explicit list of input values, we'll save the values. The syntax
-// for a line specifying a filename is of the form:
-//     filename t1 t2 t3...
-// where t1, t2, etc. are the target output values. The syntax for a line that
-// specifies explicit values is:
-//     { i1, i2, i3... } t1 t2 t3
-// where i1, i2... are the input values and t1, t2, etc. are the target output values.
-// We now honor the directive "path_prefix=", which is a string that gets prepended
-// to the front of every filename.
-//
-void SampleSet::loadSamples(const string &inputFilename)
+inline floatxN operator+(floatxN a, floatxN b) { return { _mm256_add_ps(a.v, b.v) }; }
+inline floatxN operator-(floatxN a, floatxN b) { return { _mm256_sub_ps(a.v, b.v) }; }
+inline floatxN operator*(floatxN a, floatxN b) { return { _mm256_mul_ps(a.v, b.v) }; }
+inline floatxN operator/(floatxN a, floatxN b) { return { _mm256_div_ps(a.v, b.v) }; }
+inline floatxN vmin(floatxN a, floatxN b) { return { _mm256_min_ps(a.v, b.v) }; }
+inline floatxN vmax(floatxN a, floatxN b) { return { _mm256_max_ps(a.v, b.v) }; }
+inline floatxN vround(floatxN a) { return { _mm256_cvtepi32_ps(_mm256_cvtps_epi32(a.v)) }; }
+inline floatxN vpow2(floatxN n)
 {
-    string line;
-    uint32_t lineNum = 0;
-    string pathPrefix = "";
+    __m256i bits = _mm256_add_epi32(_mm256_cvtps_epi32(n.v), _mm256_set1_epi32(127));
+    return { _mm256_castsi256_ps(_mm256_slli_epi32(bits, 23)) };
+}
 
-    if (!isFileExists(inputFilename)) {
-        err << "Error reading input samples config file \'" << inputFilename << "\'" << endl;
-        throw exceptionInputSamplesFile();
-    }
+#elif defined(NNET_SIMD_SSE2)
 
-    std::ifstream dataIn(inputFilename);
-    if (!dataIn || !dataIn.is_open()) {
-        err << "Error opening input samples config file \'" << inputFilename << "\'" << endl;
-        throw exceptionInputSamplesFile();
-    }
+struct floatxN
+{
+    __m128 v;
+    static const uint32_t width = 4;
 
-    samples.clear();  // Lose all prior samples
+    static floatxN load(float const *p) { return { _mm_loadu_ps(p) }; }
+    static floatxN set(float f) { return { _mm_set1_ps(f) }; }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+};
 
-    while (getline(dataIn, line)) {
-        ++lineNum;
-        Sample sample; // Default ctor will clear all members
-        string token;
-        char delim;
+inline floatxN operator+(floatxN a, floatxN b) { return { _mm_add_ps(a.v, b.v) }; }
+inline floatxN operator-(floatxN a, floatxN b) { return { _mm_sub_ps(a.v, b.v) }; }
+inline floatxN operator*(floatxN a, floatxN b) { return { _mm_mul_ps(a.v, b.v) }; }
+inline floatxN operator/(floatxN a, floatxN b) { return { _mm_div_ps(a.v, b.v) }; }
+inline floatxN vmin(floatxN a, floatxN b) { return { _mm_min_ps(a.v, b.v) }; }
+inline floatxN vmax(floatxN a, floatxN b) { return { _mm_max_ps(a.v, b.v) }; }
+inline floatxN vround(floatxN a) { return { _mm_cvtepi32_ps(_mm_cvtps_epi32(a.v)) }; }
+inline floatxN vpow2(floatxN n)
+{
+    __m128i bits = _mm_add_epi32(_mm_cvtps_epi32(n.v), _mm_set1_epi32(127));
+    return { _mm_castsi128_ps(_mm_slli_epi32(bits, 23)) };
+}
 
-        std::stringstream ss(line);
-        ss >> token;
+#else
 
-        if (token.find("path_prefix") == 0) {
-            if (token.size() == 11) {
-                ss >> delim;
-                token += delim; // Attach the equals sign, no spaces
-            }
-            if (token.size() == 12) {
-                string s;
-                ss >> s;
-                token += s; // Attach the path prefix string, no spaces
-            }
-            pathPrefix = token.substr(12); // "path_prefix=" is 12 chars
-            continue;
-        } else if (token == "{") {
-            // This means we have literal values like "{ 0.2 0 -1.0}"
-            sample.imageFilename="";   // "" means we have immediate data
-
-            // Read from the char after the { up to but including the } char:
-            char args[16384]; // Review !!!
-            ss.get(args, sizeof args, '}');
-            std::stringstream inargs(args);
-            while (!inargs.eof()) {
-                float val;
-                if (!(inargs >> val).fail()) {
-                    sample.data.push_back(val);
-                }
-            }
-            ss >> delim;
-        } else {
-            // We may have an image filename (instead of an explicit list of values):
-            sample.imageFilename = pathPrefix + token;
-            // Skip blank and comment lines:
-            if (sample.imageFilename.size() == 0 || sample.imageFilename[0] == '#') {
-                continue;
-            }
-        }
+typedef floatx1 floatxN;
 
-        // If they exist, read the target values from the rest of the line:
-        while (!ss.eof()) {
-            float val;
-            if (!(ss >> val).fail()) {
-                sample.targetVals.push_back(val);
-            }
-        }
+#endif
 
-        samples.push_back(sample);
-    }
 
-    info << samples.size() << " training samples initialized" << endl;
+// exp(x), by reducing x to r = x - n*ln(2) with |r| <= ln(2)/2, then
+// exp(x) = 2^n * exp(r) with a polynomial for exp(r) (coefficients from Cephes).
+// The argument is clamped so that the result stays a normal float, which
+// saturates it at about 1.6e38 and 1.6e-38 instead of inf and zero.
+//
+template<typename V> inline V expApprox(V x)
+{
+    x = vmin(vmax(x, V::set(-87.0f)), V::set(88.0f));
+    V n = vround(x * V::set(1.44269504088896341f));
+    V r = x - n * V::set(0.693359375f) - n * V::set(-2.12194440e-4f);
+
+    V p = V::set(1.9875691500e-4f);
+    p = p * r + V::set(1.3981999507e-3f);
+    p = p * r + V::set(8.3334519073e-3f);
+    p = p * r + V::set(4.1665795894e-2f);
+    p = p * r + V::set(1.6666665459e-1f);
+    p = p * r + V::set(5.0000001201e-1f);
+    p = p * r * r + r + V::set(1.0f);
+
+    return p * vpow2(n);
 }
 
-
-// Randomize the order of the samples container.
+// log(1 + x) for 0 <= x <= 1, from 2*atanh(s) where s = x / (2 + x) <= 1/3:
 //
-void SampleSet::shuffle(void)
+template<typename V> inline V log1pApprox(V x)
 {
-    std::random_shuffle(samples.begin(), samples.end());
+    V s = x / (V::set(2.0f) + x);
+    V s2 = s * s;
+    V p = V::set(2.0f / 13.0f);
+    p = p * s2 + V::set(2.0f / 11.0f);
+    p = p * s2 + V::set(2.0f / 9.0f);
+    p = p * s2 + V::set(2.0f / 7.0f);
+    p = p * s2 + V::set(2.0f / 5.0f);
+    p = p * s2 + V::set(2.0f / 3.0f);
+    p = p * s2 + V::set(2.0f);
+    return p * s;
 }
 
-
-// By clearing the cache, future image access will cause the pixel data to
-// be re-read and converted by whatever color conversion is in effect then.
+// A 13/6 rational approximation of tanh (the one used by Eigen). Beyond the
+// clamp, tanh rounds to +/-1 in float:
 //
-void SampleSet::clearImageCache(void)
+template<typename V> inline V tanhApprox(V x)
 {
-    for (auto &samp : samples) {
-        if (samp.imageFilename != "")
-            samp.clearImageCache();
-    }
+    x = vmin(vmax(x, V::set(-7.90531110763549805f)), V::set(7.90531110763549805f));
+    V x2 = x * x;
+
+    V p = V::set(-2.76076847742355e-16f);
+    p = p * x2 + V::set(2.00018790482477e-13f);
+    p = p * x2 + V::set(-8.60467152213735e-11f);
+    p = p * x2 + V::set(5.12229709037114e-08f);
+    p = p * x2 + V::set(1.48572235717979e-05f);
+    p = p * x2 + V::set(6.37261928875436e-04f);
+    p = p * x2 + V::set(4.89352455891786e-03f);
+    p = p * x;
+
+    V q = V::set(1.19825839466702e-06f);
+    q = q * x2 + V::set(1.18534705686654e-04f);
+    q = q * x2 + V::set(2.26843463243900e-03f);
+    q = q * x2 + V::set(4.89352518554385e-03f);
+
+    return p / q;
 }
 
-
-// ***********************************  struct Connection  ***********************************
-
-
-Connection::Connection(Neuron &from, Neuron &to)
-     : fromNeuron(from), toNeuron(to)
+template<typename V> inline V logisticApprox(V x)
 {
-    weight = randomFloat() / 2.0f - 1.0f;  // Range -0.25..0.25
-    deltaWeight = 0.0f;
-    convolveMatrixIndex = 0;
+    return V::set(1.0f) / (V::set(1.0f) + expApprox(V::set(0.0f) - x));
 }
 
+// Softplus, as log(1 + exp(x)) = max(x, 0) + log(1 + exp(-|x|)) so that
+// nothing overflows:
+//
+template<typename V> inline V softplusApprox(V x)
+{
+    V absX = vmax(x, V::set(0.0f) - x);
+    return vmax(x, V::set(0.0f)) + log1pApprox(expApprox(V::set(0.0f) - absX));
+}
 
-// *****************************  class Layer  *****************************
+template<typename V> inline V gaussianApprox(V x)
+{
+    return expApprox(x * x * V::set(-0.5f));
+}
+
+// Applies f in place to x[0..n-1], a whole vector at a time, then one float
+// at a time for the tail:
+//
+template<typename F> inline void applyBatch(float *x, uint32_t n, F f)
+{
+    uint32_t i = 0;
+    for (; i + floatxN::width <= n; i += floatxN::width) {
+        f(floatxN::load(x + i)).store(x + i);
+    }
+    for (; i < n; ++i) {
+        f(floatx1::load(x + i)).store(x + i);
+    }
+}
+
+// Multiplies gradients[i] by d(y[i]) for i in 0..n-1:
+//
+template<typename D> inline void applyDerivativeBatch(float const *y, float *gradients, uint32_t n, D d)
+{
+    uint32_t i = 0;
+    for (; i + floatxN::width <= n; i += floatxN::width) {
+        (floatxN::load(gradients + i) * d(floatxN::load(y + i))).store(gradients + i);
+    }
+    for (; i < n; ++i) {
+        (floatx1::load(gradients + i) * d(floatx1::load(y + i))).store(gradients + i);
+    }
+}
+
+// Generic lambdas are C++14, so each function gets a small functor instead:
+//
+struct TanhOp { template<typename V> V operator()(V x) const { return tanhApprox(x); } };
+struct LogisticOp { template<typename V> V operator()(V x) const { return logisticApprox(x); } };
+struct SoftplusOp { template<typename V> V operator()(V x) const { return softplusApprox(x); } };
+struct GaussianOp { template<typename V> V operator()(V x) const { return gaussianApprox(x); } };
+struct RampOp { template<typename V> V operator()(V x) const { return vmin(vmax(x, V::set(-1.0f)), V::set(1.0f)); } };
+
+// Derivatives in terms of the argument a, the same as the scalar derivative
+// functions above:
+//
+struct TanhDerivativeOp
+{
+    template<typename V> V operator()(V a) const { V t = tanhApprox(a); return V::set(1.0f) - t * t; }
+};
+struct LogisticDerivativeOp
+{
+    template<typename V> V operator()(V a) const { V s = logisticApprox(a); return s * (V::set(1.0f) - s); }
+};
+struct GaussianDerivativeOp
+{
+    template<typename V> V operator()(V a) const { return (V::set(0.0f) - a) * gaussianApprox(a); }
+};
+
+// Derivatives in terms of the transfer function's output y = tf(x):
+//
+struct TanhDerivativeFromOutputOp
+{
+    template<typename V> V operator()(V y) const { return V::set(1.0f) - y * y; }
+};
+struct LogisticDerivativeFromOutputOp
+{
+    template<typename V> V operator()(V y) const { return y * (V::set(1.0f) - y); }
+};
+struct SoftplusDerivativeFromOutputOp
+{
+    template<typename V> V operator()(V y) const { return V::set(1.0f) - expApprox(V::set(0.0f) - y); }
+};
+
+void transferFunctionBatchTanh(float *x, uint32_t n) { applyBatch(x, n, TanhOp()); }
+void transferFunctionBatchLogistic(float *x, uint32_t n) { applyBatch(x, n, LogisticOp()); }
+void transferFunctionBatchRamp(float *x, uint32_t n) { applyBatch(x, n, RampOp()); }
+void transferFunctionBatchGaussian(float *x, uint32_t n) { applyBatch(x, n, GaussianOp()); }
+void transferFunctionBatchReLU(float *x, uint32_t n) { applyBatch(x, n, SoftplusOp()); }
+void transferFunctionBatchIdentity(float *x, uint32_t n) { (void)x, (void)n; }
+
+void transferDerivativeBatchTanh(float const *a, float *gradients, uint32_t n)
+{
+    applyDerivativeBatch(a, gradients, n, TanhDerivativeOp());
+}
+
+void transferDerivativeBatchLogistic(float const *a, float *gradients, uint32_t n)
+{
+    applyDerivativeBatch(a, gradients, n, LogisticDerivativeOp());
+}
+
+void transferDerivativeBatchRamp(float const *a, float *gradients, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; ++i) {
+        gradients[i] *= transferFunctionDerivativeRamp(a[i]);
+    }
+}
+
+void transferDerivativeBatchGaussian(float const *a, float *gradients, uint32_t n)
+{
+    applyDerivativeBatch(a, gradients, n, GaussianDerivativeOp());
+}
+
+// The derivative of softplus is the logistic function:
+//
+void transferDerivativeBatchReLU(float const *a, float *gradients, uint32_t n)
+{
+    applyDerivativeBatch(a, gradients, n, LogisticOp());
+}
+
+void transferDerivativeBatchIdentity(float const *a, float *gradients, uint32_t n)
+{
+    (void)a, (void)gradients, (void)n;
+}
+
+void transferDerivativeFromOutputBatchTanh(float const *y, float *gradients, uint32_t n)
+{
+    applyDerivativeBatch(y, gradients, n, TanhDerivativeFromOutputOp());
+}
+
+void transferDerivativeFromOutputBatchLogistic(float const *y, float *gradients, uint32_t n)
+{
+    applyDerivativeBatch(y, gradients, n, LogisticDerivativeFromOutputOp());
+}
+
+// The ramp's slope is 1 for -1 <= x <= 1, the same test as
+// transferFunctionDerivativeRamp(). At y = -1 or 1 the output can't tell the corner
+// from a saturated argument, so we take the corner's slope:
+//
+void transferDerivativeFromOutputBatchRamp(float const *y, float *gradients, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; ++i) {
+        gradients[i] *= (y[i] >= -1.0f && y[i] <= 1.0f) ? 1.0f : 0.0f;
+    }
+}
+
+// If y = log(1 + exp(x)), then logistic(x) = 1 - exp(-y):
+//
+void transferDerivativeFromOutputBatchReLU(float const *y, float *gradients, uint32_t n)
+{
+    applyDerivativeBatch(y, gradients, n, SoftplusDerivativeFromOutputOp());
+}
+
+
+// ***********************************  Batch inference kernels  ***********************************
+
+// Net::feedForwardBatch() multiplies each layer's weights by a narrow matrix with one
+// column per sample of a block of samples. gemm() keeps its operands in cache but
+// accumulates in memory, which is the right trade for wide matrices. For narrow ones,
+// these kernels keep a tile of the result in registers, numRows rows by numVectors
+// vectors of samples, for the whole length of the sum. Each weight is then loaded
+// once per tile, and each vector of inputs is used for numRows rows. The columns that
+// don't fill a whole vector go through the same code one float at a time.
+
+// c[i][j] += sum of a[i][kk] * b[kk][j] over kk, for one tile at row i, column j:
+//
+template<typename V, uint32_t numRows, uint32_t numVectors>
+static inline void gemmNarrowTile(uint32_t i, uint32_t j, uint32_t k, float const *a, uint32_t lda,
+                                  float const *b, uint32_t ldb, float *c, uint32_t ldc)
+{
+    V acc[numRows][numVectors];
+    for (uint32_t r = 0; r < numRows; ++r) {
+        for (uint32_t v = 0; v < numVectors; ++v) {
+            acc[r][v] = V::set(0.0f);
+        }
+    }
+
+    float const *pA = a + (size_t)i * lda;
+    float const *pB = b + j;
+    for (uint32_t kk = 0; kk < k; ++kk, pB += ldb) {
+        V x[numVectors];
+        for (uint32_t v = 0; v < numVectors; ++v) {
+            x[v] = V::load(pB + v * V::width);
+        }
+        for (uint32_t r = 0; r < numRows; ++r) {
+            V w = V::set(pA[r * lda + kk]);
+            for (uint32_t v = 0; v < numVectors; ++v) {
+                acc[r][v] = acc[r][v] + w * x[v];
+            }
+        }
+    }
+
+    for (uint32_t r = 0; r < numRows; ++r) {
+        float *pC = c + (size_t)(i + r) * ldc + j;
+        for (uint32_t v = 0; v < numVectors; ++v) {
+            (V::load(pC + v * V::width) + acc[r][v]).store(pC + v * V::width);
+        }
+    }
+}
+
+// Does the tiles that fit in columns [jBegin, n) and returns the first column not done:
+//
+template<typename V, uint32_t numVectors>
+static uint32_t gemmNarrowColumns(uint32_t m, uint32_t jBegin, uint32_t n, uint32_t k, float const *a,
+                                  uint32_t lda, float const *b, uint32_t ldb, float *c, uint32_t ldc)
+{
+    const uint32_t tileWidth = numVectors * V::width;
+    uint32_t j = jBegin;
+
+    for (; j + tileWidth <= n; j += tileWidth) {
+        uint32_t i = 0;
+        for (; i + 4 <= m; i += 4) {
+            gemmNarrowTile<V, 4, numVectors>(i, j, k, a, lda, b, ldb, c, ldc);
+        }
+        for (; i < m; ++i) {
+            gemmNarrowTile<V, 1, numVectors>(i, j, k, a, lda, b, ldb, c, ldc);
+        }
+    }
+
+    return j;
+}
+
+// c += a * b, with the same arguments as gemm(), for matrices b and c of a few dozen
+// columns at most:
+//
+void gemmNarrow(uint32_t m, uint32_t n, uint32_t k, float const *a, uint32_t lda,
+                float const *b, uint32_t ldb, float *c, uint32_t ldc)
+{
+    uint32_t j = gemmNarrowColumns<floatxN, 2>(m, 0, n, k, a, lda, b, ldb, c, ldc);
+    j = gemmNarrowColumns<floatxN, 1>(m, j, n, k, a, lda, b, ldb, c, ldc);
+    gemmNarrowColumns<floatx1, 1>(m, j, n, k, a, lda, b, ldb, c, ldc);
+}
+
+// pDest[j] += sum of w[kk] * b[columns[kk]][j] over kk, i.e., one sparse row times a
+// narrow matrix b, for the n columns of b:
+//
+template<typename V, uint32_t numVectors>
+static uint32_t sparseNarrowColumns(uint32_t jBegin, uint32_t n, float const *w, uint32_t const *columns,
+                                    uint32_t numWeights, float const *b, uint32_t ldb, float *pDest)
+{
+    const uint32_t tileWidth = numVectors * V::width;
+    uint32_t j = jBegin;
+
+    for (; j + tileWidth <= n; j += tileWidth) {
+        V acc[numVectors];
+        for (uint32_t v = 0; v < numVectors; ++v) {
+            acc[v] = V::set(0.0f);
+        }
+        for (uint32_t kk = 0; kk < numWeights; ++kk) {
+            V weight = V::set(w[kk]);
+            float const *pB = b + (size_t)columns[kk] * ldb + j;
+            for (uint32_t v = 0; v < numVectors; ++v) {
+                acc[v] = acc[v] + weight * V::load(pB + v * V::width);
+            }
+        }
+        for (uint32_t v = 0; v < numVectors; ++v) {
+            (V::load(pDest + j + v * V::width) + acc[v]).store(pDest + j + v * V::width);
+        }
+    }
+
+    return j;
+}
+
+void sparseGemvNarrow(uint32_t n, float const *w, uint32_t const *columns, uint32_t numWeights,
+                      float const *b, uint32_t ldb, float *pDest)
+{
+    uint32_t j = sparseNarrowColumns<floatxN, 2>(0, n, w, columns, numWeights, b, ldb, pDest);
+    j = sparseNarrowColumns<floatxN, 1>(j, n, w, columns, numWeights, b, ldb, pDest);
+    sparseNarrowColumns<floatx1, 1>(j, n, w, columns, numWeights, b, ldb, pDest);
+}
+
+
+// ***********************************  Quantized kernels  ***********************************
+
+// After Net::quantize(), regular layers multiply 8-bit integer weights by 8-bit integer
+// source outputs. These kernels return the exact sums of the products in 32-bit
+// integers. A product is at most 127 * 127, so a sum can't overflow in rows of fewer
+// than 133,000 weights. The vector versions widen 16 values at a time to 16 bits, then
+// multiply adjacent pairs and add them into 32-bit sums (pmaddwd). SSE2 and AVX2 both
+// have that instruction; AVX-512 builds use the AVX2 version.
+
+// Rounds x * invScale to the nearest integer in -127..127, halves away from zero like
+// vround(floatx1):
+//
+inline int8_t quantizeToInt8(float x, float invScale)
+{
+    float q = x * invScale;
+    q = q < -127.0f ? -127.0f : (q > 127.0f ? 127.0f : q);
+    return (int8_t)(int32_t)(q >= 0.0f ? q + 0.5f : q - 0.5f);
+}
+
+#if defined(NNET_SIMD_AVX512) || defined(NNET_SIMD_AVX2) || defined(NNET_SIMD_SSE2)
+inline int32_t horizontalSum(__m128i v)
+{
+    int32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, v);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+#endif
+
+// q[i] = quantizeToInt8(x[i], invScale). The vector version converts 16 floats at a
+// time and packs them into bytes; like vround(floatxN), it rounds halves to even:
+//
+void quantizeArray(float const *x, float invScale, int8_t *q, uint32_t n)
+{
+    uint32_t i = 0;
+
+#if defined(NNET_SIMD_AVX512) || defined(NNET_SIMD_AVX2) || defined(NNET_SIMD_SSE2)
+    __m128 scale = _mm_set1_ps(invScale);
+    __m128 lowest = _mm_set1_ps(-127.0f);
+    __m128 highest = _mm_set1_ps(127.0f);
+    auto convert4 = [&](uint32_t j) {
+        __m128 v = _mm_mul_ps(_mm_loadu_ps(x + j), scale);
+        return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(v, lowest), highest));
+    };
+    for (; i + 16 <= n; i += 16) {
+        __m128i low = _mm_packs_epi32(convert4(i), convert4(i + 4));
+        __m128i high = _mm_packs_epi32(convert4(i + 8), convert4(i + 12));
+        _mm_storeu_si128((__m128i *)(q + i), _mm_packs_epi16(low, high));
+    }
+#endif
+
+    for (; i < n; ++i) {
+        q[i] = quantizeToInt8(x[i], invScale);
+    }
+}
+
+// Returns the sum of a[i] * b[i]:
+//
+int32_t dotProductInt8(int8_t const *a, int8_t const *b, uint32_t n)
+{
+    int32_t sum = 0;
+    uint32_t i = 0;
+
+#if defined(NNET_SIMD_AVX512) || defined(NNET_SIMD_AVX2)
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 16 <= n; i += 16) {
+        __m256i a16 = _mm256_cvtepi8_epi16(_mm_loadu_si128((__m128i const *)(a + i)));
+        __m256i b16 = _mm256_cvtepi8_epi16(_mm_loadu_si128((__m128i const *)(b + i)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a16, b16));
+    }
+    sum = horizontalSum(_mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)));
+#elif defined(NNET_SIMD_SSE2)
+    // SSE2 has no sign extension instruction, so each byte is interleaved with a byte
+    // of its sign bits instead:
+    __m128i acc = _mm_setzero_si128();
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i a8 = _mm_loadu_si128((__m128i const *)(a + i));
+        __m128i b8 = _mm_loadu_si128((__m128i const *)(b + i));
+        __m128i aSign = _mm_cmplt_epi8(a8, zero);
+        __m128i bSign = _mm_cmplt_epi8(b8, zero);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(a8, aSign), _mm_unpacklo_epi8(b8, bSign)));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpackhi_epi8(a8, aSign), _mm_unpackhi_epi8(b8, bSign)));
+    }
+    sum = horizontalSum(acc);
+#endif
+
+    for (; i < n; ++i) {
+        sum += (int32_t)a[i] * b[i];
+    }
+
+    return sum;
+}
+
+// Returns the sum of w[k] * x[columns[k]], like sparseDotProduct():
+//
+int32_t sparseDotProductInt8(int8_t const *w, uint32_t const *columns, int8_t const *x, uint32_t n)
+{
+    int32_t sum = 0;
+
+    for (uint32_t k = 0; k < n; ++k) {
+        sum += (int32_t)w[k] * x[columns[k]];
+    }
+
+    return sum;
+}
+
+// ***********************************  Input samples  ***********************************
+
+
+// Given an integer 8-bit pixel value in the range 0..255, convert that into
+// a floating point value that can be input directly into the input layer of
+// the neural net. If you change this, also change the inverse function
+// networkInputValToPixelRange()
+//
+float pixelToNetworkInputRange(unsigned val)
+{
+    // Return a value in the range -1..1:
+    return val / 128.0f - 1.0f;
+
+    // Alternatively, return a value in the range 0..1:
+    //return val / 256.0f;
+
+    // Alternatively, return a value in the range -0.5..0.5:
+    //return val / 256.0f - 0.5f;
+}
+
+// Returns a table of pixelToNetworkInputRange() for all 8-bit pixel values:
+//
+float const *pixelToNetworkInputTable(void)
+{
+    struct Table {
+        Table(void)
+        {
+            for (unsigned v = 0; v < 256; ++v) {
+                value[v] = pixelToNetworkInputRange(v);
+            }
+        }
+        float value[256];
+    };
+
+    static const Table table;
+    return table.value;
+}
+
+// If you change this, also change the inverse function
+// pixelToNetworkInputRange().
+//
+unsigned networkInputValToPixelRange(float val)
+{
+    return min((unsigned)((val + 1.0f) * 128 + 0.5f), 255);
+
+    // Alternatively for a value in the range 0..1:
+    //return min((unsigned)(val * 256 + 0.5f), 255);
+
+    // Alternatively for a value in the range -0.5..0.5:
+    //return min((unsigned)((val + 0.5f) * 256 + 0.5f), 255);
+}
+
+
+// ***********************************  class MappedFile  ***********************************
+
+// The binary files written by neural2d store floats in the byte order of the machine
+// that wrote them, and record it with one of these codes:
+//
+const uint32_t dtypeFloat32LE = 1;  // IEEE 754 single precision, little-endian
+const uint32_t dtypeFloat32BE = 2;  // IEEE 754 single precision, big-endian
+
+uint32_t hostFloatDtype(void)
+{
+    const uint32_t one = 1;
+    return *(char const *)&one == 1 ? dtypeFloat32LE : dtypeFloat32BE;
+}
+
+uint32_t bitCount(uint32_t bits)
+{
+    uint32_t count = 0;
+    for (; bits != 0; bits &= bits - 1) {
+        ++count;
+    }
+    return count;
+}
+
+#if defined(WIN32)
+MappedFile::MappedFile(const string &filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (file) {
+        buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        length = buffer.size();
+        pData = buffer.data();
+    }
+}
+
+MappedFile::~MappedFile(void)
+{
+}
+
+void MappedFile::prefetch(uint64_t, uint64_t) const
+{
+}
+#else
+MappedFile::MappedFile(const string &filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *pMap = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (pMap != MAP_FAILED) {
+            madvise(pMap, st.st_size, MADV_SEQUENTIAL);
+            pData = (char const *)pMap;
+            length = st.st_size;
+        }
+    }
+    close(fd); // The mapping stays valid
+}
+
+MappedFile::~MappedFile(void)
+{
+    if (pData != nullptr) {
+        munmap((void *)pData, length);
+    }
+}
+
+// Asks the kernel to start reading the given range of the file into memory:
+//
+void MappedFile::prefetch(uint64_t offset, uint64_t numBytes) const
+{
+    uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t begin = offset & ~(pageSize - 1);
+    if (pData != nullptr && begin < length) {
+        madvise((void *)(pData + begin), std::min(offset + numBytes, length) - begin, MADV_WILLNEED);
+    }
+}
+#endif
+
+
+// ***********************************  class Sample  ***********************************
+
+
+// If the data is available, we'll return it. If this is the first time getData()
+// is called for inputs that come from an image, or the cache doesn't hold the requested
+// channel, we'll open the image file and cache the pixel data in memory: just that
+// channel, or all the channels in the file if channelMask asks for others too or
+// SampleSet::decodeAllChannels is set.
+// Samples loaded from a packed sample file already have the data of each channel in
+// the mapped file. Returns a view of the input data.
+//
+DataView Sample::getData(ColorChannel_t channel, uint32_t channelMask)
+{
+   if (packedData != nullptr) {
+       if (packedChannelStride == 0) {
+           return DataView(packedData, packedCount); // Explicit data serves every channel
+       }
+       if ((packedChannels & (1u << channel)) == 0) {
+           err << "Channel " << channel << " is not in the packed sample file for " << imageFilename << std::endl;
+           throw exceptionInputSamplesFile();
+       }
+       uint32_t channelIndex = bitCount(packedChannels & ((1u << channel) - 1));
+       return DataView(packedData + channelIndex * packedChannelStride, packedCount);
+   }
+
+   if (imageFilename != "" && (data.size() == 0 || (dataChannels & (1u << channel)) == 0)) {
+       size = { 0, 0 };
+       dataChannels = 0;
+
+       // Try all the image readers until we find one that succeeds:
+       if (SampleSet::decodeAllChannels || (channelMask & ~(1u << channel)) != 0) {
+           for (auto imageReader : SampleSet::imageReaders) {
+               size = imageReader->getAllChannels(imageFilename, data, dataChannels);
+               if (size.x != 0) {
+                   break;
+               }
+           }
+       }
+
+       if (size.x == 0 || (dataChannels & (1u << channel)) == 0) {
+           for (auto imageReader : SampleSet::imageReaders) {
+               size = imageReader->getData(imageFilename, data, channel);
+               if (size.x != 0) {
+                   break;
+               }
+           }
+           dataChannels = 1u << channel;
+       }
+
+       if (size.x == 0) {
+           dataChannels = 0;
+           data.clear();
+           err << "Unsupported image file format in " << imageFilename << std::endl;
+           throw exceptionInputSamplesFile();
+       }
+   }
+
+   // If we get here, we can assume there is something in the .data member
+
+   if (dataChannels == 0) {
+       return DataView(data.data(), data.size()); // Explicit data serves every channel
+   }
+
+   size_t channelSize = (size_t)size.x * size.y;
+   uint32_t channelIndex = bitCount(dataChannels & ((1u << channel) - 1));
+   return DataView(data.data() + channelIndex * channelSize, channelSize);
+}
+
+
+void Sample::decode(ColorChannel_t channel, uint32_t channelMask)
+{
+    if (packedData != nullptr || imageFilename == ""
+            || (data.size() != 0 && (dataChannels & (1u << channel)) != 0)) {
+        return;
+    }
+
+    if (SampleSet::compactImageCache) {
+        if (pixels.size() != 0 && (pixelChannels & (1u << channel)) != 0) {
+            return;
+        }
+
+        channelMask |= 1u << channel;
+        if (SampleSet::decodeAllChannels) {
+            channelMask |= (1u << NNet::R) | (1u << NNet::G) | (1u << NNet::B) | (1u << NNet::BW);
+        }
+
+        for (auto imageReader : SampleSet::imageReaders) {
+            xySize pixelsSize = imageReader->getPixels(imageFilename, pixels, channelMask);
+            if (pixelsSize.x != 0) {
+                size = pixelsSize;
+                pixelChannels = channelMask;
+                data.clear(); // Don't keep both caches
+                dataChannels = 0;
+                return;
+            }
+        }
+        pixels.clear();
+        pixelChannels = 0;
+    }
+
+    getData(channel, channelMask); // Not an 8-bit image, or not compact
+}
+
+
+size_t Sample::copyInputs(ColorChannel_t channel, float *pDest, size_t maxCount, uint32_t channelMask)
+{
+    decode(channel, channelMask);
+
+    if (pixels.size() != 0 && (pixelChannels & (1u << channel)) != 0) {
+        size_t channelSize = (size_t)size.x * size.y;
+        uint8_t const *pPixels = pixels.data() + bitCount(pixelChannels & ((1u << channel) - 1)) * channelSize;
+        float const *pTable = pixelToNetworkInputTable();
+        for (size_t i = 0; i < std::min(channelSize, maxCount); ++i) {
+            pDest[i] = pTable[pPixels[i]];
+        }
+        return channelSize;
+    }
+
+    DataView values = getData(channel);
+    std::copy_n(values.begin(), std::min(values.size(), maxCount), pDest);
+    return values.size();
+}
+
+
+void Sample::clearImageCache(void)
+{
+    data.clear();
+    dataChannels = 0;
+    pixels.clear();
+    pixelChannels = 0;
+}
+
+
+xySize ImageReader::getAllChannels(string const &, vector<float> &, uint32_t &)
+{
+    return { 0, 0 };
+}
+
+xySize ImageReader::getPixels(string const &, vector<uint8_t> &, uint32_t)
+{
+    return { 0, 0 };
+}
+
+
+vector<ImageReader *> SampleSet::imageReaders = {
+        new ImageReaderDat(),
+        new ImageReaderBMP()
+};
+
+bool SampleSet::decodeAllChannels = false;
+bool SampleSet::compactImageCache = false;
+
+
+// ***********************************  class SampleSet  ***********************************
+
+
+// Given the name of an input sample config file, open it and save the contents
+// in memory. For lines that specify an image filename, we'll just save the filename
+// for now and defer reading the pixel data until it's needed. For lines that
+// contain an explicit list of input values, we'll save the values. The syntax
+// for a line specifying a filename is of the form:
+//     filename t1 t2 t3...
+// where t1, t2, etc. are the target output values. The syntax for a line that
+// specifies explicit values is:
+//     { i1, i2, i3... } t1 t2 t3
+// where i1, i2... are the input values and t1, t2, etc. are the target output values.
+// We now honor the directive "path_prefix=", which is a string that gets prepended
+// to the front of every filename.
+//
+void SampleSet::loadSamples(const string &inputFilename)
+{
+    string pathPrefix = "";
+
+    if (!isFileExists(inputFilename)) {
+        err << "Error reading input samples config file \'" << inputFilename << "\'" << endl;
+        throw exceptionInputSamplesFile();
+    }
+
+    if (isPackedSampleFile(inputFilename)) {
+        loadPackedSamples(inputFilename);
+        return;
+    }
+
+    MappedFile file(inputFilename);
+    if (!file.isOpen() && !std::ifstream(inputFilename)) { // An empty file can't be mapped
+        err << "Error opening input samples config file \'" << inputFilename << "\'" << endl;
+        throw exceptionInputSamplesFile();
+    }
+
+    samples.clear();  // Lose all prior samples
+    pPackedFile.reset();
+
+    // One pass to count the lines, so the samples never have to be moved, then
+    // one pass to parse each line directly into its place in the container:
+
+    char const *p = file.data();
+    char const *pEnd = p + file.size();
+    samples.reserve(std::count(p, pEnd, '\n') + 1);
+
+    uint32_t lineNum = 0;
+    while (p < pEnd) {
+        ++lineNum;
+        char const *pLineEnd = (char const *)memchr(p, '\n', pEnd - p);
+        if (pLineEnd == nullptr) {
+            pLineEnd = pEnd;
+        }
+
+        samples.emplace_back(); // Default ctor will clear all members
+        try {
+            if (!parseSampleLine(p, pLineEnd, pathPrefix, samples.back())) {
+                samples.pop_back();
+            }
+        } catch (exceptionInputSamplesFile &) {
+            err << "In line " << lineNum << " of \'" << inputFilename << "\'" << endl;
+            throw;
+        }
+
+        p = pLineEnd + 1;
+    }
+
+    info << samples.size() << " training samples initialized" << endl;
+}
+
+
+// Helpers for parsing input data config files. A filename ends at a blank; a
+// number also ends at a comma or at the closing brace of a list of literal values:
+//
+static bool isBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+static char const *skipBlanks(char const *p, char const *pEnd)
+{
+    while (p < pEnd && isBlank(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+static char const *findNameEnd(char const *p, char const *pEnd)
+{
+    while (p < pEnd && !isBlank(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+static char const *findNumberEnd(char const *p, char const *pEnd)
+{
+    while (p < pEnd && !isBlank(*p) && *p != ',' && *p != '}') {
+        ++p;
+    }
+    return p;
+}
+
+// Converts a plain decimal number such as "-0.1234" with at most 7 or 8 significant
+// digits and at most 10 digits after the decimal point. Then the digits and the power
+// of ten are both exact in a float, so one division rounds correctly, exactly like
+// strtof(). Returns false for anything else:
+//
+static bool parseShortDecimal(char const *p, char const *pEnd, float &val)
+{
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+    static const float powersOfTen[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+
+    bool isNegative = (p < pEnd && *p == '-');
+    if (p < pEnd && (*p == '-' || *p == '+')) {
+        ++p;
+    }
+
+    uint32_t digits = 0;
+    uint32_t numDigits = 0;
+    uint32_t numFractionDigits = 0;
+    bool isFraction = false;
+    for (; p < pEnd; ++p) {
+        if (*p >= '0' && *p <= '9') {
+            digits = digits * 10 + (*p - '0');
+            numFractionDigits += isFraction;
+            if (++numDigits > 9 || digits > (1u << 24) || numFractionDigits > 10) {
+                return false;
+            }
+        } else if (*p == '.' && !isFraction) {
+            isFraction = true;
+        } else {
+            return false;
+        }
+    }
+
+    if (numDigits == 0) {
+        return false;
+    }
+
+    val = (float)digits / powersOfTen[numFractionDigits];
+    if (isNegative) {
+        val = -val;
+    }
+    return true;
+#else
+    (void)p; (void)pEnd; (void)val;
+    return false; // Intermediate results could be rounded twice
+#endif
+}
+
+// Converts the number token at p and advances p past it. Short decimals are
+// converted directly; other tokens are copied into a terminated buffer for strtof().
+// Either way, the result is rounded the same way as istream >> float. Throws if
+// the token is not entirely a number:
+//
+static float parseFloat(char const *&p, char const *pEnd)
+{
+    char const *pTokenEnd = findNumberEnd(p, pEnd);
+    size_t length = pTokenEnd - p;
+
+    float val;
+    if (parseShortDecimal(p, pTokenEnd, val)) {
+        p = pTokenEnd;
+        return val;
+    }
+
+    char buffer[64];
+    string longToken;
+    char const *pToken = buffer;
+    if (length < sizeof buffer) {
+        memcpy(buffer, p, length);
+        buffer[length] = '\0';
+    } else {
+        longToken.assign(p, length);
+        pToken = longToken.c_str();
+    }
+
+    char *pConvertedEnd;
+    val = strtof(pToken, &pConvertedEnd);
+    if (length == 0 || pConvertedEnd != pToken + length) {
+        err << "Error: \"" << string(p, length) << "\" is not a number" << endl;
+        throw exceptionInputSamplesFile();
+    }
+
+    p = pTokenEnd;
+    return val;
+}
+
+
+// Parses one line of an input data config file. Returns true if the line defines a
+// sample; returns false for blank and comment lines and for the path_prefix
+// directive, which changes pathPrefix. Throws for a value that is not a number:
+//
+bool SampleSet::parseSampleLine(char const *p, char const *pEnd, string &pathPrefix, Sample &sample)
+{
+    static const char prefixDirective[] = "path_prefix";
+    const size_t prefixLength = sizeof prefixDirective - 1;
+
+    p = skipBlanks(p, pEnd);
+    if (p == pEnd || *p == '#') {
+        return false; // Skip blank and comment lines
+    }
+
+    char const *pTokenEnd = findNameEnd(p, pEnd);
+
+    if ((size_t)(pEnd - p) >= prefixLength && memcmp(p, prefixDirective, prefixLength) == 0) {
+        // The equals sign may have spaces around it:
+        p = skipBlanks(p + prefixLength, pEnd);
+        if (p < pEnd && *p == '=') {
+            p = skipBlanks(p + 1, pEnd);
+        }
+        pathPrefix.assign(p, findNameEnd(p, pEnd));
+        return false;
+    } else if (*p == '{') {
+        // This means we have literal values like "{ 0.2 0 -1.0}" or "{ 0.2, 0, -1.0 }"
+        sample.imageFilename.clear();   // "" means we have immediate data
+
+        p = skipBlanks(p + 1, pEnd);
+        while (p < pEnd && *p != '}') {
+            sample.data.push_back(parseFloat(p, pEnd));
+            p = skipBlanks(p, pEnd);
+            if (p < pEnd && *p == ',') {
+                p = skipBlanks(p + 1, pEnd);
+            }
+        }
+        if (p < pEnd) {
+            ++p; // Skip the }
+        }
+    } else {
+        // We may have an image filename (instead of an explicit list of values):
+        sample.imageFilename = pathPrefix;
+        sample.imageFilename.append(p, pTokenEnd);
+        p = pTokenEnd;
+    }
+
+    // If they exist, read the target values from the rest of the line:
+    for (p = skipBlanks(p, pEnd); p < pEnd; p = skipBlanks(p, pEnd)) {
+        sample.targetVals.push_back(parseFloat(p, pEnd));
+    }
+
+    return true;
+}
+
+bool SampleSet::parseSampleLine(const string &line, string &pathPrefix, Sample &sample)
+{
+    return parseSampleLine(line.data(), line.data() + line.size(), pathPrefix, sample);
+}
+
+
+// Randomize the order of the samples container.
+//
+void SampleSet::shuffle(void)
+{
+    std::random_shuffle(samples.begin(), samples.end());
+}
+
+
+// By clearing the cache, future image access will cause the pixel data to
+// be re-read and converted by whatever color conversion is in effect then.
+//
+void SampleSet::clearImageCache(void)
+{
+    for (auto &samp : samples) {
+        if (samp.imageFilename != "")
+            samp.clearImageCache();
+    }
+}
+
+
+// ****************  Packed sample files  ****************
+
+// A packed sample file holds the input data of all the samples in an input data
+// config file, already decoded, so that training does not open and decode each
+// image file. It starts with a PackedSamplesHeader, then one PackedSampleRecord per
+// sample, then the input values, the target values, and the image filenames (see
+// neural2d.h for the header). The input values of an image are stored once per
+// channel in the channel mask, in the order of ColorChannel_t; explicit input values
+// are stored once for all channels. The file is memory mapped by loadPackedSamples(),
+// and the samples refer to their input values in the mapped file.
+//
+const char packedSamplesMagic[4] = { 'N', '2', 'D', 'S' };
+const uint32_t packedSamplesVersion = 1;
+
+struct PackedSampleRecord {
+    uint64_t dataIndex;              // Index of the first value in the data block
+    uint64_t targetIndex;            // Index of the first value in the targets block
+    uint64_t nameOffset;             // Byte offset in the names block
+    uint32_t count;                  // Number of input values per channel
+    uint32_t channelStride;          // Zero for explicit data, else count
+    uint32_t numTargets;
+    uint32_t nameLength;
+    uint32_t sizeX, sizeY;
+};
+
+static_assert(sizeof(PackedSamplesHeader) == 48 && sizeof(PackedSampleRecord) == 48,
+              "The packed sample file layout must not depend on the compiler");
+
+bool SampleSet::isPackedSampleFile(const string &filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    char magic[sizeof packedSamplesMagic] = { 0 };
+    file.read(magic, sizeof magic);
+    return file && std::memcmp(magic, packedSamplesMagic, sizeof magic) == 0;
+}
+
+// Writes the current samples to a packed sample file. Each image is decoded once for
+// each channel in channelMask. The image cache is cleared as we go, so the memory
+// needed does not grow with the number of samples:
+//
+void SampleSet::savePackedSamples(const string &filename, uint32_t channelMask)
+{
+    std::ofstream file(filename, std::ios::binary);
+    if (!file) {
+        err << "Error writing packed sample file \'" << filename << "\'" << endl;
+        throw exceptionInputSamplesFile();
+    }
+
+    PackedSamplesHeader header = { };
+    std::memcpy(header.magic, packedSamplesMagic, sizeof header.magic);
+    header.version = packedSamplesVersion;
+    header.dtype = hostFloatDtype();
+    header.numSamples = (uint32_t)samples.size();
+    header.channelMask = channelMask;
+    header.dataOffset = sizeof header + samples.size() * sizeof(PackedSampleRecord);
+
+    // The header and records are written last, when the offsets are known:
+
+    vector<PackedSampleRecord> records(samples.size());
+    file.seekp(header.dataOffset);
+
+    uint64_t dataIndex = 0;
+    for (uint32_t n = 0; n < samples.size(); ++n) {
+        Sample &sample = samples[n];
+        PackedSampleRecord &record = records[n];
+        record.dataIndex = dataIndex;
+
+        for (uint32_t channel = 0; channel < 32; ++channel) {
+            if ((channelMask & (1u << channel)) == 0) {
+                continue;
+            }
+            DataView values = sample.getData((ColorChannel_t)channel);
+            file.write((char const *)values.data(), values.size() * sizeof(float));
+            record.count = (uint32_t)values.size();
+            record.sizeX = sample.size.x;
+            record.sizeY = sample.size.y;
+            dataIndex += values.size();
+            if (sample.imageFilename == "") {
+                break; // Explicit data is the same for all channels
+            }
+            record.channelStride = record.count;
+        }
+
+        if (sample.imageFilename != "" && sample.packedData == nullptr) {
+            sample.clearImageCache();
+        }
+    }
+
+    header.targetsOffset = header.dataOffset + dataIndex * sizeof(float);
+    uint64_t targetIndex = 0;
+    for (uint32_t n = 0; n < samples.size(); ++n) {
+        records[n].targetIndex = targetIndex;
+        records[n].numTargets = (uint32_t)samples[n].targetVals.size();
+        file.write((char const *)samples[n].targetVals.data(), samples[n].targetVals.size() * sizeof(float));
+        targetIndex += samples[n].targetVals.size();
+    }
+
+    header.namesOffset = header.targetsOffset + targetIndex * sizeof(float);
+    uint64_t nameOffset = 0;
+    for (uint32_t n = 0; n < samples.size(); ++n) {
+        records[n].nameOffset = nameOffset;
+        records[n].nameLength = (uint32_t)samples[n].imageFilename.size();
+        file.write(samples[n].imageFilename.data(), samples[n].imageFilename.size());
+        nameOffset += samples[n].imageFilename.size();
+    }
+
+    file.seekp(0);
+    file.write((char const *)&header, sizeof header);
+    file.write((char const *)records.data(), records.size() * sizeof(PackedSampleRecord));
+
+    file.close();
+    if (!file) {
+        err << "Error writing packed sample file \'" << filename << "\'" << endl;
+        throw exceptionInputSamplesFile();
+    }
+}
+
+// Maps a packed sample file and checks its header:
+//
+std::shared_ptr<MappedFile> openPackedSampleFile(const string &filename, PackedSamplesHeader &header)
+{
+    std::shared_ptr<MappedFile> pFile(new MappedFile(filename));
+
+    if (!pFile->isOpen() || pFile->size() < sizeof header) {
+        err << "Error reading packed sample file \'" << filename << "\'" << endl;
+        throw exceptionInputSamplesFile();
+    }
+
+    std::memcpy(&header, pFile->data(), sizeof header);
+
+    if (header.version != packedSamplesVersion || header.dtype != hostFloatDtype()) {
+        err << "Error: packed sample file \'" << filename << "\' has unsupported version or data type" << endl;
+        throw exceptionInputSamplesFile();
+    }
+
+    if (header.dataOffset != sizeof header + (uint64_t)header.numSamples * sizeof(PackedSampleRecord)
+            || header.dataOffset > header.targetsOffset || header.targetsOffset > header.namesOffset
+            || header.namesOffset > pFile->size() || (header.targetsOffset - header.dataOffset) % sizeof(float) != 0) {
+        err << "Error: packed sample file \'" << filename << "\' is corrupt" << endl;
+        throw exceptionInputSamplesFile();
+    }
+
+    return pFile;
+}
+
+// Appends samples [first, first + count) of a packed sample file to newSamples. Their
+// input values stay in the mapped file:
+//
+void readPackedSamples(MappedFile const &file, PackedSamplesHeader const &header, uint32_t first,
+                       uint32_t count, vector<Sample> &newSamples, const string &filename)
+{
+    char const *base = file.data();
+    float const *dataBlock = (float const *)(base + header.dataOffset);
+    float const *targetsBlock = (float const *)(base + header.targetsOffset);
+    uint64_t numDataValues = (header.targetsOffset - header.dataOffset) / sizeof(float);
+    uint64_t numTargetValues = (header.namesOffset - header.targetsOffset) / sizeof(float);
+    uint64_t namesSize = file.size() - header.namesOffset;
+    uint32_t numChannels = bitCount(header.channelMask);
+
+    newSamples.reserve(newSamples.size() + count);
+    for (uint32_t n = first; n < first + count; ++n) {
+        PackedSampleRecord record;
+        std::memcpy(&record, base + sizeof header + (uint64_t)n * sizeof record, sizeof record);
+
+        uint64_t dataEnd = record.dataIndex + record.count
+                         + (uint64_t)record.channelStride * (numChannels > 0 ? numChannels - 1 : 0);
+        if (dataEnd > numDataValues || record.targetIndex + record.numTargets > numTargetValues
+                || record.nameOffset + record.nameLength > namesSize) {
+            err << "Error: packed sample file \'" << filename << "\' is corrupt at sample " << n << endl;
+            throw exceptionInputSamplesFile();
+        }
+
+        newSamples.push_back(Sample());
+        Sample &sample = newSamples.back();
+        sample.packedData = dataBlock + record.dataIndex;
+        sample.packedCount = record.count;
+        sample.packedChannelStride = record.channelStride;
+        sample.packedChannels = header.channelMask;
+        sample.size.x = record.sizeX;
+        sample.size.y = record.sizeY;
+        sample.targetVals.assign(targetsBlock + record.targetIndex, targetsBlock + record.targetIndex + record.numTargets);
+        sample.imageFilename.assign(base + header.namesOffset + record.nameOffset, record.nameLength);
+    }
+}
+
+// Replaces the samples with those in a packed sample file. The input values stay in
+// the mapped file until the samples are replaced again:
+//
+void SampleSet::loadPackedSamples(const string &filename)
+{
+    PackedSamplesHeader header;
+    std::shared_ptr<MappedFile> pFile = openPackedSampleFile(filename, header);
+
+    vector<Sample> newSamples;
+    readPackedSamples(*pFile, header, 0, header.numSamples, newSamples, filename);
+
+    samples.swap(newSamples);
+    pPackedFile = pFile;
+}
+
+
+// ***********************************  class SampleStream  ***********************************
+
+
+// Makes one pass over the file to find where each chunk starts. For an input data
+// config file, that is the file offset of the chunk's first sample line and the
+// path prefix in effect there:
+//
+SampleStream::SampleStream(const string &filename_, ColorChannel_t channel_, uint32_t chunkSize_,
+                           uint32_t windowChunks_, bool shuffle_)
+    : filename(filename_), channel(channel_), chunkSize(std::max(chunkSize_, 1u)),
+      windowChunks(std::max(windowChunks_, 1u)), shuffle(shuffle_)
+{
+    if (SampleSet::isPackedSampleFile(filename)) {
+        pPackedFile = openPackedSampleFile(filename, packedHeader);
+        numSamples = packedHeader.numSamples;
+        numChunks = (uint32_t)((numSamples + chunkSize - 1) / chunkSize);
+    } else {
+        std::ifstream dataIn(filename, std::ios::binary);
+        if (!dataIn) {
+            err << "Error opening input samples config file \'" << filename << "\'" << endl;
+            throw exceptionInputSamplesFile();
+        }
+
+        string line;
+        string pathPrefix;
+        uint64_t offset = 0;
+        numSamples = 0;
+        while (getline(dataIn, line)) {
+            Sample sample;
+            string prefixBefore = pathPrefix;
+            if (SampleSet::parseSampleLine(line, pathPrefix, sample)) {
+                if (numSamples % chunkSize == 0) {
+                    chunkOffsets.push_back(offset);
+                    chunkPathPrefixes.push_back(prefixBefore);
+                }
+                ++numSamples;
+            }
+            offset += line.size() + 1;
+        }
+        numChunks = (uint32_t)chunkOffsets.size();
+    }
+
+    for (uint32_t chunkNum = 0; chunkNum < numChunks; ++chunkNum) {
+        chunkOrder.push_back(chunkNum);
+    }
+
+    info << numSamples << " training samples in " << numChunks << " chunks" << endl;
+
+    nextChunk = numChunks; // So that the first loadNextWindow() starts an epoch
+    pendingStartsEpoch = loadNextWindow();
+}
+
+SampleStream::~SampleStream(void)
+{
+    if (pending.valid()) {
+        pending.wait();
+    }
+}
+
+// Returns the next samples of the epoch in pSamples, at most maxSamples of them, and
+// their number. Returns 0 once at the end of each epoch; the next call starts the
+// next epoch. The samples remain valid until the next call:
+//
+uint32_t SampleStream::next(Sample *&pSamples, uint32_t maxSamples)
+{
+    if (windowPos == window.size()) {
+        if (numChunks == 0) {
+            return 0;
+        }
+
+        if (pendingStartsEpoch && !epochEndReported) {
+            epochEndReported = true;
+            return 0;
+        }
+        epochEndReported = false;
+
+        auto start = std::chrono::steady_clock::now();
+        window = pending.get(); // Rethrows any exception from the loader
+        stallSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (shuffle) {
+            std::random_shuffle(window.begin(), window.end());
+        }
+        windowPos = 0;
+        pendingStartsEpoch = loadNextWindow();
+    }
+
+    uint32_t numReturned = (uint32_t)std::min<size_t>(maxSamples, window.size() - windowPos);
+    pSamples = &window[windowPos];
+    windowPos += numReturned;
+    return numReturned;
+}
+
+// Starts loading the next windowChunks chunks in the background. Returns true if
+// they are the first chunks of a new epoch:
+//
+bool SampleStream::loadNextWindow(void)
+{
+    bool startsEpoch = false;
+
+    if (numChunks == 0) {
+        return false;
+    }
+
+    if (nextChunk == numChunks) {
+        if (shuffle) {
+            std::random_shuffle(chunkOrder.begin(), chunkOrder.end());
+        }
+        nextChunk = 0;
+        startsEpoch = true;
+    }
+
+    vector<uint32_t> chunkNums;
+    for (; nextChunk < numChunks && chunkNums.size() < windowChunks; ++nextChunk) {
+        chunkNums.push_back(chunkOrder[nextChunk]);
+    }
+
+    pending = std::async(std::launch::async, [this, chunkNums]() {
+        vector<Sample> samples;
+        for (uint32_t chunkNum : chunkNums) {
+            loadChunk(chunkNum, samples);
+        }
+        return samples;
+    });
+
+    return startsEpoch;
+}
+
+// Appends the samples of one chunk, with their image data decoded for our channel.
+// For a packed sample file, we ask the kernel to read the chunk's input values in
+// advance:
+//
+void SampleStream::loadChunk(uint32_t chunkNum, vector<Sample> &samples) const
+{
+    uint64_t first = (uint64_t)chunkNum * chunkSize;
+    uint32_t count = (uint32_t)std::min<uint64_t>(chunkSize, numSamples - first);
+
+    if (pPackedFile) {
+        size_t firstNew = samples.size();
+        readPackedSamples(*pPackedFile, packedHeader, (uint32_t)first, count, samples, filename);
+        for (size_t n = firstNew; n < samples.size(); ++n) {
+            DataView data = samples[n].getData(channel);
+            pPackedFile->prefetch((char const *)data.data() - pPackedFile->data(), data.size() * sizeof(float));
+        }
+        return;
+    }
+
+    std::ifstream dataIn(filename, std::ios::binary);
+    dataIn.seekg(chunkOffsets[chunkNum]);
+    string pathPrefix = chunkPathPrefixes[chunkNum];
+    string line;
+
+    for (uint32_t numRead = 0; numRead < count && getline(dataIn, line); ) {
+        Sample sample;
+        if (SampleSet::parseSampleLine(line, pathPrefix, sample)) {
+            sample.decode(channel); // Decode and cache the image data now
+            samples.push_back(std::move(sample));
+            ++numRead;
+        }
+    }
+}
+
+
+// ***********************************  class SamplePrefetcher  ***********************************
+
+
+SamplePrefetcher::SamplePrefetcher(uint32_t numWorkers, uint32_t depth_)
+    : depth(std::max(depth_, 1u))
+{
+    for (uint32_t n = 0; n < std::max(numWorkers, 1u); ++n) {
+        workers.emplace_back(&SamplePrefetcher::workerLoop, this);
+    }
+}
+
+SamplePrefetcher::~SamplePrefetcher(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    workAvailable.notify_all();
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+void SamplePrefetcher::start(Sample *pSamples_, size_t numSamples_, ColorChannel_t channel_, bool keepCache_,
+                             uint32_t channelMask_)
+{
+    finish();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    pSamples = pSamples_;
+    numSamples = numSamples_;
+    channel = channel_;
+    channelMask = channelMask_;
+    keepCache = keepCache_;
+    nextToClaim = 0;
+    claimLimit = std::min<size_t>(depth, numSamples);
+    readyPrefix = 0;
+    releasedUpTo = 0;
+    ready.assign(numSamples, 0);
+    pError = nullptr;
+    workAvailable.notify_all();
+}
+
+// Blocks until samples [first, end) have been decoded. The caller promises that it
+// is done with all the samples before first, so the workers may move on:
+//
+void SamplePrefetcher::waitFor(size_t first, size_t end)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    end = std::min(end, numSamples);
+
+    claimLimit = std::min(std::max(first + depth, end), numSamples);
+    workAvailable.notify_all();
+
+    queueDepthSum += readyPrefix > first ? readyPrefix - first : 0;
+    ++numWaits;
+
+    if (!keepCache) {
+        for (; releasedUpTo < first; ++releasedUpTo) {
+            if (pSamples[releasedUpTo].imageFilename != "") {
+                pSamples[releasedUpTo].clearImageCache();
+            }
+        }
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+    sampleReady.wait(lock, [&] { return readyPrefix >= end || pError != nullptr; });
+    stallSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+    if (pError != nullptr) {
+        std::exception_ptr pCopy = pError;
+        pError = nullptr;
+        std::rethrow_exception(pCopy);
+    }
+}
+
+// Stops handing out samples and waits for the workers to finish the ones they have:
+//
+void SamplePrefetcher::finish(void)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    claimLimit = nextToClaim;
+    sampleReady.wait(lock, [&] { return numInProgress == 0; });
+}
+
+double SamplePrefetcher::averageQueueDepth(void) const
+{
+    return numWaits == 0 ? 0.0 : queueDepthSum / numWaits;
+}
+
+void SamplePrefetcher::reportStats(void) const
+{
+    info << "Prefetch: " << numWorkers() << " workers, average queue depth " << averageQueueDepth()
+         << " of " << depth << ", stalled " << stallSeconds << " s" << endl;
+}
+
+void SamplePrefetcher::workerLoop(void)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    for (;;) {
+        workAvailable.wait(lock, [&] { return stopping || nextToClaim < claimLimit; });
+        if (stopping) {
+            return;
+        }
+
+        size_t sampleNum = nextToClaim++;
+        ++numInProgress;
+        lock.unlock();
+
+        std::exception_ptr pException;
+        try {
+            pSamples[sampleNum].decode(channel, channelMask);
+        } catch (...) {
+            pException = std::current_exception();
+        }
+
+        lock.lock();
+        --numInProgress;
+        if (pException != nullptr && pError == nullptr) {
+            pError = pException;
+        }
+        ready[sampleNum] = 1;
+        while (readyPrefix < numSamples && ready[readyPrefix]) {
+            ++readyPrefix;
+        }
+        sampleReady.notify_all();
+    }
+}
+
+
+// ***********************************  struct Projection  ***********************************
+
+// The member functions below operate on one row, i.e., on the inputs of one destination
+// neuron.
+
+uint32_t Projection::rowLength(uint32_t row) const
+{
+    return isSparse() ? rowOffsets[row + 1] - rowOffsets[row] : numColumns;
+}
+
+// A dense row that reads only the matching depth of the source layer starts at the
+// first neuron of that depth plane:
+//
+uint32_t Projection::firstDenseColumn(uint32_t row) const
+{
+    return sameDepth ? (row / (numRows / pFromLayer->size.depth)) * numColumns : 0;
+}
+
+float Projection::weightedSum(uint32_t row) const
+{
+    if (isSparse()) {
+        uint32_t begin = rowOffsets[row];
+        return sparseDotProduct(&weights[begin], &columnIndices[begin], pFromLayer->outputs.data(),
+                                rowOffsets[row + 1] - begin);
+    } else {
+        return dotProduct(&weights[row * numColumns], &pFromLayer->outputs[firstDenseColumn(row)], numColumns);
+    }
+}
+
+// Adds the weighted sums of rows [rowBegin, rowEnd) for a block of numSamples
+// samples to pDest[row * destStride + sample]. The source layer's batchOutputs hold
+// the samples' source outputs, one contiguous run of samples per source neuron, so
+// every weight is applied to all the samples at once: a dense Projection is one
+// gemmNarrow() per group of rows that read the same columns, and a sparse row is one
+// sparseGemvNarrow():
+//
+void Projection::addWeightedSumsBatch(uint32_t rowBegin, uint32_t rowEnd, uint32_t numSamples,
+                                      float *pDest, uint32_t destStride) const
+{
+    float const *pFrom = pFromLayer->batchOutputs.data();
+    uint32_t fromStride = pFromLayer->batchStride;
+
+    if (isSparse()) {
+        for (uint32_t row = rowBegin; row < rowEnd; ++row) {
+            uint32_t begin = rowOffsets[row];
+            sparseGemvNarrow(numSamples, &weights[begin], &columnIndices[begin], rowOffsets[row + 1] - begin,
+                             pFrom, fromStride, pDest + (size_t)row * destStride);
+        }
+        return;
+    }
+
+    uint32_t rowsPerGroup = numRows / numColumnGroups();
+    for (uint32_t row = rowBegin; row < rowEnd; ) {
+        uint32_t groupEnd = std::min(rowEnd, (row / rowsPerGroup + 1) * rowsPerGroup);
+        gemmNarrow(groupEnd - row, numSamples, numColumns,
+             &weights[(size_t)row * numColumns], numColumns,
+             pFrom + (size_t)firstDenseColumn(row) * fromStride, fromStride,
+             pDest + (size_t)row * destStride, destStride);
+        row = groupEnd;
+    }
+}
+
+// Adds this row's weights times the destination neuron's gradient to the gradients
+// of the source neurons:
+//
+void Projection::addToSourceGradients(uint32_t row, float gradient) const
+{
+    if (isSparse()) {
+        uint32_t begin = rowOffsets[row];
+        sparseAxpy(gradient, &weights[begin], &columnIndices[begin], pFromLayer->gradients.data(),
+                   rowOffsets[row + 1] - begin);
+    } else {
+        axpy(gradient, &weights[row * numColumns], &pFromLayer->gradients[firstDenseColumn(row)], numColumns);
+    }
+}
+
+// Same rule as Neuron::updateInputWeights(): each weight changes by its input times
+// eta times the destination neuron's gradient, plus momentum:
+//
+void Projection::updateRowWeights(uint32_t row, float etaGradient, float alpha)
+{
+    uint32_t begin = isSparse() ? rowOffsets[row] : row * numColumns;
+    uint32_t n = rowLength(row);
+    float *pWeights = &weights[begin];
+    float *pDeltaWeights = &deltaWeights[begin];
+    vector<float> const &sourceOutputs = pFromLayer->outputs;
+
+    if (isSparse()) {
+        uint32_t const *pColumns = &columnIndices[begin];
+        for (uint32_t k = 0; k < n; ++k) {
+            float newDeltaWeight = etaGradient * sourceOutputs[pColumns[k]] + alpha * pDeltaWeights[k];
+            pDeltaWeights[k] = newDeltaWeight;
+            pWeights[k] += newDeltaWeight;
+        }
+    } else {
+        float const *pInputs = &sourceOutputs[firstDenseColumn(row)];
+        for (uint32_t k = 0; k < n; ++k) {
+            float newDeltaWeight = etaGradient * pInputs[k] + alpha * pDeltaWeights[k];
+            pDeltaWeights[k] = newDeltaWeight;
+            pWeights[k] += newDeltaWeight;
+        }
+    }
+}
+
+// Rows that read only the matching depth of the source layer form one group per
+// source depth, each group reading a different block of columns:
+//
+uint32_t Projection::numColumnGroups(void) const
+{
+    return sameDepth ? pFromLayer->size.depth : 1;
+}
+
+// Prepares to accumulate the weight gradients of a mini-batch of numSamples samples.
+// The saved inputs and gradients start out zero so that the unused samples of a
+// partial batch contribute nothing:
+//
+void Projection::beginBatch(uint32_t numSamples)
+{
+    batchCapacity = numSamples;
+
+    if (isSparse()) {
+        weightGradients.assign(weights.size(), 0.0f);
+    } else {
+        batchInputs.assign(numColumnGroups() * numSamples * numColumns, 0.0f);
+        batchGradients.assign(numRows * numSamples, 0.0f);
+    }
+}
+
+// Called once for each sample of the batch after the gradients are calculated, while
+// the source layer's outputs still hold that sample's values. rowGradients are the
+// gradients of the destination neurons:
+//
+void Projection::accumulateBatchGradients(uint32_t sampleNum, vector<float> const &rowGradients)
+{
+    vector<float> const &sourceOutputs = pFromLayer->outputs;
+
+    if (isSparse()) {
+        for (uint32_t row = 0; row < numRows; ++row) {
+            uint32_t begin = rowOffsets[row];
+            float gradient = rowGradients[row];
+            for (uint32_t k = begin; k < rowOffsets[row + 1]; ++k) {
+                weightGradients[k] += gradient * sourceOutputs[columnIndices[k]];
+            }
+        }
+        return;
+    }
+
+    uint32_t numGroups = numColumnGroups();
+    for (uint32_t group = 0; group < numGroups; ++group) {
+        std::copy_n(&sourceOutputs[group * numColumns], numColumns,
+                    &batchInputs[(group * batchCapacity + sampleNum) * numColumns]);
+    }
+
+    for (uint32_t row = 0; row < numRows; ++row) {
+        batchGradients[row * batchCapacity + sampleNum] = rowGradients[row];
+    }
+}
+
+// Updates the weights once for the whole batch, using the average of the batch's
+// weight gradients in place of the single-sample gradient in updateRowWeights().
+// For dense rows, the sum over the batch is the gradients matrix [row][sample] times
+// the inputs matrix [sample][column]:
+//
+void Projection::updateWeightsFromBatch(float eta, float alpha, uint32_t batchCount)
+{
+    if (!isSparse()) {
+        weightGradients.assign(weights.size(), 0.0f);
+        uint32_t numGroups = numColumnGroups();
+        uint32_t rowsPerGroup = numRows / numGroups;
+        for (uint32_t group = 0; group < numGroups; ++group) {
+            uint32_t firstRow = group * rowsPerGroup;
+            gemm(rowsPerGroup, numColumns, batchCapacity,
+                 &batchGradients[firstRow * batchCapacity],
+                 &batchInputs[group * batchCapacity * numColumns],
+                 &weightGradients[firstRow * numColumns]);
+        }
+    }
+
+    float etaPerSample = eta / batchCount;
+    for (size_t k = 0; k < weights.size(); ++k) {
+        float newDeltaWeight = etaPerSample * weightGradients[k] + alpha * deltaWeights[k];
+        deltaWeights[k] = newDeltaWeight;
+        weights[k] += newDeltaWeight;
+    }
+}
+
+// Adds the batch gradients of the same Projection in a replica of the net, which
+// processed the samples of the batch starting at firstSampleNum. Dense inputs and
+// gradients are copied into place, so the batch product is the same as if we had
+// processed all the samples ourselves:
+//
+void Projection::gatherBatchGradients(Projection const &replica, uint32_t firstSampleNum)
+{
+    if (isSparse()) {
+        for (size_t k = 0; k < weightGradients.size(); ++k) {
+            weightGradients[k] += replica.weightGradients[k];
+        }
+        return;
+    }
+
+    uint32_t numSamples = replica.batchCapacity;
+    for (uint32_t group = 0; group < numColumnGroups(); ++group) {
+        std::copy_n(&replica.batchInputs[group * numSamples * numColumns], numSamples * numColumns,
+                    &batchInputs[(group * batchCapacity + firstSampleNum) * numColumns]);
+    }
+
+    for (uint32_t row = 0; row < numRows; ++row) {
+        std::copy_n(&replica.batchGradients[row * numSamples], numSamples,
+                    &batchGradients[row * batchCapacity + firstSampleNum]);
+    }
+}
+
+// The weights file lists the inputs of each neuron by source x, then y, then source
+// depth, which is the order of a sparse row. A dense row is stored by source depth
+// first, so we translate the column index here:
+//
+void Projection::saveRowWeights(std::ofstream &file, uint32_t row) const
+{
+    if (isSparse()) {
+        for (uint32_t k = rowOffsets[row]; k < rowOffsets[row + 1]; ++k) {
+            file << weights[k] << '\n';
+        }
+        return;
+    }
+
+    uint32_t fromPlaneSize = pFromLayer->size.x * pFromLayer->size.y;
+    uint32_t numDepths = numColumns / fromPlaneSize;
+    float const *pRow = &weights[row * numColumns];
+
+    for (uint32_t i = 0; i < fromPlaneSize; ++i) {
+        for (uint32_t depth = 0; depth < numDepths; ++depth) {
+            file << pRow[depth * fromPlaneSize + i] << '\n';
+        }
+    }
+}
+
+// The looping order must match that of saveRowWeights():
+//
+void Projection::loadRowWeights(std::ifstream &file, uint32_t row)
+{
+    if (isSparse()) {
+        for (uint32_t k = rowOffsets[row]; k < rowOffsets[row + 1]; ++k) {
+            file >> weights[k];
+        }
+        return;
+    }
+
+    uint32_t fromPlaneSize = pFromLayer->size.x * pFromLayer->size.y;
+    uint32_t numDepths = numColumns / fromPlaneSize;
+    float *pRow = &weights[row * numColumns];
+
+    for (uint32_t i = 0; i < fromPlaneSize; ++i) {
+        for (uint32_t depth = 0; depth < numDepths; ++depth) {
+            file >> pRow[depth * fromPlaneSize + i];
+        }
+    }
+}
+
+// Converts the weights to 8-bit integers. Each row's scale maps its largest weight to
+// 127, or if layerMaxWeight is nonzero, maps that to 127 instead:
+//
+void Projection::quantizeWeights(float layerMaxWeight)
+{
+    quantizedWeights.resize(weights.size());
+    rowScales.resize(numRows);
+
+    for (uint32_t row = 0; row < numRows; ++row) {
+        uint32_t begin = isSparse() ? rowOffsets[row] : row * numColumns;
+        uint32_t end = begin + rowLength(row);
+
+        float maxWeight = layerMaxWeight;
+        if (maxWeight == 0.0f) {
+            for (uint32_t k = begin; k < end; ++k) {
+                maxWeight = std::max(maxWeight, absd(weights[k]));
+            }
+        }
+
+        rowScales[row] = maxWeight > 0.0f ? maxWeight / 127.0f : 1.0f;
+        float invScale = 1.0f / rowScales[row];
+        for (uint32_t k = begin; k < end; ++k) {
+            quantizedWeights[k] = quantizeToInt8(weights[k], invScale);
+        }
+    }
+}
+
+// Source outputs beyond the largest ones seen during calibration are clipped:
+//
+void Projection::quantizeInputs(void)
+{
+    auto const &fromOutputs = pFromLayer->outputs;
+    quantizedInputs.resize(fromOutputs.size());
+
+    quantizeArray(fromOutputs.data(), 1.0f / inputScale, quantizedInputs.data(), fromOutputs.size());
+}
+
+// The same as weightedSum(), from the quantized weights and inputs. Every product in
+// the row has the same scale, so the integer sum is scaled back to float once:
+//
+float Projection::weightedSumQuantized(uint32_t row) const
+{
+    int32_t sum;
+
+    if (isSparse()) {
+        uint32_t begin = rowOffsets[row];
+        sum = sparseDotProductInt8(&quantizedWeights[begin], &columnIndices[begin], quantizedInputs.data(),
+                                   rowOffsets[row + 1] - begin);
+    } else {
+        sum = dotProductInt8(&quantizedWeights[row * numColumns], &quantizedInputs[firstDenseColumn(row)],
+                             numColumns);
+    }
+
+    return sum * (rowScales[row] * inputScale);
+}
+
+
+// ***********************************  struct WindowedSource  ***********************************
+
+
+void WindowedSource::kernelRangeX(uint32_t destX, uint32_t &begin, uint32_t &end) const
+{
+    int32_t start = windowStartX[destX];
+    begin = start < 0 ? -start : 0;
+    end = min((int32_t)windowSize.x, (int32_t)pFromLayer->size.x - start);
+}
+
+void WindowedSource::kernelRangeY(uint32_t destY, uint32_t &begin, uint32_t &end) const
+{
+    int32_t start = windowStartY[destY];
+    begin = start < 0 ? -start : 0;
+    end = min((int32_t)windowSize.y, (int32_t)pFromLayer->size.y - start);
+}
+
+
+// Calls fn(kernelIndex, sourceIndex) for each source neuron inside the window of the
+// destination neuron at (destDepth, destX, destY), where kernelIndex indexes the
+// flattened convolution kernel (x*szY + y) and sourceIndex indexes the source layer's
+// .outputs and .gradients containers. The inputs are visited in order of X, then Y,
+// then source depth.
+//
+template <typename Fn>
+static void forEachWindowInput(WindowedSource const &source, uint32_t destDepth,
+        uint32_t destX, uint32_t destY, Fn fn)
+{
+    dxySize const &fromSize = source.pFromLayer->size;
+    uint32_t fromPlaneSize = fromSize.x * fromSize.y;
+    uint32_t sourceDepthMin = source.sameDepth ? destDepth : 0;
+    uint32_t sourceDepthMax = source.sameDepth ? destDepth : fromSize.depth - 1;
+
+    uint32_t kxBegin, kxEnd, kyBegin, kyEnd;
+    source.kernelRangeX(destX, kxBegin, kxEnd);
+    source.kernelRangeY(destY, kyBegin, kyEnd);
+
+    for (uint32_t kx = kxBegin; kx < kxEnd; ++kx) {
+        uint32_t srcX = source.windowStartX[destX] + kx;
+        for (uint32_t ky = kyBegin; ky < kyEnd; ++ky) {
+            uint32_t srcY = source.windowStartY[destY] + ky;
+            uint32_t kernelIdx = flattenXY(kx, ky, source.windowSize.y);
+            uint32_t srcXY = flattenXY(srcX, srcY, fromSize);
+            for (uint32_t sourceDepth = sourceDepthMin; sourceDepth <= sourceDepthMax; ++sourceDepth) {
+                fn(kernelIdx, sourceDepth * fromPlaneSize + srcXY);
+            }
+        }
+    }
+}
+
+
+// *****************************  class Layer  *****************************
 
 
 Layer::Layer(const topologyConfigSpec_t &params)
@@ -353,7 +2465,12 @@ Layer::Layer(const topologyConfigSpec_t &params)
     isConvolutionFilterLayer = params.isConvolutionFilterLayer;
     isConvolutionNetworkLayer = params.isConvolutionNetworkLayer;
     isPoolingLayer = params.isPoolingLayer;
+    kernelSize = params.kernelSize;    // Zero except in convolution layers
+    poolSize = params.poolSize;        // Zero except in pooling layers
+    poolMethod = params.poolMethod;
+    convolveMethod = params.convolveMethod;
     resolveTransferFunctionName(params.transferFunctionName);
+    tfDerivativeFromOutput = false;
     totalNumberBackConnections = 0;
     projectRectangular = false;
 }
@@ -364,24 +2481,45 @@ void Layer::resolveTransferFunctionName(string const &transferFunctionName)
         // This is the default transfer function:
         tf = transferFunctionTanh;
         tfDerivative = transferFunctionDerivativeTanh;
+        tfBatch = transferFunctionBatchTanh;
+        tfDerivativeBatch = transferDerivativeBatchTanh;
+        tfDerivativeFromOutputBatch = transferDerivativeFromOutputBatchTanh;
     } else if (transferFunctionName == "logistic") {
         tf = transferFunctionLogistic;
         tfDerivative = transferFunctionDerivativeLogistic;
+        tfBatch = transferFunctionBatchLogistic;
+        tfDerivativeBatch = transferDerivativeBatchLogistic;
+        tfDerivativeFromOutputBatch = transferDerivativeFromOutputBatchLogistic;
     } else if (transferFunctionName == "linear") {
         tf = transferFunctionLinear;
         tfDerivative = transferFunctionDerivativeLinear;
+        tfBatch = transferFunctionBatchIdentity;
+        tfDerivativeBatch = transferDerivativeBatchIdentity;
+        tfDerivativeFromOutputBatch = transferDerivativeBatchIdentity;
     } else if (transferFunctionName == "ramp") {
         tf = transferFunctionRamp;
         tfDerivative = transferFunctionDerivativeRamp;
+        tfBatch = transferFunctionBatchRamp;
+        tfDerivativeBatch = transferDerivativeBatchRamp;
+        tfDerivativeFromOutputBatch = transferDerivativeFromOutputBatchRamp;
     } else if (transferFunctionName == "gaussian") {
         tf = transferFunctionGaussian;
         tfDerivative = transferFunctionDerivativeGaussian;
+        tfBatch = transferFunctionBatchGaussian;
+        tfDerivativeBatch = transferDerivativeBatchGaussian;
+        tfDerivativeFromOutputBatch = transferDerivativeBatchGaussian; // Not invertible
     } else if (transferFunctionName == "relu" || transferFunctionName == "ReLU") {
         tf = transferFunctionReLU;
         tfDerivative = transferFunctionDerivativeReLU;
+        tfBatch = transferFunctionBatchReLU;
+        tfDerivativeBatch = transferDerivativeBatchReLU;
+        tfDerivativeFromOutputBatch = transferDerivativeFromOutputBatchReLU;
     } else if (transferFunctionName == "identity") {
         tf = transferFunctionIdentity;
         tfDerivative = transferFunctionIdentityDerivative;
+        tfBatch = transferFunctionBatchIdentity;
+        tfDerivativeBatch = transferDerivativeBatchIdentity;
+        tfDerivativeFromOutputBatch = transferDerivativeBatchIdentity;
     } else {
         err << "Undefined transfer function: \'" << transferFunctionName << "\'" << endl;
         throw exceptionConfigFile();
@@ -404,216 +2542,771 @@ void Layer::saveWeights(std::ofstream &) { }
 
 void Layer::loadWeights(std::ifstream &) { }
 
+// Returns the Philox stream keyed by randomSeed, layerNumber, and kind:
+//
+Philox Layer::randomStream(uint32_t kind) const
+{
+    return Philox(randomSeed, ((uint64_t)layerNumber << 32) | kind);
+}
+
+// Allocates the neurons' outputs and gradients and the Neuron objects that refer to
+// them. The containers are sized once, here, so the references stay valid:
+//
+void Layer::createNeurons(void)
+{
+    uint32_t planeSize = size.x * size.y;
+
+    outputs.resize(size.depth * planeSize);
+    randomStream(RANDOM_OUTPUTS).uniform(0, outputs.data(), outputs.size());
+    for (auto &output : outputs) {
+        output -= 0.5f;
+    }
+
+    fanOut.assign(size.depth * planeSize, 0);
+
+    // The Neuron objects refer to the gradients, which only backprop uses:
+    if (inferenceOnly) {
+        return;
+    }
+
+    gradients.assign(size.depth * planeSize, 0.0f);
+
+    neurons.resize(size.depth);
+    for (uint32_t depth = 0; depth < size.depth; ++depth) {
+        neurons[depth].reserve(planeSize);
+        for (uint32_t i = 0; i < planeSize; ++i) {
+            neurons[depth].emplace_back(outputs[depth * planeSize + i], gradients[depth * planeSize + i]);
+        }
+    }
+}
+
+uint32_t Layer::numBackConnections(uint32_t depth, uint32_t i) const
+{
+    uint32_t count = 0;
+
+    for (auto const &proj : projections) {
+        count += proj.rowLength(depth * size.x * size.y + i);
+    }
+
+    for (auto const &source : windowedSources) {
+        forEachWindowInput(source, depth, i / size.y, i % size.y,
+                           [&count](uint32_t, uint32_t) { ++count; });
+    }
+
+    return count + (biasWeights.empty() ? 0 : 1);
+}
+
+uint32_t Layer::numForwardConnections(uint32_t depth, uint32_t i) const
+{
+    return fanOut[depth * size.x * size.y + i];
+}
+
+// Multiplies each neuron's gradient by the derivative of the transfer function
+// at its output:
+//
+void Layer::applyTfDerivative(void)
+{
+    if (tfDerivativeFromOutput) {
+        tfDerivativeFromOutputBatch(outputs.data(), gradients.data(), outputs.size());
+    } else {
+        tfDerivativeBatch(outputs.data(), gradients.data(), outputs.size());
+    }
+}
+
+// The output layer's gradients come from the target values. For hidden layers,
+// the layers above have already accumulated the sums of the downstream gradients
+// into our gradients container:
+//
 void Layer::calcGradients(const vector<float> &targetVals)
 {
     if (layerName == "output") {
-        for (uint32_t n = 0; n < neurons[0].size(); ++n) {
-            neurons[0][n].calcOutputGradients(targetVals[n], tfDerivative);
+        for (uint32_t n = 0; n < targetVals.size(); ++n) {
+            gradients[n] = targetVals[n] - outputs[n];
         }
     } else {
         assert(layerName != "input");
-        for (auto &plane : neurons) {
-            for (auto &neuron : plane) {
-                neuron.calcHiddenGradients(*this);
+    }
+
+    applyTfDerivative();
+}
+
+// Only regular layers and convolution network layers have trainable weights:
+//
+void Layer::updateWeights(float, float)
+{
+}
+
+void Layer::beginBatch(uint32_t)
+{
+}
+
+void Layer::accumulateBatchGradients(uint32_t)
+{
+}
+
+void Layer::updateWeightsFromBatch(float, float, uint32_t)
+{
+}
+
+void Layer::gatherBatchGradients(Layer &, uint32_t)
+{
+}
+
+// Calls fn(begin, end) for ranges of items that together cover [0, numItems). Each
+// item must write only its own outputs, so the results are the same however the
+// items are divided among threads. Loops too small to be worth the overhead, or
+// layers without a thread pool, just call fn(0, numItems):
+//
+void Layer::parallelFor(uint32_t numItems, uint32_t workPerItem,
+                        std::function<void(uint32_t, uint32_t)> const &fn) const
+{
+    uint64_t totalWork = (uint64_t)numItems * std::max(workPerItem, 1u);
+
+    if (pThreadPool == nullptr || pThreadPool->size() == 1 || totalWork < minParallelWork) {
+        fn(0, numItems);
+        return;
+    }
+
+    // About four tasks per thread leaves room for work stealing to even out the load:
+
+    uint32_t numTasks = std::min((uint64_t)pThreadPool->size() * 4, totalWork / (minParallelWork / 4));
+    pThreadPool->parallelFor(numItems, (numItems + numTasks - 1) / numTasks, fn);
+}
+
+// Layers without a batch kernel run feedForward() once per sample. First, each source
+// layer's outputs are loaded with the values it computed for that sample:
+//
+void Layer::feedForwardBatch(uint32_t numSamples)
+{
+    vector<Layer *> sourceLayers;
+    for (auto const &proj : projections) {
+        sourceLayers.push_back(proj.pFromLayer);
+    }
+    for (auto const &source : windowedSources) {
+        sourceLayers.push_back(source.pFromLayer);
+    }
+
+    for (uint32_t sample = 0; sample < numSamples; ++sample) {
+        for (Layer *pSource : sourceLayers) {
+            float const *pColumn = pSource->batchOutputs.data() + sample;
+            for (size_t n = 0; n < pSource->outputs.size(); ++n) {
+                pSource->outputs[n] = pColumn[n * pSource->batchStride];
+            }
+        }
+
+        feedForward();
+
+        for (size_t n = 0; n < outputs.size(); ++n) {
+            batchOutputs[n * batchStride + sample] = outputs[n];
+        }
+    }
+}
+
+uint32_t Layer::windowInputsPerNeuron(void) const
+{
+    uint32_t count = 0;
+
+    for (auto const &source : windowedSources) {
+        count += source.windowSize.x * source.windowSize.y * (source.sameDepth ? 1 : source.pFromLayer->size.depth);
+    }
+
+    return count;
+}
+
+// Copies the weights, and the settings that can be changed while the net is running,
+// from the same layer in another instance of the net with the same topology:
+//
+void Layer::copyWeightsFrom(Layer const &layer)
+{
+    for (size_t projNum = 0; projNum < projections.size(); ++projNum) {
+        projections[projNum].weights = layer.projections[projNum].weights;
+    }
+
+    biasWeights = layer.biasWeights;
+    flatConvolveMatrix = layer.flatConvolveMatrix;
+    convolveMethod = layer.convolveMethod;
+    channel = layer.channel;
+    channels = layer.channels;
+}
+
+// Returns true if the radius of this regular layer projects every neuron onto the
+// entire area of a source layer of size fromSize. The projected window is clipped
+// to the source layer, so it covers the whole layer if it reaches both edges for
+// every destination neuron. If the projection is elliptical, the corners of the
+// source layer must also be inside the ellipse; they are the points farthest from
+// its center.
+//
+bool Layer::coversWholeLayer(dxySize const &fromSize) const
+{
+    assert(isRegularLayer);
+
+    for (uint32_t destX = 0; destX < size.x; ++destX) {
+        int32_t lfromX = nearestSourceCoord(destX, size.x, fromSize.x);
+        if (lfromX - (int64_t)radius.x > 0 || lfromX + (int64_t)radius.x < (int32_t)fromSize.x - 1) {
+            return false;
+        }
+    }
+
+    for (uint32_t destY = 0; destY < size.y; ++destY) {
+        int32_t lfromY = nearestSourceCoord(destY, size.y, fromSize.y);
+        if (lfromY - (int64_t)radius.y > 0 || lfromY + (int64_t)radius.y < (int32_t)fromSize.y - 1) {
+            return false;
+        }
+    }
+
+    if (projectRectangular) {
+        return true;
+    }
+
+    return elliptDist((fromSize.x - 1) / 2.0f, (fromSize.y - 1) / 2.0f,
+                      (float)radius.x, (float)radius.y) < 1.0f;
+}
+
+void Layer::connectLayers(Layer &layerFrom)
+{
+    if (isRegularLayer) {
+        if (coversWholeLayer(layerFrom.size)) {
+            connectLayersDense(layerFrom);
+        } else {
+            connectLayersSparse(layerFrom);
+        }
+        return;
+    }
+
+    // Convolution and pooling layers:
+    connectLayersWindowed(layerFrom);
+}
+
+
+// Creates a dense Projection that connects every neuron in this layer to every
+// neuron in layerFrom (or to every neuron in the same depth plane if both layers
+// have the same depth). This is equivalent to what connectLayersSparse() creates
+// when the radius covers the whole source layer, without the column indices.
+//
+void Layer::connectLayersDense(Layer &layerFrom)
+{
+    // A repeated "from" clause naming the same source layer would only create
+    // duplicate connections:
+    for (auto const &proj : projections) {
+        if (proj.pFromLayer == &layerFrom) {
+            return;
+        }
+    }
+
+    uint32_t fromPlaneSize = layerFrom.size.x * layerFrom.size.y;
+
+    Projection proj;
+    proj.pFromLayer = &layerFrom;
+    proj.sameDepth = (layerFrom.size.depth == size.depth);
+    proj.numRows = size.depth * size.x * size.y;
+    proj.numColumns = proj.sameDepth ? fromPlaneSize : layerFrom.size.depth * fromPlaneSize;
+
+    // Same heuristic weight initialization as for individual connections, where the
+    // number of source neurons is the size of the projected area. Weight k of the
+    // Projection is number k of its random stream, so the rows can be filled in
+    // parallel:
+    proj.weights.resize(proj.numRows * proj.numColumns);
+    Philox random = randomStream(RANDOM_PROJECTIONS + projections.size());
+    float scale = (float)(1.0 / sqrt(fromPlaneSize));
+    uint32_t numColumns = proj.numColumns;
+    float *pWeights = proj.weights.data();
+    parallelFor(proj.numRows, numColumns, [&](uint32_t rowBegin, uint32_t rowEnd) {
+        float *pRow = pWeights + (size_t)rowBegin * numColumns;
+        size_t count = (size_t)(rowEnd - rowBegin) * numColumns;
+        random.uniform((uint64_t)rowBegin * numColumns, pRow, count);
+        for (size_t k = 0; k < count; ++k) {
+            pRow[k] = (pRow[k] * 2 - 1.0f) * scale;
+        }
+    });
+    if (!inferenceOnly) {
+        proj.deltaWeights.assign(proj.weights.size(), 0.0f);
+    }
+
+    totalNumberBackConnections += proj.weights.size();
+
+    // Each source neuron feeds one row per destination neuron that reads its depth:
+    uint32_t fanOut = proj.sameDepth ? size.x * size.y : proj.numRows;
+    for (auto &count : layerFrom.fanOut) {
+        count += fanOut;
+    }
+
+    projections.push_back(std::move(proj));
+}
+
+
+// Creates a sparse Projection that connects each neuron in this layer to the neurons
+// in layerFrom inside its elliptical or rectangular projected area. The area is
+// centered on the source neuron nearest the destination neuron and extends radius.x
+// and radius.y neurons in each direction, clipped to the bounds of the source layer.
+// If both layers have the same depth, each neuron connects only to the same depth in
+// the source layer; otherwise it connects to all source depths.
+//
+// The projected area depends only on the destination x,y, so the connections are
+// counted once per destination plane and the CSR arrays are allocated once before
+// the rows are filled in parallel. Duplicate connections can only come from a repeated "from"
+// clause for a layer name that appears more than once in the topology config file,
+// which is detected by the source layer of the existing projections.
+//
+void Layer::connectLayersSparse(Layer &layerFrom)
+{
+    // A repeated "from" clause naming the same source layer projects the same areas
+    // again, so it would only create duplicate connections:
+    for (auto const &proj : projections) {
+        if (proj.pFromLayer == &layerFrom) {
+            return;
+        }
+    }
+
+    dxySize &fromSize = layerFrom.size;
+    uint32_t fromPlaneSize = fromSize.x * fromSize.y;
+    uint32_t destPlaneSize = size.x * size.y;
+
+    Projection proj;
+    proj.pFromLayer = &layerFrom;
+    proj.sameDepth = (fromSize.depth == size.depth);
+    proj.numRows = size.depth * destPlaneSize;
+    proj.numColumns = 0;
+
+    // Calls fn(srcX, srcY, maxNumSourceNeurons) for each source location inside the
+    // projected area of the destination neuron at destX, destY:
+    auto forEachProjectedSource = [&](uint32_t destX, uint32_t destY,
+                                      std::function<void(int32_t, int32_t, uint32_t)> const &fn) {
+        // Calculate the rectangular window into the "from" layer, centered on
+        // the nearest neuron in the "from" layer:
+        int32_t lfromX = nearestSourceCoord(destX, size.x, fromSize.x);
+        int32_t lfromY = nearestSourceCoord(destY, size.y, fromSize.y);
+        int32_t xmin = lfromX - radius.x;
+        int32_t xmax = lfromX + radius.x;
+        int32_t ymin = lfromY - radius.y;
+        int32_t ymax = lfromY + radius.y;
+        clipToBounds(xmin, xmax, ymin, ymax, fromSize);
+
+        float srcCenterX = ((float)xmin + (float)xmax) / 2.0f; // for elliptical calculations
+        float srcCenterY = ((float)ymin + (float)ymax) / 2.0f;
+
+        uint32_t maxNumSourceNeurons = ((xmax - xmin) + 1) * ((ymax - ymin) + 1); // for heuristic weight initializations
+
+        for (int32_t srcX = xmin; srcX <= xmax; ++srcX) {
+            for (int32_t srcY = ymin; srcY <= ymax; ++srcY) {
+                if (!projectRectangular
+                            && elliptDist(srcCenterX - (float)srcX,
+                                          srcCenterY - (float)srcY,
+                                          (float)radius.x, (float)radius.y) >= 1.0f) {
+                    continue; // Skip this location, it's outside the ellipse
+                }
+                fn(srcX, srcY, maxNumSourceNeurons);
             }
         }
+    };
+
+    // First pass: the row offsets. Each location in the projected area is one
+    // connection per source depth that the row reads:
+    uint32_t depthsPerLocation = proj.sameDepth ? 1 : fromSize.depth;
+    uint32_t areaEstimate = (2 * radius.x + 1) * (2 * radius.y + 1); // For parallelFor() only
+    vector<uint32_t> planeRowLengths(destPlaneSize, 0);
+    parallelFor(destPlaneSize, areaEstimate, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; ++i) {
+            uint32_t &rowLength = planeRowLengths[i];
+            forEachProjectedSource(i / size.y, i % size.y, [&rowLength, depthsPerLocation](int32_t, int32_t, uint32_t) {
+                rowLength += depthsPerLocation;
+            });
+        }
+    });
+
+    proj.rowOffsets.resize(proj.numRows + 1);
+    proj.rowOffsets[0] = 0;
+    for (uint32_t row = 0; row < proj.numRows; ++row) {
+        proj.rowOffsets[row + 1] = proj.rowOffsets[row] + planeRowLengths[row % destPlaneSize];
+    }
+
+    uint32_t numConnections = proj.rowOffsets.back();
+    proj.columnIndices.resize(numConnections);
+    proj.weights.resize(numConnections);
+
+    // Second pass: the column indices and initial weights, one row per destination
+    // neuron [depth][i]. Weight k of the Projection is number k of its random stream,
+    // so the result doesn't depend on how the rows are divided among threads:
+
+    Philox random = randomStream(RANDOM_PROJECTIONS + projections.size());
+
+    parallelFor(proj.numRows, areaEstimate * depthsPerLocation, [&](uint32_t rowBegin, uint32_t rowEnd) {
+        for (uint32_t row = rowBegin; row < rowEnd; ++row) {
+            uint32_t destDepth = row / destPlaneSize;
+            uint32_t i = row % destPlaneSize;
+            uint32_t sourceDepthMin = proj.sameDepth ? destDepth : 0;
+            uint32_t sourceDepthMax = proj.sameDepth ? destDepth : fromSize.depth - 1;
+
+            uint32_t offset = proj.rowOffsets[row];
+            uint32_t *pColumn = proj.columnIndices.data() + offset;
+            float *pWeight = proj.weights.data() + offset;
+            random.uniform(offset, pWeight, proj.rowOffsets[row + 1] - offset);
+
+            forEachProjectedSource(i / size.y, i % size.y, [&](int32_t srcX, int32_t srcY, uint32_t maxNumSourceNeurons) {
+                float scale = (float)(1.0 / sqrt(maxNumSourceNeurons));
+                for (uint32_t sourceDepth = sourceDepthMin; sourceDepth <= sourceDepthMax; ++sourceDepth) {
+                    *pColumn++ = sourceDepth * fromPlaneSize + flattenXY(srcX, srcY, fromSize);
+                    *pWeight = (*pWeight * 2 - 1.0f) * scale;
+                    ++pWeight;
+                }
+            });
+
+            assert(pColumn == proj.columnIndices.data() + proj.rowOffsets[row + 1]);
+        }
+    });
+
+    // Counting the readers of each source neuron is cheap enough to do serially:
+    for (uint32_t column : proj.columnIndices) {
+        ++layerFrom.fanOut[column];
+    }
+
+    if (!inferenceOnly) {
+        proj.deltaWeights.assign(numConnections, 0.0f);
     }
+    totalNumberBackConnections += numConnections;
+
+    projections.push_back(std::move(proj));
 }
 
-void Layer::updateWeights(float eta, float alpha)
+
+// Creates a WindowedSource through which this convolution or pooling layer reads
+// layerFrom. Each neuron's window is kernelSize (or poolSize) neurons, centered over
+// the source neuron nearest to it, and is clipped to the bounds of layerFrom. If both
+// layers have the same depth, each neuron reads only the same depth in the source
+// layer; otherwise it reads all source depths.
+//
+void Layer::connectLayersWindowed(Layer &layerFrom)
 {
-    for (auto &plane : neurons) {
-        for (auto &neuron : plane) {
-            neuron.updateInputWeights(eta, alpha, pConnections);
+    // A repeated "from" clause naming the same source layer would only read the
+    // same windows again:
+    for (auto const &source : windowedSources) {
+        if (source.pFromLayer == &layerFrom) {
+            return;
         }
     }
-}
 
-void Layer::connectLayers(Layer &layerFrom)
-{
+    WindowedSource source;
+    source.pFromLayer = &layerFrom;
+    source.sameDepth = (layerFrom.size.depth == size.depth);
+    source.windowSize = isPoolingLayer ? poolSize : kernelSize;
+
+    for (uint32_t destX = 0; destX < size.x; ++destX) {
+        source.windowStartX.push_back((int32_t)nearestSourceCoord(destX, size.x, layerFrom.size.x)
+                                      - (int32_t)source.windowSize.x / 2);
+    }
+    for (uint32_t destY = 0; destY < size.y; ++destY) {
+        source.windowStartY.push_back((int32_t)nearestSourceCoord(destY, size.y, layerFrom.size.y)
+                                      - (int32_t)source.windowSize.y / 2);
+    }
+
     for (uint32_t destDepth = 0; destDepth < size.depth; ++destDepth) {
         for (uint32_t destX = 0; destX < size.x; ++destX) {
             for (uint32_t destY = 0; destY < size.y; ++destY) {
-                auto &toNeuron = neurons[destDepth][flattenXY(destX, destY, size)];
-                connectOneNeuronAllDepths(layerFrom, toNeuron, destDepth, destX, destY);
+                forEachWindowInput(source, destDepth, destX, destY,
+                                   [&](uint32_t, uint32_t srcIdx) {
+                    ++layerFrom.fanOut[srcIdx];
+                    ++totalNumberBackConnections;
+                });
             }
         }
     }
+
+    windowedSources.push_back(std::move(source));
 }
 
 
-// Add a weighted bias input, modeled as a back-connection to a fake neuron:
+// Gives each neuron in a regular layer a weighted bias input. The bias input is a
+// constant 1.0, so only the weights need to be stored:
 //
-void Layer::connectBiasToAllNeuronsAllDepths(Neuron &bias)
+void Layer::initBiasWeights(void)
 {
-    for (auto &plane : neurons) {
-        for (auto &neuron : plane) {
-            // Create a new Connection record and get its index:
-            (*pConnections).push_back(Connection(bias, neuron));
-            uint32_t connectionIdx = (*pConnections).size() - 1;
-
-            Connection &c = (*pConnections).back();
-            c.weight = randomFloat() / (size.x * size.y);
-            c.deltaWeight = 0.0;
+    biasWeights.resize(size.depth * size.x * size.y);
+    randomStream(RANDOM_BIAS).uniform(0, biasWeights.data(), biasWeights.size());
+    for (auto &weight : biasWeights) {
+        weight /= (size.x * size.y);
+    }
+    if (!inferenceOnly) {
+        biasDeltaWeights.assign(biasWeights.size(), 0.0f);
+    }
 
-            // Record the back connection with the destination neuron:
-            neuron.backConnectionsIndices.push_back(connectionIdx);
+    totalNumberBackConnections += biasWeights.size();
+}
 
-            ++totalNumberBackConnections;
 
-            // Record the forward connection with the fake bias neuron:
-            bias.forwardConnectionsIndices.push_back(connectionIdx);
-        }
+// An inference-only net keeps just the weights, the outputs, and what feedForward()
+// needs to compute them. The layer ctors allocate some training state before
+// Net::createLayer() sets inferenceOnly, so this frees it. shrink_to_fit() is only
+// a request, so the containers are swapped with empty ones instead:
+//
+void Layer::releaseTrainingState(void)
+{
+    vector<float>().swap(gradients);
+    vector<vector<Neuron>>().swap(neurons);
+    vector<float>().swap(biasDeltaWeights);
+    vector<float>().swap(biasGradients);
+    vector<vector<float>>().swap(flatConvolveGradients);
+    vector<vector<float>>().swap(flatDeltaWeights);
+
+    for (auto &proj : projections) {
+        vector<float>().swap(proj.deltaWeights);
+        vector<float>().swap(proj.batchInputs);
+        vector<float>().swap(proj.batchGradients);
+        vector<float>().swap(proj.weightGradients);
+        proj.batchCapacity = 0;
     }
 }
 
-void Layer::connectOneNeuronAllDepths(Layer &fromLayer, Neuron &toNeuron,
-        uint32_t destDepth, uint32_t destX, uint32_t destY)
+
+void Layer::debugShow(bool)
+{
+}
+
+LayerConvolution::LayerConvolution(const topologyConfigSpec_t &params) : Layer(params)
 {
-    auto &layerTo = *this;
-    assert(size.x > 0 && size.y > 0);
+    flatConvolveMatrix.clear();
+    flatConvolveMatrix = params.flatConvolveMatrix;
+    flatConvolveGradients.clear();
+    flatConvolveGradients.assign(size.depth, vector<float>(kernelSize.x * kernelSize.y));
+    flatDeltaWeights.clear();
+    flatDeltaWeights.assign(size.depth, vector<float>(kernelSize.x * kernelSize.y));
+}
 
-    // Calculate the normalized [0..1] coordinates of our neuron:
-    float normalizedX = ((float)destX / size.x) + (1.0f / (2 * size.x));
-    float normalizedY = ((float)destY / size.y) + (1.0f / (2 * size.y));
+// Each neuron's output is the sum of the source outputs in its window times the
+// kernel elements of its depth. The tf parameter applies to convolution network
+// layers only; convolution filter layers output the plain sum.
+//
+void LayerConvolution::feedForward()
+{
+    if (convolveMethod == CONVOLVE_GEMM) {
+        feedForwardGemm();
+        return;
+    }
 
-    // Calculate the coords of the nearest neuron in the "from" layer.
-    // The calculated coords are relative to the "from" layer:
-    uint32_t lfromX = uint32_t(normalizedX * fromLayer.size.x); // should we round off instead of round down?
-    uint32_t lfromY = uint32_t(normalizedY * fromLayer.size.y);
+    // Each work item is one line of neurons with the same depth and x:
 
-//    info << "our neuron at " << destX << "," << ny << " covers neuron at "
-//         << lfromX << "," << lfromY << endl;
+    parallelFor(size.depth * size.x, size.y * windowInputsPerNeuron(), [this](uint32_t begin, uint32_t end) {
+        for (uint32_t line = begin; line < end; ++line) {
+            uint32_t depth = line / size.x;
+            uint32_t x = line % size.x;
+            float const *kernel = flatConvolveMatrix[depth].data();
+            for (uint32_t y = 0; y < size.y; ++y) {
+                float sum = 0.0;
 
-    // Calculate the rectangular window into the "from" layer:
+                for (auto const &source : windowedSources) {
+                    float const *fromOutputs = source.pFromLayer->outputs.data();
+                    forEachWindowInput(source, depth, x, y, [&](uint32_t kernelIdx, uint32_t srcIdx) {
+                        sum += fromOutputs[srcIdx] * kernel[kernelIdx];
+                    });
+                }
 
-    int32_t xmin, xmax, ymin, ymax;
+                outputs[depth * size.x * size.y + flattenXY(x, y, size)] = sum;
+            }
+        }
+    });
 
-    if (isRegularLayer) {
-        xmin = lfromX - layerTo.radius.x;
-        xmax = lfromX + layerTo.radius.x;
-        ymin = lfromY - layerTo.radius.y;
-        ymax = lfromY + layerTo.radius.y;
-        clipToBounds(xmin, xmax, ymin, ymax, fromLayer.size);
-    }
-    else if (isConvolutionFilterLayer || isConvolutionNetworkLayer) {
-        ymin = lfromY - layerTo.kernelSize.y / 2;
-        ymax = ymin   + layerTo.kernelSize.y - 1;
-        xmin = lfromX - layerTo.kernelSize.x / 2;
-        xmax = xmin   + layerTo.kernelSize.x - 1;
+    if (!isConvolutionFilterLayer) {
+        tfBatch(outputs.data(), outputs.size());
     }
-    else { // isPoolingLayer
-        ymin = lfromY - layerTo.poolSize.y / 2;
-        ymax = ymin   + layerTo.poolSize.y - 1;
-        xmin = lfromX - layerTo.poolSize.x / 2;
-        xmax = xmin   + layerTo.poolSize.x - 1;
-    }
-
-    // Now (xmin,xmax,ymin,ymax) defines a rectangular subset of neurons in a previous layer.
-    // We'll make a connection from each of those neurons in the previous layer to our
-    // neuron in the current layer.
+}
 
-    // We will also check for and avoid duplicate connections. Duplicates are mostly harmless,
-    // but unnecessary. Duplicate connections can be formed when the same layer name appears
-    // more than once in the topology config file with the same "from" layer if the projected
-    // rectangular or elliptical areas on the source layer overlap.
+// After calculating our own gradients, we push each neuron's gradient times the
+// kernel elements back to the source neurons in its window, the same way that
+// LayerRegular::calcGradients() does for its weight matrices. Convolution network
+// layers also accumulate the gradient of each kernel element here, summed over
+// all the neurons that share the kernel; updateWeights() consumes them.
+//
+void LayerConvolution::calcGradients(const vector<float> &targetVals)
+{
+    // Convolution filter layers don't apply a transfer function to their outputs,
+    // so their gradient is just the sum of the errors at the neurons we feed:
 
-    float srcCenterX = ((float)xmin + (float)xmax) / 2.0f; // for elliptical calculations
-    float srcCenterY = ((float)ymin + (float)ymax) / 2.0f; // for elliptical calculations
+    if (layerName == "output") {
+        Layer::calcGradients(targetVals);
+    } else if (!isConvolutionFilterLayer) {
+        applyTfDerivative();
+    }
 
-    uint32_t maxNumSourceNeurons = ((xmax - xmin) + 1) * ((ymax - ymin) + 1); // for heuristic weight initializations
+    if (convolveMethod == CONVOLVE_GEMM) {
+        propagateGradientsGemm();
+        return;
+    }
 
-    // The way we connect to the source layer depends on the depth of the source layer:
-    //
-    //   src depth == my depth  -- connect only to same depth in source
-    //   src depth != my depth  -- fully connect to all depths
+    for (uint32_t depth = 0; depth < size.depth; ++depth) {
+        float const *kernel = flatConvolveMatrix[depth].data();
+        float *kernelGradients = flatConvolveGradients[depth].data();
+        for (uint32_t x = 0; x < size.x; ++x) {
+            for (uint32_t y = 0; y < size.y; ++y) {
+                float gradient = gradients[depth * size.x * size.y + flattenXY(x, y, size)];
+
+                for (auto const &source : windowedSources) {
+                    float const *fromOutputs = source.pFromLayer->outputs.data();
+                    float *fromGradients = source.pFromLayer->gradients.data();
+                    bool pushToSource = (source.pFromLayer->layerName != "input");
+                    forEachWindowInput(source, depth, x, y, [&](uint32_t kernelIdx, uint32_t srcIdx) {
+                        if (pushToSource) {
+                            fromGradients[srcIdx] += kernel[kernelIdx] * gradient;
+                        }
+                        if (isConvolutionNetworkLayer) {
+                            kernelGradients[kernelIdx] += fromOutputs[srcIdx] * gradient;
+                        }
+                    });
+                }
+            }
+        }
+    }
+}
 
-    uint32_t sourceDepthMin = 0;
-    uint32_t sourceDepthMax = 0;
 
-    if (fromLayer.size.depth == layerTo.size.depth) {
-        sourceDepthMin = sourceDepthMax = destDepth;
-    } else {
-        sourceDepthMin = 0;
-        sourceDepthMax = fromLayer.size.depth - 1;
+// The window columns are shared by all the depths of this layer unless a source layer
+// is read depth by depth, in which case each depth gets its own group of columns:
+//
+uint32_t LayerConvolution::numColumnGroups(void) const
+{
+    for (auto const &source : windowedSources) {
+        if (source.sameDepth) {
+            return size.depth;
+        }
     }
 
-    for (int32_t srcX = xmin; srcX <= xmax; ++srcX) {
-        for (int32_t srcY = ymin; srcY <= ymax; ++srcY) {
-            // Some layer types may allow either a rectangular or elliptical project pattern:
-            if (isRegularLayer) {
-                if (!projectRectangular
-                            && elliptDist(srcCenterX - (float)srcX, 
-                                          srcCenterY - (float)srcY, 
-                                          (float)layerTo.radius.x, (float)layerTo.radius.y) >= 1.0f) {
-                    continue; // Skip this location, it's outside the ellipse
-                }
-            } else if (!isRegularLayer) {
-                if (srcX < 0 || srcY < 0 || srcX >= (int32_t)fromLayer.size.x || srcY >= (int32_t)fromLayer.size.y) {
-                    continue; // Skip, out of bounds
+    return 1;
+}
+
+// im2col: column i of the matrix for a group holds the window of neuron i, one row per
+// kernel element. Because all source depths in a window share the same kernel element,
+// and so do all the source layers, their outputs are summed into the same row:
+//
+void LayerConvolution::lowerWindowsToColumns(void)
+{
+    uint32_t numKernelElements = kernelSize.x * kernelSize.y;
+    uint32_t planeSize = size.x * size.y;
+    uint32_t numGroups = numColumnGroups();
+
+    windowColumns.assign(numGroups * numKernelElements * planeSize, 0.0f);
+
+    // Each work item fills the columns of one line of neurons with the same x. The
+    // sources are visited in the same order for every column, so the sums do not
+    // depend on how the lines are divided among threads:
+
+    parallelFor(numGroups * size.x, size.y * windowInputsPerNeuron(), [&](uint32_t begin, uint32_t end) {
+        for (uint32_t line = begin; line < end; ++line) {
+            uint32_t group = line / size.x;
+            uint32_t x = line % size.x;
+            float *columns = windowColumns.data() + group * numKernelElements * planeSize;
+            for (auto const &source : windowedSources) {
+                float const *fromOutputs = source.pFromLayer->outputs.data();
+                for (uint32_t y = 0; y < size.y; ++y) {
+                    uint32_t col = flattenXY(x, y, size);
+                    forEachWindowInput(source, group, x, y, [&](uint32_t kernelIdx, uint32_t srcIdx) {
+                        columns[kernelIdx * planeSize + col] += fromOutputs[srcIdx];
+                    });
                 }
             }
+        }
+    });
+}
 
-            for (uint32_t sourceDepth = sourceDepthMin; sourceDepth <= sourceDepthMax; ++sourceDepth) {
-                Neuron &fromNeuron = fromLayer.neurons[sourceDepth][flattenXY(srcX, srcY, fromLayer.size)];
+// The outputs container, flattened [depth][i], is the product of the kernels (one row
+// per depth) and the window columns:
+//
+void LayerConvolution::feedForwardGemm(void)
+{
+    uint32_t numKernelElements = kernelSize.x * kernelSize.y;
+    uint32_t planeSize = size.x * size.y;
 
-                // Test for a duplicate connection and connect if needed:
-                if (toNeuron.sourceNeurons.find(&fromNeuron) == toNeuron.sourceNeurons.end()) {
-                    // Add a new Connection record to the main container of connections:
-                    (*pConnections).push_back(Connection(fromNeuron, toNeuron));
-                    int connectionIdx = (*pConnections).size() - 1;  //  and get its index
-                    ++totalNumberBackConnections;
+    lowerWindowsToColumns();
+    std::fill(outputs.begin(), outputs.end(), 0.0f);
 
-                    if (isRegularLayer) {
-                        // Initialize the weight of the connection: it was already given a random value
-                        // when constructed, but we can adjust or replace that here given our more
-                        // complete knowledge of the layer topology:
-                        (*pConnections).back().weight = (float)(((randomFloat() * 2) - 1.0f) / sqrt(maxNumSourceNeurons));
-                    } else if (isConvolutionFilterLayer || isConvolutionNetworkLayer) {
-                        // Remember which kernel element goes with this connection:
-                        uint32_t matIdx = flattenXY(srcX - xmin, srcY - ymin, kernelSize.y);
-                        (*pConnections).back().convolveMatrixIndex = matIdx;
-                    } else {
-                        // pooling does not use weights
-                    }
+    if (numColumnGroups() == 1) {
+        kernelMatrix.clear();
+        for (auto const &kernel : flatConvolveMatrix) {
+            kernelMatrix.insert(kernelMatrix.end(), kernel.begin(), kernel.end());
+        }
+    }
 
-                    // Record the back connection index at the destination neuron:
-                    toNeuron.backConnectionsIndices.push_back(connectionIdx);
+    // Each work item is a block of columns of the outputs, the same width as the blocks
+    // gemm() uses internally. Every output element is a sum over the same kernel
+    // elements in the same order, whichever thread computes it:
 
-                    // Remember the source neuron for detecting duplicate connections:
-                    toNeuron.sourceNeurons.insert(&fromNeuron);
+    const uint32_t colsPerItem = 256;
+    uint32_t numItems = (planeSize + colsPerItem - 1) / colsPerItem;
 
-                    // Record the Connection index at the source neuron:
-                    fromNeuron.forwardConnectionsIndices.push_back(connectionIdx);
-                }
+    parallelFor(numItems, colsPerItem * size.depth * numKernelElements, [&](uint32_t begin, uint32_t end) {
+        uint32_t col0 = begin * colsPerItem;
+        uint32_t numCols = min(end * colsPerItem, planeSize) - col0;
+
+        if (numColumnGroups() == 1) {
+            gemm(size.depth, numCols, numKernelElements, kernelMatrix.data(), numKernelElements,
+                 windowColumns.data() + col0, planeSize, outputs.data() + col0, planeSize);
+        } else {
+            for (uint32_t depth = 0; depth < size.depth; ++depth) {
+                gemm(1, numCols, numKernelElements, flatConvolveMatrix[depth].data(), numKernelElements,
+                     windowColumns.data() + depth * numKernelElements * planeSize + col0, planeSize,
+                     outputs.data() + depth * planeSize + col0, planeSize);
             }
         }
+    });
+
+    if (!isConvolutionFilterLayer) {
+        tfBatch(outputs.data(), outputs.size());
     }
 }
 
-
-void Layer::debugShow(bool)
+// The same as the direct backprop in calcGradients(), using the window columns saved
+// by the last feedForwardGemm(). The kernel gradients are the gradients times the
+// transposed window columns. The gradients of the window columns are the transposed
+// kernels times the gradients; each one is then added back to every source neuron
+// that was summed into it (col2im):
+//
+void LayerConvolution::propagateGradientsGemm(void)
 {
-}
+    uint32_t numKernelElements = kernelSize.x * kernelSize.y;
+    uint32_t planeSize = size.x * size.y;
+    uint32_t numGroups = numColumnGroups();
+    uint32_t depthsPerGroup = size.depth / numGroups;
+
+    if (isConvolutionNetworkLayer) {
+        for (uint32_t depth = 0; depth < size.depth; ++depth) {
+            float const *columns = windowColumns.data()
+                                 + (depth / depthsPerGroup) * numKernelElements * planeSize;
+            for (uint32_t k = 0; k < numKernelElements; ++k) {
+                flatConvolveGradients[depth][k] += dotProduct(gradients.data() + depth * planeSize,
+                                                              columns + k * planeSize, planeSize);
+            }
+        }
+    }
 
-LayerConvolution::LayerConvolution(const topologyConfigSpec_t &params) : Layer(params)
-{
-    kernelSize = params.kernelSize;
-    flatConvolveMatrix.clear();
-    flatConvolveMatrix = params.flatConvolveMatrix;
-    flatConvolveGradients.clear();
-    flatConvolveGradients.assign(size.depth, vector<float>(kernelSize.x * kernelSize.y));
-    flatDeltaWeights.clear();
-    flatDeltaWeights.assign(size.depth, vector<float>(kernelSize.x * kernelSize.y));
-}
+    bool anySourceNeedsGradients = false;
+    for (auto const &source : windowedSources) {
+        anySourceNeedsGradients |= (source.pFromLayer->layerName != "input");
+    }
+    if (!anySourceNeedsGradients) {
+        return;
+    }
 
-void LayerConvolution::feedForward()
-{
-    for (uint32_t depthIdx = 0; depthIdx < size.depth; ++depthIdx) {
-        for (uint32_t x = 0; x < size.x; ++x) {
-            for (uint32_t y = 0; y < size.y; ++y) {
-                auto &neuron = neurons[depthIdx][flattenXY(x, y, size)];
-                neuron.feedForwardConvolution(depthIdx, this);
+    for (uint32_t group = 0; group < numGroups; ++group) {
+        // Transpose this group's kernels into a numKernelElements x depthsPerGroup matrix:
+        kernelMatrix.resize(numKernelElements * depthsPerGroup);
+        for (uint32_t d = 0; d < depthsPerGroup; ++d) {
+            for (uint32_t k = 0; k < numKernelElements; ++k) {
+                kernelMatrix[k * depthsPerGroup + d] = flatConvolveMatrix[group * depthsPerGroup + d][k];
+            }
+        }
+
+        columnGradients.assign(numKernelElements * planeSize, 0.0f);
+        gemm(numKernelElements, planeSize, depthsPerGroup, kernelMatrix.data(),
+             gradients.data() + group * depthsPerGroup * planeSize, columnGradients.data());
+
+        for (auto const &source : windowedSources) {
+            if (source.pFromLayer->layerName == "input") {
+                continue;
+            }
+            float *fromGradients = source.pFromLayer->gradients.data();
+            for (uint32_t x = 0; x < size.x; ++x) {
+                for (uint32_t y = 0; y < size.y; ++y) {
+                    uint32_t col = flattenXY(x, y, size);
+                    forEachWindowInput(source, group, x, y, [&](uint32_t kernelIdx, uint32_t srcIdx) {
+                        fromGradients[srcIdx] += columnGradients[kernelIdx * planeSize + col];
+                    });
+                }
             }
         }
     }
@@ -628,7 +3321,7 @@ LayerConvolutionFilter::LayerConvolutionFilter(const topologyConfigSpec_t &param
 void LayerConvolutionFilter::debugShow(bool)
 {
     info << layerName << ": 1*" << size.x << "x" << size.y
-         << " = " << neurons.size() * neurons[0].size() << " neurons"
+         << " = " << outputs.size() << " neurons"
          << " convolution filter " << kernelSize.x << "x" << kernelSize.y << endl;
 }
 
@@ -638,34 +3331,47 @@ LayerConvolutionNetwork::LayerConvolutionNetwork(const topologyConfigSpec_t &par
 
 }
 
-void LayerConvolutionNetwork::calcGradients(const vector<float> &targetVals)
+// The kernel gradients were accumulated by calcGradients(). Each kernel element is
+// shared by all the neurons in its depth plane, so we use the average of their
+// gradients; the sum would scale the training rate by the size of the plane. Then
+// each kernel element is updated like any other weight, with momentum:
+//
+void LayerConvolutionNetwork::updateWeights(float eta, float alpha)
 {
-    (void)targetVals;
+    updateWeightsFromBatch(eta, alpha, 1);
+}
 
-    assert(flatConvolveGradients[0][0] == 0.0);
+// calcGradients() keeps adding to the kernel gradients until they are used here,
+// so a mini-batch needs no extra storage; we just average over its samples too:
+//
+void LayerConvolutionNetwork::updateWeightsFromBatch(float eta, float alpha, uint32_t batchCount)
+{
+    float numSharingNeurons = (float)(size.x * size.y * batchCount);
 
     for (uint32_t depth = 0; depth < size.depth; ++depth) {
-        for (auto &neuron : neurons[depth]) {
-            neuron.calcHiddenGradientsConvolution(depth, *this);
+        for (size_t wIdx = 0; wIdx < flatConvolveMatrix[depth].size(); ++wIdx) {
+            float gradient = flatConvolveGradients[depth][wIdx] / numSharingNeurons;
+            float newDeltaWeight = eta * gradient + alpha * flatDeltaWeights[depth][wIdx];
+            flatDeltaWeights[depth][wIdx] = newDeltaWeight;
+            flatConvolveMatrix[depth][wIdx] += newDeltaWeight;
+
+            // We can clear the gradient now that we're done with it, then we don't
+            // have to make a special loop to clear them at the beginning of backProp:
+            flatConvolveGradients[depth][wIdx] = 0;
         }
     }
 }
 
-void LayerConvolutionNetwork::updateWeights(float eta, float alpha)
+// The replica's kernel gradients are cleared after we take them, because the
+// replica never updates its own weights:
+//
+void LayerConvolutionNetwork::gatherBatchGradients(Layer &replica, uint32_t)
 {
     for (uint32_t depth = 0; depth < size.depth; ++depth) {
-        auto &plane = neurons[depth];
-        for (auto &neuron : plane) {
-            neuron.updateInputWeightsConvolution(depth, eta, alpha, *this);
-        }
-
-        for (size_t wIdx = 0; wIdx < flatConvolveMatrix[depth].size(); ++wIdx) {
-            flatConvolveMatrix[depth][wIdx] += flatDeltaWeights[depth][wIdx];
-            // We can clear the flatDeltaWeights and flatConvolveGradients items now,
-            // we're done with them, then we don't have to make a special loop to clear
-            // them at the beginning of backProp:
-            flatDeltaWeights[depth][wIdx] = 0;
-            flatConvolveGradients[depth][wIdx] = 0;
+        auto &replicaGradients = replica.flatConvolveGradients[depth];
+        for (size_t wIdx = 0; wIdx < replicaGradients.size(); ++wIdx) {
+            flatConvolveGradients[depth][wIdx] += replicaGradients[wIdx];
+            replicaGradients[wIdx] = 0;
         }
     }
 }
@@ -674,7 +3380,7 @@ void LayerConvolutionNetwork::saveWeights(std::ofstream &file)
 {
     for (auto const &kernelInstance : flatConvolveMatrix) {
         for (auto weight : kernelInstance) {
-            file << weight << endl;
+            file << weight << '\n';
         }
     }
 }
@@ -691,43 +3397,131 @@ void LayerConvolutionNetwork::loadWeights(std::ifstream &file)
 void LayerConvolutionNetwork::debugShow(bool)
 {
     info << layerName << ": " << size.depth << "*" << size.x << "x" << size.y
-         << " = " << neurons.size() * neurons[0].size() << " neurons, convolution network "
+         << " = " << outputs.size() << " neurons, convolution network "
          << kernelSize.x << "x" << kernelSize.y << " kernels" << endl;
 }
 
 
 LayerPooling::LayerPooling(const topologyConfigSpec_t &params) : Layer(params)
 {
-    poolMethod = params.poolMethod;
-    poolSize = params.poolSize;
+    uint32_t numNeurons = size.depth * size.x * size.y;
+    argmaxSource.assign(numNeurons, 0);
+    argmaxIndex.assign(numNeurons, 0);
+    numPoolInputs.assign(numNeurons, 0);
+}
+
+void LayerPooling::releaseTrainingState(void)
+{
+    Layer::releaseTrainingState();
+    vector<uint32_t>().swap(argmaxSource);
+    vector<uint32_t>().swap(argmaxIndex);
+    vector<uint32_t>().swap(numPoolInputs);
 }
 
+// Pooling layers have no transfer function. The maximum starts with the first source
+// neuron in the window, so any output value can win:
+//
 void LayerPooling::feedForward()
 {
-    for (auto &plane : neurons) {
-        for (auto &neuron : plane) {
-            neuron.feedForwardPooling(this);
+    // Only backprop needs to know which source neurons were pooled:
+    bool recordSources = !inferenceOnly;
+
+    // Each work item is one line of neurons with the same depth and x:
+
+    parallelFor(size.depth * size.x, size.y * windowInputsPerNeuron(), [this, recordSources](uint32_t begin, uint32_t end) {
+        for (uint32_t line = begin; line < end; ++line) {
+            uint32_t depth = line / size.x;
+            uint32_t x = line % size.x;
+            for (uint32_t y = 0; y < size.y; ++y) {
+                uint32_t idx = depth * size.x * size.y + flattenXY(x, y, size);
+                uint32_t count = 0;
+                float result = 0.0f;
+
+                for (uint32_t sourceNum = 0; sourceNum < windowedSources.size(); ++sourceNum) {
+                    auto const &source = windowedSources[sourceNum];
+                    float const *fromOutputs = source.pFromLayer->outputs.data();
+                    forEachWindowInput(source, depth, x, y, [&](uint32_t, uint32_t srcIdx) {
+                        if (poolMethod == POOL_MAX) {
+                            if (count == 0 || fromOutputs[srcIdx] > result) {
+                                result = fromOutputs[srcIdx];
+                                if (recordSources) {
+                                    argmaxSource[idx] = sourceNum;
+                                    argmaxIndex[idx] = srcIdx;
+                                }
+                            }
+                        } else {
+                            result += fromOutputs[srcIdx];
+                        }
+                        ++count;
+                    });
+                }
+
+                if (poolMethod == POOL_AVG && count > 0) {
+                    result /= count;
+                }
+                if (recordSources) {
+                    numPoolInputs[idx] = count;
+                }
+                outputs[idx] = result;
+            }
+        }
+    });
+}
+
+// A pooling layer's gradients are the sums pushed back by the layers it feeds. For max
+// pooling, each gradient goes to the one source neuron that won; for average pooling,
+// it is divided equally among the source neurons in the window:
+//
+void LayerPooling::calcGradients(const vector<float> &targetVals)
+{
+    if (layerName == "output") {
+        for (uint32_t n = 0; n < targetVals.size(); ++n) {
+            gradients[n] = targetVals[n] - outputs[n];
         }
     }
-}
 
+    for (uint32_t depth = 0; depth < size.depth; ++depth) {
+        for (uint32_t x = 0; x < size.x; ++x) {
+            for (uint32_t y = 0; y < size.y; ++y) {
+                uint32_t idx = depth * size.x * size.y + flattenXY(x, y, size);
+                float gradient = gradients[idx];
 
-void LayerPooling::updateWeights(float, float)
-{
+                if (poolMethod == POOL_MAX) {
+                    Layer &fromLayer = *windowedSources[argmaxSource[idx]].pFromLayer;
+                    if (fromLayer.layerName != "input") {
+                        fromLayer.gradients[argmaxIndex[idx]] += gradient;
+                    }
+                } else if (numPoolInputs[idx] > 0) {
+                    float share = gradient / numPoolInputs[idx];
+                    for (auto const &source : windowedSources) {
+                        if (source.pFromLayer->layerName == "input") {
+                            continue;
+                        }
+                        float *fromGradients = source.pFromLayer->gradients.data();
+                        forEachWindowInput(source, depth, x, y, [&](uint32_t, uint32_t srcIdx) {
+                            fromGradients[srcIdx] += share;
+                        });
+                    }
+                }
+            }
+        }
+    }
 }
 
+
 void LayerPooling::debugShow(bool)
 {
     info << layerName << ": " << size.depth << "*" << size.x << "x" << size.y
-         << " = " << neurons.size() * neurons[0].size() << " neurons, pool "
+         << " = " << outputs.size() << " neurons, pool "
          << (poolMethod == POOL_MAX ? "max" : "avg")
-         << " " << kernelSize.x << "x" << kernelSize.y << endl;
+         << " " << poolSize.x << "x" << poolSize.y << endl;
 }
 
 
 LayerRegular::LayerRegular(const topologyConfigSpec_t &params) : Layer(params)
 {
     channel = params.channel;
+    channels = params.channels;
 
     if (params.radiusSpecified) {
         radius = params.radius;
@@ -738,305 +3532,260 @@ LayerRegular::LayerRegular(const topologyConfigSpec_t &params) : Layer(params)
 
 void LayerRegular::feedForward()
 {
-    for (auto &plane : neurons) {
-        for (auto &neuron : plane) {
-            neuron.feedForward(this);
-        }
+    if (quantized) {
+        feedForwardQuantized();
+        return;
     }
-}
 
-void LayerRegular::saveWeights(std::ofstream &file)
-{
-    for (auto const &plane : neurons) {
-        for (auto const &neuron : plane) {
-            for (auto idx : neuron.backConnectionsIndices) {
-                const Connection &conn = (*pConnections)[idx];
-                file << conn.weight << endl;
-            }
-        }
-    }
-}
+    // Each neuron's sum is its row in each Projection times the source outputs, plus
+    // the bias, summed in the same order as the weights file lists the inputs (first
+    // source layer, bias, other source layers):
 
-void LayerRegular::loadWeights(std::ifstream &file)
-{
-    for (auto const &plane : neurons) {
-        for (auto const &neuron : plane) {
-            for (auto idx : neuron.backConnectionsIndices) {
-                Connection &conn = (*pConnections)[idx];
-                file >> conn.weight;
+    uint32_t numRows = size.depth * size.x * size.y;
+
+    parallelFor(numRows, totalNumberBackConnections / numRows, [this](uint32_t begin, uint32_t end) {
+        for (uint32_t row = begin; row < end; ++row) {
+            float sum = 0.0;
+
+            for (size_t projNum = 0; projNum < projections.size(); ++projNum) {
+                sum += projections[projNum].weightedSum(row);
+                if (projNum == 0) {
+                    sum += biasWeights[row]; // The bias input is always 1.0
+                }
             }
+
+            outputs[row] = sum;
         }
-    }
-}
+    });
 
-void LayerRegular::updateWeights(float eta, float alpha)
-{
-    assert(size.depth == 1);
-    for (auto &neuron : neurons[0]) {
-        neuron.updateInputWeights(eta, alpha, pConnections);
-    }
+    // Shape the outputs by passing them through the transfer function:
+    tfBatch(outputs.data(), outputs.size());
 }
 
-void LayerRegular::debugShow(bool details)
+// The batch version of feedForward(): each neuron's row of batchOutputs starts with
+// its bias, then each Projection adds its weighted sums for all the samples. The
+// results equal those of feedForward() except for floating point rounding, because
+// the sums are added in a different order. A quantized layer has no batch kernels and
+// runs feedForward() for each sample instead:
+//
+void LayerRegular::feedForwardBatch(uint32_t numSamples)
 {
-    uint32_t numFwdConnections;
-    uint32_t numBackConnections;
-    auto const &l = *this; // A more convenient name
-
-//    info << "Layer '" << l.layerName << "' has " << l.neurons.size() * l.neurons[0].size()
-//         << " neurons arranged in " << l.size.x << "x" << l.size.y
-//         << " depth " << l.size.depth << ":" << endl;
-
-    info << l.layerName << ": " << l.size.depth << "*" << l.size.x << "x" << l.size.y
-         << " = " << l.neurons.size() * l.neurons[0].size() << " neurons";
-
-    for (size_t depth = 0; depth < l.size.depth; ++depth) {
-        numFwdConnections = 0;
-        numBackConnections = 0;
-
-        for (auto const &n : l.neurons[depth]) {
-            if (details) {
-                info << "  neuron(" << &n << ")" << " output: " << n.output << endl;
-            }
-
-            numFwdConnections += n.forwardConnectionsIndices.size();
-            numBackConnections += n.backConnectionsIndices.size(); // Includes the bias connection
-
-            if (details && n.forwardConnectionsIndices.size() > 0) {
-                info << "    Fwd connections:" << endl;
-                for (auto idx : n.forwardConnectionsIndices) {
-                    Connection const &pc = (*pConnections)[idx];
-                    info << "      conn(" << &pc << ") pFrom=" << &pc.fromNeuron
-                         << ", pTo=" << &pc.toNeuron
-                         << ", w,dw=" << pc.weight << ", " << pc.deltaWeight
-                         << endl;
-                }
-            }
+    if (quantized) {
+        Layer::feedForwardBatch(numSamples);
+        return;
+    }
 
-            if (details && n.backConnectionsIndices.size() > 0) {
-                info << "    Back connections (incl. bias):" << endl;
-                for (auto idx : n.backConnectionsIndices) {
-                    Connection const &c = (*pConnections)[idx];
-                    info << "      conn(" << &c << ") pFrom=" << &c.fromNeuron
-                         << ", pTo=" << &c.toNeuron
-                         << ", w=" << c.weight
+    uint32_t numRows = size.depth * size.x * size.y;
+    uint32_t workPerRow = (totalNumberBackConnections / numRows) * numSamples;
 
-                         << endl;
-                    assert(&c.toNeuron == &n);
-                }
-            }
+    parallelFor(numRows, workPerRow, [this, numSamples](uint32_t begin, uint32_t end) {
+        for (uint32_t row = begin; row < end; ++row) {
+            std::fill_n(&batchOutputs[row * batchStride], numSamples, biasWeights[row]);
         }
 
-        if (!details) {
-            info << "\t, " << numBackConnections << " back, "
-                 << numFwdConnections << " forward connections";
+        for (auto const &proj : projections) {
+            proj.addWeightedSumsBatch(begin, end, numSamples, batchOutputs.data(), batchStride);
         }
 
-        info << endl;
-    }
+        for (uint32_t row = begin; row < end; ++row) {
+            tfBatch(&batchOutputs[row * batchStride], numSamples);
+        }
+    });
 }
 
+// feedForward() after Net::quantize(). Each Projection quantizes its source outputs
+// once, then each row's integer dot products are converted back to float and added
+// to the bias before the transfer function:
+//
+void LayerRegular::feedForwardQuantized(void)
+{
+    for (auto &proj : projections) {
+        proj.quantizeInputs();
+    }
 
-// ***********************************  class Neuron  ***********************************
+    uint32_t numRows = size.depth * size.x * size.y;
 
+    parallelFor(numRows, totalNumberBackConnections / numRows, [this](uint32_t begin, uint32_t end) {
+        for (uint32_t row = begin; row < end; ++row) {
+            float sum = biasWeights[row];
+            for (auto const &proj : projections) {
+                sum += proj.weightedSumQuantized(row);
+            }
+            outputs[row] = sum;
+        }
+    });
 
-Neuron::Neuron()
-{
-    output = randomFloat() - 0.5f;
-    gradient = 0.0f;
-    backConnectionsIndices.clear();
-    forwardConnectionsIndices.clear();
-    sourceNeurons.clear();
+    tfBatch(outputs.data(), outputs.size());
 }
 
-
-// The error gradient of an output-layer neuron is equal to the target (desired)
-// value minus the computed output value, times the derivative of
-// the output-layer activation function evaluated at the computed output value.
+// For each neuron, the weights are saved in this order: the inputs from the first
+// source layer, the bias, then the inputs from each additional source layer. This
+// is the order in which the layer's connections were originally created.
 //
-void Neuron::calcOutputGradients(float targetVal, transferFunction_t tfDerivative)
+void LayerRegular::saveWeights(std::ofstream &file)
 {
-    float delta = targetVal - output;
-    gradient = delta * tfDerivative(output);
+    for (uint32_t row = 0; row < size.depth * size.x * size.y; ++row) {
+        for (size_t projNum = 0; projNum < projections.size(); ++projNum) {
+            projections[projNum].saveRowWeights(file, row);
+            if (projNum == 0) {
+                file << biasWeights[row] << '\n';
+            }
+        }
+    }
 }
 
-
-// The error gradient of a hidden-layer neuron is equal to the derivative
-// of the activation function of the hidden layer evaluated at the
-// local output of the neuron times the sum of the product of
-// the primary outputs times their associated hidden-to-output weights.
-//
-void Neuron::calcHiddenGradients(Layer &myLayer)
+void LayerRegular::loadWeights(std::ifstream &file)
 {
-    float dow = sumDOW_nextLayer(myLayer.pConnections);
-    gradient = dow * myLayer.tfDerivative(output);
-}
+    // The looping order must match that of saveWeights():
 
+    for (uint32_t row = 0; row < size.depth * size.x * size.y; ++row) {
+        for (size_t projNum = 0; projNum < projections.size(); ++projNum) {
+            projections[projNum].loadRowWeights(file, row);
+            if (projNum == 0) {
+                file >> biasWeights[row];
+            }
+        }
+    }
+}
 
-// Special for convolution layers where the weights are stored in the Layer
-// object instead of in the Connection records:
+// After calculating our own gradients, a regular layer pushes its share of the
+// source layers' gradients back to them, i.e., it adds the transpose of each weight
+// matrix times our gradients to the source neurons' gradients. See
+// Layer::calcGradients() for the receiving end. The input layer has no use
+// for gradients, so we skip it.
 //
-void Neuron::calcHiddenGradientsConvolution(uint32_t depth, Layer &myLayer)
+void LayerRegular::calcGradients(const vector<float> &targetVals)
 {
-    float sum = 0.0;
+    Layer::calcGradients(targetVals);
 
-    // Sum our contributions of the errors at the nodes we feed.
+    for (auto const &proj : projections) {
+        if (proj.pFromLayer->layerName == "input") {
+            continue;
+        }
 
-    for (auto idx : forwardConnectionsIndices) {
-        auto const &conn = (*myLayer.pConnections)[idx];
+        for (uint32_t row = 0; row < proj.numRows; ++row) {
+            proj.addToSourceGradients(row, gradients[row]);
+        }
+    }
+}
 
-        // Is the following correct? !!!
-        sum += myLayer.flatConvolveMatrix[depth][conn.convolveMatrixIndex]
-             * conn.toNeuron.gradient;
+void LayerRegular::updateWeights(float eta, float alpha)
+{
+    for (auto &proj : projections) {
+        for (uint32_t row = 0; row < proj.numRows; ++row) {
+            proj.updateRowWeights(row, eta * gradients[row], alpha);
+        }
     }
 
-    // The individual neuron's gradient:
-    gradient = sum * myLayer.tfDerivative(output);
+    for (uint32_t row = 0; row < biasWeights.size(); ++row) {
+        float newDeltaWeight = eta * gradients[row] + alpha * biasDeltaWeights[row];
+        biasDeltaWeights[row] = newDeltaWeight;
+        biasWeights[row] += newDeltaWeight;
+    }
 }
 
-
-// To do: add commentary!!!
-//
-float Neuron::sumDOW_nextLayer(vector<Connection> *pConnections) const
+void LayerRegular::beginBatch(uint32_t numSamples)
 {
-    float sum = 0.0;
-
-    // Sum our contributions of the errors at the nodes we feed.
+    for (auto &proj : projections) {
+        proj.beginBatch(numSamples);
+    }
 
-    for (auto idx : forwardConnectionsIndices) {
-        const Connection &conn = (*pConnections)[idx];
+    biasGradients.assign(biasWeights.size(), 0.0f);
+}
 
-        sum += conn.weight * conn.toNeuron.gradient;
+void LayerRegular::accumulateBatchGradients(uint32_t sampleNum)
+{
+    for (auto &proj : projections) {
+        proj.accumulateBatchGradients(sampleNum, gradients);
     }
 
-    return sum;
+    for (uint32_t row = 0; row < biasGradients.size(); ++row) {
+        biasGradients[row] += gradients[row];
+    }
 }
 
-
-void Neuron::updateInputWeights(float eta, float alpha, vector<Connection> *pConnections)
+void LayerRegular::updateWeightsFromBatch(float eta, float alpha, uint32_t batchCount)
 {
-    // The weights to be updated are the weights from the neurons in the
-    // preceding layer (the source layer) to this neuron:
-
-    for (size_t i = 0; i < backConnectionsIndices.size(); ++i) {
-        auto idx = backConnectionsIndices[i];
-        Connection &conn = (*pConnections)[idx];
+    for (auto &proj : projections) {
+        proj.updateWeightsFromBatch(eta, alpha, batchCount);
+    }
 
-        const Neuron &fromNeuron = conn.fromNeuron;
-        float oldDeltaWeight = conn.deltaWeight;
+    float etaPerSample = eta / batchCount;
+    for (uint32_t row = 0; row < biasWeights.size(); ++row) {
+        float newDeltaWeight = etaPerSample * biasGradients[row] + alpha * biasDeltaWeights[row];
+        biasDeltaWeights[row] = newDeltaWeight;
+        biasWeights[row] += newDeltaWeight;
+    }
+}
 
-        float newDeltaWeight =
-                // Individual input, magnified by the gradient and train rate:
-                eta
-                * fromNeuron.output
-                * gradient
-                // Add momentum = a fraction of the previous delta weight;
-                + alpha
-                * oldDeltaWeight;
+void LayerRegular::gatherBatchGradients(Layer &replica, uint32_t firstSampleNum)
+{
+    for (size_t projNum = 0; projNum < projections.size(); ++projNum) {
+        projections[projNum].gatherBatchGradients(replica.projections[projNum], firstSampleNum);
+    }
 
-        conn.deltaWeight = newDeltaWeight;
-        conn.weight += newDeltaWeight;
+    for (uint32_t row = 0; row < biasGradients.size(); ++row) {
+        biasGradients[row] += replica.biasGradients[row];
     }
 }
 
-void Neuron::updateInputWeightsConvolution(uint32_t depth, float eta, float alpha, Layer &myLayer)
+void LayerRegular::debugShow(bool details)
 {
-    // For convolution network layers, the weights to be updated are stored in
-    // the Layer object, not the Connection records.
+    uint32_t numFwdConnections;
+    uint32_t numBackConnections;
+    auto const &l = *this; // A more convenient name
+
+//    info << "Layer '" << l.layerName << "' has " << l.neurons.size() * l.neurons[0].size()
+//         << " neurons arranged in " << l.size.x << "x" << l.size.y
+//         << " depth " << l.size.depth << ":" << endl;
 
-    for (size_t i = 0; i < backConnectionsIndices.size(); ++i) {
-        auto idx = backConnectionsIndices[i];
-        auto const &conn = (*myLayer.pConnections)[idx];
-        auto const &fromNeuron = conn.fromNeuron;
-        auto &deltaWeight = myLayer.flatDeltaWeights[depth][conn.convolveMatrixIndex];
-        auto &gradient    = myLayer.flatConvolveGradients[depth][conn.convolveMatrixIndex];
+    info << l.layerName << ": " << l.size.depth << "*" << l.size.x << "x" << l.size.y
+         << " = " << l.outputs.size() << " neurons";
 
-        float oldDeltaWeight = deltaWeight;
+    uint32_t planeSize = l.size.x * l.size.y;
 
-        float newDeltaWeight =
-                // Individual input, magnified by the gradient and train rate:
-                eta
-                * fromNeuron.output
-                * gradient
-                // Add momentum = a fraction of the previous delta weight;
-                + alpha
-                * oldDeltaWeight;
+    for (uint32_t depth = 0; depth < l.size.depth; ++depth) {
+        numFwdConnections = 0;
+        numBackConnections = 0;
 
-        deltaWeight += newDeltaWeight; // Just accumulate for now
-    }
-}
+        for (uint32_t i = 0; i < planeSize; ++i) {
+            if (details) {
+                info << "  neuron(" << depth << "," << i << ")" << " output: " << l.outputs[depth * planeSize + i] << endl;
+            }
 
+            numFwdConnections += l.numForwardConnections(depth, i);
+            numBackConnections += l.numBackConnections(depth, i); // Includes the bias connection
 
-// To feed forward an individual neuron, we'll sum the weighted inputs, then pass that
-// sum through the transfer function. This version is for regular layers where the
-// weights are stored in the Connection records.
-//
-void Neuron::feedForward(Layer *pMyLayer)
-{
-    float sum = 0.0;
+        }
 
-    // Sum the neuron's inputs:
-    for (size_t i = 0; i < backConnectionsIndices.size(); ++i) {
-        size_t idx = backConnectionsIndices[i];
-        const Connection &conn = (*pMyLayer->pConnections)[idx];
+        if (!details) {
+            info << "\t, " << numBackConnections << " back, "
+                 << numFwdConnections << " forward connections";
+        }
 
-        sum += conn.fromNeuron.output * conn.weight;
+        info << endl;
     }
 
-    // Shape the output by passing it through the transfer function:
-    this->output = pMyLayer->tf(sum);
+    if (details) {
+        for (auto const &proj : l.projections) {
+            if (proj.isSparse()) {
+                info << "  sparse weights from " << proj.pFromLayer->layerName << ": "
+                     << proj.numRows << " rows, " << proj.weights.size() << " weights" << endl;
+            } else {
+                info << "  dense weights from " << proj.pFromLayer->layerName << ": "
+                     << proj.numRows << "x" << proj.numColumns << endl;
+            }
+        }
+    }
 }
 
-// This version is for convolution network layers where the weights are stored in the
-// Layer->flatConvolveMatrix[][] object instead of in the Connection records:
-//
-void Neuron::feedForwardConvolution(uint32_t depth, Layer *pMyLayer)
-{
-    output = 0.0;
 
-    // Sum the neuron's inputs:
-    for (size_t i = 0; i < backConnectionsIndices.size(); ++i) {
-        auto idx = backConnectionsIndices[i];
-        auto const &conn = (*pMyLayer->pConnections)[idx];
-        auto &sourceNeuron = conn.fromNeuron;
-        auto kernelElement = pMyLayer->flatConvolveMatrix[depth][conn.convolveMatrixIndex];
-        output += sourceNeuron.output * kernelElement;
-    }
+// ***********************************  class Neuron  ***********************************
 
-    // This allows a tf parameter on regular and convolution network layers.
-    // Should we also allow tf on convolution filter layers and pooling layers?
-    if (!pMyLayer->isConvolutionFilterLayer && !pMyLayer->isPoolingLayer) {
-        // Shape the output by passing it through the transfer function:
-        output = pMyLayer->tf(output);
-    }
-}
 
-void Neuron::feedForwardPooling(Layer *pMyLayer)
+Neuron::Neuron(float &output_, float &gradient_)
+     : output(output_), gradient(gradient_)
 {
-    output = -9999.;
-
-    if (pMyLayer->poolMethod == NNet::POOL_MAX) {
-        // Find the max:
-        for (size_t i = 0; i < backConnectionsIndices.size(); ++i) {
-            auto idx = backConnectionsIndices[i];
-            auto const &conn = (*pMyLayer->pConnections)[idx];
-            auto &sourceNeuron = conn.fromNeuron;
-            if (sourceNeuron.output > output) {
-                output = sourceNeuron.output;
-            }
-        }
-    } else if (pMyLayer->poolMethod == NNet::POOL_AVG) {
-        // Find the average:
-        float sum = 0.0;
-        for (size_t i = 0; i < backConnectionsIndices.size(); ++i) {
-            auto idx = backConnectionsIndices[i];
-            auto const &conn = (*pMyLayer->pConnections)[idx];
-            sum += conn.fromNeuron.output;
-        }
-        output = sum / backConnectionsIndices.size();
-    } else {
-        // An unspecified pooling operator is a silent no-op.
-    }
 }
 
 
@@ -1057,19 +3806,28 @@ Net::Net(const string &topologyFilename, bool webserverEnabled_)
     dynamicEtaAdjust = true;       // true enables automatic eta adjustment during training
     alpha = 0.1f;                   // Momentum factor, multiplier of last deltaWeight, [0.0..1.0]
     lambda = 0.0f;                  // Regularization parameter; disabled if 0.0
+    batchSize = 1;                  // Update the weights after every sample
+    numTrainingThreads = 1;         // Train on the calling thread only
+    numLayerThreads = 1;            // Run the layer loops on the calling thread only
+    inferenceOnly = false;          // Allocate what training needs too
+    quantized = false;              // Float weights until quantize() is called
+    randomSeed = 1;                 // Same initial weights every run
     projectRectangular = false;    // Use elliptical areas for sparse connections
+    tfDerivativeFromOutput = false; // Evaluate the derivative function at the outputs
     isRunning = true;              // Command line option -p overrides this
     reportEveryNth = 1;
     recentAverageSmoothingFactor = 125.; // Average net errors over this many input samples
     repeatInputSamples = true;
     shuffleInputSamples = true;
     weightsFilename = "weights.txt";
+    weightsFormat = WEIGHTS_TEXT;  // saveWeights() writes one number per line
     inputSampleNumber = 0;         // Increments each time feedForward() is called
     error = 1.0f;
     recentAverageError = 1.0f;
-    connections.clear();
     layers.clear();
     lastRecentAverageError = 1.0f;
+    batchCount = 0;
+    batchCapacity = 0;
     totalNumberBackConnections = 0;
     totalNumberNeurons = 0;
 
@@ -1082,17 +3840,26 @@ Net::Net(const string &topologyFilename, bool webserverEnabled_)
     }
 #endif
 
-    // Initialize the dummy bias neuron to provide a weighted bias input for all other neurons.
-    // This is a single special neuron that has no inputs of its own, and feeds a constant
-    // 1.0 through weighted connections to every other neuron in the network except input
-    // neurons:
+    // Set up the layers, create neurons, and connect them:
 
-    bias.output = 1.0f;
+    loadTopology(topologyFilename);
+}
 
-    // Set up the layers, create neurons, and connect them:
 
-    if (topologyFilename.size() > 0) {
-        parseConfigFile(topologyFilename);  // Throws an exception if any error
+// Creates the layers from a topology config file, or from a model file saved by
+// saveModel(). The ctor calls this; to set members that affect how the net is built,
+// such as inferenceOnly or randomSeed, construct the net with an empty filename,
+// set them, then call this. An empty filename creates no layers.
+// Throws an exception for any error.
+//
+void Net::loadTopology(const string &filename)
+{
+    if (filename.size() > 0) {
+        if (isModelFile(filename)) {
+            loadModel(filename);          // Topology and weights saved by saveModel()
+        } else {
+            parseConfigFile(filename);    // Throws an exception if any error
+        }
     }
 
 #if defined(ENABLE_WEBSERVER) && !defined(DISABLE_WEBSERVER)
@@ -1117,53 +3884,608 @@ Net::~Net(void) {
 }
 
 
-// Load weights from an external file. The file must contain one floating point
-// number per line, with no blank lines. This function is intended to read the
-// same format that saveWeights() produces.
+// ****************  Weights files  ****************
+
+// The binary weights file starts with a WeightsFileHeader, then one WeightsFileLayer
+// per layer, then the weight arrays in the order of forEachWeightArray(), each one
+// padded with zeros to a multiple of 8 bytes. The checksum covers everything after
+// the header. The fingerprint identifies the topology, so that a binary file can
+// only be loaded into a net whose weight arrays have the same layout.
+//
+const char weightsFileMagic[4] = { 'N', '2', 'D', 'W' };
+const uint32_t weightsFileVersion = 1;
+
+struct WeightsFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t dtype;
+    uint32_t numLayers;
+    uint64_t topologyFingerprint;
+    uint64_t numWeights;             // In all the layers
+    uint64_t checksum;
+};
+
+struct WeightsFileLayer {
+    uint32_t depth, x, y;
+    uint32_t kernelX, kernelY;       // Zero except in convolution layers
+    uint32_t numArrays;
+    uint64_t numWeights;
+};
+
+static_assert(sizeof(WeightsFileHeader) == 40 && sizeof(WeightsFileLayer) == 32,
+              "The binary weights file layout must not depend on the compiler");
+
+uint64_t paddedByteSize(vector<float> const &array)
+{
+    return (array.size() * sizeof(float) + 7) & ~(uint64_t)7;
+}
+
+// Calls f(array) for each container of trainable weights in the layer. The text
+// format interleaves these arrays row by row, but the binary format stores each one
+// whole. Convolution filter kernels come from the topology config file, so they are
+// not saved:
+//
+template<typename L, typename F> void forEachWeightArray(L &layer, F f)
+{
+    for (auto &proj : layer.projections) {
+        f(proj.weights);
+    }
+    if (!layer.biasWeights.empty()) {
+        f(layer.biasWeights);
+    }
+    if (layer.isConvolutionNetworkLayer) {
+        for (auto &kernel : layer.flatConvolveMatrix) {
+            f(kernel);
+        }
+    }
+}
+
+// FNV-1a, used for the topology fingerprint:
+//
+uint64_t hashBytes(uint64_t hash, void const *data, size_t numBytes)
+{
+    unsigned char const *p = (unsigned char const *)data;
+    for (size_t i = 0; i < numBytes; ++i) {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+const uint64_t hashSeed = 0xcbf29ce484222325ULL;
+
+// The same scheme applied to 64-bit words, for the checksum of the weights. This is
+// eight times faster than hashing bytes, which matters for large files. numBytes
+// must be a multiple of 8:
+//
+uint64_t hashWords(uint64_t hash, void const *data, uint64_t numBytes)
+{
+    unsigned char const *p = (unsigned char const *)data;
+    for (uint64_t i = 0; i < numBytes; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, p + i, 8);
+        hash = (hash ^ word) * 0x100000001b3ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+// Identifies the shapes of all the layers and how they are connected. Two nets with
+// the same fingerprint have weight arrays of the same sizes, in the same order, with
+// the same meaning:
+//
+uint64_t Net::topologyFingerprint(void) const
+{
+    uint64_t hash = hashSeed;
+
+    for (auto const &pLayer : layers) {
+        Layer const &layer = *pLayer;
+        hash = hashBytes(hash, layer.layerName.data(), layer.layerName.size() + 1);
+        uint32_t shape[] = { layer.size.depth, layer.size.x, layer.size.y,
+                             layer.kernelSize.x, layer.kernelSize.y, layer.poolSize.x, layer.poolSize.y,
+                             (uint32_t)layer.projections.size(), (uint32_t)layer.windowedSources.size() };
+        hash = hashBytes(hash, shape, sizeof shape);
+
+        for (auto const &proj : layer.projections) {
+            hash = hashBytes(hash, proj.pFromLayer->layerName.data(), proj.pFromLayer->layerName.size() + 1);
+            uint32_t projShape[] = { proj.sameDepth, proj.numRows, proj.numColumns, (uint32_t)proj.weights.size() };
+            hash = hashBytes(hash, projShape, sizeof projShape);
+            hash = hashBytes(hash, proj.columnIndices.data(), proj.columnIndices.size() * sizeof(uint32_t));
+        }
+
+        for (auto const &source : layer.windowedSources) {
+            hash = hashBytes(hash, source.pFromLayer->layerName.data(), source.pFromLayer->layerName.size() + 1);
+        }
+
+        forEachWeightArray(layer, [&](vector<float> const &array) {
+            uint64_t arraySize = array.size();
+            hash = hashBytes(hash, &arraySize, sizeof arraySize);
+        });
+    }
+
+    return hash;
+}
+
+// Load weights from an external file written by saveWeights() in either format.
+// Binary files are recognized by their first four bytes. A text file must contain
+// one floating point number per line, with no blank lines, and exactly as many
+// numbers as the net has weights. Either way, a file that fails the checks leaves
+// the net's weights as they were.
 //
 bool Net::loadWeights(const string &filename)
 {
-    if (!isFileExists(filename)) {
-        err << "Error reading weights file \'" << filename << "\'" << endl;
-        throw exceptionWeightsFile();
+    if (quantized) {
+        err << "Error: can't load weights into a quantized net" << endl;
+        throw exceptionRuntime();
     }
 
-    std::ifstream file(filename);
+    std::ifstream file(filename, std::ios::binary);
     if (!file) {
         err << "Error reading weights file \'" << filename << "\'" << endl;
         throw exceptionWeightsFile();
     }
 
+    char magic[sizeof weightsFileMagic] = { 0 };
+    file.read(magic, sizeof magic);
+    if (file && std::memcmp(magic, weightsFileMagic, sizeof magic) == 0) {
+        file.close();
+        MappedFile mappedFile(filename);
+        if (!mappedFile.isOpen()) {
+            err << "Error reading weights file \'" << filename << "\'" << endl;
+            throw exceptionWeightsFile();
+        }
+        loadWeightsBinary(mappedFile.data(), mappedFile.size(), filename);
+        return true;
+    }
+
+    // Count the numbers in a first pass, so that a file with the wrong number of
+    // weights is rejected before any weights are changed:
+
+    uint64_t numWeights = 0;
+    for (auto const &pLayer : layers) {
+        forEachWeightArray(*pLayer, [&](vector<float> const &array) {
+            numWeights += array.size();
+        });
+    }
+
+    file.clear();
+    file.seekg(0);
+
+    uint64_t numInFile = 0;
+    float weight;
+    while (file >> weight) {
+        ++numInFile;
+    }
+
+    if (!file.eof()) {
+        err << "Error: weights file \'" << filename << "\' contains something other than numbers" << endl;
+        throw exceptionWeightsFile();
+    }
+
+    if (numInFile < numWeights) {
+        err << "Error: weights file \'" << filename << "\' has too few weights for this topology" << endl;
+        throw exceptionWeightsFile();
+    }
+
+    if (numInFile > numWeights) {
+        err << "Error: weights file \'" << filename << "\' has more weights than this topology" << endl;
+        throw exceptionWeightsFile();
+    }
+
+    file.clear();
+    file.seekg(0);
+
     for (auto &pLayer : layers) {
         pLayer->loadWeights(file);
     }
 
-    // ToDo!!! check that the number of weights in the file == size of connections
     file.close();
     return true;
 }
 
+// Loads the weights from the image of a binary weights file in memory, usually a
+// mapped file. All the checks are done before any weights are changed, so a bad file
+// leaves the net as it was. The weights are copied straight into the layers' arrays,
+// with no parsing. The filename is only for error messages:
+//
+void Net::loadWeightsBinary(char const *data, uint64_t numBytes, const string &filename)
+{
+    if (numBytes < sizeof(WeightsFileHeader) || std::memcmp(data, weightsFileMagic, sizeof weightsFileMagic) != 0) {
+        err << "Error reading weights file \'" << filename << "\'" << endl;
+        throw exceptionWeightsFile();
+    }
+
+    WeightsFileHeader header;
+    std::memcpy(&header, data, sizeof header);
+
+    if (header.version != weightsFileVersion) {
+        err << "Error: weights file \'" << filename << "\' has unsupported version " << header.version << endl;
+        throw exceptionWeightsFile();
+    }
+
+    if (header.dtype != hostFloatDtype()) {
+        err << "Error: weights file \'" << filename << "\' has unsupported data type " << header.dtype << endl;
+        throw exceptionWeightsFile();
+    }
+
+    if (header.numLayers != layers.size() || header.topologyFingerprint != topologyFingerprint()) {
+        err << "Error: weights file \'" << filename << "\' was saved from a different topology" << endl;
+        throw exceptionWeightsFile();
+    }
+
+    uint64_t expectedSize = sizeof header + layers.size() * sizeof(WeightsFileLayer);
+    uint64_t numWeights = 0;
+    for (auto const &pLayer : layers) {
+        forEachWeightArray(*pLayer, [&](vector<float> const &array) {
+            expectedSize += paddedByteSize(array);
+            numWeights += array.size();
+        });
+    }
+
+    if (numBytes != expectedSize || header.numWeights != numWeights) {
+        err << "Error: weights file \'" << filename << "\' has " << numBytes
+            << " bytes of weights, expecting " << expectedSize << endl;
+        throw exceptionWeightsFile();
+    }
+
+    if (hashWords(hashSeed, data + sizeof header, numBytes - sizeof header) != header.checksum) {
+        err << "Error: weights file \'" << filename << "\' is corrupt (checksum mismatch)" << endl;
+        throw exceptionWeightsFile();
+    }
+
+    char const *p = data + sizeof header + layers.size() * sizeof(WeightsFileLayer);
+    for (auto &pLayer : layers) {
+        forEachWeightArray(*pLayer, [&](vector<float> &array) {
+            std::memcpy(array.data(), p, array.size() * sizeof(float));
+            p += paddedByteSize(array);
+        });
+    }
+}
+
 
 // Write all the connection weights to an external file that can be later read
-// back in using loadWeights(). The format is one floating point number per
-// line, with no blank lines.
+// back in using loadWeights(), in the format given by weightsFormat. The text
+// format is one floating point number per line, with no blank lines.
 //
 bool Net::saveWeights(const string &filename) const
 {
-    std::ofstream file(filename);
+    return saveWeights(filename, weightsFormat);
+}
+
+bool Net::saveWeights(const string &filename, weightsFormat_t format) const
+{
+    checkFloatWeights();
+
+    std::ofstream file(filename, std::ios::binary);
     if (!file) {
-        err << "Error reading weights file \'" << filename << "\'" << endl;
+        err << "Error writing weights file \'" << filename << "\'" << endl;
+        throw exceptionWeightsFile();
+    }
+
+    if (format == WEIGHTS_BINARY) {
+        saveWeightsBinary(file);
+    } else {
+        // The looping order must match that of loadWeights():
+
+        for (auto &pLayer : layers) {
+            pLayer->saveWeights(file);
+        }
+    }
+
+    file.close();
+    if (!file) {
+        err << "Error writing weights file \'" << filename << "\'" << endl;
+        throw exceptionWeightsFile();
+    }
+
+    return true;
+}
+
+void Net::saveWeightsBinary(std::ofstream &file) const
+{
+    WeightsFileHeader header = { };
+    std::memcpy(header.magic, weightsFileMagic, sizeof header.magic);
+    header.version = weightsFileVersion;
+    header.dtype = hostFloatDtype();
+    header.numLayers = (uint32_t)layers.size();
+    header.topologyFingerprint = topologyFingerprint();
+
+    vector<WeightsFileLayer> layerTable;
+    for (auto const &pLayer : layers) {
+        WeightsFileLayer entry = { };
+        entry.depth = pLayer->size.depth;
+        entry.x = pLayer->size.x;
+        entry.y = pLayer->size.y;
+        if (!pLayer->flatConvolveMatrix.empty()) {
+            entry.kernelX = pLayer->kernelSize.x;
+            entry.kernelY = pLayer->kernelSize.y;
+        }
+        forEachWeightArray(*pLayer, [&](vector<float> const &array) {
+            ++entry.numArrays;
+            entry.numWeights += array.size();
+        });
+        header.numWeights += entry.numWeights;
+        layerTable.push_back(entry);
+    }
+
+    const char padding[8] = { 0 };
+    uint64_t checksum = hashWords(hashSeed, layerTable.data(), layerTable.size() * sizeof(WeightsFileLayer));
+    for (auto const &pLayer : layers) {
+        forEachWeightArray(*pLayer, [&](vector<float> const &array) {
+            uint64_t numBytes = array.size() * sizeof(float);
+            uint64_t wholeWords = numBytes & ~(uint64_t)7;
+            checksum = hashWords(checksum, array.data(), wholeWords);
+            if (wholeWords < numBytes) {
+                char lastWord[8] = { 0 };
+                std::memcpy(lastWord, (char const *)array.data() + wholeWords, numBytes - wholeWords);
+                checksum = hashWords(checksum, lastWord, 8);
+            }
+        });
+    }
+    header.checksum = checksum;
+
+    file.write((char const *)&header, sizeof header);
+    file.write((char const *)layerTable.data(), layerTable.size() * sizeof(WeightsFileLayer));
+    for (auto const &pLayer : layers) {
+        forEachWeightArray(*pLayer, [&](vector<float> const &array) {
+            file.write((char const *)array.data(), array.size() * sizeof(float));
+            file.write(padding, paddedByteSize(array) - array.size() * sizeof(float));
+        });
+    }
+}
+
+
+// ****************  Model files  ****************
+
+// A model file bundles the topology with the weights, so that a net can be deployed
+// as one file. It starts with a ModelFileHeader, then the topology config specs that
+// were passed to configureNetwork(), serialized as below and padded with zeros to a
+// multiple of 8 bytes, then the image of a binary weights file. Because the specs
+// were already parsed and checked when the model was saved, a Net constructed from
+// a model file goes straight to configureNetwork().
+//
+const char modelFileMagic[4] = { 'N', '2', 'D', 'M' };
+const uint32_t modelFileVersion = 1;
+
+struct ModelFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t numSpecs;
+    uint32_t reserved;
+    uint64_t specsNumBytes;          // Before padding
+    uint64_t specsChecksum;          // Of the padded specs
+};
+
+static_assert(sizeof(ModelFileHeader) == 32, "The model file layout must not depend on the compiler");
+
+// Little helpers that append fixed-size values and length-prefixed strings and
+// arrays to a byte string, and read them back. Reading past the end sets ok to
+// false and returns zeros:
+//
+struct SpecWriter {
+    string bytes;
+    void u32(uint32_t value) { bytes.append((char const *)&value, sizeof value); }
+    void str(string const &value) { u32((uint32_t)value.size()); bytes.append(value); }
+    void floats(vector<float> const &value) {
+        u32((uint32_t)value.size());
+        bytes.append((char const *)value.data(), value.size() * sizeof(float));
+    }
+};
+
+struct SpecReader {
+    char const *p;
+    char const *end;
+    bool ok;
+
+    bool take(void *dest, uint64_t numBytes) {
+        if (!ok || (uint64_t)(end - p) < numBytes) {
+            ok = false;
+            std::memset(dest, 0, numBytes);
+            return false;
+        }
+        std::memcpy(dest, p, numBytes);
+        p += numBytes;
+        return true;
+    }
+    uint32_t u32(void) { uint32_t value; take(&value, sizeof value); return value; }
+    string str(void) {
+        uint32_t len = u32();
+        if (!ok || (uint64_t)(end - p) < len) { ok = false; return string(); }
+        p += len;
+        return string(p - len, len);
+    }
+    vector<float> floats(void) {
+        uint32_t len = u32();
+        if (!ok || (uint64_t)(end - p) / sizeof(float) < len) { ok = false; return vector<float>(); }
+        vector<float> value(len);
+        take(value.data(), len * sizeof(float));
+        return value;
+    }
+};
+
+// The channels of the input layer are packed one per byte, first channel in the low
+// byte, so that a single-channel spec packs to just its channel:
+//
+static uint32_t packChannels(topologyConfigSpec_t const &spec)
+{
+    uint32_t packed = spec.channel;
+    for (size_t i = 1; i < spec.channels.size() && i < 4; ++i) {
+        packed |= (uint32_t)spec.channels[i] << (8 * i);
+    }
+    return packed;
+}
+
+static void unpackChannels(topologyConfigSpec_t &spec, uint32_t packed)
+{
+    spec.channel = (ColorChannel_t)(packed & 0xff);
+    spec.channels.clear();
+    for (; packed != 0; packed >>= 8) {
+        spec.channels.push_back((ColorChannel_t)(packed & 0xff));
+    }
+}
+
+// The members in the order they are serialized. fromLayerIndex is not saved because
+// configureNetwork() finds the source layers by name:
+//
+void writeSpec(SpecWriter &w, topologyConfigSpec_t const &spec)
+{
+    w.u32(spec.configLineNum);
+    w.str(spec.fromLayerName);
+    w.u32(spec.sizeSpecified);
+    w.u32(spec.colorChannelSpecified);
+    w.u32(spec.radiusSpecified);
+    w.u32(spec.tfSpecified);
+    w.str(spec.layerName);
+    w.u32(spec.isRegularLayer);
+    w.u32(spec.isConvolutionFilterLayer);
+    w.u32(spec.isConvolutionNetworkLayer);
+    w.u32(spec.isPoolingLayer);
+    w.u32(spec.size.depth);
+    w.u32(spec.size.x);
+    w.u32(spec.size.y);
+    w.u32(packChannels(spec));
+    w.u32(spec.radius.x);
+    w.u32(spec.radius.y);
+    w.str(spec.transferFunctionName);
+    w.u32(spec.poolMethod);
+    w.u32(spec.poolSize.x);
+    w.u32(spec.poolSize.y);
+    w.u32((uint32_t)spec.flatConvolveMatrix.size());
+    for (auto const &kernel : spec.flatConvolveMatrix) {
+        w.floats(kernel);
+    }
+    w.u32(spec.kernelSize.x);
+    w.u32(spec.kernelSize.y);
+    w.u32(spec.convolveMethod);
+}
+
+topologyConfigSpec_t readSpec(SpecReader &r)
+{
+    topologyConfigSpec_t spec;
+
+    spec.configLineNum = r.u32();
+    spec.fromLayerName = r.str();
+    spec.sizeSpecified = r.u32() != 0;
+    spec.colorChannelSpecified = r.u32() != 0;
+    spec.radiusSpecified = r.u32() != 0;
+    spec.tfSpecified = r.u32() != 0;
+    spec.layerName = r.str();
+    spec.isRegularLayer = r.u32() != 0;
+    spec.isConvolutionFilterLayer = r.u32() != 0;
+    spec.isConvolutionNetworkLayer = r.u32() != 0;
+    spec.isPoolingLayer = r.u32() != 0;
+    spec.size.depth = r.u32();
+    spec.size.x = r.u32();
+    spec.size.y = r.u32();
+    unpackChannels(spec, r.u32());
+    spec.radius.x = r.u32();
+    spec.radius.y = r.u32();
+    spec.transferFunctionName = r.str();
+    spec.poolMethod = (poolMethod_t)r.u32();
+    spec.poolSize.x = r.u32();
+    spec.poolSize.y = r.u32();
+    uint32_t numKernels = r.u32();
+    for (uint32_t k = 0; k < numKernels && r.ok; ++k) {
+        spec.flatConvolveMatrix.push_back(r.floats());
+    }
+    spec.kernelSize.x = r.u32();
+    spec.kernelSize.y = r.u32();
+    spec.convolveMethod = (convolveMethod_t)r.u32();
+
+    return spec;
+}
+
+// Returns true if the file starts like a model file:
+//
+bool Net::isModelFile(const string &filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    char magic[sizeof modelFileMagic] = { 0 };
+    file.read(magic, sizeof magic);
+    return file && std::memcmp(magic, modelFileMagic, sizeof magic) == 0;
+}
+
+// Saves the topology and the current weights in one file that can be passed to the
+// Net constructor in place of a topology config file:
+//
+bool Net::saveModel(const string &filename) const
+{
+    checkFloatWeights();
+
+    SpecWriter w;
+    for (auto const &spec : topologySpecs) {
+        writeSpec(w, spec);
+    }
+
+    ModelFileHeader header = { };
+    std::memcpy(header.magic, modelFileMagic, sizeof header.magic);
+    header.version = modelFileVersion;
+    header.numSpecs = (uint32_t)topologySpecs.size();
+    header.specsNumBytes = w.bytes.size();
+    w.bytes.resize((w.bytes.size() + 7) & ~(size_t)7, '\0');
+    header.specsChecksum = hashWords(hashSeed, w.bytes.data(), w.bytes.size());
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file) {
+        err << "Error writing model file \'" << filename << "\'" << endl;
+        throw exceptionWeightsFile();
+    }
+
+    file.write((char const *)&header, sizeof header);
+    file.write(w.bytes.data(), w.bytes.size());
+    saveWeightsBinary(file);
+
+    file.close();
+    if (!file) {
+        err << "Error writing model file \'" << filename << "\'" << endl;
         throw exceptionWeightsFile();
     }
 
-    // The looping order must match that of loadWeights():
+    return true;
+}
+
+// Creates the layers from the specs in a model file, then loads its weights. Errors
+// in the topology part throw exceptionConfigFile; errors in the weights part throw
+// exceptionWeightsFile:
+//
+void Net::loadModel(const string &filename)
+{
+    MappedFile mappedFile(filename);
+    ModelFileHeader header;
+
+    if (!mappedFile.isOpen() || mappedFile.size() < sizeof header) {
+        err << "Error reading model file \'" << filename << "\'" << endl;
+        throw exceptionConfigFile();
+    }
+
+    std::memcpy(&header, mappedFile.data(), sizeof header);
+    uint64_t paddedNumBytes = (header.specsNumBytes + 7) & ~(uint64_t)7;
+
+    if (header.version != modelFileVersion) {
+        err << "Error: model file \'" << filename << "\' has unsupported version " << header.version << endl;
+        throw exceptionConfigFile();
+    }
+
+    if (mappedFile.size() - sizeof header < paddedNumBytes
+            || hashWords(hashSeed, mappedFile.data() + sizeof header, paddedNumBytes) != header.specsChecksum) {
+        err << "Error: model file \'" << filename << "\' is corrupt (topology checksum mismatch)" << endl;
+        throw exceptionConfigFile();
+    }
+
+    SpecReader r = { mappedFile.data() + sizeof header, mappedFile.data() + sizeof header + header.specsNumBytes, true };
+    vector<topologyConfigSpec_t> specs;
+    for (uint32_t i = 0; i < header.numSpecs && r.ok; ++i) {
+        specs.push_back(readSpec(r));
+    }
 
-    for (auto &pLayer : layers) {
-        pLayer->saveWeights(file);
+    if (!r.ok || r.p != r.end) {
+        err << "Error: model file \'" << filename << "\' has a malformed topology" << endl;
+        throw exceptionConfigFile();
     }
 
-    file.close();
-    return true;
+    configureNetwork(specs, filename);
+
+    uint64_t weightsOffset = sizeof header + paddedNumBytes;
+    loadWeightsBinary(mappedFile.data() + weightsOffset, mappedFile.size() - weightsOffset, filename);
 }
 
 
@@ -1181,8 +4503,8 @@ void Net::reportResults(const Sample &sample) const
     // Report actual and expected outputs:
 
     info << "\nPass #" << inputSampleNumber << ": " << sample.imageFilename << "\nOutputs: ";
-    for (auto &n : layers.back()->neurons[0]) { // For all neurons in output layer
-        info << n.output << " ";
+    for (float output : layers.back()->outputs) { // For all neurons in output layer
+        info << output << " ";
     }
     info << endl;
 
@@ -1203,10 +4525,10 @@ void Net::reportResults(const Sample &sample) const
             float maxOutput = std::numeric_limits<float>::min();
             size_t maxIdx = 0;
 
-            for (size_t li = 0; li < layers.back()->neurons[0].size(); ++li) { // Assumes output depth = 1
-                auto const &neuron = layers.back()->neurons[0][li];
-                if (neuron.output > maxOutput) {
-                    maxOutput = neuron.output;
+            auto const &outputs = layers.back()->outputs;
+            for (size_t li = 0; li < outputs.size(); ++li) { // Assumes output depth = 1
+                if (outputs[li] > maxOutput) {
+                    maxOutput = outputs[li];
                     maxIdx = li;
                 }
             }
@@ -1246,8 +4568,14 @@ Layer &Net::createLayer(const topologyConfigSpec_t &params)
     Layer &newLayer = *layers.back(); // Make a convenient name
 
     newLayer.resolveTransferFunctionName(params.transferFunctionName);
-    newLayer.pConnections = &connections;
     newLayer.projectRectangular = projectRectangular; // Note: cannot be changed after net is initialized. !!!
+    newLayer.randomSeed = randomSeed;
+    newLayer.inferenceOnly = inferenceOnly;
+    if (inferenceOnly) {
+        newLayer.releaseTrainingState();
+    }
+    newLayer.layerNumber = layers.size() - 1;
+    newLayer.pThreadPool = pThreadPool.get();         // Builds the connections in parallel
 
     return newLayer;
 }
@@ -1267,17 +4595,11 @@ void Net::debugShowNet(bool details)
 }
 
 
-// Here is where the weights are updated. This is called after every training
-// sample. The outputs of the neural net are compared to the target output
-// values, and the differences are used to adjust the weights in all the
-// connections for all the neurons.
+// Computes the gradients of all the neurons for the sample most recently fed
+// forward, without changing any weights:
 //
-void Net::backProp(const Sample &sample)
+void Net::calcGradients(const Sample &sample)
 {
-    if (!enableBackPropTraining) {
-        return;
-    }
-
     // Verify that we have the right number of target output values:
     auto const &outputSize = layers.back()->size;
     if (sample.targetVals.size() != outputSize.depth * outputSize.x * outputSize.y) {
@@ -1285,18 +4607,63 @@ void Net::backProp(const Sample &sample)
         throw exceptionConfigFile();
     }
 
+    // Each layer accumulates gradients into its source neurons, so start
+    // with a clean slate:
+
+    for (auto &pLayer : layers) {
+        std::fill(pLayer->gradients.begin(), pLayer->gradients.end(), 0.0f);
+        pLayer->tfDerivativeFromOutput = tfDerivativeFromOutput;
+    }
+
     // Calculate the gradients of all the neurons' outputs, starting at the output layer:
 
     for (uint32_t layerNum = layers.size() - 1; layerNum > 0; --layerNum) {
         layers[layerNum]->calcGradients(sample.targetVals);
     }
+}
 
-    // For all layers from outputs to first hidden layer, in reverse order,
-    // update connection weights.
 
-    for (uint32_t layerNum = layers.size() - 1; layerNum > 0; --layerNum) {
-        Layer &layer = *layers[layerNum];
-        layer.updateWeights(eta, alpha);
+// Here is where the weights are updated. This is called after every training
+// sample. The outputs of the neural net are compared to the target output
+// values, and the differences are used to adjust the weights in all the
+// connections for all the neurons. If batchSize > 1, the weights are adjusted
+// once every batchSize samples instead, using the average of their gradients.
+//
+void Net::backProp(const Sample &sample)
+{
+    if (!enableBackPropTraining) {
+        return;
+    }
+
+    checkTrainable();
+
+    calcGradients(sample);
+
+    // With a batch size of one, update the weights right away. For all layers from
+    // outputs to first hidden layer, in reverse order, update connection weights.
+    // Otherwise add this sample's weight gradients to the mini-batch, and update
+    // the weights once when the batch is full:
+
+    if (batchCount == 0 && batchSize <= 1) {
+        for (uint32_t layerNum = layers.size() - 1; layerNum > 0; --layerNum) {
+            Layer &layer = *layers[layerNum];
+            layer.updateWeights(eta, alpha);
+        }
+    } else {
+        if (batchCount == 0) {
+            batchCapacity = batchSize;
+            for (uint32_t layerNum = 1; layerNum < layers.size(); ++layerNum) {
+                layers[layerNum]->beginBatch(batchCapacity);
+            }
+        }
+
+        for (uint32_t layerNum = 1; layerNum < layers.size(); ++layerNum) {
+            layers[layerNum]->accumulateBatchGradients(batchCount);
+        }
+
+        if (++batchCount == batchCapacity) {
+            flushBatch();
+        }
     }
 
     // Adjust eta if dynamic eta adjustment is enabled:
@@ -1307,25 +4674,259 @@ void Net::backProp(const Sample &sample)
 }
 
 
+// A net built with inferenceOnly has no room for gradients, so it can't be trained
+// even if enableBackPropTraining is set again after it is built:
+//
+void Net::checkTrainable(void) const
+{
+    if (inferenceOnly) {
+        err << "Error: a net built with inferenceOnly can't be trained" << endl;
+        throw exceptionRuntime();
+    }
+    if (quantized) {
+        err << "Error: a quantized net can't be trained" << endl;
+        throw exceptionRuntime();
+    }
+}
+
+// quantize() frees the float weights of an inferenceOnly net:
+//
+void Net::checkFloatWeights(void) const
+{
+    if (quantized && inferenceOnly) {
+        err << "Error: the float weights of a quantized inferenceOnly net were freed" << endl;
+        throw exceptionRuntime();
+    }
+}
+
+
+// Updates the weights with the samples accumulated so far in the current
+// mini-batch, if any. backProp() calls this when the batch is full; call it
+// directly to finish a partial batch, e.g., at the end of training:
+//
+void Net::flushBatch(void)
+{
+    if (batchCount == 0) {
+        return;
+    }
+
+    for (uint32_t layerNum = layers.size() - 1; layerNum > 0; --layerNum) {
+        layers[layerNum]->updateWeightsFromBatch(eta, alpha, batchCount);
+    }
+
+    batchCount = 0;
+}
+
+
+
+// Trains the net on one mini-batch of samples: feeds each sample forward, backprops,
+// and reports the results, then updates the weights once for the whole batch. On one
+// thread, that's the same as calling feedForward(), backProp(), and reportResults()
+// for each sample, followed by flushBatch().
+//
+// With numTrainingThreads > 1, the batch is divided into contiguous slices, one per
+// thread. Each thread runs its slice through its own replica of the net, which holds
+// its own outputs and gradients, starting from a copy of our weights. Afterward, we
+// gather the replicas' batch gradients in slice order, so the result doesn't depend
+// on thread timing, and we report the samples in order from their saved outputs, so
+// the reports and the running average error are the same as on one thread.
+//
+void Net::trainBatch(Sample *pSamples, uint32_t numSamples)
+{
+    if (enableBackPropTraining) {
+        checkTrainable();
+    }
+
+    uint32_t numThreads = std::min(numTrainingThreads, numSamples);
+
+    if (numThreads <= 1) {
+        for (uint32_t i = 0; i < numSamples; ++i) {
+            feedForward(pSamples[i]);
+            backProp(pSamples[i]);
+            reportResults(pSamples[i]);
+        }
+        flushBatch();
+        return;
+    }
+
+    flushBatch(); // In case backProp() left a partial batch
+
+    while (replicas.size() < numThreads) {
+        std::unique_ptr<Net> pReplica(new Net("", false));
+        pReplica->projectRectangular = projectRectangular;
+        pReplica->inferenceOnly = inferenceOnly;
+        pReplica->configureNetwork(topologySpecs);
+        replicas.push_back(std::move(pReplica));
+    }
+
+    uint32_t numOutputs = layers.back()->outputs.size();
+    vector<float> sampleOutputs(numSamples * numOutputs);
+    vector<std::exception_ptr> exceptions(numThreads);
+
+    auto firstSampleOfSlice = [numSamples, numThreads](uint32_t slice) {
+        return (uint32_t)((uint64_t)numSamples * slice / numThreads);
+    };
+
+    auto trainSlice = [&](uint32_t slice) {
+        try {
+            Net &replica = *replicas[slice];
+            uint32_t begin = firstSampleOfSlice(slice);
+            uint32_t end = firstSampleOfSlice(slice + 1);
+
+            replica.tfDerivativeFromOutput = tfDerivativeFromOutput;
+            for (uint32_t layerNum = 0; layerNum < layers.size(); ++layerNum) {
+                replica.layers[layerNum]->copyWeightsFrom(*layers[layerNum]);
+                if (enableBackPropTraining) {
+                    replica.layers[layerNum]->beginBatch(end - begin);
+                }
+            }
+
+            for (uint32_t i = begin; i < end; ++i) {
+                replica.feedForward(pSamples[i]);
+                std::copy_n(replica.layers.back()->outputs.begin(), numOutputs, &sampleOutputs[i * numOutputs]);
+                if (enableBackPropTraining) {
+                    replica.calcGradients(pSamples[i]);
+                    for (uint32_t layerNum = 1; layerNum < layers.size(); ++layerNum) {
+                        replica.layers[layerNum]->accumulateBatchGradients(i - begin);
+                    }
+                }
+            }
+        } catch (...) {
+            exceptions[slice] = std::current_exception();
+        }
+    };
+
+    vector<std::thread> threads;
+    for (uint32_t slice = 1; slice < numThreads; ++slice) {
+        threads.emplace_back(trainSlice, slice);
+    }
+    trainSlice(0);
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (auto const &exception : exceptions) {
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+    }
+
+    // Report the samples in order, as if we had processed them one at a time:
+
+    Layer &outputLayer = *layers.back();
+    for (uint32_t i = 0; i < numSamples; ++i) {
+        ++inputSampleNumber;
+        std::copy_n(&sampleOutputs[i * numOutputs], numOutputs, outputLayer.outputs.begin());
+        calculateOverallNetError(pSamples[i]);
+#if defined(ENABLE_WEBSERVER) && !defined(DISABLE_WEBSERVER)
+        if (webserverEnabled) {
+            doCommand();
+        }
+#endif
+        if (enableBackPropTraining && dynamicEtaAdjust) {
+            eta = adjustedEta();
+        }
+        reportResults(pSamples[i]);
+    }
+
+    // Gather the batch gradients from the replicas and update the weights:
+
+    if (enableBackPropTraining) {
+        for (uint32_t layerNum = 1; layerNum < layers.size(); ++layerNum) {
+            layers[layerNum]->beginBatch(numSamples);
+            for (uint32_t slice = 0; slice < numThreads; ++slice) {
+                layers[layerNum]->gatherBatchGradients(*replicas[slice]->layers[layerNum], firstSampleOfSlice(slice));
+            }
+        }
+
+        batchCapacity = numSamples;
+        batchCount = numSamples;
+        flushBatch();
+    }
+}
+
+// numLayerThreads may be changed at any time between samples, so this is called at
+// the start of each feedForward(). The pool is only replaced when its size changes:
+//
+void Net::updateThreadPool(void)
+{
+    if (numLayerThreads <= 1) {
+        pThreadPool.reset();
+    } else if (pThreadPool == nullptr || pThreadPool->size() != numLayerThreads) {
+        pThreadPool.reset(); // Join the old threads before starting new ones
+        pThreadPool.reset(new ThreadPool(numLayerThreads));
+    }
+
+    for (auto &pLayer : layers) {
+        pLayer->pThreadPool = pThreadPool.get();
+    }
+}
+
 // This takes the values at the input layer and feeds them through the
 // neural net to produce new values at the output layer.
 //
 void Net::feedForward(Sample &sample)
 {
     ++inputSampleNumber;
+    updateThreadPool();
+    feedForwardLayers(sample);
+
+    // If target values are known, update the output neurons' errors and
+    // update the overall net error:
+
+    calculateOverallNetError(sample);
+
+#if defined(ENABLE_WEBSERVER) && !defined(DISABLE_WEBSERVER)
+    // Here is a convenient place to poll for incoming commands from the GUI interface:
+    if (webserverEnabled) {
+        doCommand();
+    }
+#endif
+}
+
+// The forward pass of feedForward(), without counting the sample, calculating the
+// error, or polling the GUI:
+//
+void Net::feedForwardLayers(Sample &sample)
+{
+    setInputs(sample);
+
+    // Start the forward propagation at the first hidden layer:
+
+    std::for_each(layers.begin() + 1, layers.end(), [](std::unique_ptr<Layer> const &pLayer) {
+        pLayer->feedForward();
+    });
+}
+
+// Returns bit (1 << channel) for each channel that the input layer reads from the
+// samples, as used by Sample::decode():
+//
+uint32_t Net::inputChannelMask(void) const
+{
+    Layer const &inputLayer = *layers[0];
+    if (inputLayer.channels.empty()) {
+        return 1u << inputLayer.channel;
+    }
+
+    uint32_t channelMask = 0;
+    for (ColorChannel_t channel : inputLayer.channels) {
+        channelMask |= 1u << channel;
+    }
+    return channelMask;
+}
+
 
+void Net::setInputs(Sample &sample)
+{
     // Move the input data from sample to the input neurons. We'll also
     // check that the number of components of the input sample equals
     // the number of input neurons:
 
-    Layer &inputLayer = *layers[0];
-    const vector<float> &data = sample.getData(inputLayer.channel);
+    // An input layer of depth > 1 takes one channel per depth, unless the sample
+    // is explicit data for the whole layer:
 
-    if (inputLayer.neurons[0].size() != data.size()) { // We'll assume input layer depth = 1
-        err << "Error: input sample " << inputSampleNumber << " has " << data.size()
-            << " components, expecting " << inputLayer.neurons[0].size() << endl;
-        //throw exceptionRuntime();
-    }
+    Layer &inputLayer = *layers[0];
+    uint32_t planeSize = inputLayer.size.x * inputLayer.size.y;
 
     // Rather than make it a fatal error if the number of input neurons != number
     // of input data values, we'll use whatever we can and skip the rest:
@@ -1333,27 +4934,237 @@ void Net::feedForward(Sample &sample)
     // the X and Y size of the input image, then we don't have to flatten the indices
     // because they are already flattened the same way:
 
-    for (uint32_t i = 0; i < (uint32_t)min(inputLayer.neurons[0].size(), data.size()); ++i) {
-        inputLayer.neurons[0][i].output = data[i];
+    // A multi-channel input layer has each image decoded once for all its channels:
+    uint32_t channelMask = inputLayer.size.depth > 1 ? inputChannelMask() : 0;
+
+    for (uint32_t depth = 0; depth < inputLayer.size.depth; ++depth) {
+        ColorChannel_t channel = inputLayer.channels.empty() ? inputLayer.channel : inputLayer.channels[depth];
+        size_t numValues = sample.copyInputs(channel, inputLayer.outputs.data() + depth * planeSize,
+                                             depth == 0 ? inputLayer.outputs.size() : planeSize, channelMask);
+        if (depth == 0 && inputLayer.size.depth > 1 && numValues == inputLayer.outputs.size()) {
+            break;
+        }
+
+        if (planeSize != numValues) {
+            err << "Error: input sample " << inputSampleNumber << " has " << numValues
+                << " components, expecting " << planeSize << endl;
+            //throw exceptionRuntime();
+        }
     }
+}
 
-    // Start the forward propagation at the first hidden layer:
 
-    std::for_each(layers.begin() + 1, layers.end(), [](std::unique_ptr<Layer> const &pLayer) {
-        pLayer->feedForward();
-    });
+// For scoring many samples with a trained net. The samples go through the layers
+// in blocks of inferenceBlockSize, so each layer's weights are read once per block
+// rather than once per sample; regular layers have batch kernels, and the other
+// layers run their feedForward() for each sample of the block. Each layer keeps its
+// batchOutputs for the next call. The layers' outputs containers are left holding
+// the values of arbitrary samples.
+//
+void Net::feedForwardBatch(float const *inputs, uint32_t numSamples, float *outputs)
+{
+    updateThreadPool();
 
-    // If target values are known, update the output neurons' errors and
-    // update the overall net error:
+    Layer &inputLayer = *layers[0];
+    Layer const &outputLayer = *layers.back();
+    uint32_t numInputs = inputLayer.outputs.size();
+    uint32_t numOutputs = outputLayer.outputs.size();
+    uint32_t blockSize = inferenceBlockSize;
 
-    calculateOverallNetError(sample);
+    for (auto &pLayer : layers) {
+        pLayer->batchStride = blockSize;
+        pLayer->batchOutputs.resize(pLayer->outputs.size() * blockSize);
+    }
 
-#if defined(ENABLE_WEBSERVER) && !defined(DISABLE_WEBSERVER)
-    // Here is a convenient place to poll for incoming commands from the GUI interface:
-    if (webserverEnabled) {
-        doCommand();
+    for (uint32_t first = 0; first < numSamples; first += blockSize) {
+        uint32_t numInBlock = std::min(blockSize, numSamples - first);
+
+        for (uint32_t sample = 0; sample < numInBlock; ++sample) {
+            float const *pInputs = inputs + (size_t)(first + sample) * numInputs;
+            for (uint32_t n = 0; n < numInputs; ++n) {
+                inputLayer.batchOutputs[n * blockSize + sample] = pInputs[n];
+            }
+        }
+
+        for (size_t layerNum = 1; layerNum < layers.size(); ++layerNum) {
+            layers[layerNum]->feedForwardBatch(numInBlock);
+        }
+
+        for (uint32_t sample = 0; sample < numInBlock; ++sample) {
+            float *pOutputs = outputs + (size_t)(first + sample) * numOutputs;
+            for (uint32_t n = 0; n < numOutputs; ++n) {
+                pOutputs[n] = outputLayer.batchOutputs[n * blockSize + sample];
+            }
+        }
     }
-#endif
+}
+
+
+// Feeds the calibration samples forward with the float weights, recording the largest
+// output magnitude of each layer, then quantizes each regular layer. The scale of a
+// Projection's inputs maps the largest output of its source layer to 127:
+//
+void Net::quantize(SampleSet &calibrationSet, quantizeGranularity_t granularity)
+{
+    checkFloatWeights();
+    if (calibrationSet.samples.empty()) {
+        err << "Error: quantize() needs at least one calibration sample" << endl;
+        throw exceptionRuntime();
+    }
+
+    updateThreadPool();
+    for (auto &pLayer : layers) {
+        pLayer->quantized = false;
+    }
+
+    vector<float> maxOutputs(layers.size(), 0.0f);
+    for (Sample &sample : calibrationSet.samples) {
+        feedForwardLayers(sample);
+        for (size_t layerNum = 0; layerNum < layers.size(); ++layerNum) {
+            for (float output : layers[layerNum]->outputs) {
+                maxOutputs[layerNum] = std::max(maxOutputs[layerNum], absd(output));
+            }
+        }
+    }
+
+    uint64_t numWeights = 0;
+    for (auto &pLayer : layers) {
+        Layer &layer = *pLayer;
+        if (layer.projections.empty()) {
+            continue; // The input layer, or a convolution or pooling layer
+        }
+
+        float layerMaxWeight = 0.0f;
+        if (granularity == QUANTIZE_PER_LAYER) {
+            for (auto const &proj : layer.projections) {
+                for (float weight : proj.weights) {
+                    layerMaxWeight = std::max(layerMaxWeight, absd(weight));
+                }
+            }
+        }
+
+        for (auto &proj : layer.projections) {
+            float maxInput = maxOutputs[proj.pFromLayer->layerNumber];
+            proj.inputScale = maxInput > 0.0f ? maxInput / 127.0f : 1.0f;
+            proj.quantizeWeights(layerMaxWeight);
+            numWeights += proj.quantizedWeights.size();
+            if (inferenceOnly) {
+                vector<float>().swap(proj.weights);
+            }
+        }
+
+        layer.quantized = true;
+    }
+
+    quantized = true;
+    info << "Quantized " << numWeights << " weights to 8 bits using "
+         << calibrationSet.samples.size() << " calibration samples" << endl;
+}
+
+// Returns the index of the largest value:
+//
+static size_t indexOfLargest(vector<float> const &values)
+{
+    return std::max_element(values.begin(), values.end()) - values.begin();
+}
+
+// Feeds each sample forward twice, with the float weights and with the 8-bit weights,
+// and compares the outputs. The report is also logged:
+//
+QuantizationReport Net::validateQuantization(SampleSet &validationSet)
+{
+    if (!quantized) {
+        err << "Error: validateQuantization() needs a quantized net" << endl;
+        throw exceptionRuntime();
+    }
+    checkFloatWeights();
+    updateThreadPool();
+
+    QuantizationReport report;
+    for (auto const &pLayer : layers) {
+        for (auto const &proj : pLayer->projections) {
+            report.floatWeightBytes += proj.weights.size() * sizeof(float);
+            report.quantizedWeightBytes += proj.quantizedWeights.size() * sizeof(int8_t)
+                                           + proj.rowScales.size() * sizeof(float);
+        }
+    }
+
+    auto setQuantized = [this](bool on) {
+        for (auto &pLayer : layers) {
+            pLayer->quantized = on && !pLayer->projections.empty();
+        }
+    };
+
+    Layer const &outputLayer = *layers.back();
+    uint32_t numFloatCorrect = 0;
+    uint32_t numQuantizedCorrect = 0;
+    uint32_t numAgree = 0;
+    vector<float> floatOutputs;
+
+    for (Sample &sample : validationSet.samples) {
+        setQuantized(false);
+        feedForwardLayers(sample);
+        floatOutputs = outputLayer.outputs;
+        setQuantized(true);
+        feedForwardLayers(sample);
+        auto const &outputs = outputLayer.outputs;
+
+        ++report.numSamples;
+        for (size_t n = 0; n < outputs.size(); ++n) {
+            report.maxOutputDifference = std::max(report.maxOutputDifference, absd(outputs[n] - floatOutputs[n]));
+        }
+
+        size_t floatLargest = indexOfLargest(floatOutputs);
+        size_t quantizedLargest = indexOfLargest(outputs);
+        numAgree += floatLargest == quantizedLargest;
+
+        if (sample.targetVals.empty()) {
+            continue;
+        }
+        if (sample.targetVals.size() != outputs.size()) {
+            err << "Error in sample " << report.numSamples << ": wrong number of target values" << endl;
+            throw exceptionRuntime();
+        }
+
+        ++report.numWithTargets;
+        numFloatCorrect += sample.targetVals[floatLargest] > 0.0f;
+        numQuantizedCorrect += sample.targetVals[quantizedLargest] > 0.0f;
+
+        // The same error as calculateOverallNetError(), without regularization:
+        float floatError = 0.0f;
+        float quantizedError = 0.0f;
+        for (size_t n = 0; n < outputs.size(); ++n) {
+            float floatDelta = sample.targetVals[n] - floatOutputs[n];
+            float quantizedDelta = sample.targetVals[n] - outputs[n];
+            floatError += floatDelta * floatDelta;
+            quantizedError += quantizedDelta * quantizedDelta;
+        }
+        report.floatError += floatError / (2.0f * outputs.size());
+        report.quantizedError += quantizedError / (2.0f * outputs.size());
+    }
+
+    if (report.numSamples > 0) {
+        report.agreement = (float)numAgree / report.numSamples;
+    }
+    if (report.numWithTargets > 0) {
+        report.floatAccuracy = (float)numFloatCorrect / report.numWithTargets;
+        report.quantizedAccuracy = (float)numQuantizedCorrect / report.numWithTargets;
+        report.floatError /= report.numWithTargets;
+        report.quantizedError /= report.numWithTargets;
+    }
+
+    info << "Quantization report for " << report.numSamples << " samples:" << endl;
+    if (report.numWithTargets > 0) {
+        info << "  Accuracy: " << report.floatAccuracy * 100.0f << "% float, "
+             << report.quantizedAccuracy * 100.0f << "% 8-bit" << endl;
+        info << "  Average error: " << report.floatError << " float, " << report.quantizedError << " 8-bit" << endl;
+    }
+    info << "  Same largest output: " << report.agreement * 100.0f << "%, largest difference "
+         << report.maxOutputDifference << endl;
+    info << "  Weights: " << report.floatWeightBytes << " bytes float, "
+         << report.quantizedWeightBytes << " bytes 8-bit" << endl;
+
+    return report;
 }
 
 
@@ -1377,17 +5188,17 @@ void Net::calculateOverallNetError(const Sample &sample)
     // Check that the number of target values equals the number of output neurons:
     // Assumes output layer depth = 1
 
-    if (sample.targetVals.size() != outputLayer.neurons[0].size()) {
+    if (sample.targetVals.size() != outputLayer.outputs.size()) {
         err << "Error in sample " << inputSampleNumber << ": wrong number of target values" << endl;
         throw exceptionRuntime();
     }
 
-    for (uint32_t n = 0; n < outputLayer.neurons[0].size(); ++n) {
-        float delta = sample.targetVals[n] - outputLayer.neurons[0][n].output;
+    for (uint32_t n = 0; n < outputLayer.outputs.size(); ++n) {
+        float delta = sample.targetVals[n] - outputLayer.outputs[n];
         error += delta * delta;
     }
 
-    error /= 2.0f * outputLayer.neurons[0].size();
+    error /= 2.0f * outputLayer.outputs.size();
 
     // Regularization calculations -- this is an experimental implementation.
     // If this experiment works, we should instead calculate the sum of weights
@@ -1399,8 +5210,12 @@ void Net::calculateOverallNetError(const Sample &sample)
 
     float sumWeightsSquared_ = 0.0;
     if (lambda != 0.0) {
-        for (size_t i = 0; i < connections.size(); ++i) {
-            sumWeightsSquared_ += connections[i].weight * connections[i].weight;
+        for (auto const &pLayer : layers) {
+            for (auto const &proj : pLayer->projections) {
+                sumWeightsSquared_ += dotProduct(proj.weights.data(), proj.weights.data(), proj.weights.size());
+            }
+            sumWeightsSquared_ += dotProduct(pLayer->biasWeights.data(), pLayer->biasWeights.data(),
+                                             pLayer->biasWeights.size());
         }
 
         error += (sumWeightsSquared_ * lambda)
@@ -1441,11 +5256,12 @@ void Net::reportUnconnectedNeurons(void)
     // Loop through all layers except the output layer, looking for unconnected neurons:
     uint32_t neuronsWithNoSink = 0;
     for (uint32_t layerNum = 0; layerNum < layers.size() - 1; ++layerNum) {
-        for (auto const &plane : layers[layerNum]->neurons) {
-            for (auto const &neuron : plane) {
-                if (neuron.forwardConnectionsIndices.size() == 0) {
+        Layer const &layer = *layers[layerNum];
+        for (uint32_t depth = 0; depth < layer.size.depth; ++depth) {
+            for (uint32_t i = 0; i < layer.size.x * layer.size.y; ++i) {
+                if (layer.numForwardConnections(depth, i) == 0) {
                     ++neuronsWithNoSink;
-                    warn << "  neuron(" << &neuron << ") on " << layers[layerNum]->layerName
+                    warn << "  neuron(" << depth << "," << i << ") on " << layer.layerName
                          << endl;
                 }
             }
@@ -1459,10 +5275,21 @@ void Net::reportUnconnectedNeurons(void)
 // for more information about the format of the topology config file.
 // Throws an exception for any error.
 //
+// The layers are connected and their weights initialized by numLayerThreads threads.
+// The initial weights depend only on randomSeed and the topology, not on the number
+// of threads.
+//
 void Net::configureNetwork(vector<topologyConfigSpec_t> allLayerSpecs, const string /*configFilename*/)
 {
     uint32_t numNeurons = 0;
 
+    topologySpecs = allLayerSpecs;
+    updateThreadPool();
+
+    if (inferenceOnly) {
+        enableBackPropTraining = false;
+    }
+
     // We want to pre-allocate the .layers member so that we can form persistent
     // references to individual layers. We could do this more exactly, but a safe
     // heuristic is to allocate as many layers as elements in the config spec array:
@@ -1479,12 +5306,11 @@ void Net::configureNetwork(vector<topologyConfigSpec_t> allLayerSpecs, const str
 
             // Create a new layer filled with unconnected neurons:
             Layer &newLayer = createLayer(spec);
-            newLayer.pConnections = &connections;
 
             // Pre-allocate all the neurons in the layer so that we can form
             // stable references to individual neurons:
-            newLayer.neurons.assign(newLayer.size.depth, vector<Neuron>(newLayer.size.x * newLayer.size.y));
-            numNeurons += newLayer.size.x * newLayer.size.y;
+            newLayer.createNeurons();
+            numNeurons += newLayer.size.depth * newLayer.size.x * newLayer.size.y;
 
             // Connect them:
             if (newLayer.layerName != "input") {
@@ -1493,16 +5319,20 @@ void Net::configureNetwork(vector<topologyConfigSpec_t> allLayerSpecs, const str
 
             // For some layer types, all neurons get a bias input:
             if (newLayer.layerName != "input" && newLayer.isRegularLayer) {
-                newLayer.connectBiasToAllNeuronsAllDepths(bias);
+                newLayer.initBiasWeights();
             }
 
             // For convolution network layers, initialize the kernels and associated data:
             // should the Layer class do this?
             if (spec.isConvolutionNetworkLayer) {
                 uint32_t maxNumSourceNeurons = newLayer.size.x * newLayer.size.y;
+                Philox random = newLayer.randomStream(Layer::RANDOM_KERNELS);
+                uint64_t index = 0;
                 for (auto &plane : newLayer.flatConvolveMatrix) {
+                    random.uniform(index, plane.data(), plane.size());
+                    index += plane.size();
                     std::for_each(std::begin(plane), std::end(plane), [maxNumSourceNeurons](float &weight) {
-                        weight = (float)(((randomFloat() * 2) - 1.0f) / sqrt(maxNumSourceNeurons));
+                        weight = (float)((weight * 2 - 1.0f) / sqrt(maxNumSourceNeurons));
                     });
                 }
             }
@@ -1515,6 +5345,13 @@ void Net::configureNetwork(vector<topologyConfigSpec_t> allLayerSpecs, const str
             layerTo.connectLayers(*layers[layerNumFrom]);
         }
     }
+
+    // Totals used by the regularization term in calculateOverallNetError():
+    totalNumberNeurons = numNeurons;
+    totalNumberBackConnections = 0;
+    for (auto const &pLayer : layers) {
+        totalNumberBackConnections += pLayer->totalNumberBackConnections;
+    }
 }
 
 void Net::parseConfigFile(const string &configFilename)
@@ -1614,6 +5451,10 @@ void Net::makeParameterBlock(string &s)
 
     s.append("lambda=" + to_string(lambda) + ";\r\n");
 
+    // batchSize=int
+
+    s.append("batchSize=" + to_string(batchSize) + ";\r\n");
+
     // reportEveryNth=int
 
     s.append("reportEveryNth=" + to_string(reportEveryNth) + ";\r\n");
@@ -1771,6 +5612,11 @@ void Net::actOnMessageReceived(Message_t &msg)
         info << "Set lambda=" << lambda << endl;
     }
 
+    else if (token.find("batchSize=") == 0) {
+        batchSize = std::max(1, atoi(token.substr(10).c_str()));
+        info << "Set batchSize=" << batchSize << endl;
+    }
+
     else if (token == "load") {
         ss >> token;
         info << "Load weights from " << token << endl;
@@ -1850,9 +5696,11 @@ void Net::actOnMessageReceived(Message_t &msg)
 
     // Post processing
 
-    if (newColorChannel != layers[0]->channel) {
-        sampleSet.clearImageCache();
+    // The samples decode the new channel when it's first needed, or already have it
+    // if SampleSet::decodeAllChannels is set. Multi-channel input layers keep their channels:
+    if (layers[0]->size.depth == 1) {
         layers[0]->channel = newColorChannel;
+        layers[0]->channels = { newColorChannel };
     }
 
     // Send the HTTP response:
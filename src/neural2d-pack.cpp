@@ -0,0 +1,57 @@
+/*
+neural2d-pack.cpp
+https://github.com/davidrmiller/neural2d
+For more info, see neural2d.h.
+
+Converts an input data config file into a packed sample file that holds the
+decoded input data of all the samples. The packed sample file can be given to
+neural2d in place of the input data config file. Usage:
+
+    neural2d-pack inputData.txt samples.n2ds [channels]
+
+where channels is a comma-separated list of R, G, B, and BW, by default BW. Only
+the channels listed can be used by the input layer of a net that reads the file.
+*/
+
+#include "neural2d.h"
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        std::cerr << "Usage: neural2d-pack inputData.txt samples.n2ds [R,G,B,BW]" << std::endl;
+        return 1;
+    }
+
+    std::string inputDataFilename = argv[1];
+    std::string packedFilename = argv[2];
+    std::string channels = argc > 3 ? argv[3] : "BW";
+
+    uint32_t channelMask = 0;
+    std::stringstream ss(channels);
+    std::string channel;
+    while (getline(ss, channel, ',')) {
+        if (channel == "R") {
+            channelMask |= 1u << NNet::R;
+        } else if (channel == "G") {
+            channelMask |= 1u << NNet::G;
+        } else if (channel == "B") {
+            channelMask |= 1u << NNet::B;
+        } else if (channel == "BW") {
+            channelMask |= 1u << NNet::BW;
+        } else {
+            std::cerr << "Unknown channel \"" << channel << "\", expected R, G, B, or BW" << std::endl;
+            return 1;
+        }
+    }
+
+    try {
+        NNet::SampleSet sampleSet;
+        sampleSet.loadSamples(inputDataFilename);
+        sampleSet.savePackedSamples(packedFilename, channelMask);
+        std::cout << "Packed " << sampleSet.samples.size() << " samples into " << packedFilename << std::endl;
+    } catch (std::exception &) {
+        return 1;
+    }
+
+    return 0;
+}
@@ -42,21 +42,39 @@ int main(int argc, char **argv)
     myNet.shuffleInputSamples = true;
     myNet.doneErrorThreshold = 0.01f;
 
+    // To train on several cores, set a mini-batch size and the number of threads
+    // that share each batch, e.g.:
+    //myNet.batchSize = 64;
+    //myNet.numTrainingThreads = std::thread::hardware_concurrency();
+    // Or to divide the work in each large layer among threads:
+    //myNet.numLayerThreads = std::thread::hardware_concurrency();
+
+    // Image files are decoded by two worker threads that keep up to 64 samples
+    // ahead of the training:
+    NNet::SamplePrefetcher prefetcher(2, 64);
+
     do {
+        prefetcher.finish();
         if (myNet.shuffleInputSamples) {
             myNet.sampleSet.shuffle();
         }
 
-        for (auto &sample : myNet.sampleSet.samples) {
-            myNet.feedForward(sample);
-            myNet.backProp(sample);
-            myNet.reportResults(sample);
+        auto &samples = myNet.sampleSet.samples;
+        prefetcher.start(samples.data(), samples.size(), myNet.layers[0]->channel, true, myNet.inputChannelMask());
+        for (size_t first = 0; first < samples.size(); first += myNet.batchSize) {
+            uint32_t numSamples = (uint32_t)std::min<size_t>(myNet.batchSize, samples.size() - first);
+            prefetcher.waitFor(first, first + numSamples);
+            myNet.trainBatch(&samples[first], numSamples);
             if (myNet.recentAverageError < myNet.doneErrorThreshold) {
+                // Return rather than exit() so that the prefetcher's destructor
+                // joins its workers before the sample set is destroyed:
+                prefetcher.finish();
                 std::cout << "Solved!   -- Saving weights..." << std::endl;
                 myNet.saveWeights(weightsFilename);
-                exit(0);
+                return 0;
             }
         }
+        prefetcher.reportStats();
     } while (myNet.repeatInputSamples);
 
     std::cout << "Done." << std::endl;
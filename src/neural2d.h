@@ -57,7 +57,8 @@ See https://github.com/davidrmiller/neural2d for more information.
  *     TRAINED:  input samples have no target output values; outputs are
  *               reported, weights are NOT adjusted. For this mode,
  *               call loadWeights(), then call feedForward() and
- *               reportResults() once per input sample.
+ *               reportResults() once per input sample. A net built with
+ *               inferenceOnly set skips the memory that training needs.
  *
  * Typical operation is to label a bunch of input samples, use some of them in
  * TRAINING mode, and save the weights when the net is trained. Then using the saved
@@ -67,10 +68,12 @@ See https://github.com/davidrmiller/neural2d for more information.
  *
  * Class relationships: Everything is in the NNet namespace. Class Net can be
  * instantiated to create a neural net. The Net object holds a container of
- * Layer objects. Each Layer object holds a container of Neuron objects. Each
- * Neuron object holds containers of references to Connection objects which
- * define the connections. The container of Connection objects is held in the
- * net object and neurons refer to connections by indices. Class SampleSet holds
+ * Layer objects. Each Layer object holds the outputs and gradients of its neurons
+ * in flat containers, and a container of Neuron objects that refer to them. Regular
+ * layers hold their weights in Projection objects, one per source layer, stored
+ * either as a dense matrix or in compressed sparse row form. Convolution and
+ * pooling layers read their source layers through sliding windows (WindowedSource
+ * objects); convolution layers also hold their kernels. Class SampleSet holds
  * the input samples that are presented to the neural net when the
  * feedForward() member is called.
  *
@@ -78,7 +81,10 @@ See https://github.com/davidrmiller/neural2d for more information.
  * layers, convolution network layers, and pooling layers. All layers have a depth:
  * regular layers and convolution filter layers have a depth of 1; convolution
  * network layers and pooling layers have a depth > 1 (where depth is the number
- * of convolution kernels to train).
+ * of convolution kernels to train). The exception is the input layer, which may
+ * have a depth > 1 with one color channel of the input image per depth, given by
+ * a channel list such as "channel R,G,B" or "channel RGB". An input layer of
+ * depth 3 or 4 defaults to R,G,B or R,G,B,BW.
  */
 
 #ifndef NNET_H
@@ -95,22 +101,27 @@ See https://github.com/davidrmiller/neural2d for more information.
 // ISO-standard C++ headers:
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdlib>
+#include <deque>
 #include <exception>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <memory>   // for unique_ptr
+#include <mutex>
 #include <queue>
-#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #if defined(ENABLE_WEBSERVER) && !defined(DISABLE_WEBSERVER)
-    #include <condition_variable> // For mutex
-    #include <thread>
     #include <sys/socket.h>  // POSIX sockets
     #include <netinet/in.h>  // POSIX sockets
     #include "webserver.h"
@@ -193,8 +204,12 @@ struct xySize {
 
 enum ColorChannel_t { COLOR_NONE, R, G, B, BW };
 enum poolMethod_t { POOL_NONE, POOL_MAX, POOL_AVG };
+enum weightsFormat_t { WEIGHTS_TEXT, WEIGHTS_BINARY };
+enum convolveMethod_t { CONVOLVE_DIRECT, CONVOLVE_GEMM };
+enum quantizeGranularity_t { QUANTIZE_PER_LAYER, QUANTIZE_PER_NEURON };
 
 float pixelToNetworkInputRange(unsigned val);  // Converts uint8_t to float
+float const *pixelToNetworkInputTable(void);   // pixelToNetworkInputRange() of 0..255
 
 
 // ImageReader objects are used to read various image file formats and extract the
@@ -211,18 +226,75 @@ class ImageReader
 public:
     virtual xySize
     getData(string const &filename, vector<float> &dataContainer, ColorChannel_t channel = NNet::R) = 0;
+
+    // Reads every channel in the file at once: dataContainer receives one block of
+    // X*Y values per channel, in ColorChannel_t order, and channelMask gets bit
+    // (1 << channel) for each channel read. The default returns 0, 0 (unsupported).
+    virtual xySize getAllChannels(string const &filename, vector<float> &dataContainer, uint32_t &channelMask);
+
+    // For 8-bit image formats: reads the channels in channelMask as 8-bit pixel values,
+    // before the conversion to the network input range, one block of X*Y values per
+    // channel in ColorChannel_t order. The default returns 0, 0 (unsupported).
+    virtual xySize getPixels(string const &filename, vector<uint8_t> &pixels, uint32_t channelMask);
 };
 
 class ImageReaderBMP : public ImageReader
 {
 public:
     xySize getData(string const &filename, vector<float> &dataContainer, ColorChannel_t channel) override;
+    xySize getAllChannels(string const &filename, vector<float> &dataContainer, uint32_t &channelMask) override;
+    xySize getPixels(string const &filename, vector<uint8_t> &pixels, uint32_t channelMask) override;
 };
 
 class ImageReaderDat : public ImageReader
 {
 public:
     xySize getData(string const &filename, vector<float> &dataContainer, ColorChannel_t channel) override;
+    xySize getAllChannels(string const &filename, vector<float> &dataContainer, uint32_t &channelMask) override;
+};
+
+
+// Read-only view of a whole file. On *nix the file is memory mapped, so the pages
+// are read by the kernel on demand with no intermediate copy; on Windows, the file
+// is read into a buffer:
+//
+class MappedFile
+{
+public:
+    explicit MappedFile(const string &filename);
+    ~MappedFile(void);
+    MappedFile(MappedFile const &) = delete;
+    MappedFile &operator=(MappedFile const &) = delete;
+    bool isOpen(void) const { return pData != nullptr; }
+    char const *data(void) const { return pData; }
+    uint64_t size(void) const { return length; }
+    void prefetch(uint64_t offset, uint64_t numBytes) const; // A hint, may do nothing
+
+private:
+    char const *pData = nullptr;
+    uint64_t length = 0;
+#if defined(WIN32)
+    vector<char> buffer;
+#endif
+};
+
+
+// A DataView refers to an array of floats owned by something else, such as a
+// Sample's data container or a mapped file:
+//
+class DataView
+{
+public:
+    DataView(float const *p = nullptr, size_t n = 0) : pData(p), count(n) { }
+    float const *data(void) const { return pData; }
+    size_t size(void) const { return count; }
+    float const *begin(void) const { return pData; }
+    float const *end(void) const { return pData + count; }
+    float operator[](size_t i) const { return pData[i]; }
+
+private:
+    float const *pData;
+    size_t count;
 };
 
 
@@ -232,8 +304,19 @@ public:
 class Sample
 {
 public:
-    // Returns a reference to the cached image data, flattened in a 1D container:
-    vector<float> const &getData(ColorChannel_t channel);
+    // Returns a view of the cached image data, flattened in a 1D container. The view
+    // is valid until the image cache is cleared or another channel is requested.
+    // If the image must be read, the channels in channelMask (bit 1 << channel for
+    // each ColorChannel_t) are decoded along with channel and cached together:
+    DataView getData(ColorChannel_t channel, uint32_t channelMask = 0);
+
+    // Decodes and caches the image data for the channel if it isn't cached yet. If
+    // SampleSet::compactImageCache is set, 8-bit images are cached as pixels:
+    void decode(ColorChannel_t channel, uint32_t channelMask = 0);
+
+    // Copies up to maxCount input values of the channel to pDest, converting cached
+    // pixels to the network input range. Returns the number of values available:
+    size_t copyInputs(ColorChannel_t channel, float *pDest, size_t maxCount, uint32_t channelMask = 0);
 
     // Clear all cached image data (does not clear data that was explicitly defined):
     void clearImageCache(void);
@@ -244,6 +327,15 @@ public:
     // Data caches:
     vector<float> targetVals;
     vector<float> data;
+    uint32_t dataChannels = 0;  // Bit (1 << channel) for each image channel in data, 0 for explicit data
+    vector<uint8_t> pixels;     // Compact image cache, see SampleSet::compactImageCache
+    uint32_t pixelChannels = 0; // Bit (1 << channel) for each channel in pixels
+
+    // Set for samples loaded from a packed sample file, see SampleSet::loadPackedSamples():
+    float const *packedData = nullptr;  // The values of the first channel in the mapped file
+    uint32_t packedCount = 0;           // Number of values per channel
+    uint32_t packedChannelStride = 0;   // Zero if the same values serve every channel
+    uint32_t packedChannels = 0;        // Bit (1 << channel) for each channel present
 };
 
 
@@ -253,23 +345,161 @@ public:
 class SampleSet
 {
 public:
-    void loadSamples(string const &inputDataConfigFilename);
+    void loadSamples(string const &inputDataConfigFilename); // Or a packed sample file
     void shuffle(void);          // Shuffles the samples container
     void clearImageCache(void);  // Only image data is cleared, not explicit input data
 
+    // A packed sample file holds the decoded input data of all the samples for the
+    // channels in channelMask (bit 1 << channel for each ColorChannel_t). loadSamples()
+    // recognizes packed sample files and maps them instead of parsing them:
+    void savePackedSamples(const string &filename, uint32_t channelMask);
+    void loadPackedSamples(const string &filename);
+    static bool isPackedSampleFile(const string &filename);
+
+    // Parses one line of an input data config file, returns false if it's not a sample:
+    static bool parseSampleLine(char const *pLine, char const *pLineEnd, string &pathPrefix, Sample &sample);
+    static bool parseSampleLine(const string &line, string &pathPrefix, Sample &sample);
+
     static vector<ImageReader *> imageReaders; // One for each supported image format
+    static bool decodeAllChannels;  // If true, image samples cache every channel the first time
+    static bool compactImageCache;  // If true, 8-bit images are cached as uint8_t, not float
     vector<Sample> samples;
+
+private:
+    std::shared_ptr<MappedFile> pPackedFile;   // Holds the data of packed samples
+};
+
+
+// The first bytes of a packed sample file, see SampleSet::savePackedSamples():
+//
+struct PackedSamplesHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t dtype;                  // dtypeFloat32LE or dtypeFloat32BE
+    uint32_t numSamples;
+    uint32_t channelMask;            // Bit (1 << channel) for each channel stored
+    uint32_t reserved;
+    uint64_t dataOffset;             // File offsets of the three blocks
+    uint64_t targetsOffset;
+    uint64_t namesOffset;
+};
+
+
+// A SampleStream is the alternative to a SampleSet for data sets that don't fit in
+// memory. It reads the samples of an input data config file or a packed sample file
+// a chunk of chunkSize samples at a time, and holds at most two windows of
+// windowChunks chunks: the one being trained on, and the next one, which is loaded
+// and decoded on a background thread meanwhile. If shuffle is true, each epoch visits
+// the chunks in a new random order, and the samples within each window are shuffled.
+//
+class SampleStream
+{
+public:
+    SampleStream(const string &filename, ColorChannel_t channel, uint32_t chunkSize,
+                 uint32_t windowChunks = 1, bool shuffle = true);
+    ~SampleStream(void);
+    SampleStream(SampleStream const &) = delete;
+    SampleStream &operator=(SampleStream const &) = delete;
+
+    uint64_t size(void) const { return numSamples; }
+    uint32_t next(Sample *&pSamples, uint32_t maxSamples); // Returns 0 at the end of each epoch
+
+    double stallSeconds = 0.0;   // Total time next() has waited for a window to load
+
+private:
+    string filename;
+    ColorChannel_t channel;      // Image data is decoded for this channel
+    uint32_t chunkSize;
+    uint32_t windowChunks;
+    bool shuffle;
+    uint64_t numSamples;
+    uint32_t numChunks;
+
+    vector<uint64_t> chunkOffsets;         // Input data config files: file offset of each chunk
+    vector<string> chunkPathPrefixes;      // and the path_prefix in effect there
+    std::shared_ptr<MappedFile> pPackedFile;  // Packed sample files
+    PackedSamplesHeader packedHeader;
+
+    vector<uint32_t> chunkOrder;           // This epoch's order of the chunks
+    uint32_t nextChunk;                    // Index into chunkOrder of the next chunk to load
+    std::future<vector<Sample>> pending;   // The next window, being loaded
+    bool pendingStartsEpoch;
+    bool epochEndReported = true;
+    vector<Sample> window;                 // The samples being handed out by next()
+    size_t windowPos = 0;
+
+    bool loadNextWindow(void);
+    void loadChunk(uint32_t chunkNum, vector<Sample> &samples) const;
+};
+
+
+// A SamplePrefetcher decodes the image data of the samples ahead of the ones being
+// trained on, using a pool of worker threads, so that the training thread doesn't
+// wait for image files. For each epoch, call start() with the samples in the order
+// they will be trained on, then call waitFor() before training on each batch. The
+// workers stay at most depth samples ahead of the first sample not yet trained on.
+// If keepCache is false, the image data of each sample is released once it has been
+// trained on, so that no more than about depth samples are decoded at a time.
+// Don't reorder the samples until finish() has returned.
+//
+class SamplePrefetcher
+{
+public:
+    SamplePrefetcher(uint32_t numWorkers, uint32_t depth);
+    ~SamplePrefetcher(void);
+    SamplePrefetcher(SamplePrefetcher const &) = delete;
+    SamplePrefetcher &operator=(SamplePrefetcher const &) = delete;
+
+    void start(Sample *pSamples, size_t numSamples, ColorChannel_t channel, bool keepCache = true,
+               uint32_t channelMask = 0);   // As in Sample::decode()
+    void waitFor(size_t first, size_t end); // Samples before first are done; waits for [first, end)
+    void finish(void);                      // Waits until the workers are idle
+
+    // Statistics, for all epochs so far:
+    uint32_t numWorkers(void) const { return (uint32_t)workers.size(); }
+    uint32_t depth;
+    double stallSeconds = 0.0;              // Total time waitFor() has waited
+    double averageQueueDepth(void) const;   // Decoded samples ready ahead of each batch
+    void reportStats(void) const;
+
+private:
+    vector<std::thread> workers;
+    std::mutex mutex;                       // Guards everything below
+    std::condition_variable workAvailable;
+    std::condition_variable sampleReady;
+    Sample *pSamples = nullptr;
+    size_t numSamples = 0;
+    ColorChannel_t channel = BW;
+    uint32_t channelMask = 0;
+    bool keepCache = true;
+    size_t nextToClaim = 0;                 // Next sample for a worker to decode
+    size_t claimLimit = 0;                  // Workers don't claim samples at or beyond this
+    size_t numInProgress = 0;
+    size_t readyPrefix = 0;                 // Samples [0, readyPrefix) are all decoded
+    size_t releasedUpTo = 0;                // For keepCache == false
+    vector<char> ready;
+    std::exception_ptr pError;
+    bool stopping = false;
+    double queueDepthSum = 0.0;
+    uint64_t numWaits = 0;
+
+    void workerLoop(void);
 };
 
 
 class Neuron;     // Forward references
-class Connection;
+class Layer;
 
 typedef vector<float> matColumn_t;
 typedef vector<matColumn_t> mat2D_t; // Allows access as mat[x][y]
 
 typedef float (*transferFunction_t)(float); // Also used for the derivative function
 
+// Batch forms of the transfer functions. The first applies the function in place
+// to n floats; the second multiplies n gradients by the derivative at each y:
+typedef void (*transferFunctionBatch_t)(float *x, uint32_t n);
+typedef void (*transferDerivativeBatch_t)(float const *y, float *gradients, uint32_t n);
+
 
 // This structure holds the information extracted from a single line in
 // the topology config file. The topology file parser creates one of these
@@ -294,6 +524,7 @@ struct topologyConfigSpec_t {
     bool isPoolingLayer;               // Equivalent to (poolSize.x != 0)
     dxySize size;                      // layer depth, X, Y dimensions
     ColorChannel_t channel;            // Applies only to the input layer
+    vector<ColorChannel_t> channels;   // Input layer only: the channel of each depth
     xySize radius;                     // Always used, so set high to fully connect layers
     string transferFunctionName;
 
@@ -308,6 +539,162 @@ struct topologyConfigSpec_t {
 
     vector<vector<float>> flatConvolveMatrix;  // Inner index = x*szY + y
     xySize kernelSize;                 // Used only for convolution layers
+    convolveMethod_t convolveMethod;   // Used only for convolution layers
+};
+
+
+// A Projection holds the weighted connections created by one "from" clause of a
+// regular layer. Instead of one Connection record per weight, the weights are
+// stored by rows, with one row per destination neuron (flattened [depth][i]) and
+// the row's weights contiguous in memory, so that feed forward and backprop can
+// run as matrix-vector loops. Source neurons are numbered [depth][i] as well.
+//
+// If the layer's radius covers the whole source layer, the weights form a dense
+// row-major matrix with numColumns weights per row. Each row reads all depths of
+// the source layer, or only the matching depth if both layers have the same depth.
+//
+// Otherwise the weights are stored in compressed sparse row (CSR) form: the weights
+// of row r are weights[rowOffsets[r]] through weights[rowOffsets[r+1] - 1], and
+// columnIndices[] holds the number of the source neuron for each weight. Within a
+// row, the weights are in the same order that the file format uses.
+//
+// The rows read the source layer's .outputs container directly and add their
+// share of the backpropagated gradients directly to its .gradients container.
+//
+// For mini-batch training (see Net::batchSize), a dense Projection saves the inputs
+// and gradients of each sample in the batch, then computes the weight gradients of
+// the whole batch with one matrix-matrix product. A sparse Projection adds each
+// sample's weight gradients to weightGradients as it goes.
+//
+struct Projection {
+    Layer *pFromLayer;
+    bool sameDepth;              // Destination depth d reads only source depth d
+    uint32_t numRows;            // Number of destination neurons, all depths
+    uint32_t numColumns;         // Dense only: number of source neurons read by each row
+    vector<uint32_t> rowOffsets;    // Sparse only: numRows + 1 offsets into weights[]
+    vector<uint32_t> columnIndices; // Sparse only: source neuron for each weight
+    vector<float> weights;       // Dense: weights[row * numColumns + column]
+    vector<float> deltaWeights;  // The weight changes from the previous training iteration
+
+    uint32_t batchCapacity = 0;    // Number of samples in the current mini-batch
+    vector<float> batchInputs;     // Dense only: source outputs, [column group][sample][column]
+    vector<float> batchGradients;  // Dense only: destination gradients, [row][sample]
+    vector<float> weightGradients; // Summed over the batch, same layout as weights
+
+    bool isSparse(void) const { return !rowOffsets.empty(); }
+    uint32_t rowLength(uint32_t row) const;
+    float weightedSum(uint32_t row) const;                // Row times the source outputs
+    void addWeightedSumsBatch(uint32_t rowBegin, uint32_t rowEnd, uint32_t numSamples,
+                              float *pDest, uint32_t destStride) const; // The same for Layer::batchOutputs
+    void addToSourceGradients(uint32_t row, float gradient) const;
+    void updateRowWeights(uint32_t row, float etaGradient, float alpha);
+    void beginBatch(uint32_t numSamples);
+    void accumulateBatchGradients(uint32_t sampleNum, vector<float> const &rowGradients);
+    void updateWeightsFromBatch(float eta, float alpha, uint32_t batchCount);
+    void gatherBatchGradients(Projection const &replica, uint32_t firstSampleNum);
+    void saveRowWeights(std::ofstream &file, uint32_t row) const;
+    void loadRowWeights(std::ifstream &file, uint32_t row);
+
+    // Set by Net::quantize(). A weight is approximately quantizedWeights[i] * rowScales[row]
+    // and a source output is approximately quantizedInputs[n] * inputScale:
+    vector<int8_t> quantizedWeights; // Same layout as weights
+    vector<float> rowScales;         // One per row; all equal for QUANTIZE_PER_LAYER
+    float inputScale = 1.0f;         // From the largest source output seen in calibration
+    vector<int8_t> quantizedInputs;  // The source outputs of the current sample
+    void quantizeWeights(float layerMaxWeight);      // layerMaxWeight is zero for QUANTIZE_PER_NEURON
+    void quantizeInputs(void);                       // From the source layer's outputs
+    float weightedSumQuantized(uint32_t row) const;  // Integer dot product, then dequantized
+
+private:
+    uint32_t firstDenseColumn(uint32_t row) const; // First source neuron read by a dense row
+    uint32_t numColumnGroups(void) const;          // Dense only: number of distinct firstDenseColumn()s
+};
+
+
+// A WindowedSource describes how a convolution or pooling layer reads one of its
+// source layers. Each destination neuron reads a windowSize rectangle of source
+// neurons centered over the source neuron nearest the destination neuron. The parts
+// of the window that fall outside the source layer are skipped, which is the same as
+// zero padding for convolution. Because the window depends only on the destination
+// X and Y, we store just the window origins instead of a list of source neurons.
+//
+struct WindowedSource {
+    Layer *pFromLayer;
+    bool sameDepth;                // Destination depth d reads only source depth d
+    xySize windowSize;             // Equals the layer's kernelSize or poolSize
+    vector<int32_t> windowStartX;  // Per destination X, can be negative at the edges
+    vector<int32_t> windowStartY;  // Per destination Y, can be negative at the edges
+
+    // Returns the range [begin, end) of kernel X or Y offsets that are inside the source layer:
+    void kernelRangeX(uint32_t destX, uint32_t &begin, uint32_t &end) const;
+    void kernelRangeY(uint32_t destY, uint32_t &begin, uint32_t &end) const;
+};
+
+
+// ***********************************  class Philox  ***********************************
+
+// A counter-based random number generator, Philox4x32-10 from Salmon et al., "Parallel
+// Random Numbers: As Easy as 1, 2, 3" (SC11). Each number is a pure function of the
+// seed, a stream number, and the number's index in the stream, so any thread can
+// generate any part of a stream and get the same numbers regardless of how the work
+// is divided among threads, or on which platform:
+//
+class Philox
+{
+public:
+    Philox(uint64_t seed, uint64_t stream);
+    float uniform(uint64_t index) const;                              // In [0.0..1.0)
+    void uniform(uint64_t firstIndex, float *pDest, size_t count) const; // Same as count calls of uniform()
+
+    // Applies the Philox4x32-10 bijection to one 128-bit counter:
+    static void block(uint32_t ctr[4], uint32_t const key[2]);
+
+private:
+    uint32_t key[2];
+    uint32_t streamLo, streamHi;
+};
+
+
+// ***********************************  class ThreadPool  ***********************************
+
+// A ThreadPool runs the loops of one layer on several threads. The threads are created
+// once and sleep between jobs. parallelFor() divides a range of items into tasks and
+// deals them out to per-thread queues in contiguous blocks; each thread takes tasks
+// from the front of its own queue, and when that runs dry, steals from the back of
+// the others' queues. The calling thread works too, then waits for the stragglers.
+// Only one thread at a time may call parallelFor().
+//
+class ThreadPool
+{
+public:
+    explicit ThreadPool(uint32_t numThreads);  // Including the calling thread
+    ~ThreadPool(void);
+    uint32_t size(void) const { return (uint32_t)queues.size(); }
+
+    // Calls fn(begin, end) for consecutive ranges of about grainSize items that together
+    // cover [0, numItems), and returns when they're all done:
+    void parallelFor(uint32_t numItems, uint32_t grainSize, std::function<void(uint32_t, uint32_t)> const &fn);
+
+private:
+    struct Task { uint32_t begin, end; };
+    struct TaskQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    vector<std::unique_ptr<TaskQueue>> queues;  // queues[0] belongs to the calling thread
+    vector<std::thread> threads;
+    std::function<void(uint32_t, uint32_t)> const *pJob;
+    std::atomic<uint32_t> numTasksRemaining;
+    std::mutex jobMutex;                        // Guards pJob, jobNumber, and stopping
+    std::condition_variable jobStarted;
+    std::condition_variable jobFinished;
+    uint64_t jobNumber;
+    bool stopping;
+
+    void workerLoop(uint32_t queueNum);
+    void runTasks(uint32_t queueNum);
+    bool takeTask(uint32_t queueNum, Task &task);
 };
 
 
@@ -320,44 +707,105 @@ class Layer
 {
 public: // New
     Layer(const topologyConfigSpec_t &params);
-    vector<vector<Neuron>> neurons;    // neurons[depth][i], where i = flattened 2D index
+    vector<vector<Neuron>> neurons;    // neurons[depth][i], where i = flattened 2D index; empty if inferenceOnly
+
+    // The outputs and gradients of all the neurons, flattened [depth][i]. The hot loops
+    // work on these containers directly; each Neuron object refers to its own elements:
+    vector<float> outputs;
+    vector<float> gradients;
+
     string layerName;                  // Can be input, output, or layer*
     dxySize size;                      // layer depth, X, Y dimensions (number of neurons)
     bool isRegularLayer;
     bool isConvolutionFilterLayer;     // Equivalent to (convolveMatrix.size() == 1)
     bool isConvolutionNetworkLayer;    // Equivalent to (convolveMatrix.size() > 1)
     bool isPoolingLayer;               // Equivalent to (poolSize.x != 0)
-    ColorChannel_t channel;            // Applies only to the input layer
+    ColorChannel_t channel;            // Applies only to the input layer, same as channels[0]
+    vector<ColorChannel_t> channels;   // Input layer only: the channel of each depth
     xySize radius;                     // Always used in regular layers, so set high to fully connect layers
     transferFunction_t tf;             // Ignored by convolution filter layers
     transferFunction_t tfDerivative;   // Ignored by convolution filter layers
-    vector<Connection> *pConnections;  // Pointer to the container of all Connection records
+    transferFunctionBatch_t tfBatch;   // Same as tf, applied to a whole array
+    transferDerivativeBatch_t tfDerivativeBatch;           // Same as tfDerivative
+    transferDerivativeBatch_t tfDerivativeFromOutputBatch; // The derivative expressed in terms of tf's output
+    bool tfDerivativeFromOutput;       // Copied from Net::tfDerivativeFromOutput
+    bool inferenceOnly = false;        // Copied from Net::inferenceOnly, see releaseTrainingState()
+    bool quantized = false;            // Regular layers: set by Net::quantize()
     uint32_t totalNumberBackConnections;
     bool projectRectangular = false;   // Defines shape when radius parameter is used
 
+    // Regular layers keep their weights in Projections, one Projection per source
+    // layer, plus one bias weight per neuron:
+    vector<Projection> projections;
+    vector<float> biasWeights;         // Flattened [depth][i]
+    vector<float> biasDeltaWeights;
+    vector<float> biasGradients;       // Summed over the current mini-batch
+
+    // Convolution and pooling layers read their source layers through sliding
+    // windows, one WindowedSource per source layer:
+    vector<WindowedSource> windowedSources;
+
+    // Number of Projection rows and convolution windows that read each neuron of this
+    // layer, flattened [depth][i]:
+    vector<uint32_t> fanOut;
+
     // In these containers, the size of the outer container equals the layer depth,
     // and the inner container contains the convolution kernel flattened into a 1D array:
     vector<vector<float>> flatConvolveMatrix;  // Inner index = x*szY + y
     vector<vector<float>> flatConvolveGradients;
     vector<vector<float>> flatDeltaWeights;
     xySize kernelSize;                 // Used only for convolution layers
+    convolveMethod_t convolveMethod;   // Used only for convolution layers, can be changed any time
 
     enum poolMethod_t poolMethod;      // Used only for pooling layers
     xySize poolSize;                   // Used only for pooling layers
 
+    // Initial outputs and weights come from Philox streams keyed by Net::randomSeed,
+    // with a separate stream for each layer and kind of value:
+    uint64_t randomSeed = 1;
+    uint32_t layerNumber = 0;          // Index in Net::layers
+    enum randomStream_t { RANDOM_OUTPUTS, RANDOM_BIAS, RANDOM_KERNELS, RANDOM_PROJECTIONS };
+    Philox randomStream(uint32_t kind) const; // RANDOM_PROJECTIONS + n for the nth Projection
+
+    void createNeurons(void);
     static void clipToBounds(int32_t &xmin, int32_t &xmax, int32_t &ymin, int32_t &ymax, dxySize &size);
     virtual void saveWeights(std::ofstream &);
     virtual void loadWeights(std::ifstream &);
+    bool coversWholeLayer(dxySize const &fromSize) const;
     void connectLayers(Layer &layerFrom);
-    void connectOneNeuronAllDepths(Layer &fromLayer, Neuron &toNeuron,
-                uint32_t destDepth, uint32_t destX, uint32_t destY);
-    void connectBiasToAllNeuronsAllDepths(Neuron &bias);
+    void connectLayersDense(Layer &layerFrom);
+    void connectLayersSparse(Layer &layerFrom);
+    void connectLayersWindowed(Layer &layerFrom);
+    void initBiasWeights(void);
+    virtual void releaseTrainingState(void); // Frees everything that only backprop uses
     void resolveTransferFunctionName(string const &transferFunctionName);
+    uint32_t numBackConnections(uint32_t depth, uint32_t i) const;    // Including the bias input
+    uint32_t numForwardConnections(uint32_t depth, uint32_t i) const;
     virtual void debugShow(bool details);
+    void applyTfDerivative(void);      // Multiplies all the gradients by the derivative at the outputs
     virtual void calcGradients(const vector<float> &targetVals);
     virtual void updateWeights(float eta, float alpha);
+    virtual void beginBatch(uint32_t numSamples);
+    virtual void accumulateBatchGradients(uint32_t sampleNum);
+    virtual void updateWeightsFromBatch(float eta, float alpha, uint32_t batchCount);
+    virtual void gatherBatchGradients(Layer &replica, uint32_t firstSampleNum);
+    void copyWeightsFrom(Layer const &layer);  // From the same layer of another instance of the net
     virtual void feedForward() = 0;
 
+    // Net::feedForwardBatch() keeps the outputs of a block of samples here, flattened
+    // [neuron][sample] with batchStride elements per neuron, so that the values of one
+    // neuron for all the samples are contiguous:
+    vector<float> batchOutputs;
+    uint32_t batchStride = 0;
+    virtual void feedForwardBatch(uint32_t numSamples);
+
+    // Set by the Net if it has a thread pool. parallelFor() uses the pool for loops
+    // with at least minParallelWork multiply-adds in total:
+    ThreadPool *pThreadPool = nullptr;
+    static const uint32_t minParallelWork = 1 << 16;
+    void parallelFor(uint32_t numItems, uint32_t workPerItem, std::function<void(uint32_t, uint32_t)> const &fn) const;
+    uint32_t windowInputsPerNeuron(void) const; // Convolution and pooling: window size times source depths
+
 #if defined(ENABLE_WEBSERVER) && !defined(DISABLE_WEBSERVER)
     virtual std::string visualizationsAvailable(void); // Creates options for the drop-down menu in the GUI
     virtual string visualizeKernels(void); // Create a base64-encoded BMP image
@@ -370,24 +818,49 @@ class LayerRegular : public Layer
 public:
     LayerRegular(const topologyConfigSpec_t &params);
     void feedForward();
+    void feedForwardBatch(uint32_t numSamples);
+    void feedForwardQuantized(void);
     void saveWeights(std::ofstream &);
     void loadWeights(std::ifstream &);
+    void calcGradients(const vector<float> &targetVals);
     void updateWeights(float eta, float alpha);
+    void beginBatch(uint32_t numSamples);
+    void accumulateBatchGradients(uint32_t sampleNum);
+    void updateWeightsFromBatch(float eta, float alpha, uint32_t batchCount);
+    void gatherBatchGradients(Layer &replica, uint32_t firstSampleNum);
     void debugShow(bool details);
 #if defined(ENABLE_WEBSERVER) && !defined(DISABLE_WEBSERVER)
     string visualizationsAvailable(void);
 #endif
 };
 
+// A convolution layer computes its outputs in one of two ways, selected by the
+// layer's convolveMethod: CONVOLVE_DIRECT slides each neuron's window over the source
+// layers; CONVOLVE_GEMM first copies the windows into the columns of a matrix (im2col)
+// so that all the kernels can be applied with one matrix multiplication. The results
+// are the same except for floating point rounding.
+//
 class LayerConvolution : public Layer
 {
 public:
     LayerConvolution(const topologyConfigSpec_t &params);
     void feedForward();
+    void calcGradients(const vector<float> &targetVals);
 #if defined(ENABLE_WEBSERVER) && !defined(DISABLE_WEBSERVER)
     string visualizationsAvailable(void);
     string visualizeKernels(void);
 #endif
+
+private:
+    // For CONVOLVE_GEMM. Each depth plane of the layer needs its own matrix of window
+    // columns if any source layer is read depth by depth; otherwise all depths share one:
+    vector<float> windowColumns;       // [group][kernel element][neuron in plane]
+    vector<float> columnGradients;     // [kernel element][neuron in plane]
+    vector<float> kernelMatrix;        // [depth][kernel element], or its transpose
+    uint32_t numColumnGroups(void) const;
+    void lowerWindowsToColumns(void);
+    void feedForwardGemm(void);
+    void propagateGradientsGemm(void);
 };
 
 class LayerConvolutionFilter : public LayerConvolution
@@ -401,96 +874,76 @@ class LayerConvolutionNetwork : public LayerConvolution
 {
 public:
     LayerConvolutionNetwork(const topologyConfigSpec_t &params);
-    void calcGradients(const vector<float> &targetVals);
     void updateWeights(float eta, float alpha);
+    void updateWeightsFromBatch(float eta, float alpha, uint32_t batchCount);
+    void gatherBatchGradients(Layer &replica, uint32_t firstSampleNum);
     void saveWeights(std::ofstream &);
     void loadWeights(std::ifstream &);
     void debugShow(bool details);
 };
 
+// A pooling layer remembers during feedForward() which source neurons determined each
+// output, so that calcGradients() can route each gradient straight back to them:
+// for max pooling, the source neuron with the maximum output; for average pooling,
+// the number of source neurons averaged (the window itself follows from the geometry).
+//
 class LayerPooling : public Layer
 {
 public:
     LayerPooling(const topologyConfigSpec_t &params);
     void feedForward();
-    void updateWeights(float eta, float alpha);
+    void calcGradients(const vector<float> &targetVals);
+    void releaseTrainingState(void);
     void debugShow(bool details);
 #if defined(ENABLE_WEBSERVER) && !defined(DISABLE_WEBSERVER)
     string visualizationsAvailable(void);
 #endif
-};
-
 
-// ***********************************  class Connection  ***********************************
-
-
-// If neurons are considered as nodes in a directed graph, the edges would be the
-// "connections". Each connection goes from one neuron to any other neuron in any
-// layer. Connections are analogous to synapses in natural biology. The .weight
-// member is what it's all about -- once a net is trained, we only need to save
-// the weights of all the connections. The set of all weights plus the network
-// topology defines the neural net's function. The .deltaWeight member is used
-// only for the momentum calculation. For convolution layers, the weights are
-// stored in the Layer class, not here.
-//
-class Connection
-{
-public:
-    Connection(Neuron &from, Neuron &to);
-    Neuron &fromNeuron;
-    Neuron &toNeuron;
-    float weight;       // Used only by regular neuron layers
-    float deltaWeight;  // The weight change from the previous training iteration
-
-    // Used only by convolution layers, this is an index into the flattened convolve
-    // matrix container and the associated gradient container:
-    int convolveMatrixIndex;
+    // These are flattened [depth][i] like the outputs, or empty if inferenceOnly:
+    vector<uint32_t> argmaxSource;     // Max pooling: index into windowedSources
+    vector<uint32_t> argmaxIndex;      // Max pooling: index into that layer's outputs
+    vector<uint32_t> numPoolInputs;    // Average pooling: number of source neurons averaged
 };
 
 
 // ***********************************  class Neuron  ***********************************
 
 
+// A Neuron is a view of one element of its layer's .outputs and .gradients containers.
+// The layers do the feed forward, backprop, and weight updates for all their neurons
+// at once.
+//
 class Neuron
 {
 public:
-    Neuron();
-    float output;
-    float gradient;
-
-    // All the input and output connections for this neuron. We store these as indices
-    // into an array of Connection objects stored somewhere else. We store indices
-    // instead of pointers or iterators because the container of Connection objects
-    // can get reallocated which would invalidate the references. Currently the connections
-    // container is a public data member of class Net, but it could be stored anywhere that
-    // is accessible.
-
-    vector<uint32_t> backConnectionsIndices;    // My back connections
-    vector<uint32_t> forwardConnectionsIndices; // My forward connections
-
-    void feedForward(Layer *pMyLayer);          // Propagate the net inputs to the outputs
-    void feedForwardConvolution(uint32_t depth, Layer *pMyLayer); // Special for conv. network layers
-    void feedForwardPooling(Layer *pMyLayer);   // Special for pooling layers
-    void updateInputWeights(float eta, float alpha, vector<Connection> *pConnections); // For backprop training
-    void updateInputWeightsConvolution(uint32_t depth, float eta, float alpha, Layer &myLayer);
-    void calcOutputGradients(float targetVal, transferFunction_t tfDerivative); // For backprop training
-    void calcHiddenGradients(Layer &myLayer);   // For backprop training
-    void calcHiddenGradientsConvolution(uint32_t depth, Layer &myLayer); // Special for convolution network layers
-
-    // The only reason for the .sourceNeurons member is to make it easy to
-    // find and report any unconnected neurons. For everything else, we'll use
-    // the backConnectionIndices to find the neuron's inputs. This container
-    // holds pointers to all the source neurons that feed this neuron:
-    std::set<Neuron *> sourceNeurons;
-
-private:
-    float sumDOW_nextLayer(vector<Connection> *pConnections) const; // Used in hidden layer backprop training
+    Neuron(float &output, float &gradient);
+    float &output;
+    float &gradient;
 };
 
 
 // ***********************************  class Net  ***********************************
 
 
+// Returned by Net::validateQuantization(). The accuracies count a sample as correct
+// when its largest output belongs to a positive target value, the same test that
+// Net::reportResults() uses; they and the errors cover only the samples with target
+// values:
+//
+struct QuantizationReport {
+    uint32_t numSamples = 0;
+    uint32_t numWithTargets = 0;
+    float floatAccuracy = 0.0f;        // Fraction correct with the float weights
+    float quantizedAccuracy = 0.0f;    // Fraction correct with the 8-bit weights
+    float floatError = 0.0f;           // Average of Net::error with the float weights
+    float quantizedError = 0.0f;       // The same with the 8-bit weights
+    float agreement = 0.0f;            // Fraction of all samples with the same largest output
+    float maxOutputDifference = 0.0f;  // Over all the output neurons of all the samples
+    uint64_t floatWeightBytes = 0;     // Weights of the quantized layers, without biases
+    uint64_t quantizedWeightBytes = 0;
+};
+
+
 class Net
 {
 public: // This public section exposes the complete public API for class Net
@@ -499,12 +952,23 @@ public: // This public section exposes the complete public API for class Net
     // directly accessing the data members:
 
     bool enableBackPropTraining; // If false, backProp() won't update any weights
+
+    // If true, configureNetwork() allocates only what feedForward() needs: no neuron
+    // gradients, weight changes, or mini-batch buffers. Such a net can't be trained,
+    // so enableBackPropTraining is cleared. Set this on an empty net before calling
+    // loadTopology():
+    bool inferenceOnly;
     float doneErrorThreshold;    // Pause when overall avg error falls below this
     float eta;                   // Initial overall net learning rate, [0.0..1.0]
     bool dynamicEtaAdjust;       // true enables automatic eta adjustment during training
     float alpha;                 // Initial momentum, multiplier of last deltaWeight, [0.0..1.0]
     float lambda;                // Regularization parameter. If zero, regularization is disabled:
+    uint32_t batchSize;          // Number of samples per weight update, see backProp()
+    uint32_t numTrainingThreads; // Number of threads that share each batch, see trainBatch()
+    uint32_t numLayerThreads;    // Number of threads that share each layer's feed forward loops
+    uint64_t randomSeed;         // Keys the initial weights, see configureNetwork()
     string weightsFilename;      // Filename to use in saveWeights() and loadWeights()
+    weightsFormat_t weightsFormat; // Format written by saveWeights(filename)
     float error;                 // Overall net error
     float recentAverageError;    // Averaged over recentAverageSmoothingFactor samples
 
@@ -514,6 +978,13 @@ public: // This public section exposes the complete public API for class Net
     // rectangular. The default is elliptical (false).
     bool projectRectangular;
 
+    // During backprop, the gradients are multiplied by the derivative of the transfer
+    // function. If false (the default), the derivative function is evaluated at each
+    // neuron's output. If true, the derivative is computed directly from the output,
+    // e.g. 1 - y^2 for tanh, which is the true derivative and is cheaper. The gaussian
+    // transfer function can't be inverted and always uses the default behavior.
+    bool tfDerivativeFromOutput;
+
     bool isRunning;     // If true, start processing without waiting for a "resume" command
 
     // To reduce screen clutter during training, reportEveryNth can be set > 1. When
@@ -538,16 +1009,47 @@ public: // This public section exposes the complete public API for class Net
     //
     Net(const string &topologyFilename, bool webserverEnabled = true); // ctor
     ~Net(void);
+    void loadTopology(const string &filename);    // Topology config file or model file, as in the ctor
 
     void feedForward(void);                       // Propagate inputs to outputs
     void feedForward(Sample &sample);
+
+    // Runs numSamples input vectors through the net and writes their outputs, without
+    // reporting, error calculation, or polling the GUI. The inputs are numSamples
+    // consecutive vectors of input layer values, flattened [depth][i]; the outputs are
+    // written as numSamples consecutive vectors of output layer values:
+    void feedForwardBatch(float const *inputs, uint32_t numSamples, float *outputs);
+    static const uint32_t inferenceBlockSize = 32; // Samples per pass through the layers
+
+    // For deploying a trained net: converts the weights of the regular layers to 8-bit
+    // integers, with one scale per neuron or per layer, and the outputs they read to
+    // 8-bit integers scaled by the largest values seen while feeding the calibration
+    // samples forward. After that, feedForward() sums integer products and converts
+    // each sum back to float before the transfer function. Convolution and pooling
+    // layers are unchanged. A quantized net can't be trained or load weights. In an
+    // inferenceOnly net, the float weights of the quantized layers are freed, so the
+    // weights can't be saved either:
+    void quantize(SampleSet &calibrationSet, quantizeGranularity_t granularity = QUANTIZE_PER_NEURON);
+    bool isQuantized(void) const { return quantized; }
+    QuantizationReport validateQuantization(SampleSet &validationSet); // Needs the float weights
     void backProp(const Sample &sample);          // Backprop and update all weights
+    void flushBatch(void);                        // Apply a partial mini-batch now
+    void trainBatch(Sample *pSamples, uint32_t numSamples); // Train, report, and update once
 
     // The connection weights can be saved or restored at any time. Note that the network
     // topology is not saved in the weights file, so you'll have to manually keep track of
-    // which weights file goes with which topology file.
+    // which weights file goes with which topology file. A binary weights file records a
+    // fingerprint of the topology, so loading it into a different topology fails.
     bool saveWeights(const string &filename) const;
-    bool loadWeights(const string &filename);
+    bool saveWeights(const string &filename, weightsFormat_t format) const;
+    bool loadWeights(const string &filename);      // Either format
+    uint64_t topologyFingerprint(void) const;      // Same for nets with the same weights layout
+    uint32_t inputChannelMask(void) const;         // Bit (1 << channel) for each input layer channel
+
+    // A model file holds both the topology and the weights. To use it, pass its
+    // filename to the ctor in place of a topology config file:
+    bool saveModel(const string &filename) const;
+    static bool isModelFile(const string &filename);
 
     // Functions useful after forward propagation:
     float getNetError(void) const { return error; };
@@ -565,16 +1067,12 @@ public: // These members are public only for convenience of unit testing:
 
     static const uint32_t HUGE_RADIUS = (uint32_t)1e9; // Magic value
 
-    // Here is where we store all the weighted connections. The container can get
-    // reallocated, so we'll only refer to elements by indices, not by pointers or
-    // references.
-    vector<Connection> connections;
-
     vector<std::unique_ptr<Layer>> layers; // Polymorphic
 
-    Neuron bias;  // Fake neuron with constant output 1.0
     float lastRecentAverageError;    // Used for dynamically adjusting eta
-    uint32_t totalNumberBackConnections; // Including 1 bias connection per neuron
+    uint32_t batchCount;             // Number of samples accumulated in the current mini-batch
+    uint32_t batchCapacity;          // batchSize when the current mini-batch began
+    uint32_t totalNumberBackConnections; // Including 1 bias weight per neuron
     uint32_t totalNumberNeurons;
     vector<topologyConfigSpec_t> parseTopologyConfig(std::istream &cfg);
     void configureNetwork(vector<topologyConfigSpec_t> configSpecs, const string configFilename = "");
@@ -582,6 +1080,21 @@ public: // These members are public only for convenience of unit testing:
     float adjustedEta(void);
 
 private:
+    vector<topologyConfigSpec_t> topologySpecs; // Saved by configureNetwork() for creating replicas
+    vector<std::unique_ptr<Net>> replicas;      // One per training thread, see trainBatch()
+    std::unique_ptr<ThreadPool> pThreadPool;    // Has numLayerThreads threads, if more than one
+    bool quantized;                             // See quantize()
+
+    void updateThreadPool(void);                // Creates or resizes the pool if needed
+    void saveWeightsBinary(std::ofstream &file) const;
+    void loadWeightsBinary(char const *data, uint64_t numBytes, const string &filename);
+    void loadModel(const string &filename);     // Called by the ctor for model files
+
+    void calcGradients(const Sample &sample);   // The first half of backProp()
+    void checkTrainable(void) const;            // Throws if inferenceOnly or quantized
+    void checkFloatWeights(void) const;         // Throws if quantize() freed the float weights
+    void setInputs(Sample &sample);             // Copies a sample to the input layer
+    void feedForwardLayers(Sample &sample);     // Without the bookkeeping of feedForward()
     void parseConfigFile(const string &configFilename); // Creates layer metadata from a config file
     Layer &createLayer(const topologyConfigSpec_t &params);
     bool addConnectionsToLayer(Layer &layerTo, Layer &layerFrom);
@@ -604,6 +1117,7 @@ private:
 
 extern uint32_t flattenXY(uint32_t x, uint32_t y, uint32_t ySize);
 extern uint32_t flattenXY(uint32_t x, uint32_t y, dxySize size);
+extern uint32_t bitCount(uint32_t bits);
 
 } // end namespace NNet
 
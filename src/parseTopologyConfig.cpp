@@ -38,6 +38,7 @@ topologyConfigSpec_t::topologyConfigSpec_t(void)
     kernelSize.x = kernelSize.y = 0;    // Used only for convolution filter and conv. network layers
     poolSize.x = poolSize.y = 0;        // Used only for convolution network layers
     poolMethod = POOL_NONE;
+    convolveMethod = CONVOLVE_DIRECT;
 }
 
 
@@ -225,20 +226,36 @@ xySize extractXySize(std::istringstream &ss)
 }
 
 
+// format: channel-name [ , channel-name ... ] | RGB
+// A multi-depth input layer takes one channel per depth.
 // Throws for any error.
 //
 void extractChannel(topologyConfigSpec_t &params, std::istringstream &ss)
 {
     string stoken;
     ss >> stoken;
-    if      (stoken == "R")  params.channel = NNet::R;
-    else if (stoken == "G")  params.channel = NNet::G;
-    else if (stoken == "B")  params.channel = NNet::B;
-    else if (stoken == "BW") params.channel = NNet::BW;
-    else {
+    if (stoken == "RGB") {
+        stoken = "R,G,B";
+    }
+
+    params.channels.clear();
+    std::istringstream channelList(stoken);
+    string channelName;
+    while (getline(channelList, channelName, ',')) {
+        if      (channelName == "R")  params.channels.push_back(NNet::R);
+        else if (channelName == "G")  params.channels.push_back(NNet::G);
+        else if (channelName == "B")  params.channels.push_back(NNet::B);
+        else if (channelName == "BW") params.channels.push_back(NNet::BW);
+        else {
+            configErrorThrow(params, "Unknown color channel");
+        }
+    }
+
+    if (params.channels.empty()) {
         configErrorThrow(params, "Unknown color channel");
     }
 
+    params.channel = params.channels[0];
     params.colorChannelSpecified = true;
 }
 
@@ -261,6 +278,29 @@ void extractPoolMethod(topologyConfigSpec_t &params, std::istringstream &ss)
 }
 
 
+// An optional method can follow the convolve parameter. If the next token is not a
+// method name, it is left in the stream:
+//
+void extractConvolveMethod(topologyConfigSpec_t &params, std::istringstream &ss)
+{
+    string stoken;
+    auto pos = ss.tellg();
+    if ((long)pos == -1L) {
+        return; // Nothing follows the convolve parameter
+    }
+
+    ss >> stoken;
+    if (stoken == "direct") {
+        params.convolveMethod = CONVOLVE_DIRECT;
+    } else if (stoken == "gemm") {
+        params.convolveMethod = CONVOLVE_GEMM;
+    } else {
+        ss.clear();
+        ss.seekg(pos);   // Put back what is not ours
+    }
+}
+
+
 // Topology config grammar:
 //
 // layer-name parameters
@@ -269,11 +309,11 @@ void extractPoolMethod(topologyConfigSpec_t &params, std::istringstream &ss)
 //    input | output | layer-name
 //    size dxy-spec
 //    from layer-name
-//    channel channel-spec
+//    channel channel-spec [ , channel-spec ... ]
 //    radius xy-spec
 //    tf transfer-function-spec
-//    convolve filter-spec
-//    convolve xy-spec
+//    convolve filter-spec [ direct | gemm ]
+//    convolve xy-spec [ direct | gemm ]
 //    pool { max | avg } xy-spec
 // dxy-spec := integer * xy-spec
 // xy-spec := integer [ x integer ]
@@ -331,12 +371,12 @@ bool extractOneLayerParams(topologyConfigSpec_t &params, const string &line)
                 extractConvolveFilterMatrix(params, ss); // Allocates and initializes the matrix
                 params.isConvolutionFilterLayer = true;
             } else {
-                extern float randomFloat(void);
                 // Convolution network layer  expects: kernel size to be defined
                 ss.seekg(pos);
                 params.kernelSize = extractXySize(ss);
                 params.isConvolutionNetworkLayer = true;
             }
+            extractConvolveMethod(params, ss);
         } else if (stoken == "pool") {
             extractPoolMethod(params, ss);
             params.poolSize = extractXySize(ss);
@@ -391,6 +431,24 @@ void consistency(vector<topologyConfigSpec_t> &params)
         throw exceptionConfigFile();
     }
 
+    // An input layer of depth 3 or 4 defaults to the channels R,G,B or R,G,B,BW.
+    // Otherwise there must be one channel per depth:
+
+    auto &inputSpec = params[0];
+    if (!inputSpec.colorChannelSpecified && inputSpec.size.depth == 3) {
+        inputSpec.channels = { NNet::R, NNet::G, NNet::B };
+    } else if (!inputSpec.colorChannelSpecified && inputSpec.size.depth == 4) {
+        inputSpec.channels = { NNet::R, NNet::G, NNet::B, NNet::BW };
+    } else if (inputSpec.channels.empty()) {
+        inputSpec.channels = { inputSpec.channel };
+    }
+    inputSpec.channel = inputSpec.channels[0];
+
+    if (inputSpec.channels.size() != inputSpec.size.depth) {
+        err << "Input layer depth " << inputSpec.size.depth << " needs a channel for each depth" << endl;
+        throw exceptionConfigFile();
+    }
+
     // In common to hidden layer and output layer specs:
 
     for (auto it = params.begin() + 1; it != params.end(); ++it) {
@@ -467,14 +525,11 @@ void consistency(vector<topologyConfigSpec_t> &params)
             }
         }
 
-        // Initialize convolution network kernels if needed: Construct a matrix of the
-        // correct size, and make depth copies
+        // Allocate convolution network kernels if needed: Construct a matrix of the
+        // correct size, and make depth copies. Net::configureNetwork() initializes the
+        // weights:
         if (spec.isConvolutionNetworkLayer) {
-            extern float randomFloat();
-            vector<float> flatMatrix(spec.kernelSize.x * spec.kernelSize.y);
-            std::for_each(flatMatrix.begin(), flatMatrix.end(), [](float &w) {
-                w = randomFloat() / 100.0f; // Do something more intelligent here
-            });
+            vector<float> flatMatrix(spec.kernelSize.x * spec.kernelSize.y, 0.0f);
             spec.flatConvolveMatrix.assign(spec.size.depth, flatMatrix);
         }
     }
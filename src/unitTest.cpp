@@ -90,9 +90,12 @@ extern float pixelToNetworkInputRange(unsigned val);
 //
 void setAllWeights(Net &myNet, float w)
 {
-    // For regular connections:
-    for (auto &conn : myNet.connections) {
-        conn.weight = w;
+    // For regular layers, including their bias inputs:
+    for (auto &pLayer : myNet.layers) {
+        for (auto &proj : pLayer->projections) {
+            std::fill(proj.weights.begin(), proj.weights.end(), w);
+        }
+        std::fill(pLayer->biasWeights.begin(), pLayer->biasWeights.end(), w);
     }
 
     // The convolution kernel elements are weights too for testing purposes:
@@ -705,22 +708,20 @@ void unitTestNet()
         myNet.configureNetwork(myNet.parseTopologyConfig(ss));
 
         ASSERT_FEQ(myNet.alpha, 0.1f);
-        ASSERT_EQ(myNet.bias.output, 1.0);
         ASSERT_EQ(myNet.layers.size(), 2);
         ASSERT_EQ(myNet.layers[0]->neurons.size(), 1); // depth = 1
         ASSERT_EQ(myNet.layers[0]->neurons[0].size(), 1);
         ASSERT_EQ(myNet.layers[1]->neurons.size(), 1); // depth = 1
         ASSERT_EQ(myNet.layers[1]->neurons[0].size(), 1);
 
-        const Neuron *pNeuron = &myNet.layers[0]->neurons[0][0];
-        ASSERT_EQ(pNeuron->forwardConnectionsIndices.size(), 1);
-        ASSERT_EQ(pNeuron->backConnectionsIndices.size(), 0);
+        ASSERT_EQ(myNet.layers[0]->numForwardConnections(0, 0), 1);
+        ASSERT_EQ(myNet.layers[0]->numBackConnections(0, 0), 0);
 
-        pNeuron = &myNet.layers[1]->neurons[0][0];
-        ASSERT_EQ(pNeuron->forwardConnectionsIndices.size(), 0);
-        ASSERT_EQ(pNeuron->backConnectionsIndices.size(), 2);
+        ASSERT_EQ(myNet.layers[1]->numForwardConnections(0, 0), 0);
+        ASSERT_EQ(myNet.layers[1]->numBackConnections(0, 0), 2);
 
-        ASSERT_EQ(myNet.connections.size(), 2);
+        ASSERT_EQ(myNet.layers[1]->totalNumberBackConnections, 2);
+        ASSERT_EQ(myNet.layers[1]->biasWeights.size(), 1);
     }
 
     {
@@ -739,11 +740,94 @@ void unitTestNet()
         ASSERT_EQ(myNet.layers[1]->neurons.size(), 1); // depth = 1
         ASSERT_EQ(myNet.layers[1]->neurons[0].size(), 8*6);
 
-        const Neuron *pNeuron = &myNet.layers[0]->neurons[0][0];
-        ASSERT_EQ(pNeuron->forwardConnectionsIndices.size(), 8*6);
-        ASSERT_EQ(pNeuron->backConnectionsIndices.size(), 0);
+        ASSERT_EQ(myNet.layers[0]->numForwardConnections(0, 0), 8*6);
+        ASSERT_EQ(myNet.layers[0]->numBackConnections(0, 0), 0);
+
+        ASSERT_EQ(myNet.layers[1]->totalNumberBackConnections, 8*6*10*10 + 8*6);
+
+        // The output layer covers the whole input layer, so it has one dense weight matrix:
+        auto const &output = *myNet.layers[1];
+        ASSERT_EQ(output.projections.size(), 1);
+        ASSERT_EQ(output.projections[0].isSparse(), false);
+        ASSERT_EQ(output.projections[0].pFromLayer, myNet.layers[0].get());
+        ASSERT_EQ(output.projections[0].numRows, 8*6);
+        ASSERT_EQ(output.projections[0].numColumns, 10*10);
+        ASSERT_EQ(output.projections[0].weights.size(), 8*6*10*10);
+        ASSERT_EQ(output.biasWeights.size(), 8*6);
+    }
+
+    {
+        LOG("dense layer detection");
+
+        // A radius that reaches every source neuron gives a dense layer; an elliptical
+        // projection that misses the corners does not:
+        string config =
+            "input size 5x5\n"
+            "layerDense size 3x3 from input radius 4x4 tf linear\n"
+            "layerEllipse size 3x3 from input radius 3x3 tf linear\n"
+            "output size 2 from layerDense\n"
+            "output size 2 from layerEllipse\n";
+
+        istringstream ss(config);
+        Net myNet("", false);
+        myNet.configureNetwork(myNet.parseTopologyConfig(ss));
+
+        auto const &layerDense = *layerNamed(myNet, "layerDense");
+        auto const &layerEllipse = *layerNamed(myNet, "layerEllipse");
+        ASSERT_EQ(layerDense.projections[0].isSparse(), false);
+        ASSERT_EQ(layerEllipse.projections[0].isSparse(), true);
+        ASSERT_EQ(myNet.layers.back()->projections.size(), 2);
+        ASSERT_EQ(myNet.layers.back()->projections[0].isSparse(), false);
+        ASSERT_EQ(myNet.layers.back()->projections[1].isSparse(), false);
+
+        // Every dense neuron has 25 sources plus a bias:
+        ASSERT_EQ(layerDense.numBackConnections(0, 4), 5*5 + 1);
+        // The center input neuron is inside every ellipse; a corner is inside the
+        // ellipses of the 2x2 neurons nearest to it in layerEllipse:
+        auto const &input = *myNet.layers[0];
+        ASSERT_EQ(input.numForwardConnections(0, 12), 3*3 + 3*3);
+        ASSERT_EQ(input.numForwardConnections(0, 0), 3*3 + 2*2);
+        ASSERT_EQ(layerEllipse.numBackConnections(0, 4), 5*5 + 1); // Center neuron sees everything
+        ASSERT_EQ(myNet.layers.back()->numBackConnections(0, 1), 3*3 + 1 + 3*3);
+    }
+
+    {
+        LOG("repeated layer name");
+
+        // A layer that appears more than once gets connections from each source
+        // layer it names, but naming the same source again adds no duplicates:
+        string config =
+            "input size 6x6\n"
+            "layerA size 4x4 from input radius 1x1\n"
+            "layerB size 3x3 from input\n"
+            "layerA size 4x4 from input radius 1x1\n"
+            "output size 2 from layerA\n"
+            "output size 2 from layerB\n"
+            "output size 2 from layerA\n";
+
+        istringstream ss(config);
+        Net myNet("", false);
+        myNet.configureNetwork(myNet.parseTopologyConfig(ss));
 
-        ASSERT_EQ(myNet.connections.size(), 8*6*10*10 + 8*6);
+        auto const &layerA = *layerNamed(myNet, "layerA");
+        auto const &output = *myNet.layers.back();
+        ASSERT_EQ(layerA.projections.size(), 1);
+        ASSERT_EQ(layerA.projections[0].isSparse(), true);
+        ASSERT_EQ(layerA.projections[0].rowOffsets.size(), 4*4 + 1);
+        ASSERT_EQ(layerA.projections[0].rowOffsets.back(), layerA.projections[0].weights.size());
+        ASSERT_EQ(layerA.projections[0].columnIndices.size(), layerA.projections[0].weights.size());
+        ASSERT_EQ(layerA.totalNumberBackConnections, layerA.projections[0].weights.size() + 4*4);
+        ASSERT_EQ(output.projections.size(), 2);
+        ASSERT_EQ(output.totalNumberBackConnections, 2*4*4 + 2*3*3 + 2);
+
+        // The forward counts agree with the back connections:
+        auto const &input = *myNet.layers[0];
+        uint32_t forward = 0;
+        for (uint32_t i = 0; i < 6*6; ++i) {
+            forward += input.numForwardConnections(0, i);
+        }
+        ASSERT_EQ(forward, layerA.projections[0].weights.size() + 3*3*6*6);
+        ASSERT_EQ(layerA.numForwardConnections(0, 5), 2);
     }
 
     {
@@ -780,27 +864,49 @@ void unitTestNet()
         ASSERT_EQ(myNet.layers[1]->size.x, 1);
         ASSERT_EQ(myNet.layers[1]->size.y, 1);
 
-        ASSERT_EQ(myNet.connections.size(), 1+1); // one plus bias
-        ASSERT_EQ(myNet.layers[0]->neurons[0][0].backConnectionsIndices.size(), 0);
-        ASSERT_EQ(myNet.layers[0]->neurons[0][0].forwardConnectionsIndices.size(), 1);
-        ASSERT_EQ(myNet.layers[1]->neurons[0][0].backConnectionsIndices.size(), 2); // Source plus bias
-        ASSERT_EQ(myNet.layers[1]->neurons[0][0].forwardConnectionsIndices.size(), 0);
+        // A 1x1 layer is trivially fully connected, so the weights live in a dense matrix:
+        auto const &output = *myNet.layers[1];
+        ASSERT_EQ(output.projections.size(), 1);
+        ASSERT_EQ(output.projections[0].isSparse(), false);
+        ASSERT_EQ(output.projections[0].pFromLayer, myNet.layers[0].get());
+        ASSERT_EQ(output.projections[0].numRows, 1);
+        ASSERT_EQ(output.projections[0].numColumns, 1);
+        ASSERT_EQ(output.biasWeights.size(), 1);
+
+        ASSERT_EQ(myNet.layers[0]->numBackConnections(0, 0), 0);
+        ASSERT_EQ(myNet.layers[0]->numForwardConnections(0, 0), 1);
+        ASSERT_EQ(output.numBackConnections(0, 0), 2); // Source plus bias
+        ASSERT_EQ(output.numForwardConnections(0, 0), 0);
+    }
+
+    {
+        LOG("neuron state arrays");
+
+        string config =
+            "input size 4x3\n"
+            "layerHidden size 2*3x2 from input tf linear\n"
+            "output size 1 from layerHidden\n";
 
-        ASSERT_EQ(myNet.bias.backConnectionsIndices.size(), 0);
-        ASSERT_EQ(myNet.bias.forwardConnectionsIndices.size(), 1);
+        istringstream ss(config);
+        Net myNet("", false);
+        myNet.configureNetwork(myNet.parseTopologyConfig(ss));
 
-        auto const &l0n0 = myNet.layers[0]->neurons[0][0];
-        auto const &l1n0 = myNet.layers[1]->neurons[0][0];
-        auto backIdx = l1n0.backConnectionsIndices[0];
-        auto forwardIdx = l0n0.forwardConnectionsIndices[0];
-        ASSERT_EQ(backIdx, forwardIdx); // Should refer to the same connection record
+        // Each Neuron refers to its element of the layer's flattened [depth][i] containers:
+        auto &hidden = *myNet.layers[1];
+        ASSERT_EQ(hidden.outputs.size(), 2*3*2);
+        ASSERT_EQ(hidden.gradients.size(), 2*3*2);
+        ASSERT_EQ(&hidden.neurons[0][0].output, &hidden.outputs[0]);
+        ASSERT_EQ(&hidden.neurons[1][5].output, &hidden.outputs[1*3*2 + 5]);
+        ASSERT_EQ(&hidden.neurons[1][2].gradient, &hidden.gradients[1*3*2 + 2]);
 
-        auto const &conn = myNet.connections[backIdx];
-        ASSERT_EQ(&conn.fromNeuron, &l0n0);
-        ASSERT_EQ(&conn.toNeuron, &l1n0);
+        hidden.neurons[1][3].output = 0.75f;
+        ASSERT_EQ(hidden.outputs[1*3*2 + 3], 0.75f);
 
-        ASSERT_EQ(&myNet.connections[myNet.bias.forwardConnectionsIndices[0]].toNeuron, &l1n0);
-        ASSERT_EQ(&myNet.connections[l1n0.backConnectionsIndices[1]].fromNeuron, &myNet.bias);
+        // Feed forward reads the source layer's outputs container:
+        setAllWeights(myNet, 1.0);
+        std::fill(myNet.layers[0]->outputs.begin(), myNet.layers[0]->outputs.end(), 0.5f);
+        hidden.feedForward();
+        ASSERT_FEQ(hidden.neurons[1][3].output, 4*3*0.5f + 1.0f);
     }
 
     {
@@ -965,8 +1071,7 @@ void unitTestNet()
 
         uint32_t expectedSize = 1*1; // patch size
         for (uint32_t layerNum : singlePlaneOneToOneNoBias) {
-            Neuron const &exemplaryNeuron = myNet.layers[layerNum]->neurons[0][0];
-            ASSERT_EQ(exemplaryNeuron.backConnectionsIndices.size(), expectedSize);
+            ASSERT_EQ(myNet.layers[layerNum]->numBackConnections(0, 0), expectedSize);
         }
 
         // We expect the following layers to have a one-to-one connection with a single
@@ -975,8 +1080,7 @@ void unitTestNet()
 
         expectedSize = 1*1 + 1; // patch size plus a bias
         for (uint32_t layerNum : singlePlaneOneToOnePlusBias) {
-            Neuron const &exemplaryNeuron = myNet.layers[layerNum]->neurons[0][0];
-            ASSERT_EQ(exemplaryNeuron.backConnectionsIndices.size(), expectedSize);
+            ASSERT_EQ(myNet.layers[layerNum]->numBackConnections(0, 0), expectedSize);
         }
 
         // We expect the following layers to have a one-to-one connection with depth planes
@@ -985,8 +1089,7 @@ void unitTestNet()
 
         expectedSize = 2*1*1; // depth * patch size, no bias
         for (uint32_t layerNum : multiplePlaneOneToOneNoBias) {
-            Neuron const &exemplaryNeuron = myNet.layers[layerNum]->neurons[0][0];
-            ASSERT_EQ(exemplaryNeuron.backConnectionsIndices.size(), expectedSize);
+            ASSERT_EQ(myNet.layers[layerNum]->numBackConnections(0, 0), expectedSize);
         }
 
         // We expect the following layers to have a one-to-one connection with depth planes
@@ -995,8 +1098,7 @@ void unitTestNet()
 
         expectedSize = 2*1*1 + 1; // depth * patch size, plus a bias
         for (uint32_t layerNum : multiplePlaneOneToOneWithBias) {
-            Neuron const &exemplaryNeuron = myNet.layers[layerNum]->neurons[0][0];
-            ASSERT_EQ(exemplaryNeuron.backConnectionsIndices.size(), expectedSize);
+            ASSERT_EQ(myNet.layers[layerNum]->numBackConnections(0, 0), expectedSize);
         }
 
         // Follow the top left neuron output:
@@ -1070,6 +1172,310 @@ void unitTestNet()
         ASSERT_FEQ(myNet.layers[66]->neurons[0][0].output, val =        val       ); // layer66 from layer65 pool max 1x1
         ASSERT_FEQ(myNet.layers[67]->neurons[0][0].output, val = 2.0f * val + 1.0f); // output size 3x4 from layer66 radius 0x0 tf linear    }
     }
+
+    {
+        LOG("Mini-batch weight updates");
+
+        // Without momentum, the weight change from a mini-batch of two samples must
+        // equal the sum of the changes that each sample makes on its own with half
+        // the eta. This covers dense, depth-matched dense, sparse, and convolution
+        // network weights.
+
+        string topologyConfig =
+            "input size 4x4\n"
+            "layerConv size 2*4x4 from input convolve 3x3\n"
+            "layerSame size 2*3x3 from layerConv\n"
+            "layerSparse size 3x3 from layerSame radius 1x1\n"
+            "output size 2 from layerSparse\n"
+            "output size 2 from layerSame\n";
+
+        std::ofstream topologyConfigFile(topologyConfigFilename);
+        topologyConfigFile << topologyConfig;
+        topologyConfigFile.close();
+
+        const string filename = "./unitTestSavedWeights.txt";
+        Net(topologyConfigFilename, false).saveWeights(filename);
+
+        Sample samples[2];
+        for (uint32_t i = 0; i < 16; ++i) {
+            samples[0].data.push_back(i / 16.0f - 0.5f);
+            samples[1].data.push_back((i % 5) / 5.0f - 0.25f);
+        }
+        samples[0].targetVals = { 0.5f, -0.5f };
+        samples[1].targetVals = { -0.25f, 0.75f };
+
+        auto allWeights = [](Net const &net) {
+            vector<float> w;
+            for (auto const &pLayer : net.layers) {
+                for (auto const &proj : pLayer->projections) {
+                    w.insert(w.end(), proj.weights.begin(), proj.weights.end());
+                }
+                w.insert(w.end(), pLayer->biasWeights.begin(), pLayer->biasWeights.end());
+                for (auto const &kernel : pLayer->flatConvolveMatrix) {
+                    w.insert(w.end(), kernel.begin(), kernel.end());
+                }
+            }
+            return w;
+        };
+
+        auto makeNet = [&](uint32_t batchSize, float eta) {
+            std::unique_ptr<Net> pNet(new Net(topologyConfigFilename, false));
+            pNet->loadWeights(filename);
+            pNet->batchSize = batchSize;
+            pNet->eta = eta;
+            pNet->alpha = 0.0f;
+            pNet->dynamicEtaAdjust = false;
+            return pNet;
+        };
+
+        auto initialWeights = allWeights(*makeNet(1, 0.1f));
+
+        vector<float> singleDeltas(initialWeights.size(), 0.0f);
+        for (auto &sample : samples) {
+            auto pNet = makeNet(1, 0.05f);
+            pNet->feedForward(sample);
+            pNet->backProp(sample);
+            auto w = allWeights(*pNet);
+            for (uint32_t i = 0; i < w.size(); ++i) {
+                singleDeltas[i] += w[i] - initialWeights[i];
+            }
+        }
+
+        auto pBatchNet = makeNet(2, 0.1f);
+        pBatchNet->feedForward(samples[0]);
+        pBatchNet->backProp(samples[0]);
+        ASSERT_EQ(pBatchNet->batchCount, 1);
+        ASSERT_EQ(allWeights(*pBatchNet) == initialWeights, true); // Not updated yet
+        pBatchNet->feedForward(samples[1]);
+        pBatchNet->backProp(samples[1]);
+        ASSERT_EQ(pBatchNet->batchCount, 0);
+
+        auto batchWeights = allWeights(*pBatchNet);
+        ASSERT_EQ(batchWeights.size(), initialWeights.size());
+        uint32_t numChanged = 0;
+        for (uint32_t i = 0; i < batchWeights.size(); ++i) {
+            float batchDelta = batchWeights[i] - initialWeights[i];
+            float diff = batchDelta > singleDeltas[i] ? batchDelta - singleDeltas[i] : singleDeltas[i] - batchDelta;
+            ASSERT_GE(1e-6f, diff);
+            numChanged += (batchDelta != 0.0f);
+        }
+        ASSERT_GE(numChanged, batchWeights.size() / 2);
+
+        // A partial batch is applied by flushBatch():
+        pBatchNet->batchSize = 3;
+        pBatchNet->feedForward(samples[0]);
+        pBatchNet->backProp(samples[0]);
+        ASSERT_EQ(pBatchNet->batchCount, 1);
+        pBatchNet->flushBatch();
+        ASSERT_EQ(pBatchNet->batchCount, 0);
+        ASSERT_EQ(allWeights(*pBatchNet) == batchWeights, false);
+    }
+
+    {
+        LOG("Data-parallel training");
+
+        // Training a batch on several threads must give the same weights, errors, and
+        // sample count as training it on one thread, and the same weights every time.
+
+        string topologyConfig =
+            "input size 4x4\n"
+            "layerConv size 2*4x4 from input convolve 3x3\n"
+            "layerSame size 2*3x3 from layerConv\n"
+            "layerSparse size 3x3 from layerSame radius 1x1\n"
+            "output size 2 from layerSparse\n"
+            "output size 2 from layerSame\n";
+
+        std::ofstream topologyConfigFile(topologyConfigFilename);
+        topologyConfigFile << topologyConfig;
+        topologyConfigFile.close();
+
+        const string filename = "./unitTestSavedWeights.txt";
+        Net(topologyConfigFilename, false).saveWeights(filename);
+
+        vector<Sample> samples(7);
+        for (uint32_t n = 0; n < samples.size(); ++n) {
+            for (uint32_t i = 0; i < 16; ++i) {
+                samples[n].data.push_back(((i * (n + 3)) % 11) / 11.0f - 0.5f);
+            }
+            samples[n].targetVals = { n % 2 ? 0.5f : -0.5f, n % 3 ? -0.25f : 0.75f };
+        }
+
+        auto allWeights = [](Net const &net) {
+            vector<float> w;
+            for (auto const &pLayer : net.layers) {
+                for (auto const &proj : pLayer->projections) {
+                    w.insert(w.end(), proj.weights.begin(), proj.weights.end());
+                }
+                w.insert(w.end(), pLayer->biasWeights.begin(), pLayer->biasWeights.end());
+                for (auto const &kernel : pLayer->flatConvolveMatrix) {
+                    w.insert(w.end(), kernel.begin(), kernel.end());
+                }
+            }
+            return w;
+        };
+
+        auto train = [&](uint32_t numThreads) {
+            std::unique_ptr<Net> pNet(new Net(topologyConfigFilename, false));
+            pNet->loadWeights(filename);
+            pNet->batchSize = samples.size();
+            pNet->numTrainingThreads = numThreads;
+            pNet->reportEveryNth = 1000;
+            for (int pass = 0; pass < 2; ++pass) {
+                pNet->trainBatch(samples.data(), samples.size());
+            }
+            return pNet;
+        };
+
+        auto pSerialNet = train(1);
+        auto pParallelNet = train(3);
+        auto pParallelNet2 = train(3);
+
+        ASSERT_EQ(pParallelNet->inputSampleNumber, 2 * samples.size());
+        ASSERT_EQ(pParallelNet->inputSampleNumber, pSerialNet->inputSampleNumber);
+        ASSERT_FEQ(pParallelNet->recentAverageError, pSerialNet->recentAverageError);
+        ASSERT_FEQ(pParallelNet->eta, pSerialNet->eta);
+        ASSERT_EQ(pParallelNet->batchCount, 0);
+
+        auto serialWeights = allWeights(*pSerialNet);
+        auto parallelWeights = allWeights(*pParallelNet);
+        ASSERT_EQ(parallelWeights.size(), serialWeights.size());
+        for (uint32_t i = 0; i < serialWeights.size(); ++i) {
+            float diff = parallelWeights[i] > serialWeights[i] ? parallelWeights[i] - serialWeights[i]
+                                                               : serialWeights[i] - parallelWeights[i];
+            ASSERT_GE(1e-6f, diff);
+        }
+        ASSERT_EQ(allWeights(*pParallelNet2) == parallelWeights, true);
+    }
+
+    {
+        LOG("Multithreaded layers");
+
+        // The layers are big enough that their loops exceed Layer::minParallelWork and
+        // get divided among the threads. Every layer's outputs must be exactly the same
+        // as with one thread, including after the number of threads changes.
+
+        string topologyConfig =
+            "input size 64x64\n"
+            "layerDirect size 4*64x64 from input convolve 5x5 direct\n"
+            "layerGemm size 4*64x64 from input convolve 5x5 gemm\n"
+            "layerPool size 4*64x64 from layerDirect pool max 3x3\n"
+            "layerHidden1 size 32 from layerPool\n"
+            "layerHidden2 size 16 from layerGemm\n"
+            "output size 4 from layerHidden1\n"
+            "output size 4 from layerHidden2\n";
+
+        std::ofstream topologyConfigFile(topologyConfigFilename);
+        topologyConfigFile << topologyConfig;
+        topologyConfigFile.close();
+
+        const string filename = "./unitTestSavedWeights.txt";
+        Net(topologyConfigFilename, false).saveWeights(filename);
+
+        Sample sample;
+        for (uint32_t i = 0; i < 64 * 64; ++i) {
+            sample.data.push_back(((i * 7) % 13) / 13.0f - 0.5f);
+        }
+
+        auto allOutputs = [&](uint32_t numThreads) {
+            Net myNet(topologyConfigFilename, false);
+            myNet.loadWeights(filename);
+            vector<vector<float>> outputs;
+            for (uint32_t threads : { numThreads, 1u, numThreads }) {
+                myNet.numLayerThreads = threads;
+                myNet.feedForward(sample);
+                for (auto const &pLayer : myNet.layers) {
+                    outputs.push_back(pLayer->outputs);
+                }
+            }
+            return outputs;
+        };
+
+        auto serialOutputs = allOutputs(1);
+        auto parallelOutputs = allOutputs(4);
+        ASSERT_EQ(parallelOutputs.size(), serialOutputs.size());
+        for (uint32_t i = 0; i < serialOutputs.size(); ++i) {
+            ASSERT_EQ(parallelOutputs[i] == serialOutputs[i], true);
+        }
+        ASSERT_EQ(allOutputs(3) == serialOutputs, true);
+    }
+
+    {
+        LOG("Multithreaded construction");
+
+        // Philox4x32-10 known-answer vectors from Random123:
+        uint32_t ctr[4] = { 0, 0, 0, 0 };
+        uint32_t key[2] = { 0, 0 };
+        Philox::block(ctr, key);
+        ASSERT_EQ(ctr[0], 0x6627e8d5);
+        ASSERT_EQ(ctr[3], 0x9b00dbd8);
+        uint32_t ctrPi[4] = { 0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344 };
+        uint32_t keyPi[2] = { 0xa4093822, 0x299f31d0 };
+        Philox::block(ctrPi, keyPi);
+        ASSERT_EQ(ctrPi[0], 0xd16cfe09);
+        ASSERT_EQ(ctrPi[3], 0x24126ea1);
+
+        // Any part of a stream can be generated on its own:
+        Philox random(1234, 5);
+        vector<float> stream(11);
+        random.uniform(0, stream.data(), stream.size());
+        vector<float> part(6);
+        random.uniform(5, part.data(), part.size());
+        ASSERT_EQ(vector<float>(stream.begin() + 5, stream.end()) == part, true);
+        ASSERT_EQ(random.uniform(7), stream[7]);
+        ASSERT_EQ(Philox(1234, 6).uniform(7) == stream[7], false);
+
+        // The layers are big enough that connecting them is divided among the threads.
+        // The connections and initial weights must not depend on the number of threads:
+
+        string topologyConfig =
+            "input size 32x32\n"
+            "layerSparse size 2*32x32 from input radius 6x6\n"
+            "layerConv size 2*32x32 from layerSparse convolve 3x3\n"
+            "layerDense size 16x16 from layerConv\n"
+            "output size 4 from layerDense\n";
+
+        auto buildNet = [&](uint32_t numThreads, uint64_t seed) {
+            std::unique_ptr<Net> pNet(new Net("", false));
+            pNet->numLayerThreads = numThreads;
+            pNet->randomSeed = seed;
+            istringstream ss(topologyConfig);
+            pNet->configureNetwork(pNet->parseTopologyConfig(ss));
+            return pNet;
+        };
+
+        auto allState = [](Net const &net) {
+            vector<float> w;
+            for (auto const &pLayer : net.layers) {
+                w.insert(w.end(), pLayer->outputs.begin(), pLayer->outputs.end());
+                for (auto const &proj : pLayer->projections) {
+                    w.insert(w.end(), proj.weights.begin(), proj.weights.end());
+                    w.insert(w.end(), proj.rowOffsets.begin(), proj.rowOffsets.end());
+                    w.insert(w.end(), proj.columnIndices.begin(), proj.columnIndices.end());
+                }
+                w.insert(w.end(), pLayer->biasWeights.begin(), pLayer->biasWeights.end());
+                for (auto const &kernel : pLayer->flatConvolveMatrix) {
+                    w.insert(w.end(), kernel.begin(), kernel.end());
+                }
+                w.insert(w.end(), pLayer->fanOut.begin(), pLayer->fanOut.end());
+            }
+            return w;
+        };
+
+        auto serialState = allState(*buildNet(1, 1));
+        ASSERT_EQ(allState(*buildNet(4, 1)) == serialState, true);
+        ASSERT_EQ(allState(*buildNet(3, 1)) == serialState, true);
+        ASSERT_EQ(allState(*buildNet(1, 2)) == serialState, false);
+
+        // The initial weights are centered on zero:
+        auto pNet = buildNet(1, 1);
+        auto const &weights = layerNamed(*pNet, "layerSparse")->projections[0].weights;
+        float sum = 0.0f;
+        for (float w : weights) {
+            sum += w;
+        }
+        ASSERT_GE(0.01f, sum / weights.size());
+        ASSERT_GE(sum / weights.size(), -0.01f);
+    }
 }
 
 
@@ -1091,11 +1497,18 @@ void unitTestSparseConnections()
         ASSERT_EQ(myNet.layers[1]->neurons.size(), 1); // depth = 1
         ASSERT_EQ(myNet.layers[1]->neurons[0].size(), 8*8);
 
-        const Neuron *pNeuron = &myNet.layers[0]->neurons[0][0];
-        ASSERT_EQ(pNeuron->forwardConnectionsIndices.size(), 1);
-        ASSERT_EQ(pNeuron->backConnectionsIndices.size(), 0);
+        ASSERT_EQ(myNet.layers[0]->numForwardConnections(0, 0), 1);
+        ASSERT_EQ(myNet.layers[0]->numBackConnections(0, 0), 0);
+
+        ASSERT_EQ(myNet.layers[1]->totalNumberBackConnections, 8*8 + 8*8);
 
-        ASSERT_EQ(myNet.connections.size(), 8*8 + 8*8);
+        // One weight per row in compressed sparse row form:
+        auto const &proj = myNet.layers[1]->projections[0];
+        ASSERT_EQ(proj.isSparse(), true);
+        ASSERT_EQ(proj.rowOffsets.size(), 8*8 + 1);
+        ASSERT_EQ(proj.rowOffsets[8*8], 8*8);
+        ASSERT_EQ(proj.columnIndices[0], flattenXY(0, 0, 10));
+        ASSERT_EQ(proj.columnIndices[flattenXY(7, 7, 8)], flattenXY(9, 9, 10));
     }
 
     {
@@ -1114,11 +1527,10 @@ void unitTestSparseConnections()
         ASSERT_EQ(myNet.layers[1]->neurons.size(), 1); // depth = 1
         ASSERT_EQ(myNet.layers[1]->neurons[0].size(), 1);
 
-        const Neuron *pNeuron = &myNet.layers[0]->neurons[0][0];
-        ASSERT_EQ(pNeuron->forwardConnectionsIndices.size(), 0);
-        ASSERT_EQ(pNeuron->backConnectionsIndices.size(), 0);
+        ASSERT_EQ(myNet.layers[0]->numForwardConnections(0, 0), 0);
+        ASSERT_EQ(myNet.layers[0]->numBackConnections(0, 0), 0);
 
-        ASSERT_EQ(myNet.connections.size(), 1 + 1);
+        ASSERT_EQ(myNet.layers[1]->totalNumberBackConnections, 1 + 1);
     }
 
     {
@@ -1136,7 +1548,7 @@ void unitTestSparseConnections()
         ASSERT_EQ(myNet.layers[0]->neurons[0].size(), 10*10);
         ASSERT_EQ(myNet.layers[1]->neurons.size(), 1); // depth = 1
         ASSERT_EQ(myNet.layers[1]->neurons[0].size(), 1);
-        ASSERT_EQ(myNet.connections.size(), 3 + 1);
+        ASSERT_EQ(myNet.layers[1]->totalNumberBackConnections, 3 + 1);
     }
 
     {
@@ -1148,7 +1560,7 @@ void unitTestSparseConnections()
         istringstream ss(config);
         Net myNet("", false);
         myNet.configureNetwork(myNet.parseTopologyConfig(ss));
-        ASSERT_EQ(myNet.connections.size(), 5 + 1); // Assumes elliptical projection
+        ASSERT_EQ(myNet.layers[1]->totalNumberBackConnections, 5 + 1); // Assumes elliptical projection
     }
 
     {
@@ -1161,7 +1573,43 @@ void unitTestSparseConnections()
         Net myNet("", false);
         myNet.projectRectangular = true;
         myNet.configureNetwork(myNet.parseTopologyConfig(ss));
-        ASSERT_EQ(myNet.connections.size(), 9 + 1); // Assumes elliptical projection
+        ASSERT_EQ(myNet.layers[1]->totalNumberBackConnections, 9 + 1); // Assumes elliptical projection
+    }
+
+    {
+        LOG("sparse weights file order");
+
+        // Output neuron 0 is centered on input x=1 and reads x=0..2; neuron 1 is
+        // centered on x=3 and reads x=2..3. The weights file lists each neuron's
+        // inputs in source order followed by its bias:
+        string config =
+            "input size 4x1\n"
+            "output size 2x1 from input radius 1x0 tf linear\n";
+
+        istringstream ss(config);
+        Net myNet("", false);
+        myNet.configureNetwork(myNet.parseTopologyConfig(ss));
+
+        const string filename = "./unitTestSavedWeights.txt";
+        const string weights = "1\n10\n100\n1000\n1\n10\n100\n";
+        std::ofstream weightsFile(filename);
+        weightsFile << weights;
+        weightsFile.close();
+
+        myNet.loadWeights(filename);
+        for (uint32_t i = 0; i < 4; ++i) {
+            myNet.layers[0]->neurons[0][i].output = i + 1.0f;
+        }
+        myNet.layers[1]->feedForward();
+
+        ASSERT_FEQ(myNet.layers[1]->neurons[0][0].output, 1*1 + 2*10 + 3*100 + 1000);
+        ASSERT_FEQ(myNet.layers[1]->neurons[0][1].output, 3*1 + 4*10 + 100);
+
+        myNet.saveWeights(filename);
+        std::ifstream savedFile(filename);
+        std::stringstream saved;
+        saved << savedFile.rdbuf();
+        ASSERT_EQ(saved.str(), weights);
     }
 
     {
@@ -1277,13 +1725,12 @@ void unitTestConvolutionFiltering()
         ASSERT_EQ(h1.isPoolingLayer, false);
         ASSERT_EQ(h1.flatConvolveMatrix.size(), 1); // depth = 1
         ASSERT_EQ(h1.flatConvolveMatrix[0].size(), 1*1); // 1x1 kernel
-        ASSERT_EQ(h1.neurons[0][0].forwardConnectionsIndices.size(), 1);
+        ASSERT_EQ(h1.numForwardConnections(0, 0), 1);
 
-        auto const *pNeuron = &h1.neurons[0][0];
-        ASSERT_EQ(pNeuron->backConnectionsIndices.size(), 1); // no bias
-        uint32_t backConnIdx = pNeuron->backConnectionsIndices[0];
-        Connection const &conn = (*h1.pConnections)[backConnIdx];
-        ASSERT_FEQ(h1.flatConvolveMatrix[0][conn.convolveMatrixIndex], 0.5f);
+        ASSERT_EQ(h1.numBackConnections(0, 0), 1); // no bias
+        ASSERT_EQ(h1.windowedSources.size(), 1);
+        ASSERT_EQ(h1.windowedSources[0].pFromLayer, myNet.layers[0].get());
+        ASSERT_FEQ(h1.flatConvolveMatrix[0][0], 0.5f);
     }
 
     {
@@ -1320,33 +1767,26 @@ void unitTestConvolutionFiltering()
         auto const &layer1 = *myNet.layers[1]; // convolution filter layer
         Neuron const &neuron1024 = layer1.neurons[0][flattenXY(2, 4, 8)];
 
-        // check back connections to source neurons and their convolve matrix indices:
-        ASSERT_EQ(neuron1024.backConnectionsIndices.size(), 4);
+        // check the window of source neurons and the convolve matrix elements:
+        ASSERT_EQ(layer1.numBackConnections(0, flattenXY(2, 4, 8)), 4);
+        ASSERT_EQ(layer1.windowedSources.size(), 1);
+        auto const &window = layer1.windowedSources[0];
+        ASSERT_EQ(window.pFromLayer, myNet.layers[0].get());
+        ASSERT_EQ(window.windowSize.x, 2);
+        ASSERT_EQ(window.windowSize.y, 2);
 
-        Connection const &backConn00 =
-                myNet.connections[neuron1024.backConnectionsIndices[flattenXY(0, 0, 2)]]; // top left
-        ASSERT_EQ(backConn00.convolveMatrixIndex, (int)flattenXY(0,0,2));
-        ASSERT_FEQ(layer1.flatConvolveMatrix[0][backConn00.convolveMatrixIndex], 0.25f);
         // neuron on layer 1 at 2,4 covers a 2x2 patch of neurons on layer 1 at 1,3, 2,3, 1,4, 2,4
-        ASSERT_EQ(&backConn00.fromNeuron, &myNet.layers[0]->neurons[0][flattenXY(1,3,8)]);
-
-        Connection const &backConn10 =
-                myNet.connections[neuron1024.backConnectionsIndices[flattenXY(1, 0, 2)]]; // top right
-        ASSERT_EQ(backConn10.convolveMatrixIndex, (int)flattenXY(1,0,2));
-        ASSERT_FEQ(layer1.flatConvolveMatrix[0][backConn10.convolveMatrixIndex], 0.5f);
-        ASSERT_EQ(&backConn10.fromNeuron, &myNet.layers[0]->neurons[0][flattenXY(2,3,8)]);
-
-        Connection const &backConn01 =
-                myNet.connections[neuron1024.backConnectionsIndices[flattenXY(0, 1, 2)]]; // bottom left
-        ASSERT_EQ(backConn01.convolveMatrixIndex, (int)flattenXY(0,1,2));
-        ASSERT_FEQ(layer1.flatConvolveMatrix[0][backConn01.convolveMatrixIndex] + 1.0f, 0.0f + 1.0f); // Avoid divide by zero
-        ASSERT_EQ(&backConn01.fromNeuron, &myNet.layers[0]->neurons[0][flattenXY(1,4,8)]);
-
-        Connection const &backConn11 =
-                myNet.connections[neuron1024.backConnectionsIndices[flattenXY(1, 1, 2)]]; // bottom right
-        ASSERT_EQ(backConn11.convolveMatrixIndex, (int)flattenXY(1,1,2));
-        ASSERT_FEQ(layer1.flatConvolveMatrix[0][backConn11.convolveMatrixIndex], -0.25f);
-        ASSERT_EQ(&backConn11.fromNeuron, &myNet.layers[0]->neurons[0][flattenXY(2,4,8)]);
+        ASSERT_EQ(window.windowStartX[2], 1);
+        ASSERT_EQ(window.windowStartY[4], 3);
+        ASSERT_FEQ(layer1.flatConvolveMatrix[0][flattenXY(0,0,2)], 0.25f);  // top left
+        ASSERT_FEQ(layer1.flatConvolveMatrix[0][flattenXY(1,0,2)], 0.5f);   // top right
+        ASSERT_FEQ(layer1.flatConvolveMatrix[0][flattenXY(0,1,2)] + 1.0f, 0.0f + 1.0f); // bottom left; avoid divide by zero
+        ASSERT_FEQ(layer1.flatConvolveMatrix[0][flattenXY(1,1,2)], -0.25f); // bottom right
+
+        // At the edges, the part of the window outside the source layer is skipped:
+        ASSERT_EQ(window.windowStartX[0], -1);
+        ASSERT_EQ(layer1.numBackConnections(0, flattenXY(0, 4, 8)), 2);
+        ASSERT_EQ(layer1.numBackConnections(0, flattenXY(0, 0, 8)), 1);
 
         // layer 1 neuron at 2,4 covers four source neurons with outputs 4,4,5,5:
         float expected =
@@ -1413,8 +1853,8 @@ void unitTestConvolutionNetworking()
         auto &n000 = hl.neurons[0][flattenXY(0, 0, hl.size)];   // depth,x,y = 0,0,0
         auto &n100 = hl.neurons[1][flattenXY(0, 0, hl.size)];   // depth,x,y = 1,0,0
 
-        ASSERT_EQ(n000.backConnectionsIndices.size(), 1); // 1 source, no bias
-        ASSERT_EQ(n100.backConnectionsIndices.size(), 1); // 1 source, no bias
+        ASSERT_EQ(hl.numBackConnections(0, 0), 1); // 1 source, no bias
+        ASSERT_EQ(hl.numBackConnections(1, 0), 1); // 1 source, no bias
 
         setAllWeights(myNet, 1.0);
 
@@ -1423,8 +1863,8 @@ void unitTestConvolutionNetworking()
 
         // The sole hidden-layer neuron covers the sole input neuron, which has value 0.25:
         ASSERT_EQ(myNet.layers[0]->neurons[0][flattenXY(0, 0, myNet.layers[0]->size)].output, 0.25);
-        auto backIndex = n000.backConnectionsIndices[0];    // source neuron index
-        auto &sourceNeuron = myNet.connections[backIndex].fromNeuron;
+        ASSERT_EQ(hl.windowedSources[0].pFromLayer, myNet.layers[0].get());
+        auto &sourceNeuron = myNet.layers[0]->neurons[0][0];
         ASSERT_EQ(sourceNeuron.output, 0.25);
         ASSERT_EQ(hl.flatConvolveMatrix.size(), 2);    // depth = 2
         ASSERT_EQ(hl.flatConvolveMatrix[0].size(), 1*1); // 1*1 kernel elements, depth 0
@@ -1487,9 +1927,9 @@ void unitTestConvolutionNetworking()
         auto &n100 = hl.neurons[1][flattenXY(0, 0, hl.size)];   // depth,x,y = 1,0,0
         auto &n024 = hl.neurons[0][flattenXY(2, 4, hl.size)];   // depth,x,y = 0,2,4
 
-        ASSERT_EQ(n000.backConnectionsIndices.size(), 1); // 1 source, no bias
-        ASSERT_EQ(n100.backConnectionsIndices.size(), 1); // 1 source, no bias
-        ASSERT_EQ(n024.backConnectionsIndices.size(), 1); // 1 source, no bias
+        ASSERT_EQ(hl.numBackConnections(0, flattenXY(0, 0, hl.size)), 1); // 1 source, no bias
+        ASSERT_EQ(hl.numBackConnections(1, flattenXY(0, 0, hl.size)), 1); // 1 source, no bias
+        ASSERT_EQ(hl.numBackConnections(0, flattenXY(2, 4, hl.size)), 1); // 1 source, no bias
 
         setAllWeights(myNet, 1.0);
         myNet.sampleSet.loadSamples(inputDataConfigFilename);
@@ -1503,8 +1943,7 @@ void unitTestConvolutionNetworking()
         ASSERT_EQ(myNet.layers[0]->neurons[0][flattenXY(2, 4, myNet.layers[0]->size)].output,
                     pixelToNetworkInputRange(5));
 
-        auto backIndex = n000.backConnectionsIndices[0];    // source neuron index
-        auto &sourceNeuron = myNet.connections[backIndex].fromNeuron;
+        auto &sourceNeuron = myNet.layers[0]->neurons[0][flattenXY(0, 0, myNet.layers[0]->size)];
 
         ASSERT_EQ(sourceNeuron.output, pixelToNetworkInputRange(1));
 
@@ -1517,6 +1956,132 @@ void unitTestConvolutionNetworking()
         ASSERT_EQ(n024.output, pixelToNetworkInputRange(5));  // depth,x,y = 0,2,4, no bias
     }
 
+    {
+        LOG("Convolution network backprop");
+
+        string topologyConfig =
+            "input size 2x1\n"
+            "layerConv size 2x1 from input convolve 1x1 tf linear\n"
+            "output size 1 from layerConv tf linear\n";
+
+        string inputDataConfig =
+            "{ 0.25 -0.5 } 1.0\n";
+
+        std::ofstream topologyConfigFile(topologyConfigFilename);
+        topologyConfigFile << topologyConfig;
+        topologyConfigFile.close();
+
+        std::ofstream inputDataConfigFile(inputDataConfigFilename);
+        inputDataConfigFile << inputDataConfig;
+        inputDataConfigFile.close();
+
+        Net myNet(topologyConfigFilename, false);
+        auto &conv = *myNet.layers[1];
+        auto &output = *myNet.layers[2];
+        ASSERT_EQ(conv.isConvolutionNetworkLayer, true);
+
+        setAllWeights(myNet, 1.0);
+        conv.flatConvolveMatrix[0][0] = 0.5f;
+        output.biasWeights[0] = 0.0f;
+        myNet.eta = 0.1f;
+        myNet.alpha = 0.0f;
+        myNet.dynamicEtaAdjust = false;
+
+        myNet.sampleSet.loadSamples(inputDataConfigFilename);
+        myNet.feedForward(myNet.sampleSet.samples[0]);
+        ASSERT_FEQ(conv.outputs[0], 0.125f);
+        ASSERT_FEQ(conv.outputs[1], -0.25f);
+        ASSERT_FEQ(output.outputs[0], -0.125f);
+
+        myNet.backProp(myNet.sampleSet.samples[0]);
+
+        // The output gradient 1.125 reaches each convolution neuron through a weight of 1.0,
+        // and the shared kernel element is trained by the average over both neurons:
+        ASSERT_FEQ(output.gradients[0], 1.125f);
+        ASSERT_FEQ(conv.gradients[0], 1.125f);
+        ASSERT_FEQ(conv.gradients[1], 1.125f);
+        ASSERT_FEQ(conv.flatConvolveMatrix[0][0], 0.5f + 0.1f * 1.125f * (0.25f - 0.5f) / 2.0f);
+        ASSERT_FEQ(conv.flatConvolveGradients[0][0] + 1.0f, 0.0f + 1.0f); // Cleared after the update
+        ASSERT_EQ(myNet.layers[0]->gradients[0], 0.0f); // The input layer gets no gradients
+    }
+
+    {
+        LOG("Convolution by GEMM");
+
+        // layerA and layerB read all depths of their sources, so their kernels are
+        // applied to shared window columns; layerC reads its source depth by depth:
+        string topologyConfigDirect =
+            "input size 8x8 channel R\n"
+            "layerA size 3*8x8 from input convolve 3x3\n"
+            "layerB size 2*8x8 from layerA convolve 3x3 tf linear\n"
+            "layerC size 2*4x4 from layerB convolve 2x2\n"
+            "output size 2 from layerC\n";
+
+        string topologyConfigGemm =
+            "input size 8x8 channel R\n"
+            "layerA size 3*8x8 from input convolve 3x3 gemm\n"
+            "layerB size 2*8x8 from layerA convolve 3x3 gemm tf linear\n"
+            "layerC size 2*4x4 from layerB convolve 2x2 gemm\n"
+            "output size 2 from layerC\n";
+
+        string inputDataConfig =
+            "../images/8x8-test11.bmp 0.5 -0.5\n";
+
+        std::ofstream inputDataConfigFile(inputDataConfigFilename);
+        inputDataConfigFile << inputDataConfig;
+        inputDataConfigFile.close();
+
+        std::ofstream topologyConfigFile(topologyConfigFilename);
+        topologyConfigFile << topologyConfigDirect;
+        topologyConfigFile.close();
+        Net netDirect(topologyConfigFilename, false);
+
+        topologyConfigFile.open(topologyConfigFilename);
+        topologyConfigFile << topologyConfigGemm;
+        topologyConfigFile.close();
+        Net netGemm(topologyConfigFilename, false);
+
+        ASSERT_EQ(layerNamed(netDirect, "layerB")->convolveMethod, CONVOLVE_DIRECT);
+        ASSERT_EQ(layerNamed(netGemm, "layerB")->convolveMethod, CONVOLVE_GEMM);
+        ASSERT_EQ(layerNamed(netGemm, "layerB")->tf, layerNamed(netDirect, "layerB")->tf);
+
+        const string filename = "./unitTestSavedWeights.txt";
+        netDirect.saveWeights(filename);
+        netDirect.loadWeights(filename); // So that both nets have the same rounded weights
+        netGemm.loadWeights(filename);
+
+        auto assertClose = [](vector<float> const &a, vector<float> const &b) {
+            ASSERT_EQ(a.size(), b.size());
+            for (size_t i = 0; i < a.size(); ++i) {
+                float diff = a[i] - b[i];
+                ASSERT_GE(1e-5f, diff < 0.0f ? -diff : diff);
+            }
+        };
+
+        for (auto pNet : { &netDirect, &netGemm }) {
+            pNet->sampleSet.loadSamples(inputDataConfigFilename);
+            pNet->feedForward(pNet->sampleSet.samples[0]);
+            pNet->backProp(pNet->sampleSet.samples[0]);
+        }
+
+        for (string layerName : { "layerA", "layerB", "layerC" }) {
+            auto const *pDirect = layerNamed(netDirect, layerName);
+            auto const *pGemm = layerNamed(netGemm, layerName);
+            assertClose(pDirect->outputs, pGemm->outputs);
+            assertClose(pDirect->gradients, pGemm->gradients);
+            for (uint32_t depth = 0; depth < pDirect->size.depth; ++depth) {
+                assertClose(pDirect->flatConvolveMatrix[depth], pGemm->flatConvolveMatrix[depth]);
+            }
+        }
+        assertClose(netDirect.layers.back()->outputs, netGemm.layers.back()->outputs);
+
+        // The method can be changed at any time:
+        netGemm.layers[2]->convolveMethod = CONVOLVE_DIRECT; // layerB
+        netGemm.feedForward(netGemm.sampleSet.samples[0]);
+        netDirect.feedForward(netDirect.sampleSet.samples[0]);
+        assertClose(netDirect.layers.back()->outputs, netGemm.layers.back()->outputs);
+    }
+
     {
         LOG("Convolution networking");
 
@@ -1673,32 +2238,32 @@ void unitTestConvolutionNetworking()
         ASSERT_EQ(input.size.depth, 1);
         ASSERT_EQ(input.neurons.size(), 1);
         ASSERT_EQ(input.neurons[0].size(), 32*32);
-        ASSERT_EQ(input.neurons[0][0].backConnectionsIndices.size(), 0);
-        ASSERT_EQ(input.neurons[0].back().backConnectionsIndices.size(), 0);
-        ASSERT_EQ(input.neurons[0][7*16+7].forwardConnectionsIndices.size(), 10*7*7);
+        ASSERT_EQ(input.numBackConnections(0, 0), 0);
+        ASSERT_EQ(input.numBackConnections(0, input.neurons[0].size() - 1), 0);
+        ASSERT_EQ(input.numForwardConnections(0, 7*16+7), 10*7*7);
 
         // layerMix2 combines two source layers:
         auto const &layerMix2 = *layerNamed(myNet1, "layerMix2"); // size 4x4 from layerMix1 plus from layerGauss
         ASSERT_EQ(layerMix2.size.depth, 1);
         ASSERT_EQ(layerMix2.neurons.size(), 1);
         ASSERT_EQ(layerMix2.neurons[0].size(), 4*4);
-        ASSERT_EQ(layerMix2.neurons[0][flattenXY(2,2,4)].backConnectionsIndices.size(),
+        ASSERT_EQ(layerMix2.numBackConnections(0, flattenXY(2,2,4)),
                   8*8 + 8*8 + 1); // two source layers plus a bias
 
         auto const &layerConv = *layerNamed(myNet1, "layerConv"); // size 10*32x32 from input convolve 7x7
         ASSERT_EQ(layerConv.size.depth, 10);
         ASSERT_EQ(layerConv.neurons.size(), 10);
         ASSERT_EQ(layerConv.neurons[0].size(), 32*32);
-        ASSERT_EQ(layerConv.neurons[0][16*32+16].backConnectionsIndices.size(), 7*7);
+        ASSERT_EQ(layerConv.numBackConnections(0, 16*32+16), 7*7);
 
         auto const &output = *myNet1.layers.back();
         ASSERT_EQ(output.size.depth, 1);
         ASSERT_EQ(output.neurons.size(), 1);
         ASSERT_EQ(output.neurons[0].size(), 10);
-        ASSERT_EQ(output.neurons[0][0].backConnectionsIndices.size(), 4*4 + 1);
-        ASSERT_EQ(output.neurons[0].back().backConnectionsIndices.size(), 4*4 + 1);
-        ASSERT_EQ(output.neurons[0][0].forwardConnectionsIndices.size(), 0);
-        ASSERT_EQ(output.neurons[0].back().forwardConnectionsIndices.size(), 0);
+        ASSERT_EQ(output.numBackConnections(0, 0), 4*4 + 1);
+        ASSERT_EQ(output.numBackConnections(0, output.neurons[0].size() - 1), 4*4 + 1);
+        ASSERT_EQ(output.numForwardConnections(0, 0), 0);
+        ASSERT_EQ(output.numForwardConnections(0, output.neurons[0].size() - 1), 0);
     }
 }
 
@@ -1741,10 +2306,10 @@ void unitTestImages()
         inputDataConfigFile.close();
 
         Net myNet(topologyConfigFilename, false);
-        ASSERT_EQ(myNet.connections.size(), 1+1); // incl bias
+        ASSERT_EQ(myNet.layers[1]->totalNumberBackConnections, 1+1); // incl bias
 
         setAllWeights(myNet, 1.0);
-        ASSERT_EQ((int)(myNet.connections[0].weight * 100 + 0.5), 100);
+        ASSERT_EQ((int)(myNet.layers[1]->projections[0].weights[0] * 100 + 0.5), 100);
 
         myNet.sampleSet.loadSamples(inputDataConfigFilename);
         ASSERT_EQ(myNet.sampleSet.samples.size(), 1);
@@ -1779,7 +2344,7 @@ void unitTestImages()
         inputDataConfigFile.close();
 
         Net myNet(topologyConfigFilename, false);
-        ASSERT_EQ(myNet.connections.size(), 8*8 + 1);
+        ASSERT_EQ(myNet.layers[1]->totalNumberBackConnections, 8*8 + 1);
 
         setAllWeights(myNet, 1.0);
 
@@ -1824,6 +2389,81 @@ void unitTestImages()
         ASSERT_EQ(data[flattenXY(2, 4, 8)], pixelToNetworkInputRange(127));
     }
 
+    {
+        LOG("BMP pixel formats");
+
+        // Rewrite the pixels of 8x8-test11.bmp as 32-bit, 8-bit paletted, and top-down
+        // 24-bit BMP files. Every channel must read the same as from the original.
+
+        std::ifstream original("../images/8x8-test11.bmp", std::ios::binary);
+        vector<unsigned char> originalBytes((std::istreambuf_iterator<char>(original)),
+                                            std::istreambuf_iterator<char>());
+        uint32_t dataOffset = originalBytes[10] + (originalBytes[11] << 8);
+        vector<unsigned char> bgr(originalBytes.begin() + dataOffset, originalBytes.begin() + dataOffset + 8*8*3);
+
+        auto writeBmp = [&](string const &filename, unsigned pixelDepth, bool topDown) {
+            vector<unsigned char> palette;
+            vector<unsigned char> pixels;
+            for (uint32_t row = 0; row < 8; ++row) {
+                uint32_t y = topDown ? 7 - row : row;
+                for (uint32_t x = 0; x < 8; ++x) {
+                    unsigned char const *p = &bgr[(y * 8 + x) * 3];
+                    if (pixelDepth == 8) {
+                        pixels.push_back((unsigned char)(palette.size() / 4));
+                        palette.insert(palette.end(), { p[0], p[1], p[2], 0 });
+                    } else {
+                        pixels.insert(pixels.end(), p, p + 3);
+                        if (pixelDepth == 32) {
+                            pixels.push_back(255);
+                        }
+                    }
+                }
+            }
+
+            auto le32 = [](vector<unsigned char> &v, uint32_t n) {
+                v.insert(v.end(), { (unsigned char)n, (unsigned char)(n >> 8),
+                                    (unsigned char)(n >> 16), (unsigned char)(n >> 24) });
+            };
+            vector<unsigned char> header = { 'B', 'M' };
+            le32(header, (uint32_t)(54 + palette.size() + pixels.size()));
+            le32(header, 0);
+            le32(header, (uint32_t)(54 + palette.size()));
+            le32(header, 40);
+            le32(header, 8);
+            le32(header, topDown ? (uint32_t)-8 : 8);
+            le32(header, 1 + (pixelDepth << 16));
+            for (uint32_t n : { 0u, (uint32_t)pixels.size(), 2835u, 2835u, (uint32_t)palette.size() / 4, 0u }) {
+                le32(header, n);
+            }
+
+            std::ofstream f(filename, std::ios::binary);
+            f.write((char const *)header.data(), header.size());
+            f.write((char const *)palette.data(), palette.size());
+            f.write((char const *)pixels.data(), pixels.size());
+        };
+
+        const string filename = "./unitTestImage.bmp";
+        ImageReaderBMP reader;
+        for (auto format : { std::make_pair(32u, false), std::make_pair(8u, false), std::make_pair(24u, true) }) {
+            writeBmp(filename, format.first, format.second);
+            for (ColorChannel_t channel : { NNet::R, NNet::G, NNet::B, NNet::BW }) {
+                vector<float> expected;
+                vector<float> actual;
+                reader.getData("../images/8x8-test11.bmp", expected, channel);
+                xySize size = reader.getData(filename, actual, channel);
+                ASSERT_EQ(size.x, 8);
+                ASSERT_EQ(size.y, 8);
+                ASSERT_EQ(actual == expected, true);
+            }
+        }
+
+        writeBmp(filename, 16, false); // Unsupported
+        vector<float> data;
+        ASSERT_EQ(reader.getData(filename, data, NNet::R).x, 0);
+
+        std::remove(filename.c_str());
+    }
+
     {
         LOG("Image read and orientation");
 
@@ -1901,6 +2541,57 @@ void unitTestImages()
         }
     }
 
+    {
+        LOG("input data config file, literal values");
+
+        // Values must convert exactly as strtof() does, with blanks or commas between
+        // them, with no limit on the line length. A comment line after a path_prefix
+        // is not a sample, and a value that is not a number is an error.
+
+        std::ostringstream longLine;
+        longLine << "{";
+        for (uint32_t i = 0; i < 5000; ++i) {
+            longLine << " " << (i % 7) * 0.125f - 0.375f;
+        }
+        longLine << " } 1";
+
+        string inputDataConfig =
+            "path_prefix = ../images/\n"
+            "# 8x8-test.bmp\n"
+            "  8x8-test.bmp 1 -0.5\r\n"
+            "\n"
+            "{ 0.25, -0.5,1e-3 }  0.1 -.2\n"
+            "{0.3333333 -0.99999999 123456789 +7} 0\n"
+            + longLine.str() + "\n"
+            "{ } -1";  // No newline at the end
+
+        std::ofstream inputDataConfigFile(inputDataConfigFilename);
+        inputDataConfigFile << inputDataConfig;
+        inputDataConfigFile.close();
+
+        SampleSet sampleSet;
+        sampleSet.loadSamples(inputDataConfigFilename);
+        ASSERT_EQ(sampleSet.samples.size(), 5);
+
+        auto &samples = sampleSet.samples;
+        ASSERT_EQ(samples[0].imageFilename, "../images/8x8-test.bmp");
+        ASSERT_EQ(samples[0].targetVals == vector<float>({ 1.0f, -0.5f }), true);
+        ASSERT_EQ(samples[1].imageFilename, "");
+        ASSERT_EQ(samples[1].data == vector<float>({ 0.25f, -0.5f, strtof("1e-3", nullptr) }), true);
+        ASSERT_EQ(samples[1].targetVals == vector<float>({ strtof("0.1", nullptr), strtof("-.2", nullptr) }), true);
+        ASSERT_EQ(samples[2].data == vector<float>({ strtof("0.3333333", nullptr), strtof("-0.99999999", nullptr),
+                                                     123456789.0f, 7.0f }), true);
+        ASSERT_EQ(samples[3].data.size(), 5000);
+        ASSERT_EQ(samples[3].data[4999], (4999 % 7) * 0.125f - 0.375f);
+        ASSERT_EQ(samples[4].data.size(), 0);
+        ASSERT_EQ(samples[4].targetVals == vector<float>({ -1.0f }), true);
+
+        inputDataConfigFile.open(inputDataConfigFilename);
+        inputDataConfigFile << "{ 0.5 abc } 1\n";
+        inputDataConfigFile.close();
+        ASSERT_THROWS(sampleSet.loadSamples(inputDataConfigFilename), exceptionInputSamplesFile);
+    }
+
     {
         LOG("8x8-test.dat orientation channel R single precision");
 
@@ -1962,6 +2653,312 @@ void unitTestImages()
         ASSERT_FEQ(inputs[flattenXY(7,7,8)].output, pixelToNetworkInputRange(41));
         ASSERT_FEQ(inputs[flattenXY(2,4,8)].output, pixelToNetworkInputRange(101));
     }
+
+    {
+        LOG("Image channel switching");
+
+        // Each channel must read the same as with a single-channel image reader, whether
+        // the samples decode one channel at a time or all channels at once. With all
+        // channels, switching channels must not decode the image again.
+
+        string inputDataConfig =
+            "../images/8x8-test11.bmp\n"
+            "../images/8x8-test.dat\n"
+            "../images/8x8-test-doubleprecision.dat\n";
+
+        std::ofstream inputDataConfigFile(inputDataConfigFilename);
+        inputDataConfigFile << inputDataConfig;
+        inputDataConfigFile.close();
+
+        for (bool decodeAllChannels : { false, true }) {
+            SampleSet::decodeAllChannels = decodeAllChannels;
+            SampleSet sampleSet;
+            sampleSet.loadSamples(inputDataConfigFilename);
+
+            for (Sample &sample : sampleSet.samples) {
+                bool isBmp = sample.imageFilename.find(".bmp") != string::npos;
+                ImageReaderBMP bmpReader;
+                ImageReaderDat datReader;
+                ImageReader *pReader = isBmp ? (ImageReader *)&bmpReader : &datReader;
+                vector<ColorChannel_t> channels = { NNet::R, NNet::G, NNet::B, NNet::G, NNet::R };
+                if (isBmp) {
+                    channels.push_back(NNet::BW);
+                }
+
+                sample.getData(NNet::R);
+                float const *pCache = sample.data.data();
+                for (ColorChannel_t channel : channels) {
+                    vector<float> expected;
+                    pReader->getData(sample.imageFilename, expected, channel);
+                    DataView data = sample.getData(channel);
+                    ASSERT_EQ(vector<float>(data.begin(), data.end()) == expected, true);
+                    if (decodeAllChannels) {
+                        ASSERT_EQ(sample.data.data() == pCache, true);
+                    }
+                }
+            }
+        }
+        SampleSet::decodeAllChannels = false;
+    }
+
+    {
+        LOG("Multi-channel input layer");
+
+        // Each depth of the input layer must hold one channel of the image. A depth
+        // of 3 or 4 has default channels, other depths need a channel for each depth,
+        // and a model file must keep the channels.
+
+        auto writeTopology = [&](string const &inputLine) {
+            std::ofstream topologyConfigFile(topologyConfigFilename);
+            topologyConfigFile << inputLine << "\n"
+                "layerConv size 2*8x8 from input convolve 3x3\n"
+                "output size 2 from layerConv\n";
+        };
+
+        std::ofstream inputDataConfigFile(inputDataConfigFilename);
+        inputDataConfigFile << "../images/8x8-test11.bmp 1 -1\n";
+        inputDataConfigFile.close();
+
+        writeTopology("input size 3*8x8 channel B,BW,G");
+        Net myNet1(topologyConfigFilename, false);
+        ASSERT_EQ(myNet1.layers[0]->channels == vector<ColorChannel_t>({ NNet::B, NNet::BW, NNet::G }), true);
+        ASSERT_EQ(myNet1.layers[1]->windowInputsPerNeuron(), 3 * 3 * 3); // Reads all input depths
+
+        myNet1.sampleSet.loadSamples(inputDataConfigFilename);
+        myNet1.feedForward(myNet1.sampleSet.samples[0]);
+        ASSERT_EQ(SampleSet::decodeAllChannels, false); // Only this net's samples are affected
+        ASSERT_EQ(myNet1.sampleSet.samples[0].dataChannels & myNet1.inputChannelMask(), myNet1.inputChannelMask());
+        ImageReaderBMP reader;
+        for (uint32_t depth = 0; depth < 3; ++depth) {
+            vector<float> expected;
+            reader.getData("../images/8x8-test11.bmp", expected, myNet1.layers[0]->channels[depth]);
+            auto begin = myNet1.layers[0]->outputs.begin() + depth * 64;
+            ASSERT_EQ(vector<float>(begin, begin + 64) == expected, true);
+        }
+
+        const string filename = "./unitTestSavedModel.n2d";
+        myNet1.saveModel(filename);
+        Net myNet2(filename, false);
+        ASSERT_EQ(myNet2.layers[0]->channels == myNet1.layers[0]->channels, true);
+        std::remove(filename.c_str());
+
+        writeTopology("input size 4*8x8");
+        Net myNet3(topologyConfigFilename, false);
+        ASSERT_EQ(myNet3.layers[0]->channels == vector<ColorChannel_t>({ NNet::R, NNet::G, NNet::B, NNet::BW }), true);
+
+        writeTopology("input size 3*8x8 channel RGB");
+        Net myNet4(topologyConfigFilename, false);
+        ASSERT_EQ(myNet4.layers[0]->channels == vector<ColorChannel_t>({ NNet::R, NNet::G, NNet::B }), true);
+
+        writeTopology("input size 2*8x8 channel R");
+        ASSERT_THROWS(Net(topologyConfigFilename, false), exceptionConfigFile);
+    }
+
+    {
+        LOG("Compact image cache");
+
+        // With the compact image cache, BMP samples must be cached as one byte per
+        // pixel and give the net the same inputs as the float cache; .dat samples
+        // keep using the float cache.
+
+        std::ofstream inputDataConfigFile(inputDataConfigFilename);
+        inputDataConfigFile << "../images/8x8-test11.bmp 1 -1\n" "../images/8x8-test.dat -1 1\n";
+        inputDataConfigFile.close();
+
+        for (string inputLine : { "input size 8x8 channel G", "input size 3*8x8" }) {
+            std::ofstream topologyConfigFile(topologyConfigFilename);
+            topologyConfigFile << inputLine << "\n" "output size 2 from input\n";
+            topologyConfigFile.close();
+
+            vector<vector<float>> inputs[2];
+            for (bool compact : { false, true }) {
+                SampleSet::compactImageCache = compact;
+                Net myNet(topologyConfigFilename, false);
+                myNet.sampleSet.loadSamples(inputDataConfigFilename);
+                for (Sample &sample : myNet.sampleSet.samples) {
+                    myNet.feedForward(sample);
+                    myNet.feedForward(sample); // From the cache
+                    inputs[compact].push_back(myNet.layers[0]->outputs);
+                }
+
+                Sample const &bmpSample = myNet.sampleSet.samples[0];
+                Sample const &datSample = myNet.sampleSet.samples[1];
+                // The float cache gets all the channels of the file, the compact
+                // cache just the ones the input layer reads:
+                uint32_t numChannels = myNet.layers[0]->size.depth == 1 ? 1 : compact ? 3 : 4;
+                ASSERT_EQ(bmpSample.data.size(), compact ? 0 : numChannels * 64);
+                ASSERT_EQ(bmpSample.pixels.size(), compact ? numChannels * 64 : 0);
+                ASSERT_EQ(datSample.pixels.size(), 0);
+                ASSERT_GE(datSample.data.size(), 64);
+            }
+            ASSERT_EQ(inputs[1] == inputs[0], true);
+        }
+
+        SampleSet::compactImageCache = false;
+    }
+
+    {
+        LOG("Packed sample file");
+
+        // Samples loaded from a packed sample file must have the same input data for
+        // each packed channel, targets, and filenames as the samples it was made from:
+
+        string inputDataConfig =
+            "../images/8x8-test11.bmp 1 -1\n"
+            "{ 0.25 -0.5 0.75 } 0.5\n"
+            "../images/8x8-test.dat -1 1\n";
+
+        std::ofstream inputDataConfigFile(inputDataConfigFilename);
+        inputDataConfigFile << inputDataConfig;
+        inputDataConfigFile.close();
+
+        const string filename = "./unitTestSamples.n2ds";
+        const uint32_t channelMask = (1u << NNet::R) | (1u << NNet::G);
+
+        SampleSet original;
+        original.loadSamples(inputDataConfigFilename);
+        original.savePackedSamples(filename, channelMask);
+        ASSERT_EQ(SampleSet::isPackedSampleFile(filename), true);
+        ASSERT_EQ(SampleSet::isPackedSampleFile(inputDataConfigFilename), false);
+
+        SampleSet packed;
+        packed.loadSamples(filename);
+        ASSERT_EQ(packed.samples.size(), 3);
+
+        for (uint32_t n = 0; n < 3; ++n) {
+            Sample &sample = original.samples[n];
+            Sample &packedSample = packed.samples[n];
+            ASSERT_EQ(packedSample.imageFilename, sample.imageFilename);
+            ASSERT_EQ(packedSample.targetVals == sample.targetVals, true);
+
+            for (auto channel : { NNet::R, NNet::G }) {
+                if (sample.imageFilename != "") {
+                    sample.clearImageCache();
+                }
+                vector<float> expected(sample.getData(channel).begin(), sample.getData(channel).end());
+                vector<float> actual(packedSample.getData(channel).begin(), packedSample.getData(channel).end());
+                ASSERT_EQ(actual == expected, true);
+            }
+            ASSERT_EQ(packedSample.size.x, sample.size.x);
+        }
+
+        ASSERT_EQ(packed.samples[1].getData(NNet::B).size(), 3);
+        ASSERT_THROWS(packed.samples[0].getData(NNet::B), exceptionInputSamplesFile);
+
+        // The samples stay valid when shuffled, and a net can train on them:
+        packed.shuffle();
+        string topologyConfig =
+            "input size 8x8 channel G\n"
+            "output size 2 from input\n";
+        std::ofstream topologyConfigFile(topologyConfigFilename);
+        topologyConfigFile << topologyConfig;
+        topologyConfigFile.close();
+
+        Net myNet(topologyConfigFilename, false);
+        myNet.sampleSet.loadSamples(filename);
+        Sample &bmpSample = myNet.sampleSet.samples[0];
+        myNet.feedForward(bmpSample);
+        myNet.backProp(bmpSample);
+        ASSERT_FEQ(myNet.layers[0]->outputs[flattenXY(7, 7, 8)], pixelToNetworkInputRange(8));
+
+        std::remove(filename.c_str());
+    }
+
+    {
+        LOG("Streaming samples");
+
+        // Each epoch must return every sample exactly once, a window at a time, then
+        // 0, from an input data config file or a packed sample file. The samples are
+        // numbered by their first target value.
+
+        std::ofstream inputDataConfigFile(inputDataConfigFilename);
+        inputDataConfigFile << "# Comment\n" "path_prefix=../images/\n";
+        for (uint32_t n = 0; n < 10; ++n) {
+            if (n == 7) {
+                inputDataConfigFile << "8x8-test.bmp " << n << "\n";
+            } else {
+                inputDataConfigFile << "{ " << n * 0.5f << " 1 } " << n << "\n";
+            }
+        }
+        inputDataConfigFile.close();
+
+        const string filename = "./unitTestSamples.n2ds";
+        SampleSet sampleSet;
+        sampleSet.loadSamples(inputDataConfigFilename);
+        sampleSet.savePackedSamples(filename, 1u << NNet::R);
+
+        auto readEpoch = [](SampleStream &stream, uint32_t batchSize) {
+            vector<uint32_t> ids;
+            Sample *pSamples;
+            while (uint32_t n = stream.next(pSamples, batchSize)) {
+                ASSERT_GE(batchSize, n);
+                for (uint32_t i = 0; i < n; ++i) {
+                    ids.push_back((uint32_t)pSamples[i].targetVals[0]);
+                    if (pSamples[i].targetVals[0] == 7) {
+                        ASSERT_EQ(pSamples[i].imageFilename, "../images/8x8-test.bmp");
+                        ASSERT_EQ(pSamples[i].getData(NNet::R).size(), 64);
+                    } else {
+                        ASSERT_EQ(pSamples[i].getData(NNet::R)[0], pSamples[i].targetVals[0] * 0.5f);
+                    }
+                }
+            }
+            return ids;
+        };
+
+        vector<uint32_t> inOrder = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+        for (string source : { inputDataConfigFilename, filename }) {
+            SampleStream orderedStream(source, NNet::R, 3, 2, false);
+            ASSERT_EQ(orderedStream.size(), 10);
+            ASSERT_EQ(readEpoch(orderedStream, 4) == inOrder, true);
+            ASSERT_EQ(readEpoch(orderedStream, 100) == inOrder, true);
+
+            SampleStream shuffledStream(source, NNet::R, 3, 2, true);
+            for (int epoch = 0; epoch < 3; ++epoch) {
+                vector<uint32_t> ids = readEpoch(shuffledStream, 2);
+                std::sort(ids.begin(), ids.end());
+                ASSERT_EQ(ids == inOrder, true);
+            }
+        }
+
+        std::remove(filename.c_str());
+    }
+
+    {
+        LOG("Sample prefetcher");
+
+        // After waitFor(), the samples in the range must be decoded; with keepCache
+        // false, the samples before the range must have been released. A file that
+        // can't be decoded must make waitFor() throw.
+
+        vector<Sample> samples(20);
+        for (auto &sample : samples) {
+            sample.imageFilename = "../images/8x8-test.bmp";
+        }
+
+        SamplePrefetcher prefetcher(3, 4);
+        ASSERT_EQ(prefetcher.numWorkers(), 3);
+        for (bool keepCache : { true, false }) {
+            for (auto &sample : samples) {
+                sample.clearImageCache();
+            }
+            prefetcher.start(samples.data(), samples.size(), NNet::R, keepCache);
+            for (size_t first = 0; first < samples.size(); first += 6) {
+                size_t end = std::min<size_t>(first + 6, samples.size());
+                prefetcher.waitFor(first, end);
+                for (size_t n = 0; n < end; ++n) {
+                    ASSERT_EQ(samples[n].data.size(), n >= first || keepCache ? 64 : 0);
+                }
+            }
+            prefetcher.finish();
+        }
+        ASSERT_GE(prefetcher.averageQueueDepth(), 0.0);
+        ASSERT_GE(4.0, prefetcher.averageQueueDepth());
+
+        samples[5].imageFilename = "./nonexistentImage.bmp";
+        samples[5].clearImageCache();
+        prefetcher.start(samples.data(), samples.size(), NNet::R);
+        ASSERT_THROWS(prefetcher.waitFor(0, samples.size()), exceptionInputSamplesFile);
+    }
 }
 
 
@@ -2012,14 +3009,14 @@ void unitTestPooling()
         // 4 depending on roundoff, with pixel value 4 or 5:
         // No bias, and that's the only input so it's the max:
         auto const &n00 = pl.neurons[0][0];
-        ASSERT_EQ(n00.backConnectionsIndices.size(), 1);
-        auto backIdx = n00.backConnectionsIndices[0];
-        auto const &backConn = myNet.connections[backIdx];
-        auto const &sourceNeuron = backConn.fromNeuron;
+        ASSERT_EQ(pl.numBackConnections(0, 0), 1);
+        auto const &pool = static_cast<LayerPooling const &>(pl);
+        ASSERT_EQ(pool.argmaxSource[0], 0);
+        auto const &sourceNeuron = myNet.layers[0]->neurons[0][pool.argmaxIndex[0]];
         ASSERT_EQ(sourceNeuron.output, pixelToNetworkInputRange(5));
         ASSERT_EQ(n00.output, pixelToNetworkInputRange(5));
 
-        ASSERT_EQ(n00.forwardConnectionsIndices.size(), 1);
+        ASSERT_EQ(pl.numForwardConnections(0, 0), 1);
         auto const &outputNeuron = myNet.layers.back()->neurons[0][0];
         ASSERT_EQ(outputNeuron.output, n00.output + 1.0);
     }
@@ -2065,10 +3062,10 @@ void unitTestPooling()
         auto const &neuronSE = pl.neurons[0][flattenXY(1,1,2)];
 
         // each pooling neuron covers a 4x4 patch of input neurons:
-        ASSERT_EQ(neuronNW.backConnectionsIndices.size(), 4*4);
-        ASSERT_EQ(neuronNE.backConnectionsIndices.size(), 4*4);
-        ASSERT_EQ(neuronSW.backConnectionsIndices.size(), 4*4);
-        ASSERT_EQ(neuronSE.backConnectionsIndices.size(), 4*4);
+        ASSERT_EQ(pl.numBackConnections(0, flattenXY(0,0,2)), 4*4);
+        ASSERT_EQ(pl.numBackConnections(0, flattenXY(1,0,2)), 4*4);
+        ASSERT_EQ(pl.numBackConnections(0, flattenXY(0,1,2)), 4*4);
+        ASSERT_EQ(pl.numBackConnections(0, flattenXY(1,1,2)), 4*4);
 
         // let's verify some raw inputs of the NW quadrant:
         ASSERT_EQ(data[flattenXY(0,0,8)], pixelToNetworkInputRange(127));
@@ -2202,29 +3199,32 @@ void unitTestPooling()
         ASSERT_EQ(pPool->neurons[1].size(), 2*2);
         ASSERT_EQ(pOutput->neurons[0].size(), 1);
 
-        ASSERT_EQ(pInput->neurons[0][0].forwardConnectionsIndices.size(), 2); // input splits into two
+        ASSERT_EQ(pInput->numForwardConnections(0, 0), 2); // input splits into two
 
         for (uint32_t nIdx = 0; nIdx < pConv->size.x * pConv->size.y; ++nIdx) {
-            ASSERT_EQ(pConv->neurons[0][nIdx].backConnectionsIndices.size(), 1); // one source, no bias
-            ASSERT_EQ(pConv->neurons[1][nIdx].backConnectionsIndices.size(), 1);
-            ASSERT_EQ(pConv->neurons[0][nIdx].forwardConnectionsIndices.size(), 1);
-            ASSERT_EQ(pConv->neurons[1][nIdx].forwardConnectionsIndices.size(), 1);
+            ASSERT_EQ(pConv->numBackConnections(0, nIdx), 1); // one source, no bias
+            ASSERT_EQ(pConv->numBackConnections(1, nIdx), 1);
+            ASSERT_EQ(pConv->numForwardConnections(0, nIdx), 1);
+            ASSERT_EQ(pConv->numForwardConnections(1, nIdx), 1);
         }
 
         // layerPool size 2*2x2 from layerConvPassthrough pool avg 4x4
         for (uint32_t nIdx = 0; nIdx < pPool->size.x * pPool->size.y; ++nIdx) {
-            ASSERT_EQ(pPool->neurons[0][nIdx].backConnectionsIndices.size(), 4*4); // no bias on pooling layers
-            ASSERT_EQ(pPool->neurons[1][nIdx].backConnectionsIndices.size(), 4*4);
-            ASSERT_EQ(pPool->neurons[0][nIdx].forwardConnectionsIndices.size(), 1);
-            ASSERT_EQ(pPool->neurons[1][nIdx].forwardConnectionsIndices.size(), 1);
+            ASSERT_EQ(pPool->numBackConnections(0, nIdx), 4*4); // no bias on pooling layers
+            ASSERT_EQ(pPool->numBackConnections(1, nIdx), 4*4);
+            ASSERT_EQ(pPool->numForwardConnections(0, nIdx), 1);
+            ASSERT_EQ(pPool->numForwardConnections(1, nIdx), 1);
         }
 
-        ASSERT_EQ(myNet.layers[3]->neurons[0][0].backConnectionsIndices.size(), 2*2*2 + 1);
+        ASSERT_EQ(myNet.layers[3]->numBackConnections(0, 0), 2*2*2 + 1);
 
-        auto idx = pPool->neurons[0][flattenXY(0,0,2)].backConnectionsIndices[0];
-        ASSERT_EQ(&myNet.connections[idx].fromNeuron, &pConv->neurons[0][flattenXY(0,0,8)]);
-        idx = pPool->neurons[1][flattenXY(0,0,2)].backConnectionsIndices[0];
-        ASSERT_EQ(&myNet.connections[idx].fromNeuron, &pConv->neurons[1][flattenXY(0,0,8)]);
+        // Each depth of the pooling layer reads the same depth of layerConvPassthrough,
+        // starting at the upper left:
+        ASSERT_EQ(pPool->windowedSources.size(), 1);
+        ASSERT_EQ(pPool->windowedSources[0].pFromLayer, pConv);
+        ASSERT_EQ(pPool->windowedSources[0].sameDepth, true);
+        ASSERT_EQ(pPool->windowedSources[0].windowStartX[0], 0);
+        ASSERT_EQ(pPool->windowedSources[0].windowStartY[0], 0);
 
         // The NW (upper left) pooling layer neuron covers the upper left quadrant of the input image
         auto const &neuronNW0 = pPool->neurons[0][flattenXY(0,0,2)];
@@ -2264,6 +3264,66 @@ void unitTestPooling()
         ASSERT_EQ(neuronSE0.output, expectedOutput);
         ASSERT_EQ(neuronSE1.output, expectedOutput);
     }
+
+    {
+        LOG("Pooling backprop");
+
+        // Both pooling layers read layerPass in two windows of two neurons. The outputs
+        // of layerPass are the same as the inputs:
+        string topologyConfig =
+            "input size 4x1\n"
+            "layerPass size 4x1 from input convolve {1}\n"
+            "layerMax size 2x1 from layerPass pool max 2x1\n"
+            "layerAvg size 2x1 from layerPass pool avg 2x1\n"
+            "output size 1 from layerMax tf linear\n"
+            "output size 1 from layerAvg tf linear\n";
+
+        string inputDataConfig =
+            "{ -20000 -30000 0.5 0.25 } 0.0\n";
+
+        std::ofstream topologyConfigFile(topologyConfigFilename);
+        topologyConfigFile << topologyConfig;
+        topologyConfigFile.close();
+
+        std::ofstream inputDataConfigFile(inputDataConfigFilename);
+        inputDataConfigFile << inputDataConfig;
+        inputDataConfigFile.close();
+
+        Net myNet(topologyConfigFilename, false);
+        setAllWeights(myNet, 1.0);
+        myNet.layers.back()->biasWeights[0] = 0.0f;
+
+        myNet.sampleSet.loadSamples(inputDataConfigFilename);
+        myNet.feedForward(myNet.sampleSet.samples[0]);
+
+        auto const &pass = *layerNamed(myNet, "layerPass");
+        auto const &poolMax = static_cast<LayerPooling const &>(*layerNamed(myNet, "layerMax"));
+        auto const &poolAvg = static_cast<LayerPooling const &>(*layerNamed(myNet, "layerAvg"));
+
+        // The max can be any value, no matter how negative:
+        ASSERT_EQ(poolMax.outputs[0], -20000.0f);
+        ASSERT_EQ(poolMax.outputs[1], 0.5f);
+        ASSERT_EQ(poolMax.argmaxIndex[0], 0);
+        ASSERT_EQ(poolMax.argmaxIndex[1], 2);
+        ASSERT_EQ(poolAvg.outputs[0], -25000.0f);
+        ASSERT_EQ(poolAvg.outputs[1], 0.375f);
+        ASSERT_EQ(poolAvg.numPoolInputs[0], 2);
+
+        float outputVal = -20000.0f + 0.5f - 25000.0f + 0.375f;
+        ASSERT_FEQ(myNet.layers.back()->outputs[0], outputVal);
+
+        myNet.backProp(myNet.sampleSet.samples[0]);
+
+        // Each pooling neuron gets the output gradient through a weight of 1.0. Max pooling
+        // passes it to the winning source neuron; average pooling divides it among both:
+        float g = 0.0f - outputVal;
+        ASSERT_FEQ(poolMax.gradients[0], g);
+        ASSERT_FEQ(poolAvg.gradients[1], g);
+        ASSERT_FEQ(pass.gradients[0], g + g / 2.0f);
+        ASSERT_FEQ(pass.gradients[1], g / 2.0f);
+        ASSERT_FEQ(pass.gradients[2], g + g / 2.0f);
+        ASSERT_FEQ(pass.gradients[3], g / 2.0f);
+    }
 }
 
 
@@ -2358,53 +3418,558 @@ void unitTestMisc()
 
         // layerPool has no incoming weights
 
+        // Regular layers keep their weights in Projections:
+        auto compareWeights = [](Layer const &layer1, Layer const &layer2) {
+            ASSERT_EQ(layer1.projections.size(), layer2.projections.size());
+            for (uint32_t p = 0; p < layer1.projections.size(); ++p) {
+                auto const &weights1 = layer1.projections[p].weights;
+                auto const &weights2 = layer2.projections[p].weights;
+                ASSERT_EQ(weights1.size(), weights2.size());
+                for (uint32_t i = 0; i < weights1.size(); ++i) {
+                    ASSERT_FEQ(weights1[i], weights2[i]);
+                }
+            }
+            ASSERT_EQ(layer1.biasWeights.size(), layer2.biasWeights.size());
+            for (uint32_t i = 0; i < layer1.biasWeights.size(); ++i) {
+                ASSERT_FEQ(layer1.biasWeights[i], layer2.biasWeights[i]);
+            }
+        };
+
         // layerMix size 8x8 from layerPool
-        auto const &mix1 = *layerNamed(myNet1, "layerMix");
-        auto const &mix2 = *layerNamed(myNet2, "layerMix");
-        for (uint32_t neuronNum = 0; neuronNum < mix1.neurons[0].size(); ++neuronNum) {
-            auto const &neuron1 = mix1.neurons[0][neuronNum];
-            auto const &neuron2 = mix2.neurons[0][neuronNum];
-            for (uint32_t i = 0; i < neuron1.backConnectionsIndices.size(); ++i) {
-                ASSERT_FEQ(myNet1.connections[neuron1.backConnectionsIndices[i]].weight,
-                           myNet2.connections[neuron2.backConnectionsIndices[i]].weight);
+        compareWeights(*layerNamed(myNet1, "layerMix"), *layerNamed(myNet2, "layerMix"));
+
+        // layerGauss size 8x8 from input radius 1x3
+        auto const &gauss1 = *layerNamed(myNet1, "layerGauss");
+        ASSERT_EQ(gauss1.projections[0].isSparse(), true);
+        compareWeights(gauss1, *layerNamed(myNet2, "layerGauss"));
+
+        // layerCombine size 4x4
+        compareWeights(*layerNamed(myNet1, "layerCombine"), *layerNamed(myNet2, "layerCombine"));
+
+        // output size 10
+        compareWeights(*myNet1.layers.back(), *myNet2.layers.back());
+    }
+
+    {
+        LOG("Binary weights file");
+
+        string topologyConfig =
+            "input size 8x8\n"
+            "layerConv size 3*8x8 from input convolve 3x3\n"
+            "layerPool size 3*4x4 from layerConv pool max 2x2\n"
+            "layerSparse size 4x4 from layerPool radius 1x1\n"
+            "output size 3 from layerSparse\n"
+            "output size 3 from layerConv\n";
+
+        std::ofstream topologyConfigFile(topologyConfigFilename);
+        topologyConfigFile << topologyConfig;
+        topologyConfigFile.close();
+
+        auto allWeights = [](Net const &net) {
+            vector<float> w;
+            for (auto const &pLayer : net.layers) {
+                for (auto const &proj : pLayer->projections) {
+                    w.insert(w.end(), proj.weights.begin(), proj.weights.end());
+                }
+                w.insert(w.end(), pLayer->biasWeights.begin(), pLayer->biasWeights.end());
+                for (auto const &kernel : pLayer->flatConvolveMatrix) {
+                    w.insert(w.end(), kernel.begin(), kernel.end());
+                }
+            }
+            return w;
+        };
+
+        auto readFile = [](string const &filename) {
+            std::ifstream file(filename, std::ios::binary);
+            return string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        };
+
+        auto writeFile = [](string const &filename, string const &contents) {
+            std::ofstream file(filename, std::ios::binary);
+            file << contents;
+        };
+
+        const string filename = "./unitTestSavedWeights.bin";
+        Net myNet1(topologyConfigFilename, false);
+        myNet1.saveWeights(filename, WEIGHTS_BINARY);
+        string saved = readFile(filename);
+        ASSERT_EQ(saved.substr(0, 4), "N2DW");
+
+        // The binary format is exact, unlike the text format. A different seed gives
+        // different initial weights to overwrite:
+        Net myNet2("", false);
+        myNet2.randomSeed = 2;
+        istringstream ss2(topologyConfig);
+        myNet2.configureNetwork(myNet2.parseTopologyConfig(ss2));
+        ASSERT_EQ(myNet2.topologyFingerprint(), myNet1.topologyFingerprint());
+        ASSERT_EQ(allWeights(myNet2) == allWeights(myNet1), false);
+        myNet2.loadWeights(filename);
+        ASSERT_EQ(allWeights(myNet2) == allWeights(myNet1), true);
+
+        // A corrupt or truncated file is rejected without changing the weights:
+        Net myNet3(topologyConfigFilename, false);
+        vector<float> weights3 = allWeights(myNet3);
+        string corrupt = saved;
+        corrupt[corrupt.size() - 5] ^= 0x10;
+        writeFile(filename, corrupt);
+        ASSERT_THROWS(myNet3.loadWeights(filename), exceptionWeightsFile);
+        writeFile(filename, saved.substr(0, saved.size() - 8));
+        ASSERT_THROWS(myNet3.loadWeights(filename), exceptionWeightsFile);
+        ASSERT_EQ(allWeights(myNet3) == weights3, true);
+
+        // So is a file saved from a different topology:
+        istringstream ss(
+            "input size 8x8\n"
+            "layerConv size 3*8x8 from input convolve 3x3\n"
+            "layerPool size 3*4x4 from layerConv pool max 2x2\n"
+            "layerSparse size 4x4 from layerPool radius 2x1\n"
+            "output size 3 from layerSparse\n"
+            "output size 3 from layerConv\n");
+        Net myNet4("", false);
+        myNet4.configureNetwork(myNet4.parseTopologyConfig(ss));
+        ASSERT_EQ(myNet4.topologyFingerprint() == myNet1.topologyFingerprint(), false);
+        writeFile(filename, saved);
+        ASSERT_THROWS(myNet4.loadWeights(filename), exceptionWeightsFile);
+
+        // The text format is still available, and its number of weights is checked:
+        const string textFilename = "./unitTestSavedWeights.txt";
+        myNet1.weightsFormat = WEIGHTS_TEXT;
+        myNet1.saveWeights(textFilename);
+        myNet3.loadWeights(textFilename);
+        string text = readFile(textFilename);
+        ASSERT_EQ((size_t)std::count(text.begin(), text.end(), '\n'), allWeights(myNet1).size());
+        weights3 = allWeights(myNet3);
+        writeFile(textFilename, text + "0.5\n");
+        ASSERT_THROWS(myNet3.loadWeights(textFilename), exceptionWeightsFile);
+        ASSERT_EQ(allWeights(myNet3) == weights3, true);
+        writeFile(textFilename, text.substr(0, text.rfind('\n', text.size() - 2) + 1));
+        ASSERT_THROWS(myNet3.loadWeights(textFilename), exceptionWeightsFile);
+        ASSERT_EQ(allWeights(myNet3) == weights3, true);
+
+        std::remove(filename.c_str());
+    }
+
+    {
+        LOG("Model file");
+
+        // A net constructed from a model file must have the same layers, kernels, and
+        // weights as the net that saved it, and compute the same outputs:
+
+        string topologyConfig =
+            "input size 8x8 channel G\n"
+            "layerFilter size 8x8 from input convolve {{1,2},{-1,0}}\n"
+            "layerConv size 3*8x8 from input convolve 3x3 gemm\n"
+            "layerPool size 3*4x4 from layerConv pool avg 2x2\n"
+            "layerSparse size 4x4 from layerPool radius 1x1 tf logistic\n"
+            "output size 3 from layerSparse\n"
+            "output size 3 from layerFilter tf linear\n";
+
+        std::ofstream topologyConfigFile(topologyConfigFilename);
+        topologyConfigFile << topologyConfig;
+        topologyConfigFile.close();
+
+        const string filename = "./unitTestSavedModel.n2d";
+        Net myNet1(topologyConfigFilename, false);
+        myNet1.saveModel(filename);
+        ASSERT_EQ(Net::isModelFile(filename), true);
+        ASSERT_EQ(Net::isModelFile(topologyConfigFilename), false);
+
+        Net myNet2(filename, false);
+        ASSERT_EQ(myNet2.layers.size(), myNet1.layers.size());
+        ASSERT_EQ(myNet2.topologyFingerprint(), myNet1.topologyFingerprint());
+        ASSERT_EQ(myNet2.layers[0]->channel, NNet::G);
+        for (uint32_t i = 0; i < myNet1.layers.size(); ++i) {
+            Layer const &layer1 = *myNet1.layers[i];
+            Layer const &layer2 = *myNet2.layers[i];
+            ASSERT_EQ(layer2.layerName, layer1.layerName);
+            ASSERT_EQ(layer2.flatConvolveMatrix == layer1.flatConvolveMatrix, true);
+            ASSERT_EQ(layer2.biasWeights == layer1.biasWeights, true);
+            ASSERT_EQ(layer2.convolveMethod, layer1.convolveMethod);
+            ASSERT_EQ(layer2.poolMethod, layer1.poolMethod);
+            ASSERT_EQ(layer2.tf == layer1.tf, true);
+            for (uint32_t p = 0; p < layer1.projections.size(); ++p) {
+                ASSERT_EQ(layer2.projections[p].weights == layer1.projections[p].weights, true);
             }
         }
 
-        // layerGauss size 8x8 from input radius 1x3
-        auto const &gauss1 = *layerNamed(myNet1, "layerGauss"); // myNet1.layers[3];
-        auto const &gauss2 = *layerNamed(myNet2, "layerGauss"); // myNet2.layers[3];
-        for (uint32_t neuronNum = 0; neuronNum < gauss1.neurons[0].size(); ++neuronNum) {
-            auto const &neuron1 = gauss1.neurons[0][neuronNum];
-            auto const &neuron2 = gauss2.neurons[0][neuronNum];
-            for (uint32_t i = 0; i < neuron1.backConnectionsIndices.size(); ++i) {
-                ASSERT_FEQ(myNet1.connections[neuron1.backConnectionsIndices[i]].weight,
-                           myNet2.connections[neuron2.backConnectionsIndices[i]].weight);
+        Sample sample;
+        for (uint32_t i = 0; i < 64; ++i) {
+            sample.data.push_back((i % 5) / 5.0f - 0.4f);
+        }
+        myNet1.layers[0]->channel = NNet::BW;
+        myNet2.layers[0]->channel = NNet::BW;
+        myNet1.feedForward(sample);
+        myNet2.feedForward(sample);
+        ASSERT_EQ(myNet2.layers.back()->outputs == myNet1.layers.back()->outputs, true);
+
+        // A damaged topology part is rejected:
+        std::fstream file(filename, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(40);
+        file.put('?');
+        file.close();
+        ASSERT_THROWS(Net(filename, false), exceptionConfigFile);
+
+        std::remove(filename.c_str());
+    }
+
+    {
+        LOG("Inference-only net");
+
+        // An inference-only net built from a model file computes exactly the same
+        // outputs as the net that saved it, without any of the training state:
+
+        string topologyConfig =
+            "input size 16x16\n"
+            "layerConv size 2*16x16 from input convolve 3x3\n"
+            "layerPool size 2*8x8 from layerConv pool max 2x2\n"
+            "layerSparse size 8x8 from layerPool radius 2x2\n"
+            "layerDense size 16 from layerSparse\n"
+            "output size 3 from layerDense\n";
+
+        std::ofstream topologyConfigFile(topologyConfigFilename);
+        topologyConfigFile << topologyConfig;
+        topologyConfigFile.close();
+
+        Sample sample;
+        for (uint32_t i = 0; i < 16 * 16; ++i) {
+            sample.data.push_back((i % 7) / 7.0f - 0.4f);
+        }
+        sample.targetVals = { 1.0f, -1.0f, -1.0f };
+
+        // Train a little so that the weights differ from the initial weights:
+        const string filename = "./unitTestSavedModel.n2d";
+        Net myNet1(topologyConfigFilename, false);
+        for (uint32_t i = 0; i < 3; ++i) {
+            myNet1.feedForward(sample);
+            myNet1.backProp(sample);
+        }
+        myNet1.saveModel(filename);
+
+        Net myNet2("", false);
+        myNet2.inferenceOnly = true;
+        myNet2.loadTopology(filename);
+        ASSERT_EQ(myNet2.enableBackPropTraining, false);
+        ASSERT_EQ(myNet2.layers.size(), myNet1.layers.size());
+        ASSERT_EQ(myNet2.totalNumberBackConnections, myNet1.totalNumberBackConnections);
+
+        myNet1.feedForward(sample);
+        myNet2.feedForward(sample);
+        ASSERT_EQ(myNet2.layers.back()->outputs == myNet1.layers.back()->outputs, true);
+        ASSERT_EQ(myNet2.error, myNet1.error);
+
+        // Count the bytes in the containers that either kind of net may allocate:
+        auto numBytes = [](Net const &net) {
+            size_t bytes = 0;
+            for (auto const &pLayer : net.layers) {
+                Layer const &layer = *pLayer;
+                bytes += (layer.outputs.capacity() + layer.gradients.capacity()
+                          + layer.biasWeights.capacity() + layer.biasDeltaWeights.capacity()
+                          + layer.biasGradients.capacity()) * sizeof(float);
+                bytes += layer.neurons.size() * layer.size.x * layer.size.y * sizeof(Neuron);
+                for (auto const &proj : layer.projections) {
+                    bytes += (proj.weights.capacity() + proj.deltaWeights.capacity()
+                              + proj.batchInputs.capacity() + proj.batchGradients.capacity()
+                              + proj.weightGradients.capacity()) * sizeof(float);
+                    bytes += (proj.columnIndices.capacity() + proj.rowOffsets.capacity()) * sizeof(uint32_t);
+                }
+                bytes += (layer.flatConvolveGradients.size() + layer.flatDeltaWeights.size())
+                         * layer.kernelSize.x * layer.kernelSize.y * sizeof(float);
+                if (layer.isPoolingLayer) {
+                    auto const &pool = dynamic_cast<LayerPooling const &>(layer);
+                    bytes += (pool.argmaxSource.capacity() + pool.argmaxIndex.capacity()
+                              + pool.numPoolInputs.capacity()) * sizeof(uint32_t);
+                }
+            }
+            return bytes;
+        };
+
+        for (auto const &pLayer : myNet2.layers) {
+            ASSERT_EQ(pLayer->gradients.empty(), true);
+            ASSERT_EQ(pLayer->neurons.empty(), true);
+            ASSERT_EQ(pLayer->biasDeltaWeights.empty(), true);
+            ASSERT_EQ(pLayer->flatDeltaWeights.empty(), true);
+            for (auto const &proj : pLayer->projections) {
+                ASSERT_EQ(proj.deltaWeights.empty(), true);
             }
         }
+        ASSERT_GE(numBytes(myNet1), 2 * numBytes(myNet2));
 
-        // layerCombine size 4x4
-        auto const &combine1 = *layerNamed(myNet1, "layerCombine");
-        auto const &combine2 = *layerNamed(myNet2, "layerCombine");
-        for (uint32_t neuronNum = 0; neuronNum < combine1.neurons[0].size(); ++neuronNum) {
-            auto const &neuron1 = combine1.neurons[0][neuronNum];
-            auto const &neuron2 = combine2.neurons[0][neuronNum];
-            for (uint32_t i = 0; i < neuron1.backConnectionsIndices.size(); ++i) {
-                ASSERT_FEQ(myNet1.connections[neuron1.backConnectionsIndices[i]].weight,
-                           myNet2.connections[neuron2.backConnectionsIndices[i]].weight);
+        // It can't be trained:
+        myNet2.enableBackPropTraining = true;
+        ASSERT_THROWS(myNet2.backProp(sample), exceptionRuntime);
+
+        std::remove(filename.c_str());
+    }
+
+    {
+        LOG("Batched inference");
+
+        // feedForwardBatch() must give the same outputs as feeding the samples forward
+        // one at a time, up to rounding, for blocks of any size and any number of
+        // threads. The layers cover dense, depth-wise dense, and sparse Projections,
+        // and convolution and pooling layers, which run one sample at a time:
+
+        string topologyConfig =
+            "input size 12x12\n"
+            "layerConv size 2*12x12 from input convolve 3x3\n"
+            "layerPool size 2*6x6 from layerConv pool max 2x2\n"
+            "layerDepthwise size 2*4x4 from layerPool tf relu\n"
+            "layerSparse size 6x6 from layerPool radius 1x1\n"
+            "layerDense size 64 from layerSparse tf logistic\n"
+            "output size 5 from layerDense\n"
+            "output size 5 from layerDepthwise tf linear\n";
+
+        istringstream ss(topologyConfig);
+        Net myNet("", false);
+        myNet.configureNetwork(myNet.parseTopologyConfig(ss));
+
+        const uint32_t numSamples = 2 * Net::inferenceBlockSize + 5;
+        const uint32_t numInputs = 12 * 12;
+        const uint32_t numOutputs = 5;
+        vector<float> inputs(numSamples * numInputs);
+        for (uint32_t i = 0; i < inputs.size(); ++i) {
+            inputs[i] = ((i * 37) % 101) / 101.0f - 0.5f;
+        }
+
+        vector<float> expected;
+        for (uint32_t sample = 0; sample < numSamples; ++sample) {
+            Sample s;
+            s.data.assign(&inputs[sample * numInputs], &inputs[(sample + 1) * numInputs]);
+            myNet.feedForward(s);
+            auto const &outputs = myNet.layers.back()->outputs;
+            expected.insert(expected.end(), outputs.begin(), outputs.end());
+        }
+
+        uint32_t sampleNumber = myNet.inputSampleNumber;
+        vector<float> outputs(numSamples * numOutputs, 99.0f);
+        myNet.feedForwardBatch(inputs.data(), numSamples, outputs.data());
+        ASSERT_EQ(myNet.inputSampleNumber, sampleNumber);
+        for (uint32_t i = 0; i < outputs.size(); ++i) {
+            float diff = outputs[i] > expected[i] ? outputs[i] - expected[i] : expected[i] - outputs[i];
+            ASSERT_GE(1e-5f, diff);
+        }
+
+        // A smaller batch, after a larger one, reuses the buffers. Its samples may take
+        // the scalar path through the kernels instead of the vector path:
+        vector<float> outputs3(3 * numOutputs);
+        myNet.feedForwardBatch(&inputs[7 * numInputs], 3, outputs3.data());
+        for (uint32_t i = 0; i < outputs3.size(); ++i) {
+            float diff = outputs3[i] > expected[7 * numOutputs + i] ? outputs3[i] - expected[7 * numOutputs + i]
+                                                                    : expected[7 * numOutputs + i] - outputs3[i];
+            ASSERT_GE(1e-5f, diff);
+        }
+
+        // The layers divide the rows among threads, so the sums don't change:
+        myNet.numLayerThreads = 4;
+        vector<float> parallelOutputs(numSamples * numOutputs);
+        myNet.feedForwardBatch(inputs.data(), numSamples, parallelOutputs.data());
+        ASSERT_EQ(parallelOutputs == outputs, true);
+    }
+
+    {
+        LOG("Quantized inference");
+
+        // After quantize(), the regular layers use 8-bit weights and inputs. The outputs
+        // must stay close to the float outputs, and the integer kernels must give the
+        // exact sums of the quantized products:
+
+        string topologyConfig =
+            "input size 12x12\n"
+            "layerConv size 2*12x12 from input convolve 3x3\n"
+            "layerPool size 2*6x6 from layerConv pool max 2x2\n"
+            "layerSparse size 6x6 from layerPool radius 1x1\n"
+            "layerDense size 40 from layerSparse\n"
+            "output size 4 from layerDense\n";
+
+        istringstream ss(topologyConfig);
+        Net myNet("", false);
+        myNet.configureNetwork(myNet.parseTopologyConfig(ss));
+
+        SampleSet sampleSet;
+        for (uint32_t sampleNum = 0; sampleNum < 40; ++sampleNum) {
+            Sample sample;
+            for (uint32_t i = 0; i < 12 * 12; ++i) {
+                sample.data.push_back((((i + 3) * (sampleNum + 5) * 37) % 101) / 101.0f - 0.5f);
             }
+            sample.targetVals.assign(4, -1.0f);
+            sample.targetVals[sampleNum % 4] = 1.0f;
+            sampleSet.samples.push_back(sample);
         }
 
-        // output size 10
-        auto const &output1 = *myNet1.layers.back();
-        auto const &output2 = *myNet2.layers.back();
-        for (uint32_t neuronNum = 0; neuronNum < output1.neurons[0].size(); ++neuronNum) {
-            auto const &neuron1 = output1.neurons[0][neuronNum];
-            auto const &neuron2 = output2.neurons[0][neuronNum];
-            for (uint32_t i = 0; i < neuron1.backConnectionsIndices.size(); ++i) {
-                ASSERT_FEQ(myNet1.connections[neuron1.backConnectionsIndices[i]].weight,
-                           myNet2.connections[neuron2.backConnectionsIndices[i]].weight);
+        vector<float> floatOutputs;
+        for (Sample &sample : sampleSet.samples) {
+            myNet.feedForward(sample);
+            auto const &outputs = myNet.layers.back()->outputs;
+            floatOutputs.insert(floatOutputs.end(), outputs.begin(), outputs.end());
+        }
+
+        // Save the float weights for the inference-only net below:
+        const string filename = "./unitTestSavedModel.n2d";
+        myNet.saveModel(filename);
+
+        myNet.quantize(sampleSet);
+        ASSERT_EQ(myNet.isQuantized(), true);
+
+        vector<float> quantizedOutputs;
+        for (Sample &sample : sampleSet.samples) {
+            myNet.feedForward(sample);
+            auto const &outputs = myNet.layers.back()->outputs;
+            quantizedOutputs.insert(quantizedOutputs.end(), outputs.begin(), outputs.end());
+        }
+        for (uint32_t i = 0; i < floatOutputs.size(); ++i) {
+            float diff = floatOutputs[i] > quantizedOutputs[i] ? floatOutputs[i] - quantizedOutputs[i]
+                                                                : quantizedOutputs[i] - floatOutputs[i];
+            ASSERT_GE(0.05f, diff);
+        }
+
+        // The dense rows have 36 weights, so the vector kernels also do a partial vector:
+        for (auto const &pLayer : myNet.layers) {
+            for (auto const &proj : pLayer->projections) {
+                ASSERT_EQ(proj.quantizedWeights.size(), proj.weights.size());
+                for (uint32_t row = 0; row < proj.numRows; ++row) {
+                    int32_t sum = 0;
+                    uint32_t begin = proj.isSparse() ? proj.rowOffsets[row] : row * proj.numColumns;
+                    for (uint32_t k = begin; k < begin + proj.rowLength(row); ++k) {
+                        uint32_t column = proj.isSparse() ? proj.columnIndices[k] : k - begin;
+                        sum += proj.quantizedWeights[k] * proj.quantizedInputs[column];
+                    }
+                    ASSERT_EQ(proj.weightedSumQuantized(row), sum * (proj.rowScales[row] * proj.inputScale));
+                }
+            }
+        }
+
+        QuantizationReport report = myNet.validateQuantization(sampleSet);
+        ASSERT_EQ(report.numSamples, 40u);
+        ASSERT_EQ(report.numWithTargets, 40u);
+        ASSERT_GE(report.agreement, 0.9f);
+        ASSERT_GE(0.05f, report.maxOutputDifference);
+        ASSERT_GE(report.floatWeightBytes, 3 * report.quantizedWeightBytes);
+
+        // Quantized layers feed the batch path one sample at a time:
+        vector<float> inputs;
+        for (Sample const &sample : sampleSet.samples) {
+            inputs.insert(inputs.end(), sample.data.begin(), sample.data.end());
+        }
+        vector<float> batchOutputs(quantizedOutputs.size());
+        myNet.feedForwardBatch(inputs.data(), 40, batchOutputs.data());
+        ASSERT_EQ(batchOutputs == quantizedOutputs, true);
+
+        ASSERT_THROWS(myNet.backProp(sampleSet.samples[0]), exceptionRuntime);
+        ASSERT_THROWS(myNet.loadWeights(filename), exceptionRuntime);
+
+        // With one scale per layer, all the rows of a layer share it:
+        myNet.quantize(sampleSet, QUANTIZE_PER_LAYER);
+        for (auto const &pLayer : myNet.layers) {
+            for (auto const &proj : pLayer->projections) {
+                for (float scale : proj.rowScales) {
+                    ASSERT_EQ(scale, pLayer->projections[0].rowScales[0]);
+                }
             }
         }
+        report = myNet.validateQuantization(sampleSet);
+        ASSERT_GE(0.1f, report.maxOutputDifference);
+
+        // An inference-only net keeps only the 8-bit weights:
+        myNet.quantize(sampleSet);
+        Net myNet2("", false);
+        myNet2.inferenceOnly = true;
+        myNet2.loadTopology(filename);
+        myNet2.quantize(sampleSet);
+        for (auto const &pLayer : myNet2.layers) {
+            for (auto const &proj : pLayer->projections) {
+                ASSERT_EQ(proj.weights.empty(), true);
+            }
+        }
+        for (uint32_t sampleNum = 0; sampleNum < 40; ++sampleNum) {
+            myNet2.feedForward(sampleSet.samples[sampleNum]);
+            auto const &outputs = myNet2.layers.back()->outputs;
+            ASSERT_EQ(vector<float>(&quantizedOutputs[sampleNum * 4], &quantizedOutputs[(sampleNum + 1) * 4])
+                      == outputs, true);
+        }
+        ASSERT_THROWS(myNet2.validateQuantization(sampleSet), exceptionRuntime);
+        ASSERT_THROWS(myNet2.saveModel(filename), exceptionRuntime);
+
+        std::remove(filename.c_str());
+    }
+
+    {
+        LOG("Batch transfer functions");
+
+        string topologyConfig =
+            "input size 1\n"
+            "layerTanh size 1 from input tf tanh\n"
+            "layerLogistic size 1 from input tf logistic\n"
+            "layerLinear size 1 from input tf linear\n"
+            "layerRamp size 1 from input tf ramp\n"
+            "layerGaussian size 1 from input tf gaussian\n"
+            "layerReLU size 1 from input tf relu\n"
+            "output size 1 from layerTanh\n";
+
+        std::ofstream topologyConfigFile(topologyConfigFilename);
+        topologyConfigFile << topologyConfig;
+        topologyConfigFile.close();
+
+        Net myNet(topologyConfigFilename, false);
+
+        // Enough arguments to fill a few SIMD vectors plus a scalar tail, including
+        // some that saturate the exponentials:
+        vector<float> args;
+        for (int i = -20; i <= 20; ++i) {
+            args.push_back(i * 0.37f);
+        }
+        args.push_back(95.0f);
+        args.push_back(-95.0f);
+        args.push_back(1.0f);  // The ramp's corners
+        args.push_back(-1.0f);
+
+        auto expectNear = [](float c, float v) {
+            float diff = c > v ? c - v : v - c;
+            ASSERT_GE(2e-6f, diff);
+        };
+
+        for (auto const &name : { "layerTanh", "layerLogistic", "layerLinear", "layerRamp",
+                                  "layerGaussian", "layerReLU" }) {
+            Layer const &layer = *layerNamed(myNet, name);
+
+            vector<float> y = args;
+            layer.tfBatch(y.data(), y.size());
+
+            vector<float> gradients(args.size(), 2.0f);
+            layer.tfDerivativeBatch(args.data(), gradients.data(), args.size());
+
+            for (uint32_t i = 0; i < args.size(); ++i) {
+                expectNear(y[i], layer.tf(args[i]));
+                expectNear(gradients[i], 2.0f * layer.tfDerivative(args[i]));
+            }
+
+            // Except for gaussian, the derivative from the output y = tf(x) must be the
+            // derivative at x. The ramp's output can't distinguish its corners from the
+            // saturated arguments beyond them, so for the ramp we check only -1 <= x <= 1:
+            if (string(name) != "layerGaussian") {
+                bool isRamp = string(name) == "layerRamp";
+                vector<float> gradientsFromOutput(args.size(), 1.0f);
+                layer.tfDerivativeFromOutputBatch(y.data(), gradientsFromOutput.data(), args.size());
+                for (uint32_t i = 0; i < args.size(); ++i) {
+                    float limit = isRamp ? 1.0f : 30.0f;
+                    if (args[i] <= limit && args[i] >= -limit) {
+                        expectNear(gradientsFromOutput[i], layer.tfDerivative(args[i]));
+                    }
+                }
+            }
+        }
+
+        // Net::backProp() hands the derivative mode to all the layers:
+        ASSERT_EQ(myNet.tfDerivativeFromOutput, false);
+        myNet.tfDerivativeFromOutput = true;
+        Sample sample;
+        sample.data = { 0.5f };
+        sample.targetVals = { 0.25f };
+        myNet.feedForward(sample);
+        myNet.backProp(sample);
+        ASSERT_EQ(layerNamed(myNet, "layerRamp")->tfDerivativeFromOutput, true);
+        ASSERT_FEQ(myNet.layers.back()->gradients[0],
+                   (0.25f - myNet.layers.back()->outputs[0])
+                   * (1.0f - myNet.layers.back()->outputs[0] * myNet.layers.back()->outputs[0]));
     }
 
     {